@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "upload.h"
+#include "archive.h"
+
+static void put_number(unsigned char *p, uint64_t value, int nbytes);
+static uint64_t get_number(const unsigned char *p, int nbytes);
+static void set_header(struct archive_writer *aw, int type, const struct stat *sb, size_t pathlen);
+static void next_entry(struct archive_writer *aw);
+static void next_listed(struct archive_writer *aw);
+static int valid_path(const char *path);
+static void start_entry(struct archive_reader *ar);
+static void finish_file(struct archive_reader *ar);
+static void finish_dirs(struct archive_reader *ar, const char *path);
+static void fail_entry(struct archive_reader *ar, int error);
+
+static void
+put_number(unsigned char *p, uint64_t value, int nbytes)
+{
+        while (nbytes-- > 0) {
+                p[nbytes] = value & 0xff;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+get_number(const unsigned char *p, int nbytes)
+{
+        uint64_t value;
+
+        value = 0;
+        while (nbytes-- > 0) {
+                value = (value << 8) | *p++;
+        }
+        return value;
+}
+
+/* writer */
+
+int
+archive_writer_open(struct archive_writer *aw, const char *root)
+{
+        struct stat sb;
+        const char *name;
+        size_t rootlen;
+        size_t namelen;
+        DIR *dir;
+        int fd;
+
+        memset(aw, 0, sizeof(struct archive_writer));
+        aw->fd = -1;
+        rootlen = strlen(root);
+        while (rootlen > 1 && root[rootlen - 1] == '/') {
+                rootlen--;
+        }
+        for (name = root + rootlen; name > root && name[-1] != '/'; name--) {
+        }
+        namelen = root + rootlen - name;
+        /* "/", "." and ".." unpack into the receiver's directory itself */
+        if (namelen == 0 || (namelen == 1 && name[0] == '.') ||
+            (namelen == 2 && name[0] == '.' && name[1] == '.')) {
+                name = ".";
+                namelen = 1;
+        }
+        if (namelen >= ARCHIVE_PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memcpy(aw->path, name, namelen);
+        aw->path[namelen] = '\0';
+        fd = open(root, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+        if (fstat(fd, &sb) < 0) {
+                close(fd);
+                return -1;
+        }
+        if (S_ISREG(sb.st_mode)) {
+                aw->fd = fd;
+                aw->left = sb.st_size;
+                set_header(aw, ARCHIVE_FILE, &sb, namelen);
+                return 0;
+        }
+        if (!S_ISDIR(sb.st_mode)) {
+                close(fd);
+                errno = EINVAL;
+                return -1;
+        }
+        dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return -1;
+        }
+        aw->levels[0].dir = dir;
+        aw->levels[0].pathlen = namelen;
+        aw->depth = 1;
+        set_header(aw, ARCHIVE_DIR, &sb, namelen);
+        return 0;
+}
+
+int
+archive_writer_open_list(struct archive_writer *aw, char *list, size_t len)
+{
+        memset(aw, 0, sizeof(struct archive_writer));
+        aw->fd = -1;
+        if (len > 0 && list[len - 1] != '\n') {
+                free(list);
+                errno = EINVAL;
+                return -1;
+        }
+        aw->list = list;
+        aw->listlen = len;
+        next_listed(aw);
+        return 0;
+}
+
+size_t
+archive_read(struct archive_writer *aw, char *buff, size_t size)
+{
+        size_t total;
+        size_t chunk;
+        ssize_t n;
+
+        total = 0;
+        while (total < size) {
+                if (aw->headeroff < aw->headerlen) {
+                        chunk = aw->headerlen - aw->headeroff;
+                        if (chunk > size - total) {
+                                chunk = size - total;
+                        }
+                        memcpy(buff + total, aw->header + aw->headeroff, chunk);
+                        aw->headeroff += chunk;
+                        total += chunk;
+                        continue;
+                }
+                if (aw->left > 0) {
+                        chunk = size - total;
+                        if (chunk > aw->left) {
+                                chunk = aw->left;
+                        }
+                        n = read(aw->fd, buff + total, chunk);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        if (n <= 0) {
+                                /* the file shrank; keep to the announced size */
+                                memset(buff + total, 0, chunk);
+                                n = chunk;
+                        }
+                        aw->left -= n;
+                        total += n;
+                        if (aw->left == 0) {
+                                close(aw->fd);
+                                aw->fd = -1;
+                        }
+                        continue;
+                }
+                if (aw->fd >= 0) {
+                        close(aw->fd);
+                        aw->fd = -1;
+                }
+                if (aw->done) {
+                        break;
+                }
+                if (aw->list != NULL) {
+                        next_listed(aw);
+                }
+                else {
+                        next_entry(aw);
+                }
+        }
+        aw->crc = crc32c(aw->crc, buff, total);
+        return total;
+}
+
+void
+archive_writer_close(struct archive_writer *aw)
+{
+        while (aw->depth > 0) {
+                closedir(aw->levels[--aw->depth].dir);
+        }
+        if (aw->fd >= 0) {
+                close(aw->fd);
+                aw->fd = -1;
+        }
+        free(aw->list);
+        aw->list = NULL;
+}
+
+static void
+set_header(struct archive_writer *aw, int type, const struct stat *sb, size_t pathlen)
+{
+        aw->header[0] = type;
+        put_number(aw->header + 1, sb != NULL ? sb->st_mode & 07777 : 0, 4);
+        put_number(aw->header + 5, type == ARCHIVE_FILE ? (uint64_t)sb->st_size : 0, 8);
+        put_number(aw->header + 13, sb != NULL ? (uint64_t)sb->st_mtime : 0, 8);
+        put_number(aw->header + 21, pathlen, 2);
+        memcpy(aw->header + ARCHIVE_HEADER_SIZE, aw->path, pathlen);
+        aw->headerlen = ARCHIVE_HEADER_SIZE + pathlen;
+        aw->headeroff = 0;
+}
+
+/*
+ * Moves on to the next entry of the walk and sets up its header. What
+ * cannot be read is left out; so are symbolic links and special files,
+ * which would let an archive reach outside the receiver's directory.
+ */
+static void
+next_entry(struct archive_writer *aw)
+{
+        struct archive_level *level;
+        struct dirent *dent;
+        struct stat sb;
+        size_t namelen;
+        size_t pathlen;
+        DIR *dir;
+        int fd;
+
+        for (;;) {
+                if (aw->depth == 0) {
+                        set_header(aw, ARCHIVE_END, NULL, 0);
+                        aw->done = 1;
+                        return;
+                }
+                level = &aw->levels[aw->depth - 1];
+                dent = readdir(level->dir);
+                if (dent == NULL) {
+                        closedir(level->dir);
+                        aw->depth--;
+                        continue;
+                }
+                if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0 ||
+                    upload_staging(dirfd(level->dir), dent->d_name)) {
+                        continue;
+                }
+                namelen = strlen(dent->d_name);
+                pathlen = level->pathlen + 1 + namelen;
+                if (pathlen >= ARCHIVE_PATH_MAX ||
+                    fstatat(dirfd(level->dir), dent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                        aw->nskipped++;
+                        continue;
+                }
+                aw->path[level->pathlen] = '/';
+                memcpy(aw->path + level->pathlen + 1, dent->d_name, namelen + 1);
+                if (S_ISDIR(sb.st_mode) && aw->depth < ARCHIVE_MAX_DEPTH) {
+                        fd = openat(dirfd(level->dir), dent->d_name,
+                                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        dir = fd >= 0 ? fdopendir(fd) : NULL;
+                        if (dir == NULL) {
+                                if (fd >= 0) {
+                                        close(fd);
+                                }
+                                aw->nskipped++;
+                                continue;
+                        }
+                        aw->levels[aw->depth].dir = dir;
+                        aw->levels[aw->depth].pathlen = pathlen;
+                        aw->depth++;
+                        set_header(aw, ARCHIVE_DIR, &sb, pathlen);
+                        return;
+                }
+                if (S_ISREG(sb.st_mode)) {
+                        fd = openat(dirfd(level->dir), dent->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                        if (fd < 0 || fstat(fd, &sb) < 0) {
+                                if (fd >= 0) {
+                                        close(fd);
+                                }
+                                aw->nskipped++;
+                                continue;
+                        }
+                        aw->fd = fd;
+                        aw->left = sb.st_size;
+                        set_header(aw, ARCHIVE_FILE, &sb, pathlen);
+                        return;
+                }
+                aw->nskipped++;
+        }
+}
+
+/*
+ * Moves on to the next name of the list, skipping empty ones. A name
+ * that cannot be opened, or is not a regular file, gets an error entry
+ * instead.
+ */
+static void
+next_listed(struct archive_writer *aw)
+{
+        struct stat sb;
+        const char *name;
+        size_t namelen;
+        int error;
+        int fd;
+
+        do {
+                if (aw->listoff == aw->listlen) {
+                        set_header(aw, ARCHIVE_END, NULL, 0);
+                        aw->done = 1;
+                        return;
+                }
+                name = aw->list + aw->listoff;
+                namelen = strchr(name, '\n') - name;
+                aw->listoff += namelen + 1;
+        } while (namelen == 0);
+        if (namelen >= ARCHIVE_PATH_MAX) {
+                /* named by as much of it as fits */
+                namelen = ARCHIVE_PATH_MAX - 1;
+                memcpy(aw->path, name, namelen);
+                aw->path[namelen] = '\0';
+                set_header(aw, ARCHIVE_ERROR, NULL, namelen);
+                put_number(aw->header + 1, ENAMETOOLONG, 4);
+                return;
+        }
+        memcpy(aw->path, name, namelen);
+        aw->path[namelen] = '\0';
+        fd = open(aw->path, O_RDONLY | O_CLOEXEC);
+        error = fd < 0 ? errno : 0;
+        if (fd >= 0 && fstat(fd, &sb) < 0) {
+                error = errno;
+        }
+        else if (fd >= 0 && !S_ISREG(sb.st_mode)) {
+                error = S_ISDIR(sb.st_mode) ? EISDIR : EINVAL;
+        }
+        if (error != 0) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                set_header(aw, ARCHIVE_ERROR, NULL, namelen);
+                put_number(aw->header + 1, error, 4);
+                return;
+        }
+        aw->fd = fd;
+        aw->left = sb.st_size;
+        set_header(aw, ARCHIVE_FILE, &sb, namelen);
+}
+
+/* reader */
+
+int
+archive_reader_open(struct archive_reader *ar)
+{
+        memset(ar, 0, sizeof(struct archive_reader));
+        ar->fd = -1;
+        ar->basefd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ar->basefd < 0) {
+                /* the archive is still read through, to keep in sync */
+                fail_entry(ar, errno);
+                return -1;
+        }
+        return 0;
+}
+
+size_t
+archive_want(const struct archive_reader *ar)
+{
+        if (ar->done) {
+                return 0;
+        }
+        if (ar->headerlen < ARCHIVE_HEADER_SIZE) {
+                return ARCHIVE_HEADER_SIZE - ar->headerlen;
+        }
+        if (ar->pathgot < ar->pathlen) {
+                return ar->pathlen - ar->pathgot;
+        }
+        return ar->left;
+}
+
+void
+archive_write(struct archive_reader *ar, const char *buff, size_t len)
+{
+        size_t chunk;
+        ssize_t n;
+
+        while (len > 0 && !ar->done) {
+                if (ar->headerlen < ARCHIVE_HEADER_SIZE) {
+                        chunk = ARCHIVE_HEADER_SIZE - ar->headerlen;
+                        if (chunk > len) {
+                                chunk = len;
+                        }
+                        memcpy(ar->header + ar->headerlen, buff, chunk);
+                        ar->headerlen += chunk;
+                        buff += chunk;
+                        len -= chunk;
+                        if (ar->headerlen < ARCHIVE_HEADER_SIZE) {
+                                break;
+                        }
+                        ar->type = ar->header[0];
+                        ar->mode = get_number(ar->header + 1, 4) & 07777;
+                        ar->left = ar->type == ARCHIVE_FILE ? get_number(ar->header + 5, 8) : 0;
+                        ar->mtime = get_number(ar->header + 13, 8);
+                        ar->pathlen = get_number(ar->header + 21, 2);
+                        ar->pathgot = 0;
+                        if (ar->type == ARCHIVE_END) {
+                                finish_dirs(ar, NULL);
+                                ar->done = 1;
+                                break;
+                        }
+                        if (ar->pathlen == 0 || ar->pathlen >= ARCHIVE_PATH_MAX ||
+                            (ar->type != ARCHIVE_DIR && ar->type != ARCHIVE_FILE &&
+                             ar->type != ARCHIVE_ERROR)) {
+                                /* nothing after this can be made sense of */
+                                ar->path[0] = '\0';
+                                fail_entry(ar, EPROTO);
+                                ar->done = 1;
+                                break;
+                        }
+                        continue;
+                }
+                if (ar->pathgot < ar->pathlen) {
+                        chunk = ar->pathlen - ar->pathgot;
+                        if (chunk > len) {
+                                chunk = len;
+                        }
+                        memcpy(ar->path + ar->pathgot, buff, chunk);
+                        ar->pathgot += chunk;
+                        buff += chunk;
+                        len -= chunk;
+                        if (ar->pathgot == ar->pathlen) {
+                                ar->path[ar->pathlen] = '\0';
+                                start_entry(ar);
+                        }
+                        continue;
+                }
+                chunk = ar->left < len ? ar->left : len;
+                while (ar->fd >= 0 && chunk > 0) {
+                        n = write(ar->fd, buff, chunk);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        if (n < 0) {
+                                fail_entry(ar, errno);
+                                close(ar->fd);
+                                ar->fd = -1;
+                                break;
+                        }
+                        buff += n;
+                        len -= n;
+                        chunk -= n;
+                        ar->left -= n;
+                }
+                /* whatever could not be written is skipped */
+                buff += chunk;
+                len -= chunk;
+                ar->left -= chunk;
+                if (ar->left == 0) {
+                        finish_file(ar);
+                }
+        }
+}
+
+int
+archive_reader_close(struct archive_reader *ar)
+{
+        if (ar->fd >= 0) {
+                close(ar->fd);
+                ar->fd = -1;
+        }
+        finish_dirs(ar, NULL);
+        if (ar->basefd >= 0) {
+                close(ar->basefd);
+        }
+        if (!ar->done && ar->error == 0) {
+                ar->path[0] = '\0';
+                fail_entry(ar, ECONNRESET);
+        }
+        if (ar->error != 0) {
+                errno = ar->error;
+                return -1;
+        }
+        return 0;
+}
+
+/* Refuses absolute paths and any ".." that could climb out of the base. */
+static int
+valid_path(const char *path)
+{
+        const char *p;
+
+        if (path[0] == '/') {
+                return 0;
+        }
+        p = path;
+        for (;;) {
+                if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+                        return 0;
+                }
+                p = strchr(p, '/');
+                if (p == NULL) {
+                        return 1;
+                }
+                p++;
+        }
+}
+
+static void
+start_entry(struct archive_reader *ar)
+{
+        struct stat sb;
+
+        if (ar->type == ARCHIVE_ERROR) {
+                /* the sender could not send the file; the mode is why */
+                fail_entry(ar, ar->mode != 0 ? (int)ar->mode : EIO);
+                finish_file(ar);
+                return;
+        }
+        finish_dirs(ar, ar->path);
+        if (!valid_path(ar->path)) {
+                /* a file's contents are skipped */
+                fail_entry(ar, EPERM);
+                if (ar->left == 0) {
+                        finish_file(ar);
+                }
+                return;
+        }
+        if (ar->type == ARCHIVE_DIR) {
+                /* keep it writable until everything in it is there */
+                if (mkdirat(ar->basefd, ar->path, ar->mode | S_IRWXU) < 0 &&
+                    (errno != EEXIST || fstatat(ar->basefd, ar->path, &sb, 0) < 0 ||
+                     !S_ISDIR(sb.st_mode))) {
+                        fail_entry(ar, errno == EEXIST ? ENOTDIR : errno);
+                }
+                else if (ar->ndirs < ARCHIVE_MAX_DEPTH) {
+                        ar->dirs[ar->ndirs].path = strdup(ar->path);
+                        ar->dirs[ar->ndirs].mode = ar->mode;
+                        ar->dirs[ar->ndirs].mtime = ar->mtime;
+                        if (ar->dirs[ar->ndirs].path != NULL) {
+                                ar->ndirs++;
+                        }
+                }
+                finish_file(ar);
+                return;
+        }
+        ar->fd = openat(ar->basefd, ar->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                        ar->mode & 0777);
+        if (ar->fd < 0) {
+                fail_entry(ar, errno);
+        }
+        if (ar->left == 0) {
+                finish_file(ar);
+        }
+}
+
+/* Wraps up the current entry and gets ready for the next header. */
+static void
+finish_file(struct archive_reader *ar)
+{
+        struct timespec times[2];
+
+        if (ar->fd >= 0) {
+                times[0].tv_sec = ar->mtime;
+                times[0].tv_nsec = 0;
+                times[1] = times[0];
+                futimens(ar->fd, times);
+                if (close(ar->fd) < 0) {
+                        fail_entry(ar, errno);
+                }
+                ar->fd = -1;
+        }
+        ar->headerlen = 0;
+        ar->pathlen = 0;
+        ar->pathgot = 0;
+}
+
+/*
+ * Gives the directories that path is not in their mode and mtime, now
+ * that nothing more is going to be created in them; all of them if
+ * path is NULL.
+ */
+static void
+finish_dirs(struct archive_reader *ar, const char *path)
+{
+        struct archive_dir *d;
+        struct timespec times[2];
+        size_t len;
+
+        while (ar->ndirs > 0) {
+                d = &ar->dirs[ar->ndirs - 1];
+                len = strlen(d->path);
+                if (path != NULL && strncmp(path, d->path, len) == 0 && path[len] == '/') {
+                        break;
+                }
+                times[0].tv_sec = d->mtime;
+                times[0].tv_nsec = 0;
+                times[1] = times[0];
+                if ((d->mode & S_IRWXU) != S_IRWXU) {
+                        fchmodat(ar->basefd, d->path, d->mode, 0);
+                }
+                utimensat(ar->basefd, d->path, times, AT_SYMLINK_NOFOLLOW);
+                free(d->path);
+                ar->ndirs--;
+        }
+}
+
+/*
+ * Remembers the first failure and reports every one; the rest of the
+ * archive still unpacks.
+ */
+static void
+fail_entry(struct archive_reader *ar, int error)
+{
+        if (ar->report != NULL) {
+                ar->report(ar->path, error);
+        }
+        if (ar->error != 0) {
+                return;
+        }
+        ar->error = error;
+        strcpy(ar->errpath, ar->path);
+}
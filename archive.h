@@ -0,0 +1,124 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+
+/*
+ * A directory tree as one stream. Each entry is a header holding the
+ * type, mode, size, mtime and path length as big-endian numbers of
+ * 1, 4, 8, 8 and 2 bytes, then the path and, for a regular file, size
+ * bytes of contents. Entries come depth first, every directory before
+ * what is in it, and an entry of type ARCHIVE_END closes the stream.
+ * Paths are relative and start with the name of the tree's root.
+ *
+ * An archive of a list of files rather than a tree has an entry for
+ * each name in the list, in order: the file's, or one of type
+ * ARCHIVE_ERROR with the errno that kept it out in place of the mode.
+ */
+#define ARCHIVE_DIR 'd'
+#define ARCHIVE_FILE 'f'
+#define ARCHIVE_ERROR 'x'
+#define ARCHIVE_END 'e'
+#define ARCHIVE_HEADER_SIZE 23
+#define ARCHIVE_PATH_MAX 4096
+#define ARCHIVE_MAX_DEPTH 64
+/* the longest list of names, newline after each, one archive is made of */
+#define ARCHIVE_LIST_MAX (1024 * 1024)
+
+/* one open directory on the way down */
+struct archive_level {
+        DIR *dir;
+        size_t pathlen;
+};
+
+/* a directory the reader has created and still has to finish */
+struct archive_dir {
+        char *path;
+        mode_t mode;
+        time_t mtime;
+};
+
+/* walks a tree and hands out its archive a buffer at a time */
+struct archive_writer {
+        struct archive_level levels[ARCHIVE_MAX_DEPTH];
+        int depth;
+        char path[ARCHIVE_PATH_MAX];
+        unsigned char header[ARCHIVE_HEADER_SIZE + ARCHIVE_PATH_MAX];
+        size_t headerlen;
+        size_t headeroff;
+        int fd;
+        uint64_t left;
+        int done;
+        int nskipped;
+        char *list;
+        size_t listlen;
+        size_t listoff;
+        uint32_t crc;
+};
+
+/* unpacks an archive under a directory as its bytes come in */
+struct archive_reader {
+        int basefd;
+        unsigned char header[ARCHIVE_HEADER_SIZE];
+        size_t headerlen;
+        char path[ARCHIVE_PATH_MAX];
+        size_t pathlen;
+        size_t pathgot;
+        int type;
+        mode_t mode;
+        time_t mtime;
+        int fd;
+        uint64_t left;
+        struct archive_dir dirs[ARCHIVE_MAX_DEPTH];
+        int ndirs;
+        int done;
+        int error;
+        char errpath[ARCHIVE_PATH_MAX];
+        void (*report)(const char *path, int error);
+};
+
+/* Starts archiving root, a directory or a regular file; -1 on error. */
+int archive_writer_open(struct archive_writer *aw, const char *root);
+
+/*
+ * Starts archiving the files named in list, len bytes of names each
+ * followed by a newline, which the writer takes over and frees.
+ */
+int archive_writer_open_list(struct archive_writer *aw, char *list, size_t len);
+
+/*
+ * Fills buff with the next bytes of the archive; 0 once it is over.
+ * aw->crc is the crc32c of all the bytes handed out.
+ */
+size_t archive_read(struct archive_writer *aw, char *buff, size_t size);
+
+void archive_writer_close(struct archive_writer *aw);
+
+/*
+ * Starts unpacking into the current directory. Returns -1 if it cannot
+ * be opened; the reader then only consumes the archive and fails.
+ * ar->report, if set afterwards, is told of every entry that fails.
+ */
+int archive_reader_open(struct archive_reader *ar);
+
+/*
+ * Tells how many bytes can be fed without reading past the end of the
+ * archive; 0 once it is over.
+ */
+size_t archive_want(const struct archive_reader *ar);
+
+/* Unpacks the next len bytes; anything after the end is ignored. */
+void archive_write(struct archive_reader *ar, const char *buff, size_t len);
+
+/*
+ * Finishes unpacking. Returns -1 if an entry failed, with the reason in
+ * ar->error and the entry in ar->errpath, or if the archive was cut
+ * short.
+ */
+int archive_reader_close(struct archive_reader *ar);
+
+#endif
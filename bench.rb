@@ -0,0 +1,305 @@
+require "fileutils"
+require "json"
+require "socket"
+require "tmpdir"
+
+# Loopback benchmarks for mftpd, run by "rake bench". Each workload opens
+# its sessions one after another, as the server pairs control and data
+# connections by address, then lets them all loose at once: every session
+# is a process of its own that speaks the protocol directly and times each
+# request from the command going out to the last byte of its answer.
+module Bench
+  KB = 1024
+  MB = 1024 * KB
+  GB = 1024 * MB
+
+  # what a workload moves or lists, and how many sessions run it at once
+  SCALES = {
+    "quick" => {
+      "sizes" => [1 * KB, 1 * MB, 64 * MB],
+      "entries" => [10, 1000, 100_000],
+      "sessions" => [1, 4],
+      "echo_sessions" => [1, 4, 16],
+    },
+    "full" => {
+      "sizes" => [1 * KB, 1 * MB, 64 * MB, 1 * GB, 4 * GB],
+      "entries" => [10, 1000, 100_000, 1_000_000],
+      "sessions" => [1, 4, 16],
+      "echo_sessions" => [1, 4, 16, 64],
+    },
+  }
+
+  # the bytes or entries one session goes through per workload, roughly
+  BYTES_PER_SESSION = 256 * MB
+  ENTRIES_PER_SESSION = 1_000_000
+  ECHOS_PER_SESSION = 2000
+
+  ENGINES = {
+    "fork" => [],
+    "epoll" => ["-e", "epoll"],
+  }
+
+  # how much worse than the baseline a result may get before it is flagged
+  DEFAULT_TOLERANCE = 0.10
+  DEFAULT_LATENCY_TOLERANCE = 0.25
+
+  # One client session: a control and a data connection to the server.
+  class Session
+    def initialize(port)
+      @ctrl = TCPSocket.new("127.0.0.1", port)
+      @data = TCPSocket.new("127.0.0.1", port + 1)
+      @buff = String.new(capacity: MB)
+      # the server pairs the two by address; be paired before the next one comes
+      request("echo")
+    end
+
+    # Sends a command and takes in its answer; returns the bytes it came with.
+    def request(command)
+      @ctrl.write(command + "\n")
+      take_reply(command)
+    end
+
+    # Sends a put of size bytes of path and waits for it to be stored.
+    def put(path, name, size)
+      @ctrl.write("put #{name} #{size}\n")
+      IO.copy_stream(path, @data, size)
+      take_reply("put #{name}")
+      size
+    end
+
+    def close
+      @ctrl.write("exit\n") rescue nil
+      @ctrl.close
+      @data.close
+    end
+
+    private
+
+    def take_reply(command)
+      line = @ctrl.gets
+      raise "#{command}: connection lost" if line.nil?
+      raise "#{command}: #{line.chomp}" unless line.start_with?("succ: ")
+      nbytes = line[6..].to_i
+      left = nbytes
+      while left > 0
+        left -= @data.readpartial(left < MB ? left : MB, @buff).bytesize
+      end
+      nbytes
+    end
+  end
+
+  module_function
+
+  def run(bindir, out, baseline)
+    scale = ENV.fetch("BENCH_SCALE", "quick")
+    config = SCALES.fetch(scale) { abort "bench: #{scale}: unknown scale (quick or full)" }
+    engines = ENV.fetch("BENCH_ENGINES", ENGINES.keys.join(",")).split(",")
+    extra = ENV.fetch("BENCH_MFTPD_ARGS", "").split
+    results = []
+    Dir.mktmpdir("mftp-bench", ENV["BENCH_DIR"]) do |dir|
+      prepare_tree(dir, config)
+      engines.each do |engine|
+        args = ENGINES.fetch(engine) { abort "bench: #{engine}: unknown engine" } + extra
+        with_server(bindir, dir, args) do |port|
+          results.concat(run_workloads(port, engine, dir, config))
+        end
+      end
+    end
+    report = {
+      "meta" => {
+        "time" => Time.now.utc.strftime("%Y-%m-%dT%H:%M:%SZ"),
+        "commit" => `git rev-parse --short HEAD 2>/dev/null`.chomp,
+        "host" => Socket.gethostname,
+        "cpus" => `nproc`.to_i,
+        "kernel" => `uname -r`.chomp,
+        "scale" => scale,
+        "mftpd_args" => extra.join(" "),
+      },
+      "results" => results,
+    }
+    File.write(out, JSON.pretty_generate(report) + "\n")
+    puts "bench: results in #{out}"
+    compare(baseline, out) unless baseline.nil?
+  end
+
+  # Lays out the files and directories the workloads use under dir/srv.
+  def prepare_tree(dir, config)
+    srv = File.join(dir, "srv")
+    FileUtils.mkdir_p(srv)
+    block = Random.new(1).bytes(MB)
+    config["sizes"].each do |size|
+      File.open(File.join(srv, "file-#{size}"), "wb") do |f|
+        left = size
+        while left > 0
+          left -= f.write(left < MB ? block[0, left] : block)
+        end
+      end
+    end
+    config["entries"].each do |entries|
+      path = File.join(srv, "dir-#{entries}")
+      Dir.mkdir(path)
+      entries.times { |i| File.open(File.join(path, format("entry-%07d", i)), "w") {} }
+    end
+  end
+
+  # Starts mftpd on two free loopback ports and yields the first of them.
+  def with_server(bindir, dir, args)
+    port = free_ports
+    pid = Process.spawn(File.join(bindir, "mftpd"), *args, port.to_s, (port + 1).to_s,
+                        chdir: File.join(dir, "srv"), out: File::NULL)
+    begin
+      wait_for_server(port)
+      yield port
+    ensure
+      Process.kill("TERM", pid)
+      Process.wait(pid)
+    end
+  end
+
+  # Finds a port whose successor is free as well.
+  def free_ports
+    loop do
+      server = TCPServer.new("127.0.0.1", 0)
+      port = server.addr[1]
+      server.close
+      begin
+        TCPServer.new("127.0.0.1", port + 1).close
+        return port
+      rescue SystemCallError
+        next
+      end
+    end
+  end
+
+  def wait_for_server(port)
+    100.times do
+      Session.new(port).close
+      return
+    rescue SystemCallError
+      sleep 0.05
+    end
+    abort "bench: mftpd did not come up on port #{port}"
+  end
+
+  def run_workloads(port, engine, dir, config)
+    results = []
+    config["echo_sessions"].each do |n|
+      results << measure(port, "echo/s#{n}/#{engine}", n, ECHOS_PER_SESSION, 0) do |s, _i, _k|
+        s.request("echo x")
+      end
+    end
+    config["sizes"].each do |size|
+      ops = (BYTES_PER_SESSION / size).clamp(1, 1000)
+      config["sessions"].each do |n|
+        results << measure(port, "get/#{label(size)}/s#{n}/#{engine}", n, ops, size) do |s, _i, _k|
+          s.request("get file-#{size}")
+        end
+        local = File.join(dir, "srv", "file-#{size}")
+        results << measure(port, "put/#{label(size)}/s#{n}/#{engine}", n, ops, size) do |s, i, _k|
+          s.put(local, "put-#{i}", size)
+        end
+        Dir.glob(File.join(dir, "srv", "put-*")).each { |path| File.delete(path) }
+      end
+    end
+    config["entries"].each do |entries|
+      ops = (ENTRIES_PER_SESSION / entries).clamp(3, 200)
+      results << measure(port, "rls/#{entries}/s1/#{engine}", 1, ops, 0) do |s, _i, _k|
+        s.request("rls dir-#{entries}")
+      end
+    end
+    results
+  end
+
+  # Runs ops requests in each of nsessions sessions at once.
+  def measure(port, name, nsessions, ops, size)
+    sessions = Array.new(nsessions) { Session.new(port) }
+    go_r, go_w = IO.pipe
+    workers = sessions.each_with_index.map do |s, i|
+      r, w = IO.pipe
+      pid = fork do
+        r.close
+        go_w.close
+        go_r.read
+        latencies = Array.new(ops) do |k|
+          start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          yield s, i, k
+          Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        end
+        w.write(JSON.generate(latencies))
+        w.close
+        exit!(0)
+      rescue StandardError, SystemCallError => e
+        warn "bench: #{name}: #{e.message}"
+        exit!(1)
+      end
+      w.close
+      [pid, r]
+    end
+    go_r.close
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    go_w.close
+    latencies = workers.flat_map do |pid, r|
+      output = r.read
+      Process.wait(pid)
+      abort "bench: #{name}: a session failed" unless $?.success?
+      JSON.parse(output)
+    end
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    sessions.each(&:close)
+    summarize(name, nsessions, size, latencies, elapsed)
+  end
+
+  def summarize(name, nsessions, size, latencies, elapsed)
+    latencies.sort!
+    result = {
+      "name" => name,
+      "sessions" => nsessions,
+      "ops" => latencies.size,
+      "seconds" => elapsed.round(4),
+      "ops_per_s" => (latencies.size / elapsed).round(1),
+      "mb_per_s" => (latencies.size * size / elapsed / MB).round(1),
+      "p50_ms" => (percentile(latencies, 0.50) * 1000).round(3),
+      "p99_ms" => (percentile(latencies, 0.99) * 1000).round(3),
+    }
+    puts format("%-28s %10.1f ops/s %10.1f MB/s  p50 %9.3f ms  p99 %9.3f ms", name,
+                result["ops_per_s"], result["mb_per_s"], result["p50_ms"], result["p99_ms"])
+    result
+  end
+
+  def percentile(sorted, q)
+    sorted[((sorted.size - 1) * q).round]
+  end
+
+  def label(size)
+    return "#{size / GB}g" if size % GB == 0
+    return "#{size / MB}m" if size % MB == 0
+    return "#{size / KB}k" if size % KB == 0
+    size.to_s
+  end
+
+  # Flags every result that got worse than its baseline by more than the
+  # tolerance: lower throughput, or a higher p99 latency. Fails if any did.
+  def compare(baseline, current)
+    tolerance = ENV.fetch("TOLERANCE", DEFAULT_TOLERANCE).to_f
+    lattolerance = ENV.fetch("LATENCY_TOLERANCE", DEFAULT_LATENCY_TOLERANCE).to_f
+    old = JSON.parse(File.read(baseline))["results"].to_h { |r| [r["name"], r] }
+    regressions = 0
+    JSON.parse(File.read(current))["results"].each do |r|
+      base = old[r["name"]]
+      next if base.nil?
+      rate = r["mb_per_s"] > 0 ? "mb_per_s" : "ops_per_s"
+      flags = []
+      if r[rate] < base[rate] * (1 - tolerance)
+        flags << format("%s %.1f -> %.1f", rate, base[rate], r[rate])
+      end
+      if r["p99_ms"] > base["p99_ms"] * (1 + lattolerance)
+        flags << format("p99 %.3f -> %.3f ms", base["p99_ms"], r["p99_ms"])
+      end
+      change = base[rate] > 0 ? (r[rate] / base[rate] - 1) * 100 : 0.0
+      puts format("%-28s %+7.1f%%  %s", r["name"], change, flags.empty? ? "ok" : "REGRESSION: " + flags.join(", "))
+      regressions += 1 unless flags.empty?
+    end
+    abort "bench: #{regressions} regression(s) against #{baseline}" if regressions > 0
+    puts "bench: no regressions against #{baseline}"
+  end
+end
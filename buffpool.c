@@ -0,0 +1,67 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include "buffpool.h"
+
+/* a free buffer holds the link to the next one */
+struct free_buff {
+        struct free_buff *next;
+};
+
+static size_t buffpool_buffsize = BUFFPOOL_DEFAULT_SIZE;
+static struct free_buff *buffpool_free;
+static size_t buffpool_nfree;
+
+void
+buffpool_init(size_t size)
+{
+        size_t page;
+
+        page = sysconf(_SC_PAGESIZE);
+        if (size < BUFFPOOL_MIN_SIZE) {
+                size = BUFFPOOL_MIN_SIZE;
+        }
+        if (size > BUFFPOOL_MAX_SIZE) {
+                size = BUFFPOOL_MAX_SIZE;
+        }
+        buffpool_buffsize = (size + page - 1) / page * page;
+}
+
+size_t
+buffpool_size(void)
+{
+        return buffpool_buffsize;
+}
+
+void *
+buffpool_get(void)
+{
+        struct free_buff *fb;
+        void *p;
+
+        if (buffpool_free != NULL) {
+                fb = buffpool_free;
+                buffpool_free = fb->next;
+                buffpool_nfree--;
+                return fb;
+        }
+        p = mmap(NULL, buffpool_buffsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? NULL : p;
+}
+
+void
+buffpool_put(void *buff)
+{
+        struct free_buff *fb;
+
+        if (buff == NULL) {
+                return;
+        }
+        if (buffpool_nfree >= BUFFPOOL_KEEP) {
+                munmap(buff, buffpool_buffsize);
+                return;
+        }
+        fb = buff;
+        fb->next = buffpool_free;
+        buffpool_free = fb;
+        buffpool_nfree++;
+}
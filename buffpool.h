@@ -0,0 +1,31 @@
+#ifndef BUFFPOOL_H
+#define BUFFPOOL_H
+
+#include <stddef.h>
+
+/*
+ * The buffers transfers move their data through: all of one size, set
+ * once at startup, and page-aligned so that they also serve direct I/O
+ * and io_uring. A buffer given back goes on a free list, from which the
+ * next transfer of the process takes it without a fresh mapping.
+ */
+#define BUFFPOOL_DEFAULT_SIZE (256 * 1024)
+#define BUFFPOOL_MIN_SIZE (64 * 1024)
+#define BUFFPOOL_MAX_SIZE (16 * 1024 * 1024)
+/* how many free buffers are kept back rather than unmapped */
+#define BUFFPOOL_KEEP 32
+
+/*
+ * Sets the size of the buffers, rounded up to whole pages and kept
+ * within the bounds above. Only before the first one is taken.
+ */
+void buffpool_init(size_t size);
+
+size_t buffpool_size(void);
+
+/* Takes a buffer; NULL if there is no memory for one. */
+void *buffpool_get(void);
+
+void buffpool_put(void *buff);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_BUFF_SIZE (64 * 1024)
+/* the lengths the three lanes of the hardware loop run over */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+/* a word that may overlay any buffer */
+typedef uint64_t crc32c_word __attribute__((may_alias));
+
+static void init_crc32c(void);
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t nbytes);
+
+static int crc32c_ready;
+static uint32_t crc32c_table[8][256];
+
+#if defined(__x86_64__)
+static int crc32c_has_sse42;
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec);
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat);
+static void crc32c_zeros(uint32_t zeros[][256], size_t len);
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc);
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t nbytes);
+#endif
+
+/*
+ * Builds the tables of the slicing-by-8 loop, and, where the processor
+ * has the crc32 instruction, those that join the hardware lanes.
+ */
+static void
+init_crc32c(void)
+{
+        uint32_t crc;
+        int i;
+        int j;
+
+        for (i = 0; i < 256; i++) {
+                crc = i;
+                for (j = 0; j < 8; j++) {
+                        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                }
+                crc32c_table[0][i] = crc;
+        }
+        for (i = 0; i < 256; i++) {
+                for (j = 1; j < 8; j++) {
+                        crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^
+                                             (crc32c_table[j - 1][i] >> 8);
+                }
+        }
+#if defined(__x86_64__)
+        crc32c_has_sse42 = __builtin_cpu_supports("sse4.2");
+        if (crc32c_has_sse42) {
+                crc32c_zeros(crc32c_long, CRC32C_LONG);
+                crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        }
+#endif
+        crc32c_ready = 1;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buff, size_t nbytes)
+{
+        if (!crc32c_ready) {
+                init_crc32c();
+        }
+#if defined(__x86_64__)
+        if (crc32c_has_sse42) {
+                return crc32c_hw(crc, buff, nbytes);
+        }
+#endif
+        return crc32c_sw(crc, buff, nbytes);
+}
+
+/* Eight bytes a step through eight tables. */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t nbytes)
+{
+        uint64_t word;
+
+        crc = ~crc;
+        while (nbytes > 0 && ((uintptr_t)p & 7) != 0) {
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+                nbytes--;
+        }
+        while (nbytes >= 8) {
+                word = *(const crc32c_word *)p ^ crc;
+                crc = crc32c_table[7][word & 0xff] ^
+                      crc32c_table[6][(word >> 8) & 0xff] ^
+                      crc32c_table[5][(word >> 16) & 0xff] ^
+                      crc32c_table[4][(word >> 24) & 0xff] ^
+                      crc32c_table[3][(word >> 32) & 0xff] ^
+                      crc32c_table[2][(word >> 40) & 0xff] ^
+                      crc32c_table[1][(word >> 48) & 0xff] ^
+                      crc32c_table[0][word >> 56];
+                p += 8;
+                nbytes -= 8;
+        }
+        while (nbytes-- > 0) {
+                crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+}
+
+#if defined(__x86_64__)
+/* Multiplies a 32x32 matrix over GF(2) by a vector. */
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+        uint32_t sum;
+
+        sum = 0;
+        while (vec != 0) {
+                if (vec & 1) {
+                        sum ^= *mat;
+                }
+                vec >>= 1;
+                mat++;
+        }
+        return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+        int n;
+
+        for (n = 0; n < 32; n++) {
+                square[n] = gf2_matrix_times(mat, mat[n]);
+        }
+}
+
+/*
+ * Builds the tables that advance a crc over len zero bytes, len being
+ * a power of two, a byte of the crc at a time.
+ */
+static void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+        uint32_t even[32];
+        uint32_t odd[32];
+        uint32_t *op;
+        uint32_t row;
+        uint32_t n;
+
+        /* one zero bit, then two, then four */
+        odd[0] = CRC32C_POLY;
+        row = 1;
+        for (n = 1; n < 32; n++) {
+                odd[n] = row;
+                row <<= 1;
+        }
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+        /* every square doubles the number of zero bytes, starting from one */
+        op = even;
+        for (;;) {
+                gf2_matrix_square(even, odd);
+                op = even;
+                len >>= 1;
+                if (len == 0) {
+                        break;
+                }
+                gf2_matrix_square(odd, even);
+                op = odd;
+                len >>= 1;
+                if (len == 0) {
+                        break;
+                }
+        }
+        for (n = 0; n < 256; n++) {
+                zeros[0][n] = gf2_matrix_times(op, n);
+                zeros[1][n] = gf2_matrix_times(op, n << 8);
+                zeros[2][n] = gf2_matrix_times(op, n << 16);
+                zeros[3][n] = gf2_matrix_times(op, n << 24);
+        }
+}
+
+static uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+        return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+               zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/*
+ * The crc32 instruction takes three cycles but can start every cycle,
+ * so long buffers are cut in three lanes computed side by side, then
+ * joined by advancing the earlier lanes over the later ones.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t nbytes)
+{
+        const unsigned char *end;
+        uint64_t crc0;
+        uint64_t crc1;
+        uint64_t crc2;
+
+        crc0 = ~crc;
+        while (nbytes > 0 && ((uintptr_t)p & 7) != 0) {
+                crc0 = _mm_crc32_u8(crc0, *p++);
+                nbytes--;
+        }
+        while (nbytes >= CRC32C_LONG * 3) {
+                crc1 = 0;
+                crc2 = 0;
+                end = p + CRC32C_LONG;
+                do {
+                        crc0 = _mm_crc32_u64(crc0, *(const crc32c_word *)p);
+                        crc1 = _mm_crc32_u64(crc1, *(const crc32c_word *)(p + CRC32C_LONG));
+                        crc2 = _mm_crc32_u64(crc2, *(const crc32c_word *)(p + 2 * CRC32C_LONG));
+                        p += 8;
+                } while (p < end);
+                crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+                crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+                p += 2 * CRC32C_LONG;
+                nbytes -= 3 * CRC32C_LONG;
+        }
+        while (nbytes >= CRC32C_SHORT * 3) {
+                crc1 = 0;
+                crc2 = 0;
+                end = p + CRC32C_SHORT;
+                do {
+                        crc0 = _mm_crc32_u64(crc0, *(const crc32c_word *)p);
+                        crc1 = _mm_crc32_u64(crc1, *(const crc32c_word *)(p + CRC32C_SHORT));
+                        crc2 = _mm_crc32_u64(crc2, *(const crc32c_word *)(p + 2 * CRC32C_SHORT));
+                        p += 8;
+                } while (p < end);
+                crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+                crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+                p += 2 * CRC32C_SHORT;
+                nbytes -= 3 * CRC32C_SHORT;
+        }
+        while (nbytes >= 8) {
+                crc0 = _mm_crc32_u64(crc0, *(const crc32c_word *)p);
+                p += 8;
+                nbytes -= 8;
+        }
+        while (nbytes-- > 0) {
+                crc0 = _mm_crc32_u8(crc0, *p++);
+        }
+        return ~(uint32_t)crc0;
+}
+#endif
+
+int
+crc32c_file(int fd, off_t offset, off_t length, uint32_t *crcp)
+{
+        char *buff;
+        uint32_t crc;
+        size_t chunk;
+        ssize_t n;
+
+        buff = malloc(CRC32C_BUFF_SIZE);
+        if (buff == NULL) {
+                return -1;
+        }
+        crc = 0;
+        while (length > 0) {
+                chunk = length < CRC32C_BUFF_SIZE ? length : CRC32C_BUFF_SIZE;
+                n = pread(fd, buff, chunk, offset);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        free(buff);
+                        return -1;
+                }
+                crc = crc32c(crc, buff, n);
+                offset += n;
+                length -= n;
+        }
+        free(buff);
+        *crcp = crc;
+        return 0;
+}
+
+void
+crc32c_encode(uint32_t crc, unsigned char *buff)
+{
+        buff[0] = crc >> 24;
+        buff[1] = crc >> 16;
+        buff[2] = crc >> 8;
+        buff[3] = crc;
+}
+
+uint32_t
+crc32c_decode(const unsigned char *buff)
+{
+        return (uint32_t)buff[0] << 24 | (uint32_t)buff[1] << 16 | (uint32_t)buff[2] << 8 | buff[3];
+}
@@ -0,0 +1,21 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Castagnoli CRC; start with crc 0 and feed the previous value back. */
+uint32_t crc32c(uint32_t crc, const void *buff, size_t nbytes);
+
+/* Checksums length bytes of fd from offset; -1 on a read error or EOF. */
+int crc32c_file(int fd, off_t offset, off_t length, uint32_t *crcp);
+
+/* A checksum on the wire is a big-endian number of this many bytes. */
+#define CRC32C_DIGEST_SIZE 4
+
+void crc32c_encode(uint32_t crc, unsigned char *buff);
+
+uint32_t crc32c_decode(const unsigned char *buff);
+
+#endif
@@ -0,0 +1,699 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include "crc32c.h"
+#include "delta.h"
+
+static void put_number(unsigned char *p, uint64_t value, int nbytes);
+static uint64_t get_number(const unsigned char *p, int nbytes);
+static void weak_sum(const unsigned char *buff, size_t len, uint32_t *ap, uint32_t *bp);
+static void strong_sum(const unsigned char *buff, size_t len, unsigned char *strong);
+static uint32_t hash_weak(uint32_t weak);
+static int full_block(const struct delta_sig *sig, uint32_t index);
+static int32_t find_block(struct delta_writer *dw, uint32_t weak);
+static void fill_buffer(struct delta_writer *dw);
+static void next_ops(struct delta_writer *dw);
+static void emit(struct delta_writer *dw, int type, uint32_t x, uint64_t y, const unsigned char *data);
+static void emit_literal(struct delta_writer *dw, size_t len);
+static void flush_copy(struct delta_writer *dw);
+static void apply_op(struct delta_reader *dr);
+static void copy_blocks(struct delta_reader *dr, uint32_t count, uint64_t index);
+static void append(struct delta_reader *dr, const void *buff, size_t len);
+static void fail(struct delta_reader *dr, int error);
+
+static void
+put_number(unsigned char *p, uint64_t value, int nbytes)
+{
+        while (nbytes-- > 0) {
+                p[nbytes] = value & 0xff;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+get_number(const unsigned char *p, int nbytes)
+{
+        uint64_t value;
+
+        value = 0;
+        while (nbytes-- > 0) {
+                value = (value << 8) | *p++;
+        }
+        return value;
+}
+
+/*
+ * The rolling checksum: a is the sum of the bytes and b the sum of a
+ * over every prefix, both modulo 2^16, so that moving the window by a
+ * byte takes constant time (see next_ops).
+ */
+static void
+weak_sum(const unsigned char *buff, size_t len, uint32_t *ap, uint32_t *bp)
+{
+        uint32_t a;
+        uint32_t b;
+        size_t i;
+
+        a = 0;
+        b = 0;
+        for (i = 0; i < len; i++) {
+                a += buff[i];
+                b += (len - i) * buff[i];
+        }
+        *ap = a & 0xffff;
+        *bp = b & 0xffff;
+}
+
+static void
+strong_sum(const unsigned char *buff, size_t len, unsigned char *strong)
+{
+        unsigned char md[SHA256_DIGEST_LENGTH];
+
+        SHA256(buff, len, md);
+        memcpy(strong, md, DELTA_STRONG_SIZE);
+}
+
+static uint32_t
+hash_weak(uint32_t weak)
+{
+        return (weak * 0x9e3779b1u) ^ (weak >> 16);
+}
+
+/* Only whole blocks can match, so a short last block never does. */
+static int
+full_block(const struct delta_sig *sig, uint32_t index)
+{
+        return (uint64_t)(index + 1) * sig->blocksize <= sig->size;
+}
+
+uint32_t
+delta_block_size(uint64_t size)
+{
+        uint32_t blocksize;
+
+        /* about the square root, as rsync does: few blocks, yet small */
+        blocksize = DELTA_MIN_BLOCK;
+        while (blocksize < DELTA_MAX_BLOCK && (uint64_t)blocksize * blocksize < size) {
+                blocksize *= 2;
+        }
+        return blocksize;
+}
+
+/* signature */
+
+int
+delta_sign(int fd, uint32_t blocksize, FILE *out)
+{
+        unsigned char header[DELTA_SIG_HEADER_SIZE];
+        unsigned char entry[DELTA_SIG_ENTRY_SIZE];
+        unsigned char *buff;
+        struct stat sb;
+        uint64_t nblocks;
+        off_t offset;
+        size_t len;
+        size_t got;
+        ssize_t n;
+        uint32_t a;
+        uint32_t b;
+
+        if (fstat(fd, &sb) < 0) {
+                return -1;
+        }
+        nblocks = ((uint64_t)sb.st_size + blocksize - 1) / blocksize;
+        if (nblocks > DELTA_MAX_BLOCKS) {
+                errno = EFBIG;
+                return -1;
+        }
+        buff = malloc(blocksize);
+        if (buff == NULL) {
+                return -1;
+        }
+        put_number(header, blocksize, 4);
+        put_number(header + 4, nblocks, 4);
+        put_number(header + 8, sb.st_size, 8);
+        fwrite(header, sizeof(char), DELTA_SIG_HEADER_SIZE, out);
+        for (offset = 0; offset < sb.st_size; offset += len) {
+                len = sb.st_size - offset < blocksize ? sb.st_size - offset : blocksize;
+                for (got = 0; got < len; got += n) {
+                        n = pread(fd, buff + got, len - got, offset + got);
+                        if (n < 0 && errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        if (n <= 0) {
+                                /* the file shrank under us */
+                                free(buff);
+                                errno = n == 0 ? EIO : errno;
+                                return -1;
+                        }
+                }
+                weak_sum(buff, len, &a, &b);
+                put_number(entry, a | b << 16, 4);
+                strong_sum(buff, len, entry + 4);
+                fwrite(entry, sizeof(char), DELTA_SIG_ENTRY_SIZE, out);
+        }
+        free(buff);
+        return 0;
+}
+
+struct delta_sig *
+delta_sig_parse(const char *buff, size_t len)
+{
+        const unsigned char *p;
+        struct delta_sig *sig;
+        uint32_t blocksize;
+        uint32_t nblocks;
+        uint64_t size;
+        uint32_t nheads;
+        uint32_t h;
+        uint32_t i;
+
+        p = (const unsigned char *)buff;
+        if (len < DELTA_SIG_HEADER_SIZE) {
+                return NULL;
+        }
+        blocksize = get_number(p, 4);
+        nblocks = get_number(p + 4, 4);
+        size = get_number(p + 8, 8);
+        if (blocksize < DELTA_MIN_BLOCK || blocksize > DELTA_MAX_BLOCK || nblocks > DELTA_MAX_BLOCKS ||
+            (size + blocksize - 1) / blocksize != nblocks ||
+            len != DELTA_SIG_HEADER_SIZE + (uint64_t)nblocks * DELTA_SIG_ENTRY_SIZE) {
+                return NULL;
+        }
+        sig = calloc(1, sizeof(struct delta_sig));
+        if (sig == NULL) {
+                return NULL;
+        }
+        for (nheads = 16; nheads < 2 * nblocks; nheads *= 2) {
+        }
+        sig->blocksize = blocksize;
+        sig->nblocks = nblocks;
+        sig->size = size;
+        sig->mask = nheads - 1;
+        /* one spare block each, so that an empty file still gets memory */
+        sig->weak = malloc((nblocks + 1) * sizeof(uint32_t));
+        sig->strong = malloc((nblocks + 1) * DELTA_STRONG_SIZE);
+        sig->heads = malloc(nheads * sizeof(int32_t));
+        sig->chain = malloc((nblocks + 1) * sizeof(int32_t));
+        if (sig->weak == NULL || sig->strong == NULL || sig->heads == NULL || sig->chain == NULL) {
+                delta_sig_free(sig);
+                return NULL;
+        }
+        memset(sig->heads, 0xff, nheads * sizeof(int32_t));
+        p += DELTA_SIG_HEADER_SIZE;
+        /* chained from the last, so that earlier blocks are found first */
+        for (i = nblocks; i-- > 0;) {
+                sig->weak[i] = get_number(p + i * DELTA_SIG_ENTRY_SIZE, 4);
+                memcpy(sig->strong + i * DELTA_STRONG_SIZE, p + i * DELTA_SIG_ENTRY_SIZE + 4,
+                       DELTA_STRONG_SIZE);
+                h = hash_weak(sig->weak[i]) & sig->mask;
+                sig->chain[i] = sig->heads[h];
+                sig->heads[h] = i;
+        }
+        return sig;
+}
+
+void
+delta_sig_free(struct delta_sig *sig)
+{
+        if (sig == NULL) {
+                return;
+        }
+        free(sig->weak);
+        free(sig->strong);
+        free(sig->heads);
+        free(sig->chain);
+        free(sig);
+}
+
+/* writer */
+
+int
+delta_writer_open(struct delta_writer *dw, int fd, struct delta_sig *sig)
+{
+        memset(dw, 0, sizeof(struct delta_writer));
+        dw->fd = fd;
+        dw->sig = sig;
+        /* a literal in the making plus a window, and a byte to roll in */
+        dw->buffsize = DELTA_LITERAL_MAX + sig->blocksize + 1;
+        dw->buff = malloc(dw->buffsize);
+        dw->out = malloc(3 * DELTA_OP_SIZE + DELTA_LITERAL_MAX);
+        if (dw->buff == NULL || dw->out == NULL) {
+                delta_writer_close(dw);
+                errno = ENOMEM;
+                return -1;
+        }
+        return 0;
+}
+
+size_t
+delta_read(struct delta_writer *dw, char *buff, size_t size)
+{
+        size_t total;
+        size_t chunk;
+
+        total = 0;
+        while (total < size) {
+                if (dw->outoff == dw->outlen) {
+                        if (dw->done) {
+                                break;
+                        }
+                        dw->outlen = 0;
+                        dw->outoff = 0;
+                        next_ops(dw);
+                        continue;
+                }
+                chunk = dw->outlen - dw->outoff;
+                if (chunk > size - total) {
+                        chunk = size - total;
+                }
+                memcpy(buff + total, dw->out + dw->outoff, chunk);
+                dw->outoff += chunk;
+                total += chunk;
+        }
+        return total;
+}
+
+void
+delta_writer_close(struct delta_writer *dw)
+{
+        if (dw->fd >= 0) {
+                close(dw->fd);
+                dw->fd = -1;
+        }
+        free(dw->buff);
+        free(dw->out);
+        delta_sig_free(dw->sig);
+        dw->buff = NULL;
+        dw->out = NULL;
+        dw->sig = NULL;
+}
+
+/*
+ * Looks the window at dw->pos up among the blocks of the old copy. The
+ * block after the last one matched is tried first, since unchanged
+ * runs are what a delta is mostly made of.
+ */
+static int32_t
+find_block(struct delta_writer *dw, uint32_t weak)
+{
+        unsigned char strong[DELTA_STRONG_SIZE];
+        const struct delta_sig *sig;
+        const unsigned char *window;
+        uint32_t next;
+        int32_t i;
+        int summed;
+
+        sig = dw->sig;
+        window = dw->buff + dw->pos;
+        summed = 0;
+        next = dw->copyindex + dw->copycount;
+        if (dw->copycount > 0 && next < sig->nblocks && sig->weak[next] == weak &&
+            full_block(sig, next)) {
+                strong_sum(window, sig->blocksize, strong);
+                summed = 1;
+                if (memcmp(strong, sig->strong + next * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE) == 0) {
+                        return next;
+                }
+        }
+        for (i = sig->heads[hash_weak(weak) & sig->mask]; i >= 0; i = sig->chain[i]) {
+                if (sig->weak[i] != weak || !full_block(sig, i)) {
+                        continue;
+                }
+                if (!summed) {
+                        strong_sum(window, sig->blocksize, strong);
+                        summed = 1;
+                }
+                if (memcmp(strong, sig->strong + i * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE) == 0) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+/*
+ * Makes sure that more than a block follows the window, unless the file
+ * ends first, moving the pending literal to the front of the buffer to
+ * make room. The file is checksummed as it is read, for DELTA_END.
+ */
+static void
+fill_buffer(struct delta_writer *dw)
+{
+        ssize_t n;
+
+        if (dw->eof || dw->end - dw->pos > dw->sig->blocksize) {
+                return;
+        }
+        if (dw->start > 0) {
+                memmove(dw->buff, dw->buff + dw->start, dw->end - dw->start);
+                dw->pos -= dw->start;
+                dw->end -= dw->start;
+                dw->start = 0;
+        }
+        while (dw->end < dw->buffsize) {
+                n = read(dw->fd, dw->buff + dw->end, dw->buffsize - dw->end);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        dw->eof = 1;
+                        break;
+                }
+                dw->crc = crc32c(dw->crc, dw->buff + dw->end, n);
+                dw->size += n;
+                dw->end += n;
+        }
+}
+
+/*
+ * Slides the window along the file until some operations are ready in
+ * dw->out: bytes between matches pile up into a literal, which is sent
+ * once it reaches DELTA_LITERAL_MAX or a match ends it, and matches of
+ * consecutive blocks grow into one copy.
+ */
+static void
+next_ops(struct delta_writer *dw)
+{
+        uint32_t blocksize;
+        int32_t index;
+        unsigned char in;
+        unsigned char out;
+
+        blocksize = dw->sig->blocksize;
+        while (dw->outlen == 0) {
+                fill_buffer(dw);
+                if (dw->end - dw->pos < blocksize) {
+                        /* too little is left for a block: the rest is literal */
+                        flush_copy(dw);
+                        if (dw->end > dw->start) {
+                                emit_literal(dw, dw->end - dw->start < DELTA_LITERAL_MAX ?
+                                             dw->end - dw->start : DELTA_LITERAL_MAX);
+                                continue;
+                        }
+                        emit(dw, DELTA_END, dw->crc, dw->size, NULL);
+                        dw->done = 1;
+                        return;
+                }
+                if (!dw->rolling) {
+                        weak_sum(dw->buff + dw->pos, blocksize, &dw->a, &dw->b);
+                        dw->rolling = 1;
+                }
+                index = find_block(dw, dw->a | dw->b << 16);
+                if (index >= 0) {
+                        if (dw->pos > dw->start) {
+                                flush_copy(dw);
+                                emit_literal(dw, dw->pos - dw->start);
+                        }
+                        if (dw->copycount > 0 && (uint32_t)index != dw->copyindex + dw->copycount) {
+                                flush_copy(dw);
+                        }
+                        if (dw->copycount == 0) {
+                                dw->copyindex = index;
+                        }
+                        dw->copycount++;
+                        dw->pos += blocksize;
+                        dw->start = dw->pos;
+                        dw->rolling = 0;
+                        continue;
+                }
+                if (dw->pos + blocksize == dw->end) {
+                        /* the last window of the file; nothing to roll in */
+                        dw->pos = dw->end;
+                        continue;
+                }
+                out = dw->buff[dw->pos];
+                in = dw->buff[dw->pos + blocksize];
+                dw->a = (dw->a - out + in) & 0xffff;
+                dw->b = (dw->b - blocksize * out + dw->a) & 0xffff;
+                dw->pos++;
+                if (dw->pos - dw->start == DELTA_LITERAL_MAX) {
+                        flush_copy(dw);
+                        emit_literal(dw, DELTA_LITERAL_MAX);
+                }
+        }
+}
+
+static void
+emit(struct delta_writer *dw, int type, uint32_t x, uint64_t y, const unsigned char *data)
+{
+        unsigned char *p;
+
+        p = dw->out + dw->outlen;
+        p[0] = type;
+        put_number(p + 1, x, 4);
+        put_number(p + 5, y, 8);
+        dw->outlen += DELTA_OP_SIZE;
+        if (type == DELTA_LITERAL) {
+                memcpy(dw->out + dw->outlen, data, x);
+                dw->outlen += x;
+                dw->nliteral += x;
+        }
+}
+
+/* Sends the first len bytes of the pending literal. */
+static void
+emit_literal(struct delta_writer *dw, size_t len)
+{
+        emit(dw, DELTA_LITERAL, len, 0, dw->buff + dw->start);
+        dw->start += len;
+        if (dw->pos < dw->start) {
+                dw->pos = dw->start;
+        }
+}
+
+static void
+flush_copy(struct delta_writer *dw)
+{
+        if (dw->copycount > 0) {
+                emit(dw, DELTA_COPY, dw->copycount, dw->copyindex, NULL);
+                dw->copycount = 0;
+        }
+}
+
+/* reader */
+
+int
+delta_reader_open(struct delta_reader *dr, const char *path, uint32_t blocksize)
+{
+        struct stat sb;
+        mode_t mode;
+        mode_t mask;
+
+        memset(dr, 0, sizeof(struct delta_reader));
+        dr->basefd = -1;
+        dr->fd = -1;
+        dr->blocksize = blocksize;
+        if (blocksize < DELTA_MIN_BLOCK || blocksize > DELTA_MAX_BLOCK) {
+                fail(dr, EINVAL);
+                return -1;
+        }
+        if (strlen(path) >= DELTA_PATH_MAX) {
+                fail(dr, ENAMETOOLONG);
+                return -1;
+        }
+        strcpy(dr->path, path);
+        /* without an old copy the delta can only be literals */
+        dr->basefd = open(path, O_RDONLY | O_CLOEXEC);
+        if (dr->basefd >= 0 && fstat(dr->basefd, &sb) == 0) {
+                dr->basesize = sb.st_size;
+                mode = sb.st_mode & 07777;
+        }
+        else {
+                mask = umask(0);
+                umask(mask);
+                mode = 0666 & ~mask;
+        }
+        snprintf(dr->tmppath, sizeof(dr->tmppath), "%s.XXXXXX", path);
+        dr->fd = mkostemp(dr->tmppath, O_CLOEXEC);
+        if (dr->fd < 0) {
+                fail(dr, errno);
+                dr->tmppath[0] = '\0';
+                return -1;
+        }
+        fchmod(dr->fd, mode);
+        return 0;
+}
+
+size_t
+delta_want(const struct delta_reader *dr)
+{
+        if (dr->done) {
+                return 0;
+        }
+        if (dr->headerlen < DELTA_OP_SIZE) {
+                return DELTA_OP_SIZE - dr->headerlen;
+        }
+        return dr->left;
+}
+
+void
+delta_write(struct delta_reader *dr, const char *buff, size_t len)
+{
+        size_t chunk;
+
+        while (len > 0 && !dr->done) {
+                if (dr->headerlen < DELTA_OP_SIZE) {
+                        chunk = DELTA_OP_SIZE - dr->headerlen;
+                        if (chunk > len) {
+                                chunk = len;
+                        }
+                        memcpy(dr->header + dr->headerlen, buff, chunk);
+                        dr->headerlen += chunk;
+                        buff += chunk;
+                        len -= chunk;
+                        if (dr->headerlen == DELTA_OP_SIZE) {
+                                apply_op(dr);
+                        }
+                        continue;
+                }
+                chunk = dr->left < len ? dr->left : len;
+                append(dr, buff, chunk);
+                buff += chunk;
+                len -= chunk;
+                dr->left -= chunk;
+                if (dr->left == 0) {
+                        dr->headerlen = 0;
+                }
+        }
+}
+
+int
+delta_reader_close(struct delta_reader *dr)
+{
+        if (!dr->done) {
+                fail(dr, ECONNRESET);
+        }
+        if (dr->fd >= 0) {
+                if (close(dr->fd) < 0) {
+                        fail(dr, errno);
+                }
+                dr->fd = -1;
+        }
+        if (dr->basefd >= 0) {
+                close(dr->basefd);
+                dr->basefd = -1;
+        }
+        if (dr->tmppath[0] != '\0') {
+                if (dr->error == 0 && rename(dr->tmppath, dr->path) < 0) {
+                        fail(dr, errno);
+                }
+                if (dr->error != 0) {
+                        unlink(dr->tmppath);
+                }
+                dr->tmppath[0] = '\0';
+        }
+        if (dr->error != 0) {
+                errno = dr->error;
+                return -1;
+        }
+        return 0;
+}
+
+static void
+apply_op(struct delta_reader *dr)
+{
+        uint32_t x;
+        uint64_t y;
+
+        x = get_number(dr->header + 1, 4);
+        y = get_number(dr->header + 5, 8);
+        switch (dr->header[0]) {
+        case DELTA_LITERAL:
+                dr->left = x;
+                if (dr->left == 0) {
+                        dr->headerlen = 0;
+                }
+                return;
+        case DELTA_COPY:
+                copy_blocks(dr, x, y);
+                dr->headerlen = 0;
+                return;
+        case DELTA_END:
+                if (dr->size != y || dr->crc != x) {
+                        fail(dr, EBADMSG);
+                }
+                dr->done = 1;
+                return;
+        default:
+                /* nothing after this can be made sense of */
+                fail(dr, EPROTO);
+                dr->done = 1;
+                return;
+        }
+}
+
+static void
+copy_blocks(struct delta_reader *dr, uint32_t count, uint64_t index)
+{
+        char buff[DELTA_MAX_BLOCK];
+        uint64_t offset;
+        uint64_t length;
+        ssize_t n;
+
+        if (dr->error != 0) {
+                return;
+        }
+        if (dr->basefd < 0 || index >= (dr->basesize + dr->blocksize - 1) / dr->blocksize) {
+                fail(dr, EBADMSG);
+                return;
+        }
+        offset = index * dr->blocksize;
+        length = (uint64_t)count * dr->blocksize;
+        if (length > dr->basesize - offset) {
+                length = dr->basesize - offset;
+        }
+        while (length > 0 && dr->error == 0) {
+                n = pread(dr->basefd, buff, length < sizeof(buff) ? length : sizeof(buff), offset);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        /* the old copy shrank since it was signed */
+                        fail(dr, n < 0 ? errno : EBADMSG);
+                        return;
+                }
+                append(dr, buff, n);
+                offset += n;
+                length -= n;
+        }
+}
+
+/* Adds to the new file; once something has failed, bytes are dropped. */
+static void
+append(struct delta_reader *dr, const void *buff, size_t len)
+{
+        const char *p;
+        ssize_t n;
+
+        if (dr->error != 0) {
+                return;
+        }
+        dr->crc = crc32c(dr->crc, buff, len);
+        dr->size += len;
+        p = buff;
+        while (len > 0) {
+                n = write(dr->fd, p, len);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        fail(dr, errno);
+                        return;
+                }
+                p += n;
+                len -= n;
+        }
+}
+
+static void
+fail(struct delta_reader *dr, int error)
+{
+        if (dr->error == 0) {
+                dr->error = error;
+        }
+}
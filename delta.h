@@ -0,0 +1,142 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Updating a file that the receiver already has an older copy of, the
+ * rsync way. The receiver describes its copy with a signature: a header
+ * of block size, block count and file size as big-endian numbers of 4,
+ * 4 and 8 bytes, then for every block its rolling checksum (4 bytes)
+ * and the first DELTA_STRONG_SIZE bytes of its SHA-256. The sender
+ * answers with a delta, a series of operations each starting with a
+ * DELTA_OP_SIZE header of type, x and y, 1, 4 and 8 bytes:
+ *
+ *   DELTA_LITERAL  x bytes of new data follow
+ *   DELTA_COPY     x blocks of the old copy, from block number y
+ *   DELTA_END      the new file is y bytes long with crc32c x
+ *
+ * so that only what the old copy lacks travels. The receiver checks
+ * the result against DELTA_END before it takes the place of the old
+ * copy.
+ */
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_MAX_BLOCKS (1 << 24)
+#define DELTA_LITERAL_MAX (64 * 1024)
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIG_HEADER_SIZE 16
+#define DELTA_SIG_ENTRY_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_SIG_MAX (DELTA_SIG_HEADER_SIZE + (size_t)DELTA_MAX_BLOCKS * DELTA_SIG_ENTRY_SIZE)
+#define DELTA_OP_SIZE 13
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY 'C'
+#define DELTA_END 'E'
+#define DELTA_PATH_MAX 4096
+
+/* a parsed signature, with its blocks hashed by rolling checksum */
+struct delta_sig {
+        uint32_t blocksize;
+        uint32_t nblocks;
+        uint64_t size;
+        uint32_t *weak;
+        unsigned char *strong;
+        int32_t *heads;
+        int32_t *chain;
+        uint32_t mask;
+};
+
+/* computes the delta of a file against a signature a buffer at a time */
+struct delta_writer {
+        int fd;
+        struct delta_sig *sig;
+        unsigned char *buff;
+        size_t buffsize;
+        size_t start;
+        size_t pos;
+        size_t end;
+        int eof;
+        int rolling;
+        uint32_t a;
+        uint32_t b;
+        uint32_t crc;
+        uint64_t size;
+        uint32_t copyindex;
+        uint32_t copycount;
+        unsigned char *out;
+        size_t outlen;
+        size_t outoff;
+        int done;
+        uint64_t nliteral;
+};
+
+/* rebuilds a file from the old copy and a delta as its bytes come in */
+struct delta_reader {
+        int basefd;
+        uint64_t basesize;
+        uint32_t blocksize;
+        int fd;
+        char path[DELTA_PATH_MAX];
+        char tmppath[DELTA_PATH_MAX + 8];
+        unsigned char header[DELTA_OP_SIZE];
+        size_t headerlen;
+        uint64_t left;
+        uint32_t crc;
+        uint64_t size;
+        int done;
+        int error;
+};
+
+/* Picks a block size for a file of the given size. */
+uint32_t delta_block_size(uint64_t size);
+
+/*
+ * Writes the signature of the file open on fd, read from its start, to
+ * out; -1 on a read error.
+ */
+int delta_sign(int fd, uint32_t blocksize, FILE *out);
+
+/* Parses a signature; NULL if it makes no sense. */
+struct delta_sig *delta_sig_parse(const char *buff, size_t len);
+
+void delta_sig_free(struct delta_sig *sig);
+
+/*
+ * Starts computing the delta of the file open on fd against sig. The
+ * writer owns both from now on; -1 if there is no memory for it, with
+ * both released.
+ */
+int delta_writer_open(struct delta_writer *dw, int fd, struct delta_sig *sig);
+
+/* Fills buff with the next bytes of the delta; 0 once it is over. */
+size_t delta_read(struct delta_writer *dw, char *buff, size_t size);
+
+void delta_writer_close(struct delta_writer *dw);
+
+/*
+ * Starts rebuilding path, whose current contents are the old copy, in a
+ * temporary file next to it. Returns -1 if that cannot be set up; the
+ * reader then only consumes the delta and fails.
+ */
+int delta_reader_open(struct delta_reader *dr, const char *path, uint32_t blocksize);
+
+/*
+ * Tells how many bytes can be fed without reading past the end of the
+ * delta; 0 once it is over.
+ */
+size_t delta_want(const struct delta_reader *dr);
+
+/* Applies the next len bytes; anything after the end is ignored. */
+void delta_write(struct delta_reader *dr, const char *buff, size_t len);
+
+/*
+ * Finishes rebuilding: the new file replaces the old copy if it came
+ * out whole and as checksummed. Returns -1 otherwise, with the reason
+ * in dr->error, leaving the old copy alone.
+ */
+int delta_reader_close(struct delta_reader *dr);
+
+#endif
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "upload.h"
+#include "dirlist.h"
+
+/* what getdents64 fills its buffer with */
+struct linux_dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+};
+
+/*
+ * A slot is guarded by its sequence number the way a checksum table
+ * entry is (see sumcache.c). Its data is the entries of the listing,
+ * then their names. used is a tick of the table's clock, and is only a
+ * hint for choosing what to push out; len is how much of data is
+ * taken, for giving back the pages of a bigger listing it held before.
+ */
+struct dircache_slot {
+        uint32_t seq;
+        uint32_t pad;
+        uint64_t used;
+        uint64_t dev;
+        uint64_t ino;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+        uint64_t nentries;
+        uint64_t nameslen;
+        uint64_t len;
+        char data[];
+};
+
+static int append_entry(struct dirlist *dl, const char *name, uint64_t next);
+static struct dircache_slot *slot_at(size_t i);
+static int same_dir(const struct dircache_slot *e, const struct stat *sb);
+static int same_times(const struct stat *a, const struct stat *b);
+
+static char *dircache;
+static size_t dircache_size;
+static uint64_t *dircache_clock;
+
+void
+dirlist_init(struct dirlist *dl)
+{
+        memset(dl, 0, sizeof(struct dirlist));
+}
+
+void
+dirlist_free(struct dirlist *dl)
+{
+        free(dl->names);
+        free(dl->entries);
+        dirlist_init(dl);
+}
+
+const char *
+dirlist_name(const struct dirlist *dl, size_t i)
+{
+        return dl->names + dl->entries[i].name;
+}
+
+int
+dirlist_read(int fd, uint64_t start, size_t limit, struct dirlist *dl)
+{
+        char *buff;
+        struct linux_dirent64 *d;
+        size_t added;
+        long n;
+        long pos;
+
+        if (lseek(fd, start, SEEK_SET) < 0) {
+                return -1;
+        }
+        buff = malloc(DIRLIST_BUFF_SIZE);
+        if (buff == NULL) {
+                return -1;
+        }
+        added = 0;
+        dl->eof = 0;
+        while (limit == 0 || added < limit) {
+                n = syscall(SYS_getdents64, fd, buff, DIRLIST_BUFF_SIZE);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        free(buff);
+                        return -1;
+                }
+                if (n == 0) {
+                        dl->eof = 1;
+                        break;
+                }
+                for (pos = 0; pos < n && (limit == 0 || added < limit); pos += d->d_reclen) {
+                        d = (struct linux_dirent64 *)(buff + pos);
+                        if (d->d_name[0] == '.' && upload_staging(fd, d->d_name)) {
+                                /* a put still on its way is not listed */
+                                continue;
+                        }
+                        if (append_entry(dl, d->d_name, d->d_off) < 0) {
+                                free(buff);
+                                return -1;
+                        }
+                        added++;
+                }
+        }
+        free(buff);
+        return 0;
+}
+
+static int
+append_entry(struct dirlist *dl, const char *name, uint64_t next)
+{
+        size_t len;
+        size_t size;
+        void *p;
+
+        len = strlen(name) + 1;
+        if (dl->nameslen + len > dl->namessize) {
+                size = dl->namessize == 0 ? DIRLIST_BUFF_SIZE : dl->namessize * 2;
+                while (dl->nameslen + len > size) {
+                        size *= 2;
+                }
+                p = realloc(dl->names, size);
+                if (p == NULL) {
+                        return -1;
+                }
+                dl->names = p;
+                dl->namessize = size;
+        }
+        if (dl->nentries == dl->maxentries) {
+                size = dl->maxentries == 0 ? 256 : dl->maxentries * 2;
+                p = realloc(dl->entries, size * sizeof(struct dirlist_entry));
+                if (p == NULL) {
+                        return -1;
+                }
+                dl->entries = p;
+                dl->maxentries = size;
+        }
+        memcpy(dl->names + dl->nameslen, name, len);
+        dl->entries[dl->nentries].next = next;
+        dl->entries[dl->nentries].name = dl->nameslen;
+        dl->nameslen += len;
+        dl->nentries++;
+        return 0;
+}
+
+/* each slot has room for the biggest listing kept; only what is used is touched */
+#define SLOT_SIZE (sizeof(struct dircache_slot) + DIRCACHE_MAX_BYTES)
+
+int
+dircache_open(size_t ndirs)
+{
+        char *p;
+
+        p = mmap(NULL, sizeof(uint64_t) + ndirs * SLOT_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+                return -1;
+        }
+        dircache_clock = (uint64_t *)p;
+        dircache = p + sizeof(uint64_t);
+        dircache_size = ndirs;
+        return 0;
+}
+
+int
+dircache_lookup(const struct stat *sb, struct dirlist *dl)
+{
+        struct dircache_slot *e;
+        struct dircache_slot copy;
+        size_t entrieslen;
+        uint32_t seq;
+        size_t i;
+
+        for (i = 0; i < dircache_size; i++) {
+                e = slot_at(i);
+                seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+                if (seq == 0 || (seq & 1) != 0) {
+                        continue;
+                }
+                memcpy(&copy, e, sizeof(struct dircache_slot));
+                entrieslen = copy.nentries * sizeof(struct dirlist_entry);
+                if (!same_dir(&copy, sb) || entrieslen + copy.nameslen > DIRCACHE_MAX_BYTES) {
+                        continue;
+                }
+                dl->entries = malloc(entrieslen > 0 ? entrieslen : 1);
+                dl->names = malloc(copy.nameslen > 0 ? copy.nameslen : 1);
+                if (dl->entries == NULL || dl->names == NULL) {
+                        dirlist_free(dl);
+                        return -1;
+                }
+                memcpy(dl->entries, e->data, entrieslen);
+                memcpy(dl->names, e->data + entrieslen, copy.nameslen);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+                        /* rewritten under us */
+                        dirlist_free(dl);
+                        return -1;
+                }
+                dl->nentries = dl->maxentries = copy.nentries;
+                dl->nameslen = dl->namessize = copy.nameslen;
+                dl->eof = 1;
+                __atomic_store_n(&e->used, __atomic_add_fetch(dircache_clock, 1, __ATOMIC_RELAXED),
+                                 __ATOMIC_RELAXED);
+                return 0;
+        }
+        return -1;
+}
+
+void
+dircache_store(int fd, const struct stat *sb, const struct dirlist *dl)
+{
+        struct dircache_slot *e;
+        struct dircache_slot *victim;
+        struct stat after;
+        size_t entrieslen;
+        size_t pagesize;
+        size_t keep;
+        uint64_t used;
+        uint32_t seq;
+        size_t i;
+
+        entrieslen = dl->nentries * sizeof(struct dirlist_entry);
+        if (dircache_size == 0 || !dl->eof || entrieslen + dl->nameslen > DIRCACHE_MAX_BYTES ||
+            sb->st_ctim.tv_sec + DIRCACHE_SETTLE > time(NULL)) {
+                return;
+        }
+        /* a change while it was read would go unnoticed */
+        if (fstat(fd, &after) < 0 || !same_times(sb, &after)) {
+                return;
+        }
+        /* an older listing of the same directory first, then an empty slot, then the coldest */
+        victim = NULL;
+        used = UINT64_MAX;
+        for (i = 0; i < dircache_size; i++) {
+                e = slot_at(i);
+                seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+                if ((seq & 1) != 0) {
+                        continue;
+                }
+                if (seq != 0 && e->dev == (uint64_t)sb->st_dev && e->ino == (uint64_t)sb->st_ino) {
+                        victim = e;
+                        break;
+                }
+                if (seq == 0) {
+                        if (used > 0) {
+                                victim = e;
+                                used = 0;
+                        }
+                        continue;
+                }
+                if (__atomic_load_n(&e->used, __ATOMIC_RELAXED) < used) {
+                        victim = e;
+                        used = __atomic_load_n(&e->used, __ATOMIC_RELAXED);
+                }
+        }
+        if (victim == NULL) {
+                return;
+        }
+        seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) != 0 ||
+            !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+        }
+        victim->dev = sb->st_dev;
+        victim->ino = sb->st_ino;
+        victim->mtime_sec = sb->st_mtim.tv_sec;
+        victim->mtime_nsec = sb->st_mtim.tv_nsec;
+        victim->ctime_sec = sb->st_ctim.tv_sec;
+        victim->ctime_nsec = sb->st_ctim.tv_nsec;
+        victim->nentries = dl->nentries;
+        victim->nameslen = dl->nameslen;
+        memcpy(victim->data, dl->entries, entrieslen);
+        memcpy(victim->data + entrieslen, dl->names, dl->nameslen);
+        pagesize = sysconf(_SC_PAGESIZE);
+        keep = (offsetof(struct dircache_slot, data) + entrieslen + dl->nameslen + pagesize - 1) /
+               pagesize * pagesize;
+        if (victim->len > entrieslen + dl->nameslen &&
+            offsetof(struct dircache_slot, data) + victim->len > keep) {
+                /* the rest of a bigger listing is not needed any more */
+                madvise((char *)victim + keep, offsetof(struct dircache_slot, data) + victim->len - keep,
+                        MADV_REMOVE);
+        }
+        victim->len = entrieslen + dl->nameslen;
+        __atomic_store_n(&victim->used, __atomic_add_fetch(dircache_clock, 1, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static struct dircache_slot *
+slot_at(size_t i)
+{
+        return (struct dircache_slot *)(dircache + i * SLOT_SIZE);
+}
+
+static int
+same_dir(const struct dircache_slot *e, const struct stat *sb)
+{
+        return e->dev == (uint64_t)sb->st_dev && e->ino == (uint64_t)sb->st_ino &&
+               e->mtime_sec == sb->st_mtim.tv_sec && e->mtime_nsec == sb->st_mtim.tv_nsec &&
+               e->ctime_sec == sb->st_ctim.tv_sec && e->ctime_nsec == sb->st_ctim.tv_nsec;
+}
+
+static int
+same_times(const struct stat *a, const struct stat *b)
+{
+        return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+               a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+               a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
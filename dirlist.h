@@ -0,0 +1,76 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Directory listings read straight with getdents64, in the order the
+ * file system keeps the entries. Every entry remembers the position of
+ * the one after it, which lseek on the directory goes back to, so that
+ * a listing can stop after a page and be resumed by a later request
+ * with nothing kept on the server in between.
+ *
+ * Complete listings can also be cached in shared memory set up before
+ * the server forks, like the checksum table (sumcache.h), so that the
+ * listing one session has read serves the next, in any process. A
+ * listing is good only while the directory's mtime and ctime are still
+ * what they were; adding, removing or renaming an entry moves them.
+ */
+#define DIRLIST_BUFF_SIZE (64 * 1024)
+/* listings bigger than this are read again every time */
+#define DIRCACHE_MAX_BYTES (16 * 1024 * 1024)
+/* a directory changed this recently may change again without its times moving */
+#define DIRCACHE_SETTLE 2
+
+struct dirlist_entry {
+        uint64_t next;
+        size_t name;
+};
+
+struct dirlist {
+        char *names;
+        size_t nameslen;
+        size_t namessize;
+        struct dirlist_entry *entries;
+        size_t nentries;
+        size_t maxentries;
+        int eof;
+};
+
+void dirlist_init(struct dirlist *dl);
+
+void dirlist_free(struct dirlist *dl);
+
+/* The name of entry i. */
+const char *dirlist_name(const struct dirlist *dl, size_t i);
+
+/*
+ * Appends the entries of the directory open on fd from position start
+ * on, until limit of them have been added, or all of them if limit is
+ * 0. dl->eof is set if the directory ran out. Returns -1 on an error,
+ * with errno set.
+ */
+int dirlist_read(int fd, uint64_t start, size_t limit, struct dirlist *dl);
+
+/*
+ * Sets up room for ndirs listings; -1 if it cannot be, and then nothing
+ * is cached. Without it nothing is either.
+ */
+int dircache_open(size_t ndirs);
+
+/*
+ * Fills the empty dl with a copy of the cached listing of the directory
+ * sb was taken of; -1 if there is none.
+ */
+int dircache_lookup(const struct stat *sb, struct dirlist *dl);
+
+/*
+ * Offers the complete listing dl of the directory open on fd, read
+ * after sb was taken of it. It is kept only if the directory has held
+ * still since.
+ */
+void dircache_store(int fd, const struct stat *sb, const struct dirlist *dl);
+
+#endif
@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "filecache.h"
+
+/*
+ * A slot is guarded by its sequence number the way a checksum table
+ * entry is (see sumcache.c): odd while a process is writing it, and a
+ * reader that sees it odd or changed by the time it has copied the slot
+ * takes that as a miss. used is a tick of the region's clock, and is
+ * only a hint for choosing what to push out.
+ */
+struct filecache_slot {
+        uint32_t seq;
+        uint32_t pad;
+        uint64_t used;
+        uint64_t dev;
+        uint64_t ino;
+        int64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+        char data[];
+};
+
+struct filecache_class {
+        char *slots;
+        size_t slotsize;
+        size_t nsets;
+};
+
+static struct filecache_class *find_class(const struct stat *sb);
+static struct filecache_slot *slot_at(const struct filecache_class *c, size_t set, int way);
+static size_t find_set(const struct filecache_class *c, const struct stat *sb);
+static int same_file(const struct filecache_slot *e, const struct stat *sb);
+
+static struct filecache_class classes[FILECACHE_CLASSES];
+static uint64_t *filecache_clock;
+
+int
+filecache_open(size_t nbytes)
+{
+        struct filecache_class *c;
+        size_t total;
+        char *p;
+        int i;
+
+        total = sizeof(uint64_t);
+        for (i = 0; i < FILECACHE_CLASSES; i++) {
+                c = &classes[i];
+                c->slotsize = sizeof(struct filecache_slot) + ((size_t)FILECACHE_SLOT_MIN << 2 * i);
+                c->nsets = nbytes / FILECACHE_CLASSES / c->slotsize / FILECACHE_WAYS;
+                total += c->nsets * FILECACHE_WAYS * c->slotsize;
+        }
+        if (total == sizeof(uint64_t)) {
+                /* not even a set of the smallest slots */
+                errno = EINVAL;
+                return -1;
+        }
+        p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                return -1;
+        }
+        filecache_clock = (uint64_t *)p;
+        p += sizeof(uint64_t);
+        for (i = 0; i < FILECACHE_CLASSES; i++) {
+                classes[i].slots = p;
+                p += classes[i].nsets * FILECACHE_WAYS * classes[i].slotsize;
+        }
+        return 0;
+}
+
+int
+filecache_wants(const struct stat *sb)
+{
+        return find_class(sb) != NULL;
+}
+
+char *
+filecache_lookup(const struct stat *sb, size_t extra)
+{
+        struct filecache_class *c;
+        struct filecache_slot *e;
+        struct filecache_slot copy;
+        uint32_t seq;
+        size_t set;
+        char *buff;
+        int way;
+
+        c = find_class(sb);
+        if (c == NULL) {
+                return NULL;
+        }
+        buff = malloc(sb->st_size + extra);
+        if (buff == NULL) {
+                return NULL;
+        }
+        set = find_set(c, sb);
+        for (way = 0; way < FILECACHE_WAYS; way++) {
+                e = slot_at(c, set, way);
+                seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+                if (seq == 0 || (seq & 1) != 0) {
+                        continue;
+                }
+                memcpy(&copy, e, sizeof(struct filecache_slot));
+                if (!same_file(&copy, sb)) {
+                        continue;
+                }
+                memcpy(buff, e->data, sb->st_size);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+                        /* rewritten under us */
+                        break;
+                }
+                __atomic_store_n(&e->used, __atomic_add_fetch(filecache_clock, 1, __ATOMIC_RELAXED),
+                                 __ATOMIC_RELAXED);
+                return buff;
+        }
+        free(buff);
+        return NULL;
+}
+
+int
+filecache_store(const struct stat *sb, const char *buff)
+{
+        struct filecache_class *c;
+        struct filecache_slot *e;
+        struct filecache_slot *victim;
+        uint64_t used;
+        uint32_t seq;
+        size_t set;
+        int evicted;
+        int way;
+
+        c = find_class(sb);
+        if (c == NULL || sb->st_ctim.tv_sec + FILECACHE_SETTLE > time(NULL)) {
+                return 0;
+        }
+        /* an older copy of the same file first, then an empty slot, then the coldest */
+        set = find_set(c, sb);
+        victim = NULL;
+        used = UINT64_MAX;
+        for (way = 0; way < FILECACHE_WAYS; way++) {
+                e = slot_at(c, set, way);
+                seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+                if ((seq & 1) != 0) {
+                        continue;
+                }
+                if (seq != 0 && e->dev == (uint64_t)sb->st_dev && e->ino == (uint64_t)sb->st_ino) {
+                        victim = e;
+                        break;
+                }
+                if (seq == 0) {
+                        if (used > 0) {
+                                victim = e;
+                                used = 0;
+                        }
+                        continue;
+                }
+                if (__atomic_load_n(&e->used, __ATOMIC_RELAXED) < used) {
+                        victim = e;
+                        used = __atomic_load_n(&e->used, __ATOMIC_RELAXED);
+                }
+        }
+        if (victim == NULL) {
+                return 0;
+        }
+        seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) != 0 ||
+            !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return 0;
+        }
+        evicted = seq != 0 &&
+                  (victim->dev != (uint64_t)sb->st_dev || victim->ino != (uint64_t)sb->st_ino);
+        victim->dev = sb->st_dev;
+        victim->ino = sb->st_ino;
+        victim->size = sb->st_size;
+        victim->mtime_sec = sb->st_mtim.tv_sec;
+        victim->mtime_nsec = sb->st_mtim.tv_nsec;
+        victim->ctime_sec = sb->st_ctim.tv_sec;
+        victim->ctime_nsec = sb->st_ctim.tv_nsec;
+        memcpy(victim->data, buff, sb->st_size);
+        __atomic_store_n(&victim->used, __atomic_add_fetch(filecache_clock, 1, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+        return evicted;
+}
+
+/* The smallest slots the file fits in, NULL if it is not to be cached. */
+static struct filecache_class *
+find_class(const struct stat *sb)
+{
+        int i;
+
+        if (filecache_clock == NULL || !S_ISREG(sb->st_mode) || sb->st_size > FILECACHE_FILE_MAX) {
+                return NULL;
+        }
+        for (i = 0; i < FILECACHE_CLASSES; i++) {
+                if ((size_t)sb->st_size <= classes[i].slotsize - sizeof(struct filecache_slot)) {
+                        break;
+                }
+        }
+        /* memory too small for slots of this size */
+        return classes[i].nsets > 0 ? &classes[i] : NULL;
+}
+
+static struct filecache_slot *
+slot_at(const struct filecache_class *c, size_t set, int way)
+{
+        return (struct filecache_slot *)(c->slots + (set * FILECACHE_WAYS + way) * c->slotsize);
+}
+
+static size_t
+find_set(const struct filecache_class *c, const struct stat *sb)
+{
+        uint64_t h;
+
+        h = ((uint64_t)sb->st_dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)sb->st_ino;
+        h *= 0xff51afd7ed558ccdull;
+        return (h >> 32) % c->nsets;
+}
+
+static int
+same_file(const struct filecache_slot *e, const struct stat *sb)
+{
+        return e->dev == (uint64_t)sb->st_dev && e->ino == (uint64_t)sb->st_ino &&
+               e->size == sb->st_size &&
+               e->mtime_sec == sb->st_mtim.tv_sec && e->mtime_nsec == sb->st_mtim.tv_nsec &&
+               e->ctime_sec == sb->st_ctim.tv_sec && e->ctime_nsec == sb->st_ctim.tv_nsec;
+}
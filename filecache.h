@@ -0,0 +1,46 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * The contents of small files, kept in shared memory set up before the
+ * server forks like the checksum table (sumcache.h), so that a get of a
+ * file any session has read lately is answered with a stat of its path
+ * and no open at all.
+ *
+ * Files are held in slots of a few sizes, each size with an equal part
+ * of the memory. A file goes into one set of FILECACHE_WAYS slots of the
+ * smallest size it fits, chosen by its device and inode, and pushes out
+ * the least recently used of them. An entry is good only while the
+ * file's size, mtime and ctime are still what they were.
+ */
+#define FILECACHE_SIZE (64 * 1024 * 1024)
+#define FILECACHE_CLASSES 4
+/* the slot sizes are this, four times it, sixteen times and so on */
+#define FILECACHE_SLOT_MIN (4 * 1024)
+#define FILECACHE_FILE_MAX (FILECACHE_SLOT_MIN << 2 * (FILECACHE_CLASSES - 1))
+#define FILECACHE_WAYS 8
+/* a file changed this recently may change again without its times moving */
+#define FILECACHE_SETTLE 2
+
+/* Sets up nbytes of slots; -1 if they cannot be, and then nothing is cached. */
+int filecache_open(size_t nbytes);
+
+/* Tells whether a file of this kind and size would be cached at all. */
+int filecache_wants(const struct stat *sb);
+
+/*
+ * A copy of the file's contents in a buffer the caller frees, with room
+ * for extra more bytes after them; NULL if it is not cached as it is.
+ */
+char *filecache_lookup(const struct stat *sb, size_t extra);
+
+/*
+ * Keeps the contents of a file that has held still while they were
+ * read. Returns 1 if another file was pushed out for them, else 0.
+ */
+int filecache_store(const struct stat *sb, const char *buff);
+
+#endif
@@ -1,28 +1,238 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "crc32c.h"
+#include "archive.h"
+#include "zstream.h"
+#include "sparse.h"
+#include "delta.h"
+#include "buffpool.h"
 
 #define BUFF_SIZE 1024
+#define MUX_HELLO "mux 1\n"
+#define PAIR_HELLO "pair 1\n"
+#define MUX_HEADER_SIZE 9
+#define MUX_FRAME_MAX (64 * 1024)
+#define MUX_CTRL 'C'
+#define MUX_DATA 'D'
+#define STRIPE_MIN (1024 * 1024)
+#define MAX_STRIPES 64
+#define RESUME_WINDOW (1024 * 1024)
+#define PIPELINE_DEPTH 64
+#define ARCHIVE_CHUNK (64 * 1024)
+#define MAX_JOBS 16
 
-static FILE *connect_to_server(const char *host, const char *port);
-static void fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes);
+/* a frame payload that has arrived but has not been read yet */
+struct mux_chunk {
+        int type;
+        uint32_t id;
+        char *buff;
+        size_t len;
+        size_t off;
+        struct mux_chunk *next;
+};
+
+/* one connection carrying both channels, see connect_mux */
+struct mux {
+        int fd;
+        int refs;
+        uint32_t lastid;
+        struct mux_chunk *chunks;
+};
+
+/* a command sent ahead of its reply, see queue_request */
+struct request {
+        char *command;
+        char *arg;
+        char *localname;
+        uint32_t id;
+        int done;
+        /* the rest is for receiving out of order over a mux */
+        char reply[BUFF_SIZE];
+        size_t replylen;
+        int replied;
+        int result;
+        FILE *fp;
+        size_t left;
+        int compressed;
+        struct zstream_reader *zr;
+        struct sparse_reader *sr;
+        int digest;
+        uint32_t crc;
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        size_t trailerlen;
+};
+
+/* a transfer left running in a worker process of its own, see start_job */
+struct job {
+        int id;
+        pid_t pid;
+        char *command;
+        uint64_t started;
+        int cancelled;
+};
+
+/* what a job has moved so far, in memory shared with its worker */
+struct job_progress {
+        uint64_t done;
+        uint64_t total;
+};
+
+/* what rsize tells about a remote file */
+struct remote_file {
+        off_t size;
+        time_t mtime;
+        uint32_t crc;
+};
+
+/* where the session was opened, for opening more of them */
+static const char *server_host;
+static const char *server_ctrlport;
+static const char *server_dataport;
+
+/* the mux under the main session, NULL with two connections */
+static struct mux *session_mux;
+
+/* the level transfers are compressed at by default, 0 for none */
+static int compress_level;
+
+/* whether the server can compress, -1 until it has been asked */
+static int server_deflate = -1;
+
+/* whether transfers can end in a checksum, likewise */
+static int server_digest = -1;
+
+/* whether it can page an unsorted rls, likewise */
+static int server_pages = -1;
+
+/* whether it can send a list of files as one archive, likewise */
+static int server_batch = -1;
+
+/* whether it can send a file with holes as its extents, likewise */
+static int server_sparse = -1;
+
+/* the jobs, a slot with no pid being free, and their progress by slot */
+static struct job jobs[MAX_JOBS];
+static struct job_progress *job_progress;
+static int lastjobid;
+
+/* in a worker, the progress of the job it runs; NULL otherwise */
+static struct job_progress *current_progress;
+
+/* the requests in flight, oldest first, in a ring */
+static struct request requests[PIPELINE_DEPTH];
+static int firstrequest;
+static int nrequests;
+
+static int connect_socket(const char *host, const char *port);
+static void connect_pair(const char *host, const char *ctrlport, const char *dataport,
+                         FILE **ctrlfpp, FILE **datafpp);
+static struct mux *connect_mux(const char *host, const char *port, FILE **ctrlfpp, FILE **datafpp);
+static ssize_t mux_read(struct mux *m, int type, char *buff, size_t size);
+static size_t mux_take(struct mux *m, int type, uint32_t id, char *buff, size_t size);
+static int mux_write(struct mux *m, int type, uint32_t id, const char *buff, size_t size);
+static int mux_read_frame(struct mux *m);
+static ssize_t mux_ctrl_read(void *cookie, char *buff, size_t size);
+static ssize_t mux_ctrl_write(void *cookie, const char *buff, size_t size);
+static ssize_t mux_data_read(void *cookie, char *buff, size_t size);
+static ssize_t mux_data_write(void *cookie, const char *buff, size_t size);
+static int mux_close(void *cookie);
+static int read_fully(int fd, char *buff, size_t nbytes);
+static int write_fully(int fd, const char *buff, size_t nbytes);
+static struct mux *open_session(FILE **ctrlfpp, FILE **datafpp);
+static int query_remote_cwd(char *cwd, FILE *ctrlfp, FILE *datafp);
+static int open_session_in(const char *cwd, FILE **ctrlfpp, FILE **datafpp, struct mux **mp);
+static int read_reply(FILE *ctrlfp, char *buff, char **valuep);
+static int parse_reply(char *buff, char **valuep);
+static struct request *queue_request(const char *command, const char *arg, const char *localname,
+                                     FILE *ctrlfp, FILE *datafp);
+static void complete_request(FILE *ctrlfp, FILE *datafp);
+static void receive_mux_request(struct request *r, int first);
+static void finish_request(struct request *r, int result, char *value, FILE *datafp);
+static void drain_requests(FILE *ctrlfp, FILE *datafp);
+static int pending_except(const char *command);
+static int next_option(char **saveptr, const char *optstring, char **value);
+static int fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes, uint32_t *crcp);
+static int fencode_from_to(int fromfd, FILE *tofp, size_t nbytes, int level, uint32_t *crcp);
+static int fdecode_from_to(FILE *fromfp, int tofd, size_t nbytes, uint32_t *crcp);
+static int fsparse_from_to(FILE *fromfp, int tofd, off_t offset, size_t nbytes, uint32_t *crcp);
+static int fextents_to(struct sparse_writer *sw, FILE *tofp, uint32_t *crcp);
+static int sparse_reply(const char *value);
+static void send_digest(FILE *datafp, uint32_t crc);
+static int receive_digest(FILE *datafp, uint32_t crc);
+static void query_features(FILE *ctrlfp, FILE *datafp);
+static int negotiate_level(int level, FILE *ctrlfp, FILE *datafp);
+static int negotiate_digest(FILE *ctrlfp, FILE *datafp);
+static int negotiate_batch(FILE *ctrlfp, FILE *datafp);
+static int negotiate_sparse(FILE *ctrlfp, FILE *datafp);
 static void execute_command(char *input, FILE *ctrlfp, FILE *datafp);
+static int take_background(char *input);
+
+/* jobs */
+static void start_job(char *input, FILE *ctrlfp, FILE *datafp);
+static void run_job(char *input, struct mux *m, FILE *ctrlfp, FILE *datafp);
+static void add_job_progress(size_t done, size_t total);
+static void reap_jobs(int options);
+static void finish_job(struct job *j, int status);
+static void execute_jobs_command(char *saveptr);
+static void execute_wait_command(char *saveptr);
+static void execute_cancel_command(char *saveptr);
+static struct job *find_job(const char *arg, const char *command);
+static uint64_t monotonic_now(void);
 
 /* remote */
 static void execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void list_remote_pages(const char *arg, size_t limit, const char *cursor,
+                              FILE *ctrlfp, FILE *datafp);
 static void execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_stats_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rsize_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rsum_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rcp_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rmv_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rstat_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_mget_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_mput_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void send_get(const char *arg, int level, FILE *ctrlfp, FILE *datafp);
+static void send_put(const char *arg, int resume, int level, FILE *ctrlfp, FILE *datafp);
+static void receive_archive(const char *arg, FILE *ctrlfp, FILE *datafp);
+static void add_batch_name(const char *name, char *list, size_t *lenp, FILE *ctrlfp, FILE *datafp);
+static void receive_batch(char *list, size_t len, FILE *ctrlfp, FILE *datafp);
+static void report_batch_failure(const char *path, int error);
+static void send_archive(const char *arg, FILE *ctrlfp, FILE *datafp);
+static void receive_delta(const char *arg, int level, FILE *ctrlfp, FILE *datafp);
+static void send_delta(const char *arg, int level, FILE *ctrlfp, FILE *datafp);
+static char *list_remote_directory(FILE *ctrlfp, FILE *datafp);
+static void execute_striped_get(const char *arg, int nstripes, FILE *ctrlfp, FILE *datafp);
+static int fetch_stripe(const char *arg, int fd, off_t offset, off_t length, int digest,
+                        FILE *ctrlfp, FILE *datafp);
+static int query_remote_file(const char *arg, off_t window, FILE *ctrlfp, FILE *datafp,
+                             struct remote_file *rf, char *buff, char **valuep);
+static off_t resume_get_offset(const char *arg, FILE *ctrlfp, FILE *datafp, uint32_t *crcp);
+static off_t resume_put_offset(const char *arg, int fd, off_t size,
+                               FILE *ctrlfp, FILE *datafp, uint32_t *crcp);
 
 /* local */
 static void execute_lls_command(char *saveptr);
@@ -34,34 +244,89 @@ main(int argc, char **argv)
 {
         FILE *ctrlfp;
         FILE *datafp;
+        FILE *scriptfp;
         char buff[BUFF_SIZE];
-        
-        if (argc != 4) {
-                printf("usage: mftp host ctrlport dataport\n");
+        int mux;
+        int opt;
+
+        mux = 0;
+        scriptfp = NULL;
+        while ((opt = getopt(argc, argv, "mf:z:")) != -1) {
+                switch (opt) {
+                case 'm':
+                        mux = 1;
+                        break;
+                case 'z':
+                        compress_level = strtol(optarg, NULL, 10);
+                        if (compress_level < 0 || compress_level > 9) {
+                                argc = 0;
+                        }
+                        break;
+                case 'f':
+                        scriptfp = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "r");
+                        if (scriptfp == NULL) {
+                                fprintf(stderr, "mftp: %s: %s\n", optarg, strerror(errno));
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                default:
+                        argc = 0;
+                        break;
+                }
+        }
+        if (argc - optind != (mux ? 2 : 3)) {
+                printf("usage: mftp [-f script] [-z level] host ctrlport dataport\n"
+                       "       mftp [-f script] [-z level] -m host port\n");
                 exit(EXIT_FAILURE);
         }
-        ctrlfp = connect_to_server(argv[1], argv[2]);
-        datafp = connect_to_server(argv[1], argv[3]);
+        server_host = argv[optind];
+        server_ctrlport = argv[optind + 1];
+        server_dataport = mux ? NULL : argv[optind + 2];
+        if (mux) {
+                session_mux = connect_mux(server_host, server_ctrlport, &ctrlfp, &datafp);
+        }
+        else {
+                connect_pair(server_host, server_ctrlport, server_dataport, &ctrlfp, &datafp);
+                /*
+                 * Requests are written while replies to earlier ones
+                 * are still unread, and a buffered stream would drop
+                 * whatever it had read ahead on switching to writing.
+                 */
+                setvbuf(ctrlfp, NULL, _IONBF, 0);
+                setvbuf(datafp, NULL, _IOFBF, buffpool_size());
+        }
+        /*
+         * A script runs without waiting for replies in between, so that
+         * its commands keep the connection busy instead of taking a
+         * round trip each; interactively every reply is shown before
+         * the next prompt.
+         */
         for (;;) {
-                printf("mftp> ");
-                if (fgets(buff, BUFF_SIZE, stdin) == NULL) {
+                /* finished jobs are told of before the prompt, as a shell does */
+                reap_jobs(WNOHANG);
+                if (scriptfp == NULL) {
+                        printf("mftp> ");
+                }
+                if (fgets(buff, BUFF_SIZE, scriptfp != NULL ? scriptfp : stdin) == NULL) {
                         break;
                 }
                 execute_command(buff, ctrlfp, datafp);
+                if (scriptfp == NULL) {
+                        drain_requests(ctrlfp, datafp);
+                }
         }
         execute_exit_command(NULL, ctrlfp, datafp);
         return EXIT_SUCCESS;
 }
 
-static FILE *
-connect_to_server(const char *host, const char *port)
+static int
+connect_socket(const char *host, const char *port)
 {
         struct addrinfo hints;
         struct addrinfo *result;
         struct addrinfo *res;
         int eai;
         int sockfd;
-        FILE *serverfp;
 
         hints.ai_flags = AI_NUMERICSERV;
         hints.ai_family = AF_UNSPEC;
@@ -93,295 +358,2837 @@ connect_to_server(const char *host, const char *port)
                 exit(EXIT_FAILURE);
         }
         freeaddrinfo(result);
-        serverfp = fdopen(sockfd, "r+");
-        if (serverfp == NULL) {
+        return sockfd;
+}
+
+/*
+ * Opens a two-port session. The control connection asks for a pairing
+ * token first and the data connection sends it back, so that the server
+ * cannot hand this data connection to another client on the same host.
+ * A server too old for tokens fails the request after pairing the two
+ * by address, which makes the reply a round trip all the same.
+ */
+static void
+connect_pair(const char *host, const char *ctrlport, const char *dataport,
+             FILE **ctrlfpp, FILE **datafpp)
+{
+        char reply[BUFF_SIZE];
+        char line[BUFF_SIZE];
+        int ctrlfd;
+        int datafd;
+        size_t len;
+
+        ctrlfd = connect_socket(host, ctrlport);
+        if (write_fully(ctrlfd, PAIR_HELLO, strlen(PAIR_HELLO)) < 0) {
+                perror("write");
+                exit(EXIT_FAILURE);
+        }
+        /* an old server answers only once the data connection is there */
+        datafd = connect_socket(host, dataport);
+        /* the reply is read bytewise so that no later reply gets swallowed */
+        for (len = 0; len < BUFF_SIZE - 1; len++) {
+                if (read_fully(ctrlfd, reply + len, 1) < 0) {
+                        fprintf(stderr, "%s:%s: connection closed\n", host, ctrlport);
+                        exit(EXIT_FAILURE);
+                }
+                if (reply[len] == '\n') {
+                        break;
+                }
+        }
+        reply[len] = '\0';
+        if (strncmp(reply, "succ: ", 6) == 0) {
+                snprintf(line, BUFF_SIZE, "pair %s\n", reply + 6);
+                if (write_fully(datafd, line, strlen(line)) < 0) {
+                        perror("write");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        *ctrlfpp = fdopen(ctrlfd, "r+");
+        *datafpp = fdopen(datafd, "r+");
+        if (*ctrlfpp == NULL || *datafpp == NULL) {
                 perror("fdopen");
                 exit(EXIT_FAILURE);
         }
-        return serverfp;
 }
 
-static void
-fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes)
+/*
+ * Opens a multiplexed session: control and data share one connection
+ * as frames of a type byte, a 32-bit stream id and a 32-bit payload
+ * length. Every command gets a fresh stream id, and its reply and data
+ * come back on that id. The two returned streams behave like the
+ * sockets of a two-port session, so the commands need not care.
+ */
+static struct mux *
+connect_mux(const char *host, const char *port, FILE **ctrlfpp, FILE **datafpp)
 {
-        char buff[BUFF_SIZE];
-        
-        while (nbytes > BUFF_SIZE) {
-                fread(buff, sizeof(char), BUFF_SIZE, fromfp);
-                fwrite(buff, sizeof(char), BUFF_SIZE, tofp);
-                nbytes -= BUFF_SIZE;
+        cookie_io_functions_t ctrlio = {
+                mux_ctrl_read, mux_ctrl_write, NULL, mux_close
+        };
+        cookie_io_functions_t dataio = {
+                mux_data_read, mux_data_write, NULL, mux_close
+        };
+        struct mux *m;
+        char reply[BUFF_SIZE];
+        size_t len;
+
+        m = malloc(sizeof(struct mux));
+        if (m == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        m->fd = connect_socket(host, port);
+        m->refs = 2;
+        m->lastid = 0;
+        m->chunks = NULL;
+        if (write_fully(m->fd, MUX_HELLO, strlen(MUX_HELLO)) < 0) {
+                perror("write");
+                exit(EXIT_FAILURE);
+        }
+        /* the reply is read bytewise so that no frame gets swallowed */
+        for (len = 0; len < BUFF_SIZE - 1; len++) {
+                if (read_fully(m->fd, reply + len, 1) < 0) {
+                        fprintf(stderr, "%s:%s: connection closed\n", host, port);
+                        exit(EXIT_FAILURE);
+                }
+                if (reply[len] == '\n') {
+                        break;
+                }
+        }
+        reply[len] = '\0';
+        if (strcmp(reply, "succ: 0") != 0) {
+                fprintf(stderr, "%s:%s: server does not multiplex: %s\n", host, port, reply);
+                exit(EXIT_FAILURE);
+        }
+        *ctrlfpp = fopencookie(m, "r+", ctrlio);
+        *datafpp = fopencookie(m, "r+", dataio);
+        if (*ctrlfpp == NULL || *datafpp == NULL) {
+                perror("fopencookie");
+                exit(EXIT_FAILURE);
         }
-        fread(buff, sizeof(char), nbytes, fromfp);
-        fwrite(buff, sizeof(char), nbytes, tofp);
+        setvbuf(*datafpp, NULL, _IOFBF, MUX_FRAME_MAX);
+        return m;
 }
 
-static void
-execute_command(char *input, FILE *ctrlfp, FILE *datafp)
+/* Reads payload of the given type on the current stream. */
+static ssize_t
+mux_read(struct mux *m, int type, char *buff, size_t size)
 {
-        const char *command;
-        char *saveptr;
-        
-        command = strtok_r(input, " \n", &saveptr);
-        if (command == NULL) {
-                return;
+        size_t n;
+
+        while ((n = mux_take(m, type, m->lastid, buff, size)) == 0) {
+                if (mux_read_frame(m) < 0) {
+                        return 0;
+                }
         }
-        if (strcmp(command, "exit") == 0) {
-                execute_exit_command(saveptr, ctrlfp, datafp);
-                return;
+        return n;
+}
+
+/* Takes what has arrived of a stream's payload, without waiting. */
+static size_t
+mux_take(struct mux *m, int type, uint32_t id, char *buff, size_t size)
+{
+        struct mux_chunk **cp;
+        struct mux_chunk *c;
+        size_t n;
+
+        for (cp = &m->chunks; *cp != NULL; cp = &(*cp)->next) {
+                if ((*cp)->type == type && (*cp)->id == id) {
+                        break;
+                }
         }
-        if (strcmp(command, "echo") == 0) {
-                execute_echo_command(saveptr, ctrlfp, datafp);
-                return;
+        if (*cp == NULL) {
+                return 0;
         }
-        if (strcmp(command, "rls") == 0) {
-                execute_rls_command(saveptr, ctrlfp, datafp);
-                return;
+        c = *cp;
+        n = c->len - c->off;
+        if (n > size) {
+                n = size;
         }
-        if (strcmp(command, "rcd") == 0) {
-                execute_rcd_command(saveptr, ctrlfp, datafp);
-                return;
+        memcpy(buff, c->buff + c->off, n);
+        c->off += n;
+        if (c->off == c->len) {
+                *cp = c->next;
+                free(c->buff);
+                free(c);
         }
-        if (strcmp(command, "rpwd") == 0) {
-                execute_rpwd_command(saveptr, ctrlfp, datafp);
-                return;
+        return n;
+}
+
+static int
+mux_write(struct mux *m, int type, uint32_t id, const char *buff, size_t size)
+{
+        char header[MUX_HEADER_SIZE];
+        uint32_t netid;
+        uint32_t netlen;
+        size_t chunk;
+
+        do {
+                chunk = size;
+                if (chunk > MUX_FRAME_MAX) {
+                        chunk = MUX_FRAME_MAX;
+                }
+                netid = htonl(id);
+                netlen = htonl(chunk);
+                header[0] = type;
+                memcpy(header + 1, &netid, sizeof(netid));
+                memcpy(header + 5, &netlen, sizeof(netlen));
+                if (write_fully(m->fd, header, MUX_HEADER_SIZE) < 0 ||
+                    write_fully(m->fd, buff, chunk) < 0) {
+                        return -1;
+                }
+                buff += chunk;
+                size -= chunk;
+        } while (size > 0);
+        return 0;
+}
+
+/* Reads one frame off the connection and queues its payload. */
+static int
+mux_read_frame(struct mux *m)
+{
+        char header[MUX_HEADER_SIZE];
+        struct mux_chunk *c;
+        struct mux_chunk **tail;
+        uint32_t id;
+        uint32_t len;
+
+        if (read_fully(m->fd, header, MUX_HEADER_SIZE) < 0) {
+                return -1;
         }
-        if (strcmp(command, "get") == 0) {
-                execute_get_command(saveptr, ctrlfp, datafp);
-                return;
+        memcpy(&id, header + 1, sizeof(id));
+        memcpy(&len, header + 5, sizeof(len));
+        len = ntohl(len);
+        if (len > MUX_FRAME_MAX) {
+                errno = EPROTO;
+                return -1;
         }
-        if (strcmp(command, "put") == 0) {
-                execute_put_command(saveptr, ctrlfp, datafp);
-                return;
+        c = malloc(sizeof(struct mux_chunk));
+        if (c == NULL) {
+                return -1;
         }
-        if (strcmp(command, "lls") == 0) {
-                execute_lls_command(saveptr);
-                return;
+        c->type = header[0];
+        c->id = ntohl(id);
+        c->len = len;
+        c->off = 0;
+        c->next = NULL;
+        c->buff = malloc(len > 0 ? len : 1);
+        if (c->buff == NULL || read_fully(m->fd, c->buff, len) < 0) {
+                free(c->buff);
+                free(c);
+                return -1;
         }
-        if (strcmp(command, "lcd") == 0) {
-                execute_lcd_command(saveptr);
-                return;
+        if (len == 0) {
+                free(c->buff);
+                free(c);
+                return 0;
         }
-        if (strcmp(command, "lpwd") == 0) {
-                execute_lpwd_command(saveptr);
-                return;
+        for (tail = &m->chunks; *tail != NULL; tail = &(*tail)->next) {
         }
-        fprintf(stderr, "%s: command not found\n", command);
+        *tail = c;
+        return 0;
 }
 
-static void
-execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+static ssize_t
+mux_ctrl_read(void *cookie, char *buff, size_t size)
 {
-        (void)saveptr;
-        fprintf(ctrlfp, "exit");
-        fflush(ctrlfp);
-        fclose(ctrlfp);
-        fclose(datafp);
-        exit(EXIT_SUCCESS);
+        return mux_read(cookie, MUX_CTRL, buff, size);
 }
 
-static void
-execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+/* Each flush of the control stream is one command on a new stream. */
+static ssize_t
+mux_ctrl_write(void *cookie, const char *buff, size_t size)
 {
-        const char *arg;
-        char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        size_t nbytes;
+        struct mux *m;
 
-        arg = strtok_r(NULL, "\n", &saveptr);
-        if (arg == NULL) {
-                fprintf(ctrlfp, "echo\n");
+        m = cookie;
+        m->lastid++;
+        if (mux_write(m, MUX_CTRL, m->lastid, buff, size) < 0) {
+                return -1;
         }
-        else {
-                fprintf(ctrlfp, "echo %s\n", arg);
+        return size;
+}
+
+static ssize_t
+mux_data_read(void *cookie, char *buff, size_t size)
+{
+        return mux_read(cookie, MUX_DATA, buff, size);
+}
+
+static ssize_t
+mux_data_write(void *cookie, const char *buff, size_t size)
+{
+        struct mux *m;
+
+        m = cookie;
+        if (mux_write(m, MUX_DATA, m->lastid, buff, size) < 0) {
+                return -1;
         }
-        fflush(ctrlfp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fcopy_from_to(datafp, stdout, nbytes);
-                return;
+        return size;
+}
+
+static int
+mux_close(void *cookie)
+{
+        struct mux *m;
+        struct mux_chunk *c;
+
+        m = cookie;
+        if (--m->refs > 0) {
+                return 0;
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "echo: %s: %s\n", arg, value);
-                return;
+        while (m->chunks != NULL) {
+                c = m->chunks;
+                m->chunks = c->next;
+                free(c->buff);
+                free(c);
         }
+        close(m->fd);
+        free(m);
+        return 0;
 }
 
-static void
-execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+static int
+read_fully(int fd, char *buff, size_t nbytes)
 {
-        const char *arg;
-        char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        size_t nbytes;
+        ssize_t n;
 
-        arg = strtok_r(NULL, "\n", &saveptr);
-        if (arg == NULL) {
-                arg = ".";
-        }
-        fprintf(ctrlfp, "rls %s\n", arg);
-        fflush(ctrlfp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fcopy_from_to(datafp, stdout, nbytes);
-                return;
+        while (nbytes > 0) {
+                n = read(fd, buff, nbytes);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        return -1;
+                }
+                buff += n;
+                nbytes -= n;
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "rls: %s: %s\n", arg, value);
-                return;
+        return 0;
+}
+
+static int
+write_fully(int fd, const char *buff, size_t nbytes)
+{
+        ssize_t n;
+
+        while (nbytes > 0) {
+                n = write(fd, buff, nbytes);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        return -1;
+                }
+                buff += n;
+                nbytes -= n;
         }
+        return 0;
 }
 
-static void
-execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+/*
+ * Copies nbytes; a NULL tofp discards them. If fromfp runs short the
+ * rest goes out as zeros, so that the data channel stays in sync, and
+ * -1 is returned. *crcp, unless crcp is NULL, is the crc32c of the
+ * bytes that were actually read.
+ */
+static int
+fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes, uint32_t *crcp)
 {
-        const char *arg;
-        char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        size_t nbytes;
+        char *buff;
+        uint32_t crc;
+        size_t chunk;
+        size_t n;
+        int result;
 
-        arg = strtok_r(NULL, "\n", &saveptr);
-        if (arg == NULL) {
-                fprintf(stderr, "rcd: usage: rcd dir\n");
-                return;
+        buff = buffpool_get();
+        if (buff == NULL) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
         }
-        fprintf(ctrlfp, "rcd %s\n", arg);
-        fflush(ctrlfp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fcopy_from_to(datafp, stdout, nbytes);
-                return;
+        crc = 0;
+        result = 0;
+        while (nbytes > 0) {
+                chunk = nbytes < buffpool_size() ? nbytes : buffpool_size();
+                n = result == 0 ? fread(buff, sizeof(char), chunk, fromfp) : 0;
+                crc = crc32c(crc, buff, n);
+                if (n < chunk) {
+                        memset(buff + n, 0, chunk - n);
+                        result = -1;
+                }
+                if (tofp != NULL) {
+                        fwrite(buff, sizeof(char), chunk, tofp);
+                }
+                add_job_progress(chunk, 0);
+                nbytes -= chunk;
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "rcd: %s: %s\n", arg, value);
-                return;
+        buffpool_put(buff);
+        if (crcp != NULL) {
+                *crcp = crc;
         }
+        return result;
 }
 
-static void
-execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+/*
+ * Sends nbytes of fromfd compressed at level, see zstream.h, and sets
+ * *crcp to their crc32c. Returns -1 if the data channel fails.
+ */
+static int
+fencode_from_to(int fromfd, FILE *tofp, size_t nbytes, int level, uint32_t *crcp)
 {
-        char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        size_t nbytes;
+        char buff[ZSTREAM_BLOCK];
+        struct zstream_writer *zw;
+        size_t n;
+        int result;
 
-        fprintf(ctrlfp, "rpwd\n");
-        fflush(ctrlfp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fcopy_from_to(datafp, stdout, nbytes);
-                return;
+        zw = malloc(sizeof(struct zstream_writer));
+        if (zw == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "rpwd: %s\n", value);
-                return;
+        /* the writer closes its descriptor, and the caller keeps fromfd */
+        zstream_writer_open(zw, dup(fromfd), nbytes, level);
+        result = 0;
+        while ((n = zstream_read(zw, buff, ZSTREAM_BLOCK)) > 0) {
+                if (fwrite(buff, sizeof(char), n, tofp) != n) {
+                        result = -1;
+                        break;
+                }
+                add_job_progress(n, 0);
         }
+        *crcp = zw->crc;
+        zstream_writer_close(zw);
+        free(zw);
+        return result;
 }
 
-static void
-execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+/*
+ * Receives nbytes sent compressed into tofd, which it closes; with tofd
+ * -1 they are only consumed. *crcp is the crc32c of what came out.
+ * Returns -1 with errno set if the file could not be written or the
+ * stream was bad.
+ */
+static int
+fdecode_from_to(FILE *fromfp, int tofd, size_t nbytes, uint32_t *crcp)
 {
-        const char *arg;
-        char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        size_t nbytes;
-        FILE *fp;
+        char buff[ZSTREAM_BLOCK];
+        struct zstream_reader *zr;
+        size_t want;
+        size_t n;
+        int result;
 
-        arg = strtok_r(NULL, "\n", &saveptr);
-        if (arg == NULL) {
-                fprintf(stderr, "get: usage: get file\n");
-                return;
+        zr = malloc(sizeof(struct zstream_reader));
+        if (zr == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
         }
-        if (strrchr(arg, '/') != NULL) {
-                fprintf(stderr, "get: %s: cannot use '/'\n", arg);
-                return;
+        zstream_reader_open(zr, tofd, nbytes);
+        while ((want = zstream_want(zr)) > 0) {
+                n = fread(buff, sizeof(char), want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK, fromfp);
+                if (n == 0) {
+                        break;
+                }
+                zstream_write(zr, buff, n);
+                add_job_progress(n, 0);
         }
-        fprintf(ctrlfp, "get %s\n", arg);
-        fflush(ctrlfp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fp = fopen(arg, "w");
-                if (fp == NULL) {
-                        fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
-                        return;
+        *crcp = zr->crc;
+        result = zstream_reader_close(zr);
+        errno = zr->error;
+        free(zr);
+        return result;
+}
+
+/*
+ * Receives nbytes of a get's extents into tofd from offset, leaving
+ * holes where the server's file has them, and closes tofd; with tofd
+ * -1 they are only consumed. *crcp is the crc32c of the extents.
+ * Returns -1 with errno set if the file could not be written or the
+ * stream was bad.
+ */
+static int
+fsparse_from_to(FILE *fromfp, int tofd, off_t offset, size_t nbytes, uint32_t *crcp)
+{
+        char buff[ZSTREAM_BLOCK];
+        struct sparse_reader *sr;
+        size_t want;
+        size_t n;
+        int result;
+
+        sr = malloc(sizeof(struct sparse_reader));
+        if (sr == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        sparse_reader_open(sr, tofd, offset, nbytes);
+        while ((want = sparse_want(sr)) > 0) {
+                n = fread(buff, sizeof(char), want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK, fromfp);
+                if (n == 0) {
+                        break;
                 }
-                fcopy_from_to(datafp, fp, nbytes);
-                fclose(fp);
-                return;
+                sparse_write(sr, buff, n);
+                add_job_progress(n, 0);
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "get: %s: %s\n", arg, value);
-                return;
+        *crcp = sr->crc;
+        result = sparse_reader_close(sr);
+        errno = sr->error;
+        free(sr);
+        return result;
+}
+
+/*
+ * Sends the stream of extents sw has mapped, see sparse.h, and closes
+ * the writer. *crcp is the crc32c of the extents. Returns -1 if the
+ * stream could not be written.
+ */
+static int
+fextents_to(struct sparse_writer *sw, FILE *tofp, uint32_t *crcp)
+{
+        char buff[ZSTREAM_BLOCK];
+        size_t n;
+        int result;
+
+        result = 0;
+        while ((n = sparse_read(sw, buff, ZSTREAM_BLOCK)) > 0) {
+                if (fwrite(buff, sizeof(char), n, tofp) != n) {
+                        result = -1;
+                        break;
+                }
+                add_job_progress(n, 0);
         }
+        *crcp = sw->crc;
+        sparse_writer_close(sw);
+        return result;
 }
 
-static void
-execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+/* Tells whether the value of a get's reply announces extents, see sparse.h. */
+static int
+sparse_reply(const char *value)
+{
+        char *end;
+
+        strtoull(value, &end, 10);
+        return strcmp(end, " sparse") == 0;
+}
+
+/* Ends the data of a put -k with crc, see receive_digest. */
+static void
+send_digest(FILE *datafp, uint32_t crc)
+{
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+
+        crc32c_encode(crc, trailer);
+        fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+}
+
+/*
+ * Reads the checksum that ends the data of a get -k, the sender's
+ * crc32c of the bytes, and compares it with crc, ours. Returns -1 if
+ * they differ: the file did not arrive as it was sent.
+ */
+static int
+receive_digest(FILE *datafp, uint32_t crc)
+{
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+
+        if (fread(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp) != CRC32C_DIGEST_SIZE) {
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+        return crc32c_decode(trailer) == crc ? 0 : -1;
+}
+
+/* Asks the server with feat which of the optional features it has. */
+static void
+query_features(FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char listing[BUFF_SIZE];
+        char *value;
+        char *feature;
+        char *saveptr;
+        size_t nbytes;
+
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "feat\n");
+        fflush(ctrlfp);
+        server_deflate = 0;
+        server_digest = 0;
+        server_pages = 0;
+        server_batch = 0;
+        server_sparse = 0;
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                nbytes = strtol(value, NULL, 10);
+                if (nbytes >= BUFF_SIZE) {
+                        fcopy_from_to(datafp, NULL, nbytes, NULL);
+                        break;
+                }
+                nbytes = fread(listing, sizeof(char), nbytes, datafp);
+                listing[nbytes] = '\0';
+                for (feature = strtok_r(listing, "\n", &saveptr); feature != NULL;
+                     feature = strtok_r(NULL, "\n", &saveptr)) {
+                        if (strcmp(feature, "deflate") == 0) {
+                                server_deflate = 1;
+                        }
+                        else if (strcmp(feature, "digest") == 0) {
+                                server_digest = 1;
+                        }
+                        else if (strcmp(feature, "pages") == 0) {
+                                server_pages = 1;
+                        }
+                        else if (strcmp(feature, "batch") == 0) {
+                                server_batch = 1;
+                        }
+                        else if (strcmp(feature, "sparse") == 0) {
+                                server_sparse = 1;
+                        }
+                }
+                break;
+        case 0:
+                /* a server from before feat */
+                break;
+        default:
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/*
+ * Tells the level to compress a transfer at: level, or 0 if the server
+ * cannot decompress. The server is asked the first time.
+ */
+static int
+negotiate_level(int level, FILE *ctrlfp, FILE *datafp)
+{
+        if (level <= 0) {
+                return 0;
+        }
+        if (server_deflate < 0) {
+                query_features(ctrlfp, datafp);
+                if (!server_deflate) {
+                        fprintf(stderr, "mftp: the server cannot compress; transferring as is\n");
+                }
+        }
+        return server_deflate > 0 ? level : 0;
+}
+
+/*
+ * Tells whether transfers are to be checksummed end to end: always,
+ * unless the server is too old to. The server is asked the first time.
+ */
+static int
+negotiate_digest(FILE *ctrlfp, FILE *datafp)
+{
+        if (server_digest < 0) {
+                query_features(ctrlfp, datafp);
+        }
+        return server_digest;
+}
+
+/*
+ * Tells whether mget can ask for its files in one go, see
+ * receive_batch. The server is asked the first time.
+ */
+static int
+negotiate_batch(FILE *ctrlfp, FILE *datafp)
+{
+        if (server_batch < 0) {
+                query_features(ctrlfp, datafp);
+        }
+        return server_batch;
+}
+
+/*
+ * Tells whether gets and puts can leave the holes of a file out, see
+ * sparse.h; a file without holes goes as it is either way. The server
+ * is asked the first time.
+ */
+static int
+negotiate_sparse(FILE *ctrlfp, FILE *datafp)
+{
+        if (server_sparse < 0) {
+                query_features(ctrlfp, datafp);
+        }
+        return server_sparse;
+}
+
+/*
+ * Opens one more session to the server, the same way the first one was
+ * opened, and makes sure the server has set it up before returning.
+ */
+static struct mux *
+open_session(FILE **ctrlfpp, FILE **datafpp)
+{
+        if (server_dataport == NULL) {
+                return connect_mux(server_host, server_ctrlport, ctrlfpp, datafpp);
+        }
+        connect_pair(server_host, server_ctrlport, server_dataport, ctrlfpp, datafpp);
+        setvbuf(*datafpp, NULL, _IOFBF, buffpool_size());
+        return NULL;
+}
+
+/*
+ * Reads the remote working directory into cwd, newline and all, for
+ * opening more sessions there. Returns -1 if it cannot be told.
+ */
+static int
+query_remote_cwd(char *cwd, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char *value;
+        size_t nbytes;
+
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "rpwd\n");
+        fflush(ctrlfp);
+        if (read_reply(ctrlfp, buff, &value) != 1) {
+                return -1;
+        }
+        nbytes = strtol(value, NULL, 10);
+        if (nbytes >= BUFF_SIZE || fread(cwd, sizeof(char), nbytes, datafp) != nbytes) {
+                return -1;
+        }
+        cwd[nbytes] = '\0';
+        return 0;
+}
+
+/*
+ * Opens one more session like open_session, with *mp the mux under it
+ * if any, and moves it to cwd as query_remote_cwd gave it. Returns -1,
+ * the session closed again, if it cannot get there.
+ */
+static int
+open_session_in(const char *cwd, FILE **ctrlfpp, FILE **datafpp, struct mux **mp)
+{
+        char buff[BUFF_SIZE];
+        char *value;
+
+        *mp = open_session(ctrlfpp, datafpp);
+        fprintf(*ctrlfpp, "rcd %s", cwd);
+        fflush(*ctrlfpp);
+        if (read_reply(*ctrlfpp, buff, &value) != 1) {
+                fclose(*ctrlfpp);
+                fclose(*datafpp);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Reads a "succ: value" or "fail: value" reply. Returns 1 or 0
+ * accordingly with *valuep pointing into buff, or -1 if the server is
+ * gone or makes no sense.
+ */
+static int
+read_reply(FILE *ctrlfp, char *buff, char **valuep)
+{
+        if (fgets(buff, BUFF_SIZE, ctrlfp) == NULL) {
+                return -1;
+        }
+        return parse_reply(buff, valuep);
+}
+
+/* Splits a reply line the way read_reply does. */
+static int
+parse_reply(char *buff, char **valuep)
+{
+        const char *result;
+        char *saveptr;
+
+        result = strtok_r(buff, " ", &saveptr);
+        *valuep = strtok_r(NULL, "\n", &saveptr);
+        if (result == NULL || *valuep == NULL) {
+                return -1;
+        }
+        if (strcmp(result, "succ:") == 0) {
+                return 1;
+        }
+        if (strcmp(result, "fail:") == 0) {
+                return 0;
+        }
+        return -1;
+}
+
+/*
+ * Records a command that has just been sent, whose reply is to be read
+ * later, in order with the other requests in flight. The reply's data
+ * goes to the file localname, or to stdout. Waits for the oldest
+ * replies only when PIPELINE_DEPTH requests are in flight. Returns the
+ * record, for the caller to note anything else about the request.
+ */
+static struct request *
+queue_request(const char *command, const char *arg, const char *localname,
+              FILE *ctrlfp, FILE *datafp)
+{
+        struct request *r;
+
+        if (nrequests == PIPELINE_DEPTH) {
+                complete_request(ctrlfp, datafp);
+        }
+        r = &requests[(firstrequest + nrequests) % PIPELINE_DEPTH];
+        memset(r, 0, sizeof(struct request));
+        r->command = strdup(command);
+        r->arg = arg != NULL ? strdup(arg) : NULL;
+        r->localname = localname != NULL ? strdup(localname) : NULL;
+        r->id = session_mux != NULL ? session_mux->lastid : 0;
+        nrequests++;
+        return r;
+}
+
+/*
+ * Reads the reply to the oldest request in flight. Over two
+ * connections the replies come in order. Over a mux they come as the
+ * server gets to them, so the later ones are received into their files
+ * meanwhile instead of piling up in memory; only what goes to stdout
+ * waits for its turn.
+ */
+static void
+complete_request(FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char *value;
+        struct request *r;
+        int result;
+        int i;
+
+        r = &requests[firstrequest];
+        if (session_mux == NULL) {
+                result = read_reply(ctrlfp, buff, &value);
+                finish_request(r, result, value, datafp);
+        }
+        else {
+                for (;;) {
+                        for (i = 0; i < nrequests; i++) {
+                                receive_mux_request(&requests[(firstrequest + i) % PIPELINE_DEPTH], i == 0);
+                        }
+                        if (r->done) {
+                                break;
+                        }
+                        if (mux_read_frame(session_mux) < 0) {
+                                finish_request(r, -1, NULL, NULL);
+                                break;
+                        }
+                }
+        }
+        free(r->command);
+        free(r->arg);
+        free(r->localname);
+        firstrequest = (firstrequest + 1) % PIPELINE_DEPTH;
+        nrequests--;
+}
+
+/* Takes in what has arrived for a request over the mux. */
+static void
+receive_mux_request(struct request *r, int first)
+{
+        /* taken from the pool once and kept, as requests come back here often */
+        static char *buff;
+        char *value;
+        char *newline;
+        size_t n;
+
+        if (r->done) {
+                return;
+        }
+        if (buff == NULL && (buff = buffpool_get()) == NULL) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+        }
+        while (!r->replied) {
+                n = mux_take(session_mux, MUX_CTRL, r->id, r->reply + r->replylen,
+                             BUFF_SIZE - 1 - r->replylen);
+                if (n == 0) {
+                        return;
+                }
+                r->replylen += n;
+                r->reply[r->replylen] = '\0';
+                newline = strchr(r->reply, '\n');
+                if (newline == NULL && r->replylen < BUFF_SIZE - 1) {
+                        continue;
+                }
+                r->replied = 1;
+                r->result = parse_reply(r->reply, &value);
+                if (r->result != 1) {
+                        finish_request(r, r->result, value, NULL);
+                        return;
+                }
+                r->left = strtol(value, NULL, 10);
+                if (r->localname != NULL) {
+                        add_job_progress(0, r->left);
+                        r->fp = fopen(r->localname, "w");
+                        if (r->fp == NULL) {
+                                fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(errno));
+                        }
+                }
+                if (sparse_reply(value)) {
+                        r->sr = malloc(sizeof(struct sparse_reader));
+                        if (r->sr == NULL) {
+                                perror("malloc");
+                                exit(EXIT_FAILURE);
+                        }
+                        sparse_reader_open(r->sr, r->fp != NULL ? dup(fileno(r->fp)) : -1, 0, r->left);
+                }
+                else if (r->compressed) {
+                        r->zr = malloc(sizeof(struct zstream_reader));
+                        if (r->zr == NULL) {
+                                perror("malloc");
+                                exit(EXIT_FAILURE);
+                        }
+                        zstream_reader_open(r->zr, r->fp != NULL ? dup(fileno(r->fp)) : -1, r->left);
+                }
+        }
+        if (r->localname == NULL && !first) {
+                return;
+        }
+        while (r->zr != NULL && (n = zstream_want(r->zr)) > 0) {
+                n = mux_take(session_mux, MUX_DATA, r->id, buff, n < buffpool_size() ? n : buffpool_size());
+                if (n == 0) {
+                        return;
+                }
+                zstream_write(r->zr, buff, n);
+                add_job_progress(n, 0);
+        }
+        while (r->sr != NULL && (n = sparse_want(r->sr)) > 0) {
+                n = mux_take(session_mux, MUX_DATA, r->id, buff, n < buffpool_size() ? n : buffpool_size());
+                if (n == 0) {
+                        return;
+                }
+                sparse_write(r->sr, buff, n);
+                add_job_progress(n, 0);
+        }
+        if (r->sr != NULL) {
+                r->crc = r->sr->crc;
+                if (sparse_reader_close(r->sr) < 0) {
+                        fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(r->sr->error));
+                }
+                free(r->sr);
+                r->sr = NULL;
+                r->left = 0;
+        }
+        if (r->zr != NULL) {
+                r->crc = r->zr->crc;
+                if (zstream_reader_close(r->zr) < 0) {
+                        fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(r->zr->error));
+                }
+                free(r->zr);
+                r->zr = NULL;
+                r->left = 0;
+        }
+        while (r->left > 0) {
+                n = mux_take(session_mux, MUX_DATA, r->id, buff,
+                             r->left < buffpool_size() ? r->left : buffpool_size());
+                if (n == 0) {
+                        return;
+                }
+                if (r->localname == NULL) {
+                        fwrite(buff, sizeof(char), n, stdout);
+                }
+                else if (r->fp != NULL) {
+                        fwrite(buff, sizeof(char), n, r->fp);
+                }
+                r->crc = crc32c(r->crc, buff, n);
+                add_job_progress(n, 0);
+                r->left -= n;
+        }
+        while (r->digest && r->trailerlen < CRC32C_DIGEST_SIZE) {
+                n = mux_take(session_mux, MUX_DATA, r->id, (char *)r->trailer + r->trailerlen,
+                             CRC32C_DIGEST_SIZE - r->trailerlen);
+                if (n == 0) {
+                        return;
+                }
+                r->trailerlen += n;
+        }
+        if (r->fp != NULL) {
+                fclose(r->fp);
+        }
+        if (r->digest && crc32c_decode(r->trailer) != r->crc) {
+                fprintf(stderr, "%s: %s: checksum mismatch\n", r->command, r->localname);
+        }
+        r->done = 1;
+}
+
+/*
+ * Handles a reply read in order: the data that follows a success, or
+ * the reason of a failure. datafp is NULL if the data, if any, has
+ * been taken care of.
+ */
+static void
+finish_request(struct request *r, int result, char *value, FILE *datafp)
+{
+        size_t nbytes;
+        uint32_t crc;
+        FILE *fp;
+        int status;
+        int fd;
+
+        r->done = 1;
+        switch (result) {
+        case 1:
+                if (datafp == NULL) {
+                        return;
+                }
+                nbytes = strtol(value, NULL, 10);
+                if (r->localname == NULL) {
+                        fcopy_from_to(datafp, stdout, nbytes, NULL);
+                        return;
+                }
+                add_job_progress(0, nbytes);
+                if (r->compressed || sparse_reply(value)) {
+                        fd = open(r->localname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                        if (fd < 0) {
+                                fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(errno));
+                        }
+                        if (sparse_reply(value)) {
+                                status = fsparse_from_to(datafp, fd, 0, nbytes, &crc);
+                        }
+                        else {
+                                status = fdecode_from_to(datafp, fd, nbytes, &crc);
+                        }
+                        if (status < 0) {
+                                fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(errno));
+                        }
+                }
+                else {
+                        fp = fopen(r->localname, "w");
+                        if (fp == NULL) {
+                                fprintf(stderr, "%s: %s: %s\n", r->command, r->localname, strerror(errno));
+                        }
+                        fcopy_from_to(datafp, fp, nbytes, &crc);
+                        if (fp != NULL) {
+                                fclose(fp);
+                        }
+                }
+                if (r->digest && receive_digest(datafp, crc) < 0) {
+                        fprintf(stderr, "%s: %s: checksum mismatch\n", r->command, r->localname);
+                }
+                return;
+        case 0:
+                if (r->arg == NULL) {
+                        fprintf(stderr, "%s: %s\n", r->command, value);
+                }
+                else {
+                        fprintf(stderr, "%s: %s: %s\n", r->command, r->arg, value);
+                }
+                return;
+        default:
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* Waits for every request in flight. */
+static void
+drain_requests(FILE *ctrlfp, FILE *datafp)
+{
+        while (nrequests > 0) {
+                complete_request(ctrlfp, datafp);
+        }
+}
+
+/* Tells whether a request other than the given command is in flight. */
+static int
+pending_except(const char *command)
+{
+        int i;
+
+        for (i = 0; i < nrequests; i++) {
+                if (strcmp(requests[(firstrequest + i) % PIPELINE_DEPTH].command, command) != 0) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Takes the next "-x" or "-x value" option off the arguments of a
+ * command, getopt style. Returns the option letter, 0 when the options
+ * are over ("--" ends them explicitly) or '?' for an unknown or
+ * incomplete option.
+ */
+static int
+next_option(char **saveptr, const char *optstring, char **value)
+{
+        char *p;
+        char *token;
+        const char *spec;
+
+        p = *saveptr;
+        while (*p == ' ') {
+                p++;
+        }
+        *saveptr = p;
+        if (p[0] != '-' || p[1] == '\0' || strchr(" \n", p[2]) == NULL) {
+                return 0;
+        }
+        token = strtok_r(NULL, " \n", saveptr);
+        if (token[1] == '-') {
+                return 0;
+        }
+        spec = strchr(optstring, token[1]);
+        if (spec == NULL || token[1] == ':') {
+                return '?';
+        }
+        if (spec[1] == ':') {
+                *value = strtok_r(NULL, " \n", saveptr);
+                if (*value == NULL) {
+                        return '?';
+                }
+        }
+        return token[1];
+}
+
+static void
+execute_command(char *input, FILE *ctrlfp, FILE *datafp)
+{
+        const char *command;
+        char *saveptr;
+        
+        if (take_background(input)) {
+                start_job(input, ctrlfp, datafp);
+                return;
+        }
+        command = strtok_r(input, " \n", &saveptr);
+        if (command == NULL) {
+                return;
+        }
+        if (strcmp(command, "exit") == 0) {
+                execute_exit_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "echo") == 0) {
+                execute_echo_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rls") == 0) {
+                execute_rls_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rcd") == 0) {
+                execute_rcd_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rpwd") == 0) {
+                execute_rpwd_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "stats") == 0) {
+                execute_stats_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "get") == 0) {
+                execute_get_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "put") == 0) {
+                execute_put_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rsize") == 0) {
+                execute_rsize_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rsum") == 0) {
+                execute_rsum_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rcp") == 0) {
+                execute_rcp_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rmv") == 0) {
+                execute_rmv_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rstat") == 0) {
+                execute_rstat_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "mget") == 0) {
+                execute_mget_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "mput") == 0) {
+                execute_mput_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        /* the local commands see the effects of the remote ones before */
+        drain_requests(ctrlfp, datafp);
+        if (strcmp(command, "lls") == 0) {
+                execute_lls_command(saveptr);
+                return;
+        }
+        if (strcmp(command, "lcd") == 0) {
+                execute_lcd_command(saveptr);
+                return;
+        }
+        if (strcmp(command, "lpwd") == 0) {
+                execute_lpwd_command(saveptr);
+                return;
+        }
+        if (strcmp(command, "jobs") == 0) {
+                execute_jobs_command(saveptr);
+                return;
+        }
+        if (strcmp(command, "wait") == 0) {
+                execute_wait_command(saveptr);
+                return;
+        }
+        if (strcmp(command, "cancel") == 0) {
+                execute_cancel_command(saveptr);
+                return;
+        }
+        fprintf(stderr, "%s: command not found\n", command);
+}
+
+/*
+ * Tells whether a command line ends in "&", to be run in the
+ * background, and cuts the "&" off if it does.
+ */
+static int
+take_background(char *input)
+{
+        size_t len;
+
+        len = strlen(input);
+        while (len > 0 && strchr(" \t\r\n", input[len - 1]) != NULL) {
+                len--;
+        }
+        if (len == 0 || input[len - 1] != '&') {
+                return 0;
+        }
+        len--;
+        while (len > 0 && strchr(" \t", input[len - 1]) != NULL) {
+                len--;
+        }
+        input[len] = '\n';
+        input[len + 1] = '\0';
+        return 1;
+}
+
+static void
+execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        (void)saveptr;
+        drain_requests(ctrlfp, datafp);
+        /* the transfers running in the background are let finish */
+        reap_jobs(0);
+        fprintf(ctrlfp, "exit");
+        fflush(ctrlfp);
+        fclose(ctrlfp);
+        fclose(datafp);
+        exit(EXIT_SUCCESS);
+}
+
+static void
+execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(ctrlfp, "echo\n");
+        }
+        else {
+                fprintf(ctrlfp, "echo %s\n", arg);
+        }
+        fflush(ctrlfp);
+        queue_request("echo", arg, NULL, ctrlfp, datafp);
+}
+
+static void
+execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+        const char *cursor;
+        char *optvalue;
+        size_t limit;
+        int unsorted;
+        int bad;
+        int opt;
+
+        unsorted = 0;
+        limit = 0;
+        cursor = NULL;
+        bad = 0;
+        while ((opt = next_option(&saveptr, "un:c:", &optvalue)) != 0) {
+                switch (opt) {
+                case 'u':
+                        unsorted = 1;
+                        break;
+                case 'n':
+                        limit = strtoul(optvalue, NULL, 10);
+                        bad |= limit == 0;
+                        break;
+                case 'c':
+                        cursor = optvalue;
+                        break;
+                default:
+                        bad = 1;
+                        break;
+                }
+        }
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                arg = ".";
+        }
+        if (bad || ((limit > 0 || cursor != NULL) && !unsorted)) {
+                fprintf(stderr, "rls: usage: rls [dir]\n"
+                                "       rls -u [-n limit] [-c cursor] [dir]\n");
+                return;
+        }
+        if (unsorted) {
+                if (server_pages < 0) {
+                        query_features(ctrlfp, datafp);
+                }
+                if (server_pages > 0) {
+                        list_remote_pages(arg, limit, cursor, ctrlfp, datafp);
+                        return;
+                }
+                fprintf(stderr, "rls: the server cannot page listings; listing sorted\n");
+        }
+        fprintf(ctrlfp, "rls %s%s\n", arg[0] == '-' ? "-- " : "", arg);
+        fflush(ctrlfp);
+        queue_request("rls", arg, NULL, ctrlfp, datafp);
+}
+
+/*
+ * Lists a remote directory unsorted, printing every page as soon as it
+ * arrives and asking for the next one after it. With a limit only one
+ * page is asked for, and the cursor that goes on from it is told.
+ */
+static void
+list_remote_pages(const char *arg, size_t limit, const char *cursor, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char next[BUFF_SIZE];
+        char *value;
+        char *page;
+        char *more;
+        size_t nbytes;
+
+        drain_requests(ctrlfp, datafp);
+        snprintf(next, BUFF_SIZE, "%s", cursor != NULL ? cursor : "");
+        do {
+                fprintf(ctrlfp, "rls -u");
+                if (limit > 0) {
+                        fprintf(ctrlfp, " -n %zu", limit);
+                }
+                if (next[0] != '\0') {
+                        fprintf(ctrlfp, " -c %s", next);
+                }
+                fprintf(ctrlfp, " -- %s\n", arg);
+                fflush(ctrlfp);
+                switch (read_reply(ctrlfp, buff, &value)) {
+                case 1:
+                        break;
+                case 0:
+                        fprintf(stderr, "rls: %s: %s\n", arg, value);
+                        return;
+                default:
+                        fprintf(stderr, "mftp: connection lost\n");
+                        exit(EXIT_FAILURE);
+                }
+                nbytes = strtol(value, NULL, 10);
+                page = malloc(nbytes + 1);
+                if (page == NULL) {
+                        perror("malloc");
+                        exit(EXIT_FAILURE);
+                }
+                if (fread(page, sizeof(char), nbytes, datafp) != nbytes) {
+                        fprintf(stderr, "mftp: connection lost\n");
+                        exit(EXIT_FAILURE);
+                }
+                page[nbytes] = '\0';
+                /* names cannot hold a '/', so this line is no name */
+                more = strncmp(page, "/more ", 6) == 0 ? page : strstr(page, "\n/more ");
+                next[0] = '\0';
+                if (more != NULL) {
+                        if (more != page) {
+                                more++;
+                        }
+                        snprintf(next, BUFF_SIZE, "%.*s", (int)strcspn(more + 6, "\n"), more + 6);
+                        nbytes = more - page;
+                }
+                fwrite(page, sizeof(char), nbytes, stdout);
+                fflush(stdout);
+                free(page);
+        } while (next[0] != '\0' && limit == 0);
+        if (next[0] != '\0') {
+                fprintf(stderr, "rls: more follow; go on with rls -u -n %zu -c %s %s\n", limit, next, arg);
+        }
+}
+
+static void
+execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "rcd: usage: rcd dir\n");
+                return;
+        }
+        fprintf(ctrlfp, "rcd %s\n", arg);
+        fflush(ctrlfp);
+        queue_request("rcd", arg, NULL, ctrlfp, datafp);
+}
+
+static void
+execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        (void)saveptr;
+        fprintf(ctrlfp, "rpwd\n");
+        fflush(ctrlfp);
+        queue_request("rpwd", NULL, NULL, ctrlfp, datafp);
+}
+
+static void
+execute_stats_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        (void)saveptr;
+        fprintf(ctrlfp, "stats\n");
+        fflush(ctrlfp);
+        queue_request("stats", NULL, NULL, ctrlfp, datafp);
+}
+
+static void
+execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+        char buff[BUFF_SIZE];
+        char *value;
+        char *optvalue;
+        size_t nbytes;
+        off_t offset;
+        uint32_t crc;
+        FILE *fp;
+        int nstripes;
+        int resume;
+        int recursive;
+        int delta;
+        int digest;
+        int sparse;
+        int level;
+        int fd;
+        int opt;
+
+        nstripes = 1;
+        resume = 0;
+        recursive = 0;
+        delta = 0;
+        level = compress_level;
+        while ((opt = next_option(&saveptr, "cdrs:z:", &optvalue)) != 0) {
+                switch (opt) {
+                case 'c':
+                        resume = 1;
+                        break;
+                case 'd':
+                        delta = 1;
+                        break;
+                case 'r':
+                        recursive = 1;
+                        break;
+                case 's':
+                        nstripes = strtol(optvalue, NULL, 10);
+                        break;
+                case 'z':
+                        level = strtol(optvalue, NULL, 10);
+                        if (level >= 0 && level <= 9) {
+                                break;
+                        }
+                        /* fall through */
+                default:
+                        fprintf(stderr, "get: usage: get [-c] [-s stripes] [-z level] file\n"
+                                        "       get -d file\n"
+                                        "       get -r path\n");
+                        return;
+                }
+        }
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "get: usage: get [-c] [-s stripes] [-z level] file\n"
+                                "       get -d file\n"
+                                "       get -r path\n");
+                return;
+        }
+        if (recursive) {
+                receive_archive(arg, ctrlfp, datafp);
+                return;
+        }
+        if (strrchr(arg, '/') != NULL) {
+                fprintf(stderr, "get: %s: cannot use '/'\n", arg);
+                return;
+        }
+        /* stripes are already as fast as the link; they go as they are */
+        level = nstripes > 1 ? 0 : negotiate_level(level, ctrlfp, datafp);
+        if (delta) {
+                receive_delta(arg, level, ctrlfp, datafp);
+                return;
+        }
+        if (resume || nstripes > 1) {
+                drain_requests(ctrlfp, datafp);
+        }
+        offset = resume ? resume_get_offset(arg, ctrlfp, datafp, &crc) : 0;
+        if (offset == 0 && nstripes > 1) {
+                execute_striped_get(arg, nstripes, ctrlfp, datafp);
+                return;
+        }
+        if (offset == 0) {
+                send_get(arg, level, ctrlfp, datafp);
+                return;
+        }
+        digest = negotiate_digest(ctrlfp, datafp);
+        fprintf(ctrlfp, "get -o %lld -m %08x%s%s", (long long)offset, crc, digest ? " -k" : "",
+                negotiate_sparse(ctrlfp, datafp) ? " -h" : "");
+        if (level > 0) {
+                fprintf(ctrlfp, " -z %d", level);
+        }
+        fprintf(ctrlfp, " -- %s\n", arg);
+        fflush(ctrlfp);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "get: %s: %s, fetching the whole file\n", arg, value);
+                send_get(arg, level, ctrlfp, datafp);
+                return;
+        default:
+                return;
+        }
+        nbytes = strtol(value, NULL, 10);
+        sparse = sparse_reply(value);
+        fp = fopen(arg, "r+");
+        if (fp == NULL || fseeko(fp, offset, SEEK_SET) < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                if (sparse) {
+                        fsparse_from_to(datafp, -1, 0, nbytes, &crc);
+                }
+                else if (level > 0) {
+                        fdecode_from_to(datafp, -1, nbytes, &crc);
+                }
+                else {
+                        fcopy_from_to(datafp, NULL, nbytes, &crc);
+                }
+                if (digest) {
+                        receive_digest(datafp, crc);
+                }
+                if (fp != NULL) {
+                        fclose(fp);
+                }
+                return;
+        }
+        if (sparse) {
+                fd = dup(fileno(fp));
+                if (fsparse_from_to(datafp, fd, offset, nbytes, &crc) < 0) {
+                        fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                }
+        }
+        else if (level > 0) {
+                fd = dup(fileno(fp));
+                if (fdecode_from_to(datafp, fd, nbytes, &crc) < 0) {
+                        fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                }
+        }
+        else {
+                fcopy_from_to(datafp, fp, nbytes, &crc);
+        }
+        fclose(fp);
+        if (digest && receive_digest(datafp, crc) < 0) {
+                fprintf(stderr, "get: %s: checksum mismatch\n", arg);
+        }
+}
+
+static void
+execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
 {
         const char *arg;
+        char *optvalue;
+        int resume;
+        int recursive;
+        int delta;
+        int level;
+        int opt;
+
+        resume = 0;
+        recursive = 0;
+        delta = 0;
+        level = compress_level;
+        while ((opt = next_option(&saveptr, "cdrz:", &optvalue)) != 0) {
+                switch (opt) {
+                case 'c':
+                        resume = 1;
+                        break;
+                case 'd':
+                        delta = 1;
+                        break;
+                case 'r':
+                        recursive = 1;
+                        break;
+                case 'z':
+                        level = strtol(optvalue, NULL, 10);
+                        if (level >= 0 && level <= 9) {
+                                break;
+                        }
+                        /* fall through */
+                default:
+                        fprintf(stderr, "put: usage: put [-c] [-z level] file\n"
+                                        "       put -d file\n"
+                                        "       put -r path\n");
+                        return;
+                }
+        }
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "put: usage: put [-c] [-z level] file\n"
+                                "       put -d file\n"
+                                "       put -r path\n");
+                return;
+        }
+        if (recursive) {
+                send_archive(arg, ctrlfp, datafp);
+                return;
+        }
+        if (strrchr(arg, '/') != NULL) {
+                fprintf(stderr, "put: %s: cannot use '/'\n", arg);
+                return;
+        }
+        if (delta) {
+                send_delta(arg, negotiate_level(level, ctrlfp, datafp), ctrlfp, datafp);
+                return;
+        }
+        send_put(arg, resume, negotiate_level(level, ctrlfp, datafp), ctrlfp, datafp);
+}
+
+/*
+ * Fetches every remote file matching one of the patterns, without
+ * waiting for one before asking for the next. Uncompressed, and if the
+ * server can, the files come in batches instead, each of them a single
+ * archive.
+ */
+static void
+execute_mget_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *pattern;
+        char *listing;
+        char *batch;
+        char *name;
+        char *nameptr;
+        size_t batchlen;
+        int nmatches;
+        int level;
+
+        listing = NULL;
+        batch = NULL;
+        batchlen = 0;
+        level = negotiate_level(compress_level, ctrlfp, datafp);
+        if (level == 0 && negotiate_batch(ctrlfp, datafp)) {
+                batch = malloc(ARCHIVE_LIST_MAX);
+                if (batch == NULL) {
+                        perror("malloc");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        while ((pattern = strtok_r(NULL, " \n", &saveptr)) != NULL) {
+                if (strchr(pattern, '/') != NULL) {
+                        fprintf(stderr, "mget: %s: cannot use '/'\n", pattern);
+                        continue;
+                }
+                if (strpbrk(pattern, "*?[") == NULL && batch != NULL) {
+                        add_batch_name(pattern, batch, &batchlen, ctrlfp, datafp);
+                        continue;
+                }
+                if (strpbrk(pattern, "*?[") == NULL) {
+                        send_get(pattern, level, ctrlfp, datafp);
+                        continue;
+                }
+                if (listing == NULL) {
+                        listing = list_remote_directory(ctrlfp, datafp);
+                        if (listing == NULL) {
+                                break;
+                        }
+                }
+                nmatches = 0;
+                for (name = listing; *name != '\0'; name = nameptr + 1) {
+                        nameptr = strchr(name, '\n');
+                        *nameptr = '\0';
+                        if (fnmatch(pattern, name, FNM_PERIOD) == 0 && batch != NULL) {
+                                add_batch_name(name, batch, &batchlen, ctrlfp, datafp);
+                                nmatches++;
+                        }
+                        else if (fnmatch(pattern, name, FNM_PERIOD) == 0) {
+                                send_get(name, level, ctrlfp, datafp);
+                                nmatches++;
+                        }
+                        *nameptr = '\n';
+                }
+                if (nmatches == 0) {
+                        fprintf(stderr, "mget: %s: no match\n", pattern);
+                }
+        }
+        if (batchlen > 0) {
+                receive_batch(batch, batchlen, ctrlfp, datafp);
+        }
+        free(batch);
+        free(listing);
+}
+
+/*
+ * Sends every local file matching one of the patterns, without waiting
+ * for one to be stored before sending the next.
+ */
+static void
+execute_mput_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *pattern;
+        glob_t globbuf;
+        struct stat sb;
+        size_t i;
+        int level;
+        int ret;
+
+        level = negotiate_level(compress_level, ctrlfp, datafp);
+        while ((pattern = strtok_r(NULL, " \n", &saveptr)) != NULL) {
+                if (strchr(pattern, '/') != NULL) {
+                        fprintf(stderr, "mput: %s: cannot use '/'\n", pattern);
+                        continue;
+                }
+                ret = glob(pattern, 0, NULL, &globbuf);
+                if (ret == GLOB_NOMATCH) {
+                        fprintf(stderr, "mput: %s: no match\n", pattern);
+                        continue;
+                }
+                if (ret != 0) {
+                        fprintf(stderr, "mput: %s: cannot expand\n", pattern);
+                        continue;
+                }
+                for (i = 0; i < globbuf.gl_pathc; i++) {
+                        if (stat(globbuf.gl_pathv[i], &sb) == 0 && S_ISREG(sb.st_mode)) {
+                                send_put(globbuf.gl_pathv[i], 0, level, ctrlfp, datafp);
+                        }
+                }
+                globfree(&globbuf);
+        }
+}
+
+/*
+ * Asks for a whole file, compressed at level unless it is 0; the reply
+ * is read with the others in flight. The data ends in its checksum if
+ * the server can send one.
+ */
+static void
+send_get(const char *arg, int level, FILE *ctrlfp, FILE *datafp)
+{
+        struct request *r;
+        int digest;
+
+        digest = negotiate_digest(ctrlfp, datafp);
+        fprintf(ctrlfp, "get%s%s", digest ? " -k" : "", negotiate_sparse(ctrlfp, datafp) ? " -h" : "");
+        if (level > 0) {
+                fprintf(ctrlfp, " -z %d", level);
+        }
+        fprintf(ctrlfp, " -- %s\n", arg);
+        fflush(ctrlfp);
+        r = queue_request("get", arg, arg, ctrlfp, datafp);
+        r->compressed = level > 0;
+        r->digest = digest;
+}
+
+/*
+ * Sends a file, or with resume what the server lacks of it, compressed
+ * at level unless it is 0. Otherwise a whole file with holes goes as
+ * its extents if the server takes them, see sparse.h, and the server
+ * leaves the holes in its copy. Puts in a row do not wait for each other,
+ * but anything else in flight is waited for first: the server would not
+ * read the data while it is still sending us the reply of an earlier
+ * command.
+ */
+static void
+send_put(const char *arg, int resume, int level, FILE *ctrlfp, FILE *datafp)
+{
         FILE *fp;
         struct stat sb;
+        struct sparse_writer sw;
+        size_t nbytes;
+        off_t offset;
+        uint32_t crc;
+        int digest;
+        int sparse;
+        int fd;
+
+        digest = negotiate_digest(ctrlfp, datafp);
+        if (resume || pending_except("put")) {
+                drain_requests(ctrlfp, datafp);
+        }
+        fp = fopen(arg, "r");
+        if (fp == NULL) {
+                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                return;
+        }
+        if (fstat(fileno(fp), &sb) < 0) {
+                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                fclose(fp);
+                return;
+        }
+        offset = resume ? resume_put_offset(arg, fileno(fp), sb.st_size, ctrlfp, datafp, &crc) : 0;
+        if (fseeko(fp, offset, SEEK_SET) < 0) {
+                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                fclose(fp);
+                return;
+        }
+        nbytes = sb.st_size - offset;
+        sparse = 0;
+        if (offset == 0 && level == 0 && sparse_file(&sb) && negotiate_sparse(ctrlfp, datafp)) {
+                /* the writer closes its descriptor, and fp keeps its own */
+                fd = dup(fileno(fp));
+                sparse = fd >= 0 && sparse_writer_open(&sw, fd, 0, nbytes) == 0;
+                if (fd >= 0 && !sparse) {
+                        close(fd);
+                }
+        }
+        fprintf(ctrlfp, "put");
+        if (offset > 0) {
+                fprintf(ctrlfp, " -o %lld -m %08x", (long long)offset, crc);
+        }
+        fprintf(ctrlfp, "%s%s%s -- %s %zu\n", level > 0 ? " -z" : "", sparse ? " -h" : "",
+                digest ? " -k" : "", arg, sparse ? (size_t)sw.total : nbytes);
+        fflush(ctrlfp);
+        /* compressed, less than this goes out */
+        add_job_progress(0, level > 0 ? 0 : sparse ? (size_t)sw.total : nbytes);
+        if (sparse) {
+                if (fextents_to(&sw, datafp, &crc) < 0) {
+                        fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                }
+        }
+        else if (level > 0) {
+                fencode_from_to(fileno(fp), datafp, nbytes, level, &crc);
+        }
+        else if (fcopy_from_to(fp, datafp, nbytes, &crc) < 0) {
+                fprintf(stderr, "put: %s: file shrank while being sent\n", arg);
+        }
+        if (digest) {
+                send_digest(datafp, crc);
+        }
+        fflush(datafp);
+        fclose(fp);
+        queue_request("put", arg, NULL, ctrlfp, datafp);
+}
+
+/*
+ * Fetches a remote tree, or a single file, as an archive (see
+ * archive.h) and unpacks it here while it arrives.
+ */
+static void
+receive_archive(const char *arg, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char chunk[ARCHIVE_CHUNK];
+        char *value;
+        struct archive_reader *ar;
+        size_t want;
+        size_t n;
+
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "get -r -- %s\n", arg);
+        fflush(ctrlfp);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "get: %s: %s\n", arg, value);
+                return;
+        default:
+                return;
+        }
+        ar = malloc(sizeof(struct archive_reader));
+        if (ar == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        archive_reader_open(ar);
+        while ((want = archive_want(ar)) > 0) {
+                n = fread(chunk, sizeof(char), want < ARCHIVE_CHUNK ? want : ARCHIVE_CHUNK, datafp);
+                if (n == 0) {
+                        break;
+                }
+                archive_write(ar, chunk, n);
+                add_job_progress(n, 0);
+        }
+        if (archive_reader_close(ar) < 0) {
+                fprintf(stderr, "get: %s: %s\n",
+                        ar->errpath[0] != '\0' ? ar->errpath : arg, strerror(ar->error));
+        }
+        free(ar);
+}
+
+/* Adds a name to the batch in list, fetching the batch first if it is full. */
+static void
+add_batch_name(const char *name, char *list, size_t *lenp, FILE *ctrlfp, FILE *datafp)
+{
+        size_t namelen;
+
+        namelen = strlen(name);
+        if (*lenp + namelen + 1 > ARCHIVE_LIST_MAX) {
+                receive_batch(list, *lenp, ctrlfp, datafp);
+                *lenp = 0;
+        }
+        memcpy(list + *lenp, name, namelen);
+        list[*lenp + namelen] = '\n';
+        *lenp += namelen + 1;
+}
+
+/*
+ * Fetches the files named in list, len bytes of names each followed by
+ * a newline, with a single get -b: the server sends them all as one
+ * archive, with an entry in place of each file it could not send, and
+ * they are unpacked here while they arrive.
+ */
+static void
+receive_batch(char *list, size_t len, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char chunk[ARCHIVE_CHUNK];
+        char *value;
+        struct archive_reader *ar;
+        size_t want;
+        size_t n;
+        uint32_t crc;
+        int digest;
+
+        digest = negotiate_digest(ctrlfp, datafp);
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "get -b%s %zu\n", digest ? " -k" : "", len);
+        fflush(ctrlfp);
+        fwrite(list, sizeof(char), len, datafp);
+        fflush(datafp);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "mget: %s\n", value);
+                return;
+        default:
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+        ar = malloc(sizeof(struct archive_reader));
+        if (ar == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        if (archive_reader_open(ar) < 0) {
+                fprintf(stderr, "mget: %s\n", strerror(ar->error));
+        }
+        ar->report = report_batch_failure;
+        crc = 0;
+        while ((want = archive_want(ar)) > 0) {
+                n = fread(chunk, sizeof(char), want < ARCHIVE_CHUNK ? want : ARCHIVE_CHUNK, datafp);
+                if (n == 0) {
+                        break;
+                }
+                crc = crc32c(crc, chunk, n);
+                archive_write(ar, chunk, n);
+                add_job_progress(n, 0);
+        }
+        /* every failure has been reported on the way */
+        archive_reader_close(ar);
+        free(ar);
+        if (digest && receive_digest(datafp, crc) < 0) {
+                fprintf(stderr, "mget: checksum mismatch\n");
+        }
+}
+
+/* Tells of one file of a batch that did not arrive. */
+static void
+report_batch_failure(const char *path, int error)
+{
+        if (path[0] == '\0') {
+                fprintf(stderr, "mget: %s\n", strerror(error));
+                return;
+        }
+        fprintf(stderr, "mget: %s: %s\n", path, strerror(error));
+}
+
+/*
+ * Sends a local tree, or a single file, as an archive, which the
+ * server unpacks into its directory. Like a put it does not wait for
+ * the reply.
+ */
+static void
+send_archive(const char *arg, FILE *ctrlfp, FILE *datafp)
+{
+        char chunk[ARCHIVE_CHUNK];
+        struct archive_writer *aw;
+        size_t n;
+
+        if (pending_except("put")) {
+                drain_requests(ctrlfp, datafp);
+        }
+        aw = malloc(sizeof(struct archive_writer));
+        if (aw == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        if (archive_writer_open(aw, arg) < 0) {
+                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                free(aw);
+                return;
+        }
+        fprintf(ctrlfp, "put -r\n");
+        fflush(ctrlfp);
+        while ((n = archive_read(aw, chunk, ARCHIVE_CHUNK)) > 0) {
+                fwrite(chunk, sizeof(char), n, datafp);
+                add_job_progress(n, 0);
+        }
+        fflush(datafp);
+        if (aw->nskipped > 0) {
+                fprintf(stderr, "put: %s: left out %d entries that are not regular files "
+                        "or directories or cannot be read\n", arg, aw->nskipped);
+        }
+        archive_writer_close(aw);
+        free(aw);
+        queue_request("put", arg, NULL, ctrlfp, datafp);
+}
+
+/*
+ * Brings the local copy of a file up to date with the remote one by
+ * fetching only what it lacks, see delta.h. Without a local copy the
+ * whole file is fetched, compressed at level unless it is 0.
+ */
+static void
+receive_delta(const char *arg, int level, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char chunk[DELTA_LITERAL_MAX];
+        char *value;
+        char *sig;
+        size_t siglen;
+        size_t want;
+        size_t n;
+        uint32_t blocksize;
+        struct stat sb;
+        struct delta_reader *dr;
+        FILE *sigfp;
+        int result;
+        int fd;
+
+        fd = open(arg, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                send_get(arg, level, ctrlfp, datafp);
+                return;
+        }
+        blocksize = delta_block_size(sb.st_size);
+        sig = NULL;
+        sigfp = open_memstream(&sig, &siglen);
+        if (sigfp == NULL) {
+                perror("open_memstream");
+                exit(EXIT_FAILURE);
+        }
+        result = delta_sign(fd, blocksize, sigfp);
+        fclose(sigfp);
+        close(fd);
+        if (result < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                free(sig);
+                return;
+        }
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "get -d %zu -- %s\n", siglen, arg);
+        fflush(ctrlfp);
+        fwrite(sig, sizeof(char), siglen, datafp);
+        fflush(datafp);
+        free(sig);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "get: %s: %s\n", arg, value);
+                return;
+        default:
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+        dr = malloc(sizeof(struct delta_reader));
+        if (dr == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        /* even if the file cannot be rebuilt, the delta has to be read */
+        delta_reader_open(dr, arg, blocksize);
+        while ((want = delta_want(dr)) > 0) {
+                n = fread(chunk, sizeof(char), want < DELTA_LITERAL_MAX ? want : DELTA_LITERAL_MAX, datafp);
+                if (n == 0) {
+                        break;
+                }
+                delta_write(dr, chunk, n);
+                add_job_progress(n, 0);
+        }
+        if (delta_reader_close(dr) < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(dr->error));
+        }
+        free(dr);
+}
+
+/*
+ * Brings the remote copy of a file up to date with the local one by
+ * sending only what it lacks, see delta.h. Without a remote copy the
+ * whole file is sent, compressed at level unless it is 0. Like a put it
+ * does not wait for the reply.
+ */
+static void
+send_delta(const char *arg, int level, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char chunk[DELTA_LITERAL_MAX];
+        char *value;
+        char *sigbuff;
+        size_t siglen;
+        size_t n;
+        uint32_t blocksize;
+        struct delta_sig *sig;
+        struct delta_writer *dw;
+        int fd;
+
+        drain_requests(ctrlfp, datafp);
+        fd = open(arg, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+                return;
+        }
+        fprintf(ctrlfp, "sig -- %s\n", arg);
+        fflush(ctrlfp);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                close(fd);
+                send_put(arg, 0, level, ctrlfp, datafp);
+                return;
+        default:
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+        siglen = strtol(value, NULL, 10);
+        sigbuff = malloc(siglen + 1);
+        if (sigbuff == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        if (fread(sigbuff, sizeof(char), siglen, datafp) != siglen) {
+                fprintf(stderr, "mftp: connection lost\n");
+                exit(EXIT_FAILURE);
+        }
+        sig = delta_sig_parse(sigbuff, siglen);
+        free(sigbuff);
+        if (sig == NULL) {
+                fprintf(stderr, "put: %s: bad signature, sending the whole file\n", arg);
+                close(fd);
+                send_put(arg, 0, level, ctrlfp, datafp);
+                return;
+        }
+        blocksize = sig->blocksize;
+        dw = malloc(sizeof(struct delta_writer));
+        if (dw == NULL || delta_writer_open(dw, fd, sig) < 0) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        fprintf(ctrlfp, "put -d %u -- %s\n", blocksize, arg);
+        fflush(ctrlfp);
+        while ((n = delta_read(dw, chunk, DELTA_LITERAL_MAX)) > 0) {
+                fwrite(chunk, sizeof(char), n, datafp);
+                add_job_progress(n, 0);
+        }
+        fflush(datafp);
+        delta_writer_close(dw);
+        free(dw);
+        queue_request("put", arg, NULL, ctrlfp, datafp);
+}
+
+/* Returns the names in the remote directory, one per line, or NULL. */
+static char *
+list_remote_directory(FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char *value;
+        char *listing;
+        size_t nbytes;
+
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "rls .\n");
+        fflush(ctrlfp);
+        switch (read_reply(ctrlfp, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "mget: %s\n", value);
+                return NULL;
+        default:
+                fprintf(stderr, "mget: bad reply\n");
+                return NULL;
+        }
+        nbytes = strtol(value, NULL, 10);
+        listing = malloc(nbytes + 1);
+        if (listing == NULL) {
+                perror("malloc");
+                fcopy_from_to(datafp, NULL, nbytes, NULL);
+                return NULL;
+        }
+        if (fread(listing, sizeof(char), nbytes, datafp) != nbytes) {
+                fprintf(stderr, "mget: bad reply\n");
+                free(listing);
+                return NULL;
+        }
+        listing[nbytes] = '\0';
+        return listing;
+}
+
+/*
+ * Asks the server for the size and mtime of a file and, unless window
+ * is negative, the checksum of its last window bytes. Returns the
+ * result of read_reply; on a fail reply *valuep holds the reason.
+ */
+static int
+query_remote_file(const char *arg, off_t window, FILE *ctrlfp, FILE *datafp,
+                  struct remote_file *rf, char *buff, char **valuep)
+{
+        char line[BUFF_SIZE];
+        char *p;
         size_t nbytes;
+        int result;
+
+        if (window >= 0) {
+                fprintf(ctrlfp, "rsize -w %lld -- %s\n", (long long)window, arg);
+        }
+        else {
+                fprintf(ctrlfp, "rsize %s%s\n", arg[0] == '-' ? "-- " : "", arg);
+        }
+        fflush(ctrlfp);
+        result = read_reply(ctrlfp, buff, valuep);
+        if (result != 1) {
+                return result;
+        }
+        nbytes = strtol(*valuep, NULL, 10);
+        if (nbytes >= BUFF_SIZE || fread(line, sizeof(char), nbytes, datafp) != nbytes) {
+                return -1;
+        }
+        line[nbytes] = '\0';
+        rf->size = strtoll(line, &p, 10);
+        rf->mtime = strtoll(p, &p, 10);
+        rf->crc = strtoul(p, NULL, 16);
+        return 1;
+}
+
+/*
+ * Decides where a get -c picks up: the size of the local partial file,
+ * provided the remote file is at least as long. The server checks crc,
+ * taken over the end of the partial file, before sending the rest.
+ */
+static off_t
+resume_get_offset(const char *arg, FILE *ctrlfp, FILE *datafp, uint32_t *crcp)
+{
         char buff[BUFF_SIZE];
-        const char *result;
-        const char *value;
-        
+        char *value;
+        struct remote_file rf;
+        struct stat sb;
+        off_t start;
+        int fd;
+
+        fd = open(arg, O_RDONLY);
+        if (fd < 0) {
+                return 0;
+        }
+        if (fstat(fd, &sb) < 0 || sb.st_size == 0 ||
+            query_remote_file(arg, -1, ctrlfp, datafp, &rf, buff, &value) != 1) {
+                close(fd);
+                return 0;
+        }
+        if (sb.st_size > rf.size) {
+                fprintf(stderr, "get: %s: local file is longer, fetching the whole file\n", arg);
+                close(fd);
+                return 0;
+        }
+        start = sb.st_size > RESUME_WINDOW ? sb.st_size - RESUME_WINDOW : 0;
+        if (crc32c_file(fd, start, sb.st_size - start, crcp) < 0) {
+                close(fd);
+                return 0;
+        }
+        close(fd);
+        return sb.st_size;
+}
+
+/*
+ * Decides where a put -c picks up: the size of the remote partial
+ * file, provided it is no longer than the local one and its last bytes
+ * match ours.
+ */
+static off_t
+resume_put_offset(const char *arg, int fd, off_t size,
+                  FILE *ctrlfp, FILE *datafp, uint32_t *crcp)
+{
+        char buff[BUFF_SIZE];
+        char *value;
+        struct remote_file rf;
+        off_t start;
+        uint32_t crc;
+
+        if (query_remote_file(arg, RESUME_WINDOW, ctrlfp, datafp, &rf, buff, &value) != 1 ||
+            rf.size == 0) {
+                return 0;
+        }
+        if (rf.size > size) {
+                fprintf(stderr, "put: %s: remote file is longer, sending the whole file\n", arg);
+                return 0;
+        }
+        start = rf.size > RESUME_WINDOW ? rf.size - RESUME_WINDOW : 0;
+        if (crc32c_file(fd, start, rf.size - start, &crc) < 0 || crc != rf.crc) {
+                fprintf(stderr, "put: %s: remote file differs, sending the whole file\n", arg);
+                return 0;
+        }
+        *crcp = crc;
+        return rf.size;
+}
+
+static void
+execute_rsize_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
         arg = strtok_r(NULL, "\n", &saveptr);
         if (arg == NULL) {
-                fprintf(stderr, "put: usage: put file\n");
+                fprintf(stderr, "rsize: usage: rsize file\n");
                 return;
         }
-        if (strrchr(arg, '/') != NULL) {
-                fprintf(stderr, "put: %s: cannot use '/'\n", arg);
+        fprintf(ctrlfp, "rsize %s%s\n", arg[0] == '-' ? "-- " : "", arg);
+        fflush(ctrlfp);
+        queue_request("rsize", arg, NULL, ctrlfp, datafp);
+}
+
+/* Prints the crc32c and the size of a remote file. */
+static void
+execute_rsum_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "rsum: usage: rsum file\n");
                 return;
         }
-        fp = fopen(arg, "r");
-        if (fp == NULL) {
-                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
+        fprintf(ctrlfp, "rsum %s%s\n", arg[0] == '-' ? "-- " : "", arg);
+        fflush(ctrlfp);
+        queue_request("rsum", arg, NULL, ctrlfp, datafp);
+}
+
+/* Copies a remote file to another remote name without fetching it. */
+static void
+execute_rcp_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "rcp: usage: rcp from to\n");
                 return;
         }
-        if (fstat(fileno(fp), &sb) < 0) {
-                fprintf(stderr, "put: %s: %s\n", arg, strerror(errno));
-                fclose(fp);
+        fprintf(ctrlfp, "rcp %s\n", arg);
+        fflush(ctrlfp);
+        queue_request("rcp", arg, NULL, ctrlfp, datafp);
+}
+
+static void
+execute_rmv_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+
+        arg = strtok_r(NULL, "\n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "rmv: usage: rmv from to\n");
+                return;
+        }
+        fprintf(ctrlfp, "rmv %s\n", arg);
+        fflush(ctrlfp);
+        queue_request("rmv", arg, NULL, ctrlfp, datafp);
+}
+
+/*
+ * Prints the size, mtime, mode and inode of remote files, a line each:
+ * of all the paths given, asked for in a single rstat -b, or with -d of
+ * every entry of a directory, the current one if none is given.
+ */
+static void
+execute_rstat_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+        char *optvalue;
+        char *list;
+        size_t len;
+        size_t namelen;
+        int directory;
+        int opt;
+
+        directory = 0;
+        while ((opt = next_option(&saveptr, "d", &optvalue)) != 0) {
+                if (opt != 'd') {
+                        fprintf(stderr, "rstat: usage: rstat path...\n"
+                                        "       rstat -d [dir]\n");
+                        return;
+                }
+                directory = 1;
+        }
+        if (directory) {
+                arg = strtok_r(NULL, "\n", &saveptr);
+                fprintf(ctrlfp, "rstat%s%s\n", arg == NULL ? "" : arg[0] == '-' ? " -- " : " ",
+                        arg != NULL ? arg : "");
+                fflush(ctrlfp);
+                queue_request("rstat", arg, NULL, ctrlfp, datafp);
+                return;
+        }
+        list = malloc(strlen(saveptr) + 1);
+        if (list == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        len = 0;
+        while ((arg = strtok_r(NULL, " \n", &saveptr)) != NULL) {
+                namelen = strlen(arg);
+                memcpy(list + len, arg, namelen);
+                list[len + namelen] = '\n';
+                len += namelen + 1;
+        }
+        if (len == 0) {
+                fprintf(stderr, "rstat: usage: rstat path...\n"
+                                "       rstat -d [dir]\n");
+                free(list);
                 return;
         }
-        nbytes = sb.st_size;
-        fprintf(ctrlfp, "put %s %u\n", arg, nbytes);
+        /* the server would not read the names while it is still sending an earlier reply */
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "rstat -b %zu\n", len);
         fflush(ctrlfp);
-        fcopy_from_to(fp, datafp, nbytes);
+        fwrite(list, sizeof(char), len, datafp);
         fflush(datafp);
-        fclose(fp);
-        fgets(buff, BUFF_SIZE, ctrlfp);
-        result = strtok_r(buff, " ",  &saveptr);
-        value = strtok_r(NULL, "\n", &saveptr);
-        if (strcmp(result, "succ:") == 0) {
-                nbytes = strtol(value, NULL, 10);
-                fcopy_from_to(datafp, stdout, nbytes);
+        free(list);
+        queue_request("rstat", NULL, NULL, ctrlfp, datafp);
+}
+
+/*
+ * Splits the file into nstripes ranges and fetches each of them over a
+ * session of its own in a child process, which writes its range into
+ * place with pwrite. Several TCP streams fill a long fat pipe where a
+ * single one cannot.
+ */
+static void
+execute_striped_get(const char *arg, int nstripes, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        char cwd[BUFF_SIZE];
+        char *value;
+        struct remote_file rf;
+        struct mux *m;
+        off_t size;
+        off_t stripe;
+        off_t offset;
+        pid_t pids[MAX_STRIPES];
+        FILE *stripe_ctrlfp;
+        FILE *stripe_datafp;
+        int status;
+        int failed;
+        int digest;
+        int fd;
+        int i;
+
+        switch (query_remote_file(arg, -1, ctrlfp, datafp, &rf, buff, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "get: %s: %s\n", arg, value);
+                return;
+        default:
+                fprintf(stderr, "get: %s: bad reply\n", arg);
                 return;
         }
-        if (strcmp(result, "fail:") == 0) {
-                fprintf(stderr, "put: %s: %s\n", arg, value);
+        size = rf.size;
+        add_job_progress(0, size);
+        digest = negotiate_digest(ctrlfp, datafp);
+        if (query_remote_cwd(cwd, ctrlfp, datafp) < 0) {
+                fprintf(stderr, "get: %s: cannot find the remote directory\n", arg);
+                return;
+        }
+        if (nstripes > MAX_STRIPES) {
+                nstripes = MAX_STRIPES;
+        }
+        if (size / nstripes < STRIPE_MIN) {
+                nstripes = size / STRIPE_MIN > 0 ? size / STRIPE_MIN : 1;
+        }
+        stripe = (size + nstripes - 1) / nstripes;
+        fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                return;
+        }
+        if (ftruncate(fd, size) < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                close(fd);
+                return;
+        }
+        failed = 0;
+        for (i = 0; i < nstripes; i++) {
+                pids[i] = -1;
+                offset = stripe * i;
+                if (offset >= size && i > 0) {
+                        break;
+                }
+                if (open_session_in(cwd, &stripe_ctrlfp, &stripe_datafp, &m) < 0) {
+                        fprintf(stderr, "get: %s: cannot open a stripe session\n", arg);
+                        failed = 1;
+                        break;
+                }
+                pids[i] = fork();
+                if (pids[i] == -1) {
+                        perror("fork");
+                        failed = 1;
+                }
+                if (pids[i] == 0) {
+                        _exit(fetch_stripe(arg, fd, offset,
+                                           offset + stripe > size ? size - offset : stripe, digest,
+                                           stripe_ctrlfp, stripe_datafp) < 0 ?
+                              EXIT_FAILURE : EXIT_SUCCESS);
+                }
+                fclose(stripe_ctrlfp);
+                fclose(stripe_datafp);
+        }
+        for (i = 0; i < nstripes; i++) {
+                if (pids[i] <= 0) {
+                        continue;
+                }
+                if (waitpid(pids[i], &status, 0) < 0 ||
+                    !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                        failed = 1;
+                }
+        }
+        if (close(fd) < 0) {
+                fprintf(stderr, "get: %s: %s\n", arg, strerror(errno));
+                return;
+        }
+        if (failed) {
+                fprintf(stderr, "get: %s: transfer incomplete\n", arg);
+        }
+}
+
+static int
+fetch_stripe(const char *arg, int fd, off_t offset, off_t length, int digest,
+             FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char *value;
+        char *buff;
+        uint32_t crc;
+        size_t chunk;
+        size_t n;
+
+        fprintf(ctrlfp, "get -o %lld -l %lld%s -- %s\n", (long long)offset, (long long)length,
+                digest ? " -k" : "", arg);
+        fflush(ctrlfp);
+        switch (read_reply(ctrlfp, reply, &value)) {
+        case 1:
+                break;
+        case 0:
+                fprintf(stderr, "get: %s: %s\n", arg, value);
+                return -1;
+        default:
+                fprintf(stderr, "get: %s: bad reply\n", arg);
+                return -1;
+        }
+        if (strtoll(value, NULL, 10) != length) {
+                fprintf(stderr, "get: %s: file changed during transfer\n", arg);
+                return -1;
+        }
+        buff = buffpool_get();
+        if (buff == NULL) {
+                return -1;
+        }
+        crc = 0;
+        while (length > 0) {
+                chunk = length < (off_t)buffpool_size() ? length : (off_t)buffpool_size();
+                n = fread(buff, sizeof(char), chunk, datafp);
+                if (n == 0 || pwrite(fd, buff, n, offset) != (ssize_t)n) {
+                        fprintf(stderr, "get: %s: %s\n", arg, n == 0 ? "connection lost" : strerror(errno));
+                        buffpool_put(buff);
+                        return -1;
+                }
+                crc = crc32c(crc, buff, n);
+                add_job_progress(n, 0);
+                offset += n;
+                length -= n;
+        }
+        buffpool_put(buff);
+        if (digest && receive_digest(datafp, crc) < 0) {
+                fprintf(stderr, "get: %s: checksum mismatch in a stripe\n", arg);
+                return -1;
+        }
+        fprintf(ctrlfp, "exit");
+        fflush(ctrlfp);
+        return 0;
+}
+
+/*
+ * Runs a get, put, mget or mput in the background: a worker process
+ * carries it out over a session of its own, opened in the same remote
+ * directory, while this one goes on taking commands.
+ */
+static void
+start_job(char *input, FILE *ctrlfp, FILE *datafp)
+{
+        char line[BUFF_SIZE];
+        char cwd[BUFF_SIZE];
+        const char *command;
+        char *saveptr;
+        struct job *j;
+        struct mux *m;
+        FILE *job_ctrlfp;
+        FILE *job_datafp;
+        int slot;
+
+        snprintf(line, BUFF_SIZE, "%s", input);
+        command = strtok_r(line, " \n", &saveptr);
+        if (command == NULL) {
+                return;
+        }
+        if (strcmp(command, "get") != 0 && strcmp(command, "put") != 0 &&
+            strcmp(command, "mget") != 0 && strcmp(command, "mput") != 0) {
+                fprintf(stderr, "%s: cannot run in the background\n", command);
+                return;
+        }
+        for (slot = 0; slot < MAX_JOBS && jobs[slot].pid != 0; slot++) {
+        }
+        if (slot == MAX_JOBS) {
+                fprintf(stderr, "%s: too many jobs; wait for one first\n", command);
+                return;
+        }
+        if (job_progress == NULL) {
+                job_progress = mmap(NULL, MAX_JOBS * sizeof(struct job_progress),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                if (job_progress == MAP_FAILED) {
+                        job_progress = NULL;
+                        perror("mmap");
+                        return;
+                }
+        }
+        if (query_remote_cwd(cwd, ctrlfp, datafp) < 0) {
+                fprintf(stderr, "%s: cannot find the remote directory\n", command);
+                return;
+        }
+        if (open_session_in(cwd, &job_ctrlfp, &job_datafp, &m) < 0) {
+                fprintf(stderr, "%s: cannot open a session for the job\n", command);
+                return;
+        }
+        j = &jobs[slot];
+        memset(&job_progress[slot], 0, sizeof(struct job_progress));
+        /* or the worker would print it again */
+        fflush(stdout);
+        j->pid = fork();
+        if (j->pid == 0) {
+                current_progress = &job_progress[slot];
+                run_job(input, m, job_ctrlfp, job_datafp);
+        }
+        fclose(job_ctrlfp);
+        fclose(job_datafp);
+        if (j->pid == -1) {
+                perror("fork");
+                j->pid = 0;
+                return;
+        }
+        /* in a group of its own, so that cancel reaches any stripes too */
+        setpgid(j->pid, j->pid);
+        j->id = ++lastjobid;
+        j->command = strndup(input, strcspn(input, "\n"));
+        if (j->command == NULL) {
+                perror("strndup");
+                exit(EXIT_FAILURE);
+        }
+        j->started = monotonic_now();
+        j->cancelled = 0;
+        printf("[%d] %s\n", j->id, j->command);
+}
+
+/* The worker's side of start_job; it does not return. */
+static void
+run_job(char *input, struct mux *m, FILE *ctrlfp, FILE *datafp)
+{
+        setpgid(0, 0);
+        /* the main session and its requests are the parent's */
+        session_mux = m;
+        firstrequest = 0;
+        nrequests = 0;
+        if (m == NULL) {
+                setvbuf(ctrlfp, NULL, _IONBF, 0);
+        }
+        execute_command(input, ctrlfp, datafp);
+        drain_requests(ctrlfp, datafp);
+        fprintf(ctrlfp, "exit");
+        fflush(ctrlfp);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Counts done more bytes moved by the job this worker runs, and total
+ * more that it has learnt it is to move; outside a worker it does
+ * nothing.
+ */
+static void
+add_job_progress(size_t done, size_t total)
+{
+        if (current_progress == NULL) {
+                return;
+        }
+        __atomic_add_fetch(&current_progress->done, done, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&current_progress->total, total, __ATOMIC_RELAXED);
+}
+
+/* Tells of the jobs that are over, waiting for them all unless WNOHANG. */
+static void
+reap_jobs(int options)
+{
+        int status;
+        int i;
+
+        for (i = 0; i < MAX_JOBS; i++) {
+                if (jobs[i].pid != 0 && waitpid(jobs[i].pid, &status, options) == jobs[i].pid) {
+                        finish_job(&jobs[i], status);
+                }
+        }
+}
+
+/* Tells how a job ended and frees its slot. */
+static void
+finish_job(struct job *j, int status)
+{
+        const char *how;
+
+        if (j->cancelled) {
+                how = "cancelled";
+        }
+        else if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+                how = "done";
+        }
+        else {
+                how = "failed";
+        }
+        printf("[%d] %s: %s\n", j->id, how, j->command);
+        free(j->command);
+        j->command = NULL;
+        j->pid = 0;
+}
+
+/* Shows each running job with how far it has got and how fast. */
+static void
+execute_jobs_command(char *saveptr)
+{
+        struct job_progress *jp;
+        uint64_t elapsed;
+        uint64_t done;
+        uint64_t total;
+        int i;
+
+        (void)saveptr;
+        reap_jobs(WNOHANG);
+        for (i = 0; i < MAX_JOBS; i++) {
+                if (jobs[i].pid == 0) {
+                        continue;
+                }
+                jp = &job_progress[i];
+                done = __atomic_load_n(&jp->done, __ATOMIC_RELAXED);
+                total = __atomic_load_n(&jp->total, __ATOMIC_RELAXED);
+                elapsed = monotonic_now() - jobs[i].started;
+                printf("[%d] %s: %llu", jobs[i].id, jobs[i].command, (unsigned long long)done);
+                /* what is yet to be asked for is not in the total */
+                if (total >= done && total > 0) {
+                        printf(" of %llu bytes (%d%%)", (unsigned long long)total,
+                               (int)(done * 100 / total));
+                }
+                else {
+                        printf(" bytes");
+                }
+                printf(", %.1f MB/s\n", elapsed > 0 ? (double)done / elapsed : 0.0);
+        }
+}
+
+/* Waits for one job, or with no argument for all of them. */
+static void
+execute_wait_command(char *saveptr)
+{
+        const char *arg;
+        struct job *j;
+        int status;
+
+        arg = strtok_r(NULL, " \n", &saveptr);
+        if (arg == NULL) {
+                reap_jobs(0);
+                return;
+        }
+        j = find_job(arg, "wait");
+        if (j != NULL && waitpid(j->pid, &status, 0) == j->pid) {
+                finish_job(j, status);
+        }
+}
+
+/*
+ * Stops a job where it is. What it has transferred stays, the file it
+ * was on only in part.
+ */
+static void
+execute_cancel_command(char *saveptr)
+{
+        const char *arg;
+        struct job *j;
+        int status;
+
+        arg = strtok_r(NULL, " \n", &saveptr);
+        if (arg == NULL) {
+                fprintf(stderr, "cancel: usage: cancel id\n");
                 return;
         }
+        j = find_job(arg, "cancel");
+        if (j == NULL) {
+                return;
+        }
+        if (kill(-j->pid, SIGTERM) < 0 && errno != ESRCH) {
+                fprintf(stderr, "cancel: %s: %s\n", arg, strerror(errno));
+                return;
+        }
+        j->cancelled = 1;
+        if (waitpid(j->pid, &status, 0) == j->pid) {
+                finish_job(j, status);
+        }
+}
+
+/* The running job numbered arg, with or without a '%'; NULL if none is. */
+static struct job *
+find_job(const char *arg, const char *command)
+{
+        int id;
+        int i;
+
+        id = strtol(arg[0] == '%' ? arg + 1 : arg, NULL, 10);
+        for (i = 0; i < MAX_JOBS; i++) {
+                if (jobs[i].pid != 0 && jobs[i].id == id) {
+                        return &jobs[i];
+                }
+        }
+        fprintf(stderr, "%s: %s: no such job\n", command, arg);
+        return NULL;
+}
+
+/* Microseconds on a clock that does not jump. */
+static uint64_t
+monotonic_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static void
@@ -1,65 +1,755 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <errno.h>
+#include "crc32c.h"
+#include "archive.h"
+#include "zstream.h"
+#include "delta.h"
+#include "sumcache.h"
+#include "dirlist.h"
+#include "uring.h"
+#include "buffpool.h"
+#include "stats.h"
+#include "shaper.h"
+#include "filecache.h"
+#include "upload.h"
+#include "sparse.h"
 
 #define BUFF_SIZE 1024
+#define SENDFILE_CHUNK (16 * 1024 * 1024)
+#define SPLICE_CHUNK (1024 * 1024)
+#define MAX_EVENTS 64
+#define MUX_HELLO "mux 1\n"
+#define PAIR_HELLO "pair 1\n"
+#define PAIR_TOKEN_SIZE 16
+/* how long a silent control connection may yet turn out to say hello */
+#define PAIR_SETTLE (200 * 1000)
+/* how long a token given out holds back pairing by address */
+#define PAIR_WAIT (5 * 1000 * 1000)
+#define MUX_HEADER_SIZE 9
+#define MUX_FRAME_MAX (64 * 1024)
+#define MUX_CTRL 'C'
+#define MUX_DATA 'D'
+#define RESUME_WINDOW (1024 * 1024)
+#define ARCHIVE_CHUNK (64 * 1024)
+#define RLS_PAGE 4096
+#define RLS_PAGE_MAX (64 * 1024)
+/* the size of a directory (st_size) still listed inside an epoll worker */
+#define LIST_INLINE_SIZE (64 * 1024)
+#define BULK_STEP (8 * 1024 * 1024)
 
-static int create_acceptable_socket(const char *port);
-static FILE *accept_from_client(int acceptfd);
-static void provide_service(FILE *ctrlfp, FILE *datafp);
+enum engine {
+        ENGINE_FORK,
+        ENGINE_EPOLL
+};
+
+enum watch_kind {
+        WATCH_LISTEN_CTRL,
+        WATCH_LISTEN_DATA,
+        WATCH_CTRL,
+        WATCH_DATA,
+        WATCH_HELPER,
+        WATCH_ORPHAN
+};
+
+struct watch {
+        enum watch_kind kind;
+        int fd;
+        int added;
+        unsigned int events;
+        struct session *session;
+};
+
+/*
+ * A transfer big enough to be let go of from the page cache as it goes,
+ * so that it does not push out what everyone else is reading. Pages
+ * written are started out to disk a step ahead of being dropped, as
+ * only clean pages can be. A zeroed one is not a bulk transfer.
+ */
+struct bulk {
+        int active;
+        int fd;
+        int writing;
+        off_t start;
+        off_t done;
+        off_t flushed;
+        off_t dropped;
+};
+
+/* a weight given with -W to the sessions of one client address */
+struct weight_rule {
+        char addr[INET6_ADDRSTRLEN];
+        unsigned weight;
+        struct weight_rule *next;
+};
+
+/* one client as seen by an event worker */
+struct session {
+        struct watch ctrlw;
+        struct watch dataw;
+        struct watch helperw;
+        char *helperbuff;
+        size_t helperlen;
+        size_t helpercap;
+        struct sockaddr_storage peer;
+        int cwdfd;
+        int eof;
+        int closed;
+        char inbuff[BUFF_SIZE];
+        size_t inlen;
+        char *ctrlout;
+        size_t ctrloutlen;
+        size_t ctrloutoff;
+        char *dataout;
+        size_t dataoutlen;
+        size_t dataoutoff;
+        int dataoutpooled;
+        int filefd;
+        size_t fileleft;
+        struct bulk bulk;
+        int receiving;
+        char *failreply;
+        int use_sendfile;
+        struct archive_writer *aw;
+        struct archive_reader *ar;
+        struct zstream_writer *zw;
+        struct zstream_reader *zr;
+        struct sparse_writer *sw;
+        struct sparse_reader *sr;
+        struct delta_writer *dw;
+        struct delta_reader *dr;
+        char *sig;
+        size_t siglen;
+        size_t siggot;
+        int signing;
+        int batch;
+        int statlist;
+        int digest;
+        off_t fileoffset;
+        size_t filesize;
+        uint32_t filecrc;
+        int crcknown;
+        struct stat filestat;
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        size_t trailerlen;
+        uint64_t accepted;
+        int statcmd;
+        uint64_t statstart;
+        struct stats_socket ctrlseen;
+        struct stats_socket dataseen;
+        struct shaper shaper;
+        uint64_t wakeat;
+        int throttled;
+        struct session *throttlenext;
+        char pairtoken[PAIR_TOKEN_SIZE + 1];
+        struct session *pairnext;
+        struct session *deadnext;
+};
+
+/*
+ * A connection still waiting for its partner. The token is the one a
+ * control connection was given or a data connection sent back; legacy
+ * is set once it is plain that none is coming.
+ */
+struct pending {
+        int fd;
+        struct sockaddr_storage peer;
+        int legacy;
+        char token[PAIR_TOKEN_SIZE + 1];
+        uint64_t accepted;
+        struct watch watch;
+        struct pending *next;
+};
+
+struct worker {
+        int epfd;
+        int basefd;
+        struct watch ctrlw;
+        struct watch dataw;
+        struct session *unpaired;
+        struct pending *orphans;
+        uint64_t pairat;
+        struct session *dead;
+        struct session *throttled;
+};
+
+/* one command's traffic inside a multiplexed session */
+struct mux_stream {
+        uint32_t id;
+        int incoming;
+        int fd;
+        struct bulk bulk;
+        char *buff;
+        size_t len;
+        size_t off;
+        size_t left;
+        int error;
+        char *failreply;
+        struct archive_writer *aw;
+        struct archive_reader *ar;
+        struct zstream_writer *zw;
+        struct zstream_reader *zr;
+        struct sparse_writer *sw;
+        struct sparse_reader *sr;
+        struct delta_writer *dw;
+        struct delta_reader *dr;
+        int signing;
+        int batch;
+        int statlist;
+        int digest;
+        uint32_t crc;
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        size_t trailerlen;
+        int statcmd;
+        uint64_t statstart;
+        struct mux_stream *next;
+};
+
+struct mux_session {
+        int fd;
+        int exiting;
+        char *inbuff;
+        size_t inlen;
+        char *outbuff;
+        size_t outlen;
+        size_t outoff;
+        size_t outcap;
+        struct mux_stream *streams;
+        /* the command being started, until a stream takes it over */
+        int statcmd;
+        uint64_t statstart;
+        struct stats_socket seen;
+        struct shaper shaper;
+        uint64_t wakeat;
+};
+
+static void run_fork_engine(const char *ctrlport, const char *dataport);
+static int create_acceptable_socket(const char *port, int reuseport);
+static void run_metrics_endpoint(const char *port);
+static void serve_metrics(int fd);
+static struct pending *accept_from_client(int acceptfd);
+static int greet_pending(struct pending *p);
+static int read_pair_token(struct pending *o);
+static int judge_partner(const struct pending *o, const struct sockaddr_storage *peer,
+                         const char *token, int legacy, uint64_t accepted, uint64_t now,
+                         uint64_t *wakep);
+static struct pending *take_partner(struct pending **list, const struct pending *o,
+                                    uint64_t now, uint64_t *wakep);
+static void append_pending(struct pending **list, struct pending *p);
+static int match_hello(const char *hello, const char *buff, size_t len);
+static int match_pair_token(const char *buff, size_t len, char *token);
+static ssize_t peek_input(int fd, char *buff, size_t size);
+static void new_pair_token(char *token);
+static void provide_service(FILE *ctrlfp, FILE *datafp, uint64_t accepted);
+static void leave_service(FILE *ctrlfp, FILE *datafp);
 static int fork_and_detach(void);
-static void fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes);
+static void close_inherited_fds(int keepfd1, int keepfd2);
+static size_t parse_size(const char *s);
+static void add_weight_rule(const char *rule);
+static unsigned peer_weight(const struct sockaddr_storage *peer);
+static unsigned socket_weight(int sockfd);
+static int wait_millis(uint64_t at);
+static void bulk_begin(struct bulk *b, int fd, off_t offset, size_t nbytes, int writing);
+static void bulk_advance(struct bulk *b, size_t nbytes);
+static void bulk_end(struct bulk *b);
+static int reopen_direct(int fd, int flags);
+static size_t sendfile_from_to(int fromfd, FILE *tofp, size_t nbytes, struct bulk *b,
+                               struct shaper *sh, uint32_t *crcp);
+static size_t fread_fd_to(int fromfd, FILE *tofp, size_t nbytes, struct shaper *sh,
+                          uint32_t *crcp);
+static int fzero_to(FILE *tofp, size_t nbytes);
+static int peer_gone(int err);
+static size_t splice_from_to(int fromfd, int tofd, size_t nbytes, struct bulk *b,
+                             struct shaper *sh, uint32_t *crcp);
+static size_t read_fd_to_fd(int fromfd, int tofd, size_t nbytes, struct shaper *sh,
+                            uint32_t *crcp);
+static int read_all(int fd, char *buff, size_t nbytes);
+static int write_all(int fd, const char *buff, size_t nbytes);
+static int next_option(char **saveptr, const char *optstring, char **value);
+static int prepare_get(char *saveptr, size_t *nbytesp, int *levelp, int *digestp, int *sparsep,
+                       char **copyp, char *reply);
+static char *read_into_cache(int fd, const struct stat *sb);
+static int prepare_put(char *saveptr, size_t *nbytesp, int *compressedp, int *sparsep, int *digestp,
+                       char *reply);
+static uint32_t digest_zeros(uint32_t crc, size_t nbytes);
+static void digest_behind(int fd, size_t nbytes, uint32_t *crcp);
+static int known_digest(int fd, off_t offset, size_t nbytes, struct stat *sb, uint32_t *crcp);
+static void remember_digest(int fd, const struct stat *sb, uint32_t crc);
+static void check_put_digest(const unsigned char *trailer, uint32_t crc, char *reply);
+static int verify_prefix(int fd, off_t offset, uint32_t crc);
+static int take_flag(char **saveptr, int flag);
+static struct archive_writer *open_archive_writer(char *saveptr, char *reply);
+static int prepare_batch_get(char *saveptr, size_t *listlenp, int *digestp, char *reply);
+static char *read_name_list(FILE *datafp, char *list, size_t listlen);
+static int prepare_stat_list(char *saveptr, size_t *listlenp, char *reply);
+static char *stat_names(int basefd, char *list, size_t listlen, const char *failreply,
+                        size_t *lenp, char *reply);
+static struct archive_writer *open_batch_writer(char *list, size_t listlen, const char *failreply,
+                                                char *reply);
+static struct archive_reader *open_archive_reader(void);
+static void close_archive_reader(struct archive_reader *ar, char *reply);
+static struct zstream_writer *open_zstream_writer(int fd, size_t nbytes, int level);
+static struct zstream_reader *open_zstream_reader(int fd, size_t nbytes);
+static struct sparse_writer *open_sparse_writer(int fd, size_t nbytes);
+static int close_zstream_reader(struct zstream_reader *zr, const char *failreply, char *reply);
+static struct sparse_reader *open_sparse_reader(int fd, size_t nbytes);
+static int close_sparse_reader(struct sparse_reader *sr, const char *failreply, char *reply);
+static void finish_put_file(int fd, int cut, char *reply);
+static int prepare_delta_get(char *saveptr, size_t *siglenp, char *reply);
+static struct delta_writer *open_delta_writer(int fd, const char *sig, size_t siglen,
+                                              const char *failreply, char *reply);
+static struct delta_reader *open_delta_reader(char *saveptr);
+static void close_delta_reader(struct delta_reader *dr, char *reply);
+
+/* event engine */
+static void run_event_engine(const char *ctrlport, const char *dataport, int nworkers);
+static int attach_reuseport_filter(int sockfd, int nworkers);
+static void run_event_worker(int acceptfd_ctrl, int acceptfd_data);
+static void watch_update(struct worker *w, struct watch *wt, unsigned int events);
+static void accept_ctrl_connections(struct worker *w);
+static void accept_data_connections(struct worker *w);
+static int same_peer_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+static void pair_session(struct worker *w, struct session *s, int datafd, uint64_t accepted);
+static void read_orphan(struct worker *w, struct watch *wt, unsigned int events);
+static void pair_orphans(struct worker *w);
+static void greet_session(struct session *s);
+static void close_session(struct worker *w, struct session *s);
+static void read_session_input(struct worker *w, struct session *s);
+static void advance_session(struct worker *w, struct session *s);
+static int flush_session(struct session *s);
+static int take_session_buffer(struct session *s);
+static void drop_session_dataout(struct session *s);
+static int next_session_line(struct session *s, char *line);
+static void execute_session_command(struct worker *w, struct session *s, char *line);
+static int runs_long(const char *command, char *saveptr);
+static void start_session_helper(struct worker *w, struct session *s, char *line);
+static void run_session_helper(char *line, int fd);
+static void read_session_helper(struct session *s);
+static void start_session_get(struct session *s, char *saveptr);
+static void start_session_put(struct session *s, char *saveptr);
+static void start_session_rstat(struct session *s, char *saveptr);
+static void receive_session_archive(struct session *s);
+static void receive_session_zstream(struct session *s);
+static void receive_session_sparse(struct session *s);
+static void receive_session_signature(struct session *s);
+static void receive_session_delta(struct session *s);
+static int receive_session_digest(struct session *s);
+static int queue_session_digest(struct session *s, uint32_t crc);
+static void append_session_reply(struct session *s, const char *buff, size_t len);
+static void hand_off_mux_session(struct worker *w, struct session *s);
+static int session_throttled(struct session *s);
+static void throttle_session(struct worker *w, struct session *s);
+static void wake_sessions(struct worker *w);
+
+/* multiplexed session */
+static void provide_mux_service(int sockfd, uint64_t accepted);
+static int handle_mux_frame(struct mux_session *m, int type, uint32_t id, char *payload, size_t len);
+static void execute_mux_command(struct mux_session *m, uint32_t id, char *line);
+static void start_mux_command(struct mux_session *m, uint32_t id, char *line);
+static void start_mux_get(struct mux_session *m, uint32_t id, char *saveptr);
+static void start_mux_put(struct mux_session *m, uint32_t id, char *saveptr);
+static void start_mux_rstat(struct mux_session *m, uint32_t id, char *saveptr);
+static void receive_mux_data(struct mux_session *m, uint32_t id, const char *payload, size_t len);
+static void receive_mux_signature(struct mux_session *m, struct mux_stream *ms,
+                                  const char *payload, size_t len);
+static int receive_mux_digest(struct mux_stream *ms, const char *payload, size_t len);
+static int append_mux_digest(struct mux_session *m, struct mux_stream *ms, uint32_t crc);
+static int fill_mux_output(struct mux_session *m);
+static int mux_throttled(struct mux_session *m);
+static char *reserve_mux_frame(struct mux_session *m, size_t len);
+static void append_mux_frame(struct mux_session *m, int type, uint32_t id, const char *payload, size_t len);
+static struct mux_stream *add_mux_stream(struct mux_session *m, uint32_t id);
+static void remove_mux_stream(struct mux_session *m, struct mux_stream *ms);
 
 /* grandchild */
 static void execute_command(char *input, FILE *ctrlfp, FILE *datafp);
 static void execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static size_t find_cursor(const struct dirlist *listing, uint64_t start, size_t index);
+static size_t *sort_listing(const struct dirlist *listing);
+static int compare_names(const void *a, const void *b, void *listing);
 static void execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
 static void execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rsize_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rsum_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rstat_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static char *stat_directory(const char *dirname, size_t *lenp, char *reply);
+static void print_stat(FILE *fp, int dirfd, const char *name, const char *shown);
+static void execute_rcp_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_rmv_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static off_t copy_by_name(const char *from, const char *to, const char **howp);
+static off_t copy_whole_file(int fromfd, int tofd, const char **howp);
+static void execute_feat_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_stats_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_sig_command(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_get_archive(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_put_archive(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_put_zstream(int fd, size_t nbytes, int digest, const char *failreply,
+                                FILE *ctrlfp, FILE *datafp);
+static void execute_put_sparse(int fd, size_t nbytes, int digest, const char *failreply,
+                               FILE *ctrlfp, FILE *datafp);
+static void execute_get_delta(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_get_batch(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static void execute_put_delta(char *saveptr, FILE *ctrlfp, FILE *datafp);
+static struct uring *transfer_ring(void);
+static struct shaper *transfer_shaper(void);
+
+/* whether get and put go through io_uring rather than sendfile and splice */
+static int use_uring;
+
+/* the ring of this process, once it has needed one */
+static struct uring *session_ring;
+
+/* the size from which get and put keep out of the page cache; 0 for never */
+static size_t bulk_threshold;
+
+/* when the command a session process is executing came in */
+static uint64_t command_start;
+
+/* what the connections of a session process had moved when last looked at */
+static struct stats_socket ctrlseen;
+static struct stats_socket dataseen;
+
+/* the bandwidth limits of a session process */
+static struct shaper session_shaper;
+
+/* the weights given with -W */
+static struct weight_rule *weight_rules;
 
 int
 main(int argc, char **argv)
 {
-        int acceptfd_ctrl;
-        int acceptfd_data;
-        FILE *ctrlfp;
-        FILE *datafp;
-        
-        if (argc != 3) {
-                fprintf(stderr, "usage: mftpd ctrlport dataport\n");
+        enum engine engine;
+        const char *metricsport;
+        size_t sessionrate;
+        size_t serverrate;
+        size_t cachesize;
+        size_t ndirs;
+        int fair;
+        int nworkers;
+        int opt;
+
+        engine = ENGINE_FORK;
+        metricsport = NULL;
+        sessionrate = 0;
+        serverrate = 0;
+        fair = 0;
+        cachesize = FILECACHE_SIZE;
+        ndirs = 0;
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        while ((opt = getopt(argc, argv, "e:w:l:i:b:D:p:r:R:fW:c:s:")) != -1) {
+                switch (opt) {
+                case 'e':
+                        if (strcmp(optarg, "fork") == 0) {
+                                engine = ENGINE_FORK;
+                        }
+                        else if (strcmp(optarg, "epoll") == 0) {
+                                engine = ENGINE_EPOLL;
+                        }
+                        else {
+                                fprintf(stderr, "mftpd: %s: unknown engine\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'w':
+                        nworkers = strtol(optarg, NULL, 10);
+                        break;
+                case 'l':
+                        ndirs = strtol(optarg, NULL, 10) > 0 ? strtol(optarg, NULL, 10) : 0;
+                        break;
+                case 'i':
+                        if (strcmp(optarg, "uring") == 0) {
+                                use_uring = 1;
+                        }
+                        else if (strcmp(optarg, "splice") == 0) {
+                                use_uring = 0;
+                        }
+                        else {
+                                fprintf(stderr, "mftpd: %s: unknown I/O method\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'b':
+                        buffpool_init(parse_size(optarg));
+                        break;
+                case 'D':
+                        bulk_threshold = parse_size(optarg);
+                        break;
+                case 'p':
+                        metricsport = optarg;
+                        break;
+                case 'r':
+                        sessionrate = parse_size(optarg);
+                        break;
+                case 'R':
+                        serverrate = parse_size(optarg);
+                        break;
+                case 'f':
+                        fair = 1;
+                        break;
+                case 'W':
+                        add_weight_rule(optarg);
+                        break;
+                case 'c':
+                        cachesize = parse_size(optarg);
+                        break;
+                case 's':
+                        if (upload_set_sync(optarg) < 0) {
+                                fprintf(stderr, "mftpd: %s: unknown sync policy\n", optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                default:
+                        argc = 0;
+                        break;
+                }
+        }
+        if (argc - optind != 2) {
+                fprintf(stderr, "usage: mftpd [-e fork|epoll] [-w workers] [-l dirs] [-i splice|uring]"
+                                " [-b buffsize] [-D bulksize] [-p metricsport]"
+                                " [-r sessionrate] [-R serverrate] [-f] [-W addr=weight] [-c cachesize]"
+                                " [-s none|close|periodic] ctrlport dataport\n");
                 exit(EXIT_FAILURE);
         }
-        acceptfd_ctrl = create_acceptable_socket(argv[1]);
-        acceptfd_data = create_acceptable_socket(argv[2]);
-        for (;;) {
-                ctrlfp = accept_from_client(acceptfd_ctrl);
-                datafp = accept_from_client(acceptfd_data);
-                provide_service(ctrlfp, datafp);
+        if (nworkers < 1) {
+                nworkers = 1;
         }
-        if (close(acceptfd_ctrl) < 0) {
-                perror("close");
+        if ((fair || weight_rules != NULL) && serverrate == 0) {
+                fprintf(stderr, "mftpd: fair share (-f, -W) needs a server rate (-R)\n");
                 exit(EXIT_FAILURE);
         }
-        if (close(acceptfd_data) < 0) {
-                perror("close");
-                exit(EXIT_FAILURE);
+        if (use_uring && uring_probe() < 0) {
+                fprintf(stderr, "mftpd: io_uring is not available; using sendfile and splice\n");
+                use_uring = 0;
+        }
+        if (sumcache_open(SUMCACHE_ENTRIES) < 0) {
+                perror("mmap");
+                fprintf(stderr, "mftpd: checksums will not be cached\n");
+        }
+        if (cachesize > 0 && filecache_open(cachesize) < 0) {
+                perror("mmap");
+                fprintf(stderr, "mftpd: small files will not be cached\n");
+        }
+        if (ndirs > 0 && dircache_open(ndirs) < 0) {
+                perror("mmap");
+                fprintf(stderr, "mftpd: directory listings will not be cached\n");
         }
+        if (stats_open() < 0) {
+                perror("mmap");
+                fprintf(stderr, "mftpd: statistics will not be kept\n");
+        }
+        else if (metricsport != NULL) {
+                run_metrics_endpoint(metricsport);
+        }
+        if (shaper_open(sessionrate, serverrate, fair || weight_rules != NULL) < 0) {
+                perror("mmap");
+                fprintf(stderr, "mftpd: only the session rate will hold\n");
+        }
+        if (engine == ENGINE_EPOLL) {
+                run_event_engine(argv[optind], argv[optind + 1], nworkers);
+                return EXIT_SUCCESS;
+        }
+        run_fork_engine(argv[optind], argv[optind + 1]);
         return EXIT_SUCCESS;
 }
 
+/*
+ * Accepts on both ports and pairs each data connection with the control
+ * connection it belongs to, see take_partner. A control connection that
+ * opens with MUX_HELLO carries its data itself and is served on its own.
+ */
+static void
+run_fork_engine(const char *ctrlport, const char *dataport)
+{
+        int acceptfd_ctrl;
+        int acceptfd_data;
+        struct pending *waiting;
+        struct pending *orphans;
+        struct pending *p;
+        struct pending *ctrl;
+        struct pending **pp;
+        struct pollfd *fds;
+        size_t nfds;
+        size_t maxfds;
+        char hello[sizeof(MUX_HELLO)];
+        FILE *ctrlfp;
+        FILE *datafp;
+        uint64_t accepted;
+        uint64_t wakeat;
+
+        acceptfd_ctrl = create_acceptable_socket(ctrlport, 0);
+        acceptfd_data = create_acceptable_socket(dataport, 0);
+        waiting = NULL;
+        orphans = NULL;
+        fds = NULL;
+        maxfds = 0;
+        wakeat = 0;
+        for (;;) {
+                nfds = 2;
+                for (p = waiting; p != NULL; p = p->next) {
+                        nfds++;
+                }
+                for (p = orphans; p != NULL; p = p->next) {
+                        nfds++;
+                }
+                if (nfds > maxfds) {
+                        maxfds = nfds * 2;
+                        fds = realloc(fds, sizeof(struct pollfd) * maxfds);
+                        if (fds == NULL) {
+                                perror("realloc");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                fds[0].fd = acceptfd_ctrl;
+                fds[0].events = POLLIN;
+                fds[1].fd = acceptfd_data;
+                fds[1].events = POLLIN;
+                nfds = 2;
+                for (p = waiting; p != NULL; p = p->next) {
+                        fds[nfds].fd = p->fd;
+                        /* past the hello a client may type ahead; only watch for it leaving */
+                        fds[nfds].events = (p->legacy || p->token[0] != '\0') ? POLLRDHUP : POLLIN;
+                        nfds++;
+                }
+                for (p = orphans; p != NULL; p = p->next) {
+                        fds[nfds].fd = p->fd;
+                        fds[nfds].events = p->legacy ? POLLRDHUP : POLLIN;
+                        nfds++;
+                }
+                if (poll(fds, nfds, wakeat != 0 ? wait_millis(wakeat) : -1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("poll");
+                        exit(EXIT_FAILURE);
+                }
+                nfds = 2;
+                for (p = waiting; p != NULL; p = p->next, nfds++) {
+                        if ((p->legacy || p->token[0] != '\0') &&
+                            (fds[nfds].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                                /* the client left before its data connection arrived */
+                                close(p->fd);
+                                p->fd = -1;
+                        }
+                }
+                for (p = orphans; p != NULL; p = p->next, nfds++) {
+                        if (p->legacy && (fds[nfds].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                                close(p->fd);
+                                p->fd = -1;
+                        }
+                }
+                /* classify the waiting connections first */
+                pp = &waiting;
+                while (*pp != NULL) {
+                        p = *pp;
+                        switch (p->fd < 0 ? -1 : greet_pending(p)) {
+                        case 1:
+                                *pp = p->next;
+                                recv(p->fd, hello, strlen(MUX_HELLO), MSG_WAITALL);
+                                if (fork_and_detach() == 0) {
+                                        close_inherited_fds(p->fd, -1);
+                                        provide_mux_service(p->fd, p->accepted);
+                                        _exit(EXIT_SUCCESS);
+                                }
+                                close(p->fd);
+                                free(p);
+                                continue;
+                        case -1:
+                                *pp = p->next;
+                                if (p->fd >= 0) {
+                                        close(p->fd);
+                                }
+                                free(p);
+                                continue;
+                        }
+                        pp = &p->next;
+                }
+                pp = &orphans;
+                while (*pp != NULL) {
+                        p = *pp;
+                        if (p->fd < 0 || read_pair_token(p) < 0) {
+                                *pp = p->next;
+                                if (p->fd >= 0) {
+                                        close(p->fd);
+                                }
+                                free(p);
+                                continue;
+                        }
+                        pp = &p->next;
+                }
+                if (fds[0].revents & POLLIN) {
+                        p = accept_from_client(acceptfd_ctrl);
+                        if (p != NULL) {
+                                append_pending(&waiting, p);
+                        }
+                }
+                if (fds[1].revents & POLLIN) {
+                        p = accept_from_client(acceptfd_data);
+                        if (p != NULL) {
+                                append_pending(&orphans, p);
+                        }
+                }
+                wakeat = 0;
+                pp = &orphans;
+                while (*pp != NULL) {
+                        p = *pp;
+                        ctrl = take_partner(&waiting, p, stats_now(), &wakeat);
+                        if (ctrl == NULL && p->token[0] == '\0') {
+                                pp = &p->next;
+                                continue;
+                        }
+                        *pp = p->next;
+                        if (ctrl == NULL) {
+                                /* its control connection is gone */
+                                close(p->fd);
+                                free(p);
+                                continue;
+                        }
+                        ctrlfp = fdopen(ctrl->fd, "r+");
+                        datafp = fdopen(p->fd, "r+");
+                        if (ctrlfp == NULL || datafp == NULL) {
+                                perror("fdopen");
+                                exit(EXIT_FAILURE);
+                        }
+                        /* what does go through stdio goes in whole buffers */
+                        setvbuf(datafp, NULL, _IOFBF, buffpool_size());
+                        accepted = ctrl->accepted > p->accepted ? ctrl->accepted : p->accepted;
+                        free(ctrl);
+                        free(p);
+                        provide_service(ctrlfp, datafp, accepted);
+                }
+        }
+}
+
 static int
-create_acceptable_socket(const char *port)
+create_acceptable_socket(const char *port, int reuseport)
 {
         struct addrinfo hints;
         struct addrinfo *result;
@@ -83,6 +773,11 @@ create_acceptable_socket(const char *port)
         for (res = result; res != NULL; res = res->ai_next) {
                 sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
                 if (sockfd != -1) {
+                        if (reuseport &&
+                            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) < 0) {
+                                perror("setsockopt");
+                                exit(EXIT_FAILURE);
+                        }
                         if (bind(sockfd, res->ai_addr, res->ai_addrlen) != -1) {
                                 break;
                         }
@@ -104,43 +799,438 @@ create_acceptable_socket(const char *port)
         return sockfd;
 }
 
-static FILE *
+/*
+ * Forks a process that answers HTTP requests on the loopback address at
+ * port with the numbers in the Prometheus text format. It goes away
+ * together with the server.
+ */
+static void
+run_metrics_endpoint(const char *port)
+{
+        struct sockaddr_in addr;
+        int sockfd;
+        int fd;
+        int one;
+        pid_t pid;
+
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+                perror("socket");
+                exit(EXIT_FAILURE);
+        }
+        /* the endpoint closes first, leaving its connections in TIME_WAIT */
+        one = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(strtol(port, NULL, 10));
+        if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                fprintf(stderr, "%s: failed to bind\n", port);
+                exit(EXIT_FAILURE);
+        }
+        if (listen(sockfd, SOMAXCONN) < 0) {
+                perror("listen");
+                exit(EXIT_FAILURE);
+        }
+        pid = fork();
+        if (pid == -1) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid != 0) {
+                close(sockfd);
+                return;
+        }
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGPIPE, SIG_IGN);
+        for (;;) {
+                fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+                        perror("accept");
+                        _exit(EXIT_FAILURE);
+                }
+                serve_metrics(fd);
+                close(fd);
+        }
+}
+
+/*
+ * Reads a request up to its blank line and answers a GET of / or
+ * /metrics; a client gets a second for every read and write.
+ */
+static void
+serve_metrics(int fd)
+{
+        char request[BUFF_SIZE];
+        char header[BUFF_SIZE];
+        struct pollfd pfd;
+        struct timeval tv;
+        size_t len;
+        ssize_t n;
+        char *text;
+        size_t nbytes;
+        int hlen;
+
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        len = 0;
+        for (;;) {
+                request[len] = '\0';
+                if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL ||
+                    len == BUFF_SIZE - 1) {
+                        break;
+                }
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, 1000) <= 0) {
+                        return;
+                }
+                n = read(fd, request + len, BUFF_SIZE - 1 - len);
+                if (n <= 0) {
+                        return;
+                }
+                len += n;
+        }
+        if (strncmp(request, "GET / ", strlen("GET / ")) != 0 &&
+            strncmp(request, "GET /metrics ", strlen("GET /metrics ")) != 0) {
+                hlen = snprintf(header, BUFF_SIZE, "HTTP/1.0 404 Not Found\r\n"
+                                "Content-Length: 0\r\n\r\n");
+                write_all(fd, header, hlen);
+                return;
+        }
+        text = stats_prometheus(&nbytes);
+        if (text == NULL) {
+                return;
+        }
+        hlen = snprintf(header, BUFF_SIZE, "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n\r\n", nbytes);
+        if (write_all(fd, header, hlen) == 0) {
+                write_all(fd, text, nbytes);
+        }
+        free(text);
+}
+
+static struct pending *
 accept_from_client(int acceptfd)
 {
-        int clientfd;
-        FILE *clientfp;
-        
-        clientfd = accept(acceptfd, NULL, NULL);
-        if (clientfd < 0) {
+        struct pending *p;
+        socklen_t peerlen;
+
+        p = malloc(sizeof(struct pending));
+        if (p == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        peerlen = sizeof(p->peer);
+        p->fd = accept4(acceptfd, (struct sockaddr *)&p->peer, &peerlen, SOCK_CLOEXEC);
+        if (p->fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                        free(p);
+                        return NULL;
+                }
                 perror("accept");
                 exit(EXIT_FAILURE);
         }
-        clientfp = fdopen(clientfd, "r+");
-        if (clientfp == NULL) {
-                perror("fdopen");
+        p->legacy = 0;
+        p->token[0] = '\0';
+        p->accepted = stats_now();
+        p->watch.kind = WATCH_ORPHAN;
+        p->watch.fd = p->fd;
+        p->watch.added = 0;
+        p->watch.events = 0;
+        p->watch.session = NULL;
+        p->next = NULL;
+        return p;
+}
+
+/*
+ * Sees what a waiting control connection has said so far. Answers a
+ * PAIR_HELLO with a fresh token and sets legacy once the connection
+ * has said anything else. Returns 1 for a full MUX_HELLO, -1 if the
+ * connection is gone and 0 otherwise.
+ */
+static int
+greet_pending(struct pending *p)
+{
+        char buff[sizeof(PAIR_HELLO)];
+        char reply[BUFF_SIZE];
+        ssize_t n;
+
+        if (p->legacy || p->token[0] != '\0') {
+                return 0;
+        }
+        n = peek_input(p->fd, buff, strlen(PAIR_HELLO));
+        if (n < 0) {
+                return -1;
+        }
+        if (match_hello(MUX_HELLO, buff, n) == 1) {
+                return 1;
+        }
+        if (match_hello(PAIR_HELLO, buff, n) == 1) {
+                recv(p->fd, buff, strlen(PAIR_HELLO), MSG_WAITALL);
+                new_pair_token(p->token);
+                snprintf(reply, BUFF_SIZE, "succ: %s\n", p->token);
+                return send(p->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0 ? -1 : 0;
+        }
+        if (match_hello(MUX_HELLO, buff, n) < 0 && match_hello(PAIR_HELLO, buff, n) < 0) {
+                p->legacy = 1;
+        }
+        return 0;
+}
+
+/*
+ * Takes the token a waiting data connection sends back, if it has come
+ * in whole, and sets legacy once the connection has sent anything else.
+ * Returns -1 if the connection is gone and 0 otherwise.
+ */
+static int
+read_pair_token(struct pending *o)
+{
+        char buff[sizeof("pair \n") + PAIR_TOKEN_SIZE];
+        ssize_t n;
+
+        if (o->legacy || o->token[0] != '\0') {
+                return 0;
+        }
+        n = peek_input(o->fd, buff, sizeof(buff) - 1);
+        if (n < 0) {
+                return -1;
+        }
+        switch (match_pair_token(buff, n, o->token)) {
+        case 1:
+                recv(o->fd, buff, sizeof(buff) - 1, MSG_WAITALL);
+                break;
+        case -1:
+                o->legacy = 1;
+                break;
+        }
+        return 0;
+}
+
+/*
+ * Tells how the waiting data connection o stands to a waiting control
+ * connection with the given peer, token, legacy flag and accept time: 1
+ * if o may go with it, 0 if not, and -1 if o has to wait, with *wakep
+ * lowered to when it need not any longer.
+ *
+ * A data connection that sent a token goes with the control connection
+ * that was given it. One that did not goes by address, but not while a
+ * control connection from there is young enough to be still on its way
+ * to a token: a new client's data connection is silent until then.
+ */
+static int
+judge_partner(const struct pending *o, const struct sockaddr_storage *peer,
+              const char *token, int legacy, uint64_t accepted, uint64_t now,
+              uint64_t *wakep)
+{
+        uint64_t until;
+
+        if (o->token[0] != '\0') {
+                return strcmp(token, o->token) == 0;
+        }
+        if (!same_peer_address(peer, &o->peer)) {
+                return 0;
+        }
+        until = 0;
+        if (token[0] != '\0' && !o->legacy) {
+                until = accepted + PAIR_WAIT;
+        }
+        else if (token[0] == '\0' && !legacy) {
+                until = accepted + PAIR_SETTLE;
+        }
+        if (until > now) {
+                if (*wakep == 0 || until < *wakep) {
+                        *wakep = until;
+                }
+                return -1;
+        }
+        return token[0] == '\0';
+}
+
+/*
+ * Removes and returns the control connection in list that the data
+ * connection o goes with, the oldest if several may, or NULL if there
+ * is none yet; see judge_partner.
+ */
+static struct pending *
+take_partner(struct pending **list, const struct pending *o, uint64_t now, uint64_t *wakep)
+{
+        struct pending **match;
+        struct pending *p;
+        int verdict;
+
+        match = NULL;
+        for (; *list != NULL; list = &(*list)->next) {
+                p = *list;
+                verdict = judge_partner(o, &p->peer, p->token, p->legacy, p->accepted, now, wakep);
+                if (verdict < 0) {
+                        return NULL;
+                }
+                if (verdict > 0 && match == NULL) {
+                        match = list;
+                }
+        }
+        if (match == NULL) {
+                return NULL;
+        }
+        p = *match;
+        *match = p->next;
+        p->next = NULL;
+        return p;
+}
+
+static void
+append_pending(struct pending **list, struct pending *p)
+{
+        while (*list != NULL) {
+                list = &(*list)->next;
+        }
+        *list = p;
+}
+
+/* Returns 1 for a full hello, 0 for a prefix of it and -1 otherwise. */
+static int
+match_hello(const char *hello, const char *buff, size_t len)
+{
+        size_t hellolen;
+
+        hellolen = strlen(hello);
+        if (len > hellolen) {
+                len = hellolen;
+        }
+        if (memcmp(buff, hello, len) != 0) {
+                return -1;
+        }
+        return len == hellolen;
+}
+
+/*
+ * Like match_hello for the line a data connection sends back its token
+ * in, "pair " and the token, which is copied to token once it is whole.
+ */
+static int
+match_pair_token(const char *buff, size_t len, char *token)
+{
+        size_t linelen;
+        size_t i;
+        int bad;
+
+        linelen = strlen("pair \n") + PAIR_TOKEN_SIZE;
+        for (i = 0; i < len && i < linelen; i++) {
+                if (i < 5) {
+                        bad = buff[i] != "pair "[i];
+                }
+                else if (i < 5 + PAIR_TOKEN_SIZE) {
+                        bad = !isxdigit((unsigned char)buff[i]);
+                }
+                else {
+                        bad = buff[i] != '\n';
+                }
+                if (bad) {
+                        return -1;
+                }
+        }
+        if (i < linelen) {
+                return 0;
+        }
+        memcpy(token, buff + 5, PAIR_TOKEN_SIZE);
+        token[PAIR_TOKEN_SIZE] = '\0';
+        return 1;
+}
+
+/*
+ * Peeks at up to size bytes a connection has sent without waiting for
+ * them. Returns how many there are, or -1 if the connection is gone.
+ */
+static ssize_t
+peek_input(int fd, char *buff, size_t size)
+{
+        ssize_t n;
+
+        n = recv(fd, buff, size, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0) {
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+        if (n == 0) {
+                return -1;
+        }
+        return n;
+}
+
+/* Makes a token no other client can guess, PAIR_TOKEN_SIZE hex digits. */
+static void
+new_pair_token(char *token)
+{
+        unsigned char bytes[PAIR_TOKEN_SIZE / 2];
+        size_t i;
+
+        if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes)) {
+                perror("getrandom");
                 exit(EXIT_FAILURE);
         }
-        return clientfp;       
+        for (i = 0; i < sizeof(bytes); i++) {
+                snprintf(token + 2 * i, 3, "%02x", bytes[i]);
+        }
 }
 
 static void
-provide_service(FILE *ctrlfp, FILE *datafp)
+provide_service(FILE *ctrlfp, FILE *datafp, uint64_t accepted)
 {
         char buff[BUFF_SIZE];
+        FILE *inputfp;
+        int command;
         
         if (fork_and_detach() != 0) {
                 /* parent */
+                fclose(ctrlfp);
+                fclose(datafp);
                 return;
         }
         /* grandchild */
+        close_inherited_fds(fileno(ctrlfp), fileno(datafp));
+        /*
+         * Commands are read through a stream of their own: a client may
+         * send several before reading the replies, and ctrlfp would
+         * drop what it has read ahead as soon as a reply is written.
+         */
+        inputfp = fdopen(dup(fileno(ctrlfp)), "r");
+        if (inputfp == NULL) {
+                _exit(EXIT_FAILURE);
+        }
+        shaper_init(&session_shaper, socket_weight(fileno(ctrlfp)));
+        stats_session_start(accepted);
         for (;;) {
-                if (fgets(buff, BUFF_SIZE, ctrlfp) == NULL) {
+                if (fgets(buff, BUFF_SIZE, inputfp) == NULL) {
                         break;
                 }
+                command_start = stats_now();
+                command = stats_command(buff);
                 execute_command(buff, ctrlfp, datafp);
+                stats_command_done(command, command_start);
+                stats_socket(fileno(ctrlfp), &ctrlseen);
+                stats_socket(fileno(datafp), &dataseen);
         }
+        fclose(inputfp);
+        leave_service(ctrlfp, datafp);
+}
+
+/* Ends a session process, counting what its connections moved last. */
+static void
+leave_service(FILE *ctrlfp, FILE *datafp)
+{
+        stats_socket(fileno(ctrlfp), &ctrlseen);
+        stats_socket(fileno(datafp), &dataseen);
+        stats_session_end();
+        shaper_release(&session_shaper);
         fclose(ctrlfp);
         fclose(datafp);
+        _exit(EXIT_SUCCESS);
 }
 
 static int
@@ -172,217 +1262,5597 @@ fork_and_detach(void)
         return 0;
 }
 
+/*
+ * Keeps a session process from holding on to the listening sockets and
+ * the connections of other clients.
+ */
 static void
-fcopy_from_to(FILE *fromfp, FILE *tofp, size_t nbytes)
+close_inherited_fds(int keepfd1, int keepfd2)
 {
-        char buff[BUFF_SIZE];
-        
-        while (nbytes > BUFF_SIZE) {
-                fread(buff, sizeof(char), BUFF_SIZE, fromfp);
-                fwrite(buff, sizeof(char), BUFF_SIZE, tofp);
-                nbytes -= BUFF_SIZE;
-        }
-        fread(buff, sizeof(char), nbytes, fromfp);
-        fwrite(buff, sizeof(char), nbytes, tofp);
-}
+        DIR *dir;
+        struct dirent *dent;
+        int fd;
+        int maxfd;
 
-static void
-execute_command(char *input, FILE *ctrlfp, FILE *datafp)
-{
-        const char *command;
-        char *saveptr;
-        
-        command = strtok_r(input, " \r\n", &saveptr);
-        if (command == NULL) {
+        dir = opendir("/proc/self/fd");
+        if (dir == NULL) {
+                maxfd = sysconf(_SC_OPEN_MAX);
+                for (fd = STDERR_FILENO + 1; fd < maxfd; fd++) {
+                        if (fd != keepfd1 && fd != keepfd2) {
+                                close(fd);
+                        }
+                }
                 return;
         }
-        if (strcmp(command, "exit") == 0) {
-                execute_exit_command(saveptr, ctrlfp, datafp);
-                return;
+        while ((dent = readdir(dir)) != NULL) {
+                fd = strtol(dent->d_name, NULL, 10);
+                if (fd > STDERR_FILENO && fd != keepfd1 && fd != keepfd2 && fd != dirfd(dir)) {
+                        close(fd);
+                }
         }
-        if (strcmp(command, "echo") == 0) {
-                execute_echo_command(saveptr, ctrlfp, datafp);
-                return;
+        closedir(dir);
+}
+
+/*
+ * The ring this process moves get and put data through, set up the
+ * first time one is needed; NULL if they go by sendfile and splice.
+ * A ring runs a transfer through to its end, so shaped ones do not
+ * use it.
+ */
+static struct uring *
+transfer_ring(void)
+{
+        if (shaper_enabled()) {
+                return NULL;
         }
-        if (strcmp(command, "rls") == 0) {
-                execute_rls_command(saveptr, ctrlfp, datafp);
-                return;
+        if (use_uring && session_ring == NULL) {
+                session_ring = uring_open();
         }
-        if (strcmp(command, "rcd") == 0) {
-                execute_rcd_command(saveptr, ctrlfp, datafp);
-                return;
+        if (session_ring == NULL || session_ring->fd < 0) {
+                use_uring = 0;
+                return NULL;
+        }
+        return session_ring;
+}
+
+/* The limits a session process moves file data under; NULL for none. */
+static struct shaper *
+transfer_shaper(void)
+{
+        return shaper_enabled() ? &session_shaper : NULL;
+}
+
+/* A size on the command line, with an optional k, m or g after it. */
+static size_t
+parse_size(const char *s)
+{
+        unsigned long long size;
+        char *end;
+
+        size = strtoull(s, &end, 10);
+        switch (*end) {
+        case 'g':
+        case 'G':
+                size *= 1024;
+                /* fall through */
+        case 'm':
+        case 'M':
+                size *= 1024;
+                /* fall through */
+        case 'k':
+        case 'K':
+                size *= 1024;
+                break;
+        }
+        return size;
+}
+
+/* Takes "addr=weight" for -W. */
+static void
+add_weight_rule(const char *rule)
+{
+        struct weight_rule *wr;
+        unsigned char buff[sizeof(struct in6_addr)];
+        const char *eq;
+        char addr[INET6_ADDRSTRLEN];
+        int family;
+
+        eq = strrchr(rule, '=');
+        if (eq == NULL || eq - rule >= INET6_ADDRSTRLEN || strtol(eq + 1, NULL, 10) < 1) {
+                fprintf(stderr, "mftpd: %s: expected addr=weight\n", rule);
+                exit(EXIT_FAILURE);
+        }
+        memcpy(addr, rule, eq - rule);
+        addr[eq - rule] = '\0';
+        family = strchr(addr, ':') != NULL ? AF_INET6 : AF_INET;
+        wr = malloc(sizeof(struct weight_rule));
+        if (wr == NULL || inet_pton(family, addr, buff) != 1) {
+                fprintf(stderr, "mftpd: %s: not an address\n", addr);
+                exit(EXIT_FAILURE);
+        }
+        /* written the way inet_ntop writes peers, for peer_weight to compare */
+        inet_ntop(family, buff, wr->addr, INET6_ADDRSTRLEN);
+        wr->weight = strtol(eq + 1, NULL, 10);
+        wr->next = weight_rules;
+        weight_rules = wr;
+}
+
+/* The weight -W gave the address of peer, 1 if none. */
+static unsigned
+peer_weight(const struct sockaddr_storage *peer)
+{
+        const struct sockaddr_in6 *sin6;
+        struct weight_rule *wr;
+        char addr[INET6_ADDRSTRLEN];
+
+        if (weight_rules == NULL) {
+                return 1;
+        }
+        if (peer->ss_family == AF_INET) {
+                inet_ntop(AF_INET, &((const struct sockaddr_in *)peer)->sin_addr, addr, INET6_ADDRSTRLEN);
+        }
+        else if (peer->ss_family == AF_INET6) {
+                sin6 = (const struct sockaddr_in6 *)peer;
+                if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+                        /* a v4 client of a dual-stack socket */
+                        inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], addr, INET6_ADDRSTRLEN);
+                }
+                else {
+                        inet_ntop(AF_INET6, &sin6->sin6_addr, addr, INET6_ADDRSTRLEN);
+                }
+        }
+        else {
+                return 1;
+        }
+        for (wr = weight_rules; wr != NULL; wr = wr->next) {
+                if (strcmp(wr->addr, addr) == 0) {
+                        return wr->weight;
+                }
+        }
+        return 1;
+}
+
+static unsigned
+socket_weight(int sockfd)
+{
+        struct sockaddr_storage peer;
+        socklen_t peerlen;
+
+        peerlen = sizeof(peer);
+        if (getpeername(sockfd, (struct sockaddr *)&peer, &peerlen) < 0) {
+                return 1;
+        }
+        return peer_weight(&peer);
+}
+
+/* The poll timeout that ends at the stats_now time at. */
+static int
+wait_millis(uint64_t at)
+{
+        uint64_t now;
+
+        now = stats_now();
+        return at > now ? (int)((at - now + 999) / 1000) : 0;
+}
+
+/*
+ * Makes b a bulk transfer of nbytes of fd from offset on if it is big
+ * enough for that, and leaves it zeroed otherwise.
+ */
+static void
+bulk_begin(struct bulk *b, int fd, off_t offset, size_t nbytes, int writing)
+{
+        memset(b, 0, sizeof(struct bulk));
+        /* the periodic sync policy is this stepping, for every put */
+        if ((bulk_threshold == 0 || nbytes < bulk_threshold) &&
+            !(writing && upload_sync() == UPLOAD_SYNC_PERIODIC)) {
+                return;
+        }
+        b->active = 1;
+        b->fd = fd;
+        b->writing = writing;
+        b->start = b->done = b->flushed = b->dropped = offset;
+        if (!writing) {
+                posix_fadvise(fd, offset, nbytes, POSIX_FADV_SEQUENTIAL);
+        }
+}
+
+/* Notes that nbytes more went by, and lets go of a step of them at a time. */
+static void
+bulk_advance(struct bulk *b, size_t nbytes)
+{
+        if (!b->active) {
+                return;
+        }
+        b->done += nbytes;
+        if (b->done - b->flushed < BULK_STEP) {
+                return;
+        }
+        if (b->writing) {
+                /* the step before is on its way by now; wait for it, drop it */
+                sync_file_range(b->fd, b->flushed, b->done - b->flushed, SYNC_FILE_RANGE_WRITE);
+                if (b->flushed > b->dropped) {
+                        sync_file_range(b->fd, b->dropped, b->flushed - b->dropped,
+                                        SYNC_FILE_RANGE_WAIT_BEFORE);
+                        posix_fadvise(b->fd, b->dropped, b->flushed - b->dropped, POSIX_FADV_DONTNEED);
+                        b->dropped = b->flushed;
+                }
+                b->flushed = b->done;
+                return;
+        }
+        posix_fadvise(b->fd, b->dropped, b->done - b->dropped, POSIX_FADV_DONTNEED);
+        b->dropped = b->flushed = b->done;
+}
+
+/*
+ * Lets go of what is left of a bulk transfer; b is no longer one after.
+ * All of it goes, as a checksum may have read back what was dropped.
+ */
+static void
+bulk_end(struct bulk *b)
+{
+        if (!b->active) {
+                return;
+        }
+        if (b->done > b->start) {
+                if (b->writing && b->done > b->dropped) {
+                        sync_file_range(b->fd, b->dropped, b->done - b->dropped,
+                                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                        SYNC_FILE_RANGE_WAIT_AFTER);
+                }
+                posix_fadvise(b->fd, b->start, b->done - b->start, POSIX_FADV_DONTNEED);
+        }
+        b->active = 0;
+}
+
+/*
+ * Opens fd again with O_DIRECT, for the ring to go around the page
+ * cache with; -1 if the file system does not do direct I/O.
+ */
+static int
+reopen_direct(int fd, int flags)
+{
+        char path[64];
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        return open(path, flags | O_DIRECT | O_CLOEXEC);
+}
+
+/*
+ * Sends nbytes of fromfd to tofp without copying through user space.
+ * Falls back to read/fwrite when sendfile cannot handle the pair of
+ * descriptors. Returns the number of bytes actually sent, which is
+ * less than nbytes if the file shrank or, with errno set, the peer went
+ * away. b, if not NULL, is told how far the transfer has got, and sh,
+ * if not NULL, holds it to its limits. crcp, if not NULL, is fed the
+ * bytes sent, see digest_behind.
+ */
+static size_t
+sendfile_from_to(int fromfd, FILE *tofp, size_t nbytes, struct bulk *b, struct shaper *sh,
+                 uint32_t *crcp)
+{
+        int tofd;
+        size_t nsent;
+        size_t chunk;
+        ssize_t n;
+
+        fflush(tofp);
+        tofd = fileno(tofp);
+        if (tofd < 0) {
+                return fread_fd_to(fromfd, tofp, nbytes, sh, crcp);
+        }
+        nsent = 0;
+        errno = 0;
+        while (nsent < nbytes) {
+                chunk = nbytes - nsent;
+                if (chunk > SENDFILE_CHUNK) {
+                        chunk = SENDFILE_CHUNK;
+                }
+                if (sh != NULL) {
+                        shaper_pace(sh);
+                        if (chunk > shaper_quantum(sh)) {
+                                chunk = shaper_quantum(sh);
+                        }
+                }
+                n = sendfile(tofd, fromfd, NULL, chunk);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EINVAL || errno == ENOSYS) {
+                                /* the file offset is still valid */
+                                return nsent + fread_fd_to(fromfd, tofp, nbytes - nsent, sh, crcp);
+                        }
+                        break;
+                }
+                if (n == 0) {
+                        break;
+                }
+                nsent += n;
+                shaper_charge(sh, n);
+                if (crcp != NULL) {
+                        digest_behind(fromfd, n, crcp);
+                }
+                if (b != NULL) {
+                        bulk_advance(b, n);
+                }
+        }
+        return nsent;
+}
+
+static size_t
+fread_fd_to(int fromfd, FILE *tofp, size_t nbytes, struct shaper *sh, uint32_t *crcp)
+{
+        char *buff;
+        size_t nsent;
+        size_t chunk;
+        ssize_t n;
+
+        buff = buffpool_get();
+        if (buff == NULL) {
+                return 0;
+        }
+        nsent = 0;
+        while (nsent < nbytes) {
+                chunk = nbytes - nsent;
+                if (chunk > buffpool_size()) {
+                        chunk = buffpool_size();
+                }
+                shaper_pace(sh);
+                n = read(fromfd, buff, chunk);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                if (fwrite(buff, sizeof(char), n, tofp) != (size_t)n) {
+                        break;
+                }
+                if (crcp != NULL) {
+                        *crcp = crc32c(*crcp, buff, n);
+                }
+                nsent += n;
+                shaper_charge(sh, n);
+        }
+        fflush(tofp);
+        buffpool_put(buff);
+        return nsent;
+}
+
+/* Sends nbytes of zeros; -1 as soon as a write fails. */
+static int
+fzero_to(FILE *tofp, size_t nbytes)
+{
+        char *buff;
+        size_t chunk;
+
+        buff = buffpool_get();
+        if (buff == NULL) {
+                return -1;
+        }
+        memset(buff, 0, buffpool_size());
+        while (nbytes > 0) {
+                chunk = nbytes;
+                if (chunk > buffpool_size()) {
+                        chunk = buffpool_size();
+                }
+                if (fwrite(buff, sizeof(char), chunk, tofp) != chunk || fflush(tofp) == EOF) {
+                        break;
+                }
+                nbytes -= chunk;
+        }
+        buffpool_put(buff);
+        return nbytes > 0 ? -1 : 0;
+}
+
+/* Tells whether a failed write means there is no one left to send to. */
+static int
+peer_gone(int err)
+{
+        return err == EPIPE || err == ECONNRESET || err == ENOTCONN;
+}
+
+/*
+ * Receives nbytes from the socket fromfd into tofd by splicing
+ * socket -> pipe -> file, so the payload never enters user space. The
+ * stdio buffer of the data channel is bypassed; the server never reads
+ * it through stdio. Falls back to read/write when the file system
+ * does not support splice. Returns the number of bytes stored, which
+ * is less than nbytes if the peer closed or reset the connection. b,
+ * sh and crcp are as for sendfile_from_to.
+ */
+static size_t
+splice_from_to(int fromfd, int tofd, size_t nbytes, struct bulk *b, struct shaper *sh,
+               uint32_t *crcp)
+{
+        static int pipefd[2] = {-1, -1};
+        size_t nrecv;
+        size_t chunk;
+        ssize_t n;
+        ssize_t npiped;
+
+        if (pipefd[0] < 0) {
+                if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                        return read_fd_to_fd(fromfd, tofd, nbytes, sh, crcp);
+                }
+                /* a failure here only means smaller chunks */
+                fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+        }
+        nrecv = 0;
+        while (nrecv < nbytes) {
+                chunk = nbytes - nrecv;
+                if (chunk > SPLICE_CHUNK) {
+                        chunk = SPLICE_CHUNK;
+                }
+                if (sh != NULL) {
+                        shaper_pace(sh);
+                        if (chunk > shaper_quantum(sh)) {
+                                chunk = shaper_quantum(sh);
+                        }
+                }
+                npiped = splice(fromfd, NULL, pipefd[1], NULL, chunk,
+                                SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (npiped < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EINVAL && nrecv == 0) {
+                                return read_fd_to_fd(fromfd, tofd, nbytes, sh, crcp);
+                        }
+                        break;
+                }
+                if (npiped == 0) {
+                        /* peer closed before sending everything */
+                        errno = ECONNRESET;
+                        break;
+                }
+                shaper_charge(sh, npiped);
+                while (npiped > 0) {
+                        n = splice(pipefd[0], NULL, tofd, NULL, npiped, SPLICE_F_MOVE);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        if (n < 0 && errno == EINVAL) {
+                                /* drain the pipe by hand and finish without splice */
+                                if (read_fd_to_fd(pipefd[0], tofd, npiped, NULL, crcp) != (size_t)npiped) {
+                                        return nrecv;
+                                }
+                                nrecv += npiped;
+                                return nrecv + read_fd_to_fd(fromfd, tofd, nbytes - nrecv, sh, crcp);
+                        }
+                        if (n <= 0) {
+                                /* bytes left in the pipe are lost; start afresh next time */
+                                close(pipefd[0]);
+                                close(pipefd[1]);
+                                pipefd[0] = pipefd[1] = -1;
+                                return nrecv;
+                        }
+                        npiped -= n;
+                        nrecv += n;
+                        if (crcp != NULL) {
+                                digest_behind(tofd, n, crcp);
+                        }
+                        if (b != NULL) {
+                                bulk_advance(b, n);
+                        }
+                }
+        }
+        return nrecv;
+}
+
+static size_t
+read_fd_to_fd(int fromfd, int tofd, size_t nbytes, struct shaper *sh, uint32_t *crcp)
+{
+        char *buff;
+        size_t nrecv;
+        size_t chunk;
+        ssize_t n;
+
+        buff = buffpool_get();
+        if (buff == NULL) {
+                return 0;
+        }
+        nrecv = 0;
+        while (nrecv < nbytes) {
+                chunk = nbytes - nrecv;
+                if (chunk > buffpool_size()) {
+                        chunk = buffpool_size();
+                }
+                shaper_pace(sh);
+                n = read(fromfd, buff, chunk);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n == 0) {
+                        errno = ECONNRESET;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                if (write_all(tofd, buff, n) < 0) {
+                        break;
+                }
+                if (crcp != NULL) {
+                        *crcp = crc32c(*crcp, buff, n);
+                }
+                nrecv += n;
+                shaper_charge(sh, n);
+        }
+        buffpool_put(buff);
+        return nrecv;
+}
+
+/* Reads exactly nbytes; -1 if the peer closed (errno ECONNRESET) or failed. */
+static int
+read_all(int fd, char *buff, size_t nbytes)
+{
+        ssize_t n;
+
+        while (nbytes > 0) {
+                n = read(fd, buff, nbytes);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n == 0) {
+                        errno = ECONNRESET;
+                }
+                if (n <= 0) {
+                        return -1;
+                }
+                buff += n;
+                nbytes -= n;
+        }
+        return 0;
+}
+
+static int
+write_all(int fd, const char *buff, size_t nbytes)
+{
+        ssize_t n;
+
+        while (nbytes > 0) {
+                n = write(fd, buff, nbytes);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        return -1;
+                }
+                buff += n;
+                nbytes -= n;
+        }
+        return 0;
+}
+
+/*
+ * Takes the next "-x" or "-x value" option off the arguments of a
+ * command, getopt style. Returns the option letter, 0 when the options
+ * are over ("--" ends them explicitly, so file names may start with a
+ * dash) or '?' for an unknown or incomplete option.
+ */
+static int
+next_option(char **saveptr, const char *optstring, char **value)
+{
+        char *p;
+        char *token;
+        const char *spec;
+
+        p = *saveptr;
+        while (*p == ' ') {
+                p++;
+        }
+        *saveptr = p;
+        if (p[0] != '-' || p[1] == '\0' || strchr(" \r\n", p[2]) == NULL) {
+                return 0;
+        }
+        token = strtok_r(NULL, " \r\n", saveptr);
+        if (token[1] == '-') {
+                return 0;
+        }
+        spec = strchr(optstring, token[1]);
+        if (spec == NULL || token[1] == ':') {
+                return '?';
+        }
+        if (spec[1] == ':') {
+                *value = strtok_r(NULL, " \r\n", saveptr);
+                if (*value == NULL) {
+                        return '?';
+                }
+        }
+        return token[1];
+}
+
+/*
+ * Parses the arguments of get, "[-o offset] [-l length] [-m crc]
+ * [-z level] file", and opens the file positioned at the start of the
+ * range. Returns the descriptor and the number of bytes to send, or -1
+ * with a fail reply in reply (BUFF_SIZE bytes). The range is clipped to
+ * the end of file. With -m, the client resumes a download and crc is
+ * the checksum of its copy of the RESUME_WINDOW bytes before offset; a
+ * mismatch means the file has changed since and the range is refused.
+ * With -z, *levelp is the level to compress at (see zstream.h), else 0.
+ * With -k, *digestp is set: the data is to be followed by the crc32c of
+ * the bytes sent, CRC32C_DIGEST_SIZE bytes of it, see known_digest.
+ *
+ * A small file is sent from the file cache rather than opened: then -1
+ * is returned with *copyp pointing to the bytes to send, in a buffer the
+ * caller frees with CRC32C_DIGEST_SIZE bytes to spare after them. It is
+ * NULL otherwise.
+ */
+static int
+prepare_get(char *saveptr, size_t *nbytesp, int *levelp, int *digestp, int *sparsep,
+            char **copyp, char *reply)
+{
+        const char *filename;
+        char *value;
+        struct stat sb;
+        off_t offset;
+        off_t length;
+        uint32_t crc;
+        int verify;
+        int opt;
+        int fd;
+
+        offset = 0;
+        length = -1;
+        crc = 0;
+        verify = 0;
+        *levelp = 0;
+        *digestp = 0;
+        *sparsep = 0;
+        *copyp = NULL;
+        while ((opt = next_option(&saveptr, "o:l:m:z:kh", &value)) != 0) {
+                switch (opt) {
+                case 'o':
+                        offset = strtoll(value, NULL, 10);
+                        break;
+                case 'l':
+                        length = strtoll(value, NULL, 10);
+                        break;
+                case 'm':
+                        crc = strtoul(value, NULL, 16);
+                        verify = 1;
+                        break;
+                case 'z':
+                        *levelp = strtol(value, NULL, 10);
+                        if (*levelp < 1 || *levelp > 9) {
+                                offset = -1;
+                        }
+                        break;
+                case 'k':
+                        *digestp = 1;
+                        break;
+                case 'h':
+                        *sparsep = 1;
+                        break;
+                default:
+                        offset = -1;
+                        break;
+                }
+        }
+        filename = strtok_r(NULL, "\r\n", &saveptr);
+        if (filename == NULL || offset < 0) {
+                snprintf(reply, BUFF_SIZE,
+                         "fail: usage: get [-o offset] [-l length] [-m crc] [-z level] [-k] [-h] file\n");
+                return -1;
+        }
+        if (upload_staging(AT_FDCWD, filename)) {
+                /* a put still on its way is not there yet */
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(ENOENT));
+                return -1;
+        }
+        /* compressing, checking a prefix and mapping holes want the file itself */
+        if (*levelp == 0 && !verify && stat(filename, &sb) == 0 && filecache_wants(&sb) &&
+            offset <= sb.st_size && !(*sparsep && sparse_file(&sb))) {
+                *copyp = filecache_lookup(&sb, CRC32C_DIGEST_SIZE);
+                stats_cache(*copyp != NULL ? STATS_CACHE_HIT : STATS_CACHE_MISS);
+        }
+        if (*copyp != NULL) {
+                if (length < 0 || length > sb.st_size - offset) {
+                        length = sb.st_size - offset;
+                }
+                memmove(*copyp, *copyp + offset, length);
+                *nbytesp = length;
+                return -1;
+        }
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                return -1;
+        }
+        if (fstat(fd, &sb) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+        }
+        if (offset > sb.st_size) {
+                snprintf(reply, BUFF_SIZE, "fail: offset beyond end of file\n");
+                close(fd);
+                return -1;
+        }
+        if (verify && verify_prefix(fd, offset, crc) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: partial file does not match\n");
+                close(fd);
+                return -1;
+        }
+        if (length < 0 || length > sb.st_size - offset) {
+                length = sb.st_size - offset;
+        }
+        /* a dense file goes as it is, the holes would only cost a map */
+        *sparsep = *sparsep && sparse_file(&sb);
+        if (*sparsep) {
+                *levelp = 0;
+        }
+        if (*levelp == 0 && !verify && !*sparsep && filecache_wants(&sb)) {
+                *copyp = read_into_cache(fd, &sb);
+                if (*copyp != NULL) {
+                        memmove(*copyp, *copyp + offset, length);
+                        *nbytesp = length;
+                        close(fd);
+                        return -1;
+                }
+        }
+        if (offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+        }
+        *nbytesp = length;
+        return fd;
+}
+
+/*
+ * Reads the whole of a small file into a buffer with room for a digest
+ * after it, and keeps it in the file cache if the file held still
+ * meanwhile. NULL if the file could not be read through.
+ */
+static char *
+read_into_cache(int fd, const struct stat *sb)
+{
+        struct stat after;
+        char *buff;
+        off_t got;
+        ssize_t n;
+
+        buff = malloc(sb->st_size + CRC32C_DIGEST_SIZE);
+        if (buff == NULL) {
+                return NULL;
+        }
+        for (got = 0; got < sb->st_size; got += n) {
+                n = pread(fd, buff + got, sb->st_size - got, got);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n <= 0) {
+                        free(buff);
+                        return NULL;
+                }
+        }
+        if (fstat(fd, &after) == 0 && after.st_size == sb->st_size &&
+            after.st_ctim.tv_sec == sb->st_ctim.tv_sec &&
+            after.st_ctim.tv_nsec == sb->st_ctim.tv_nsec && filecache_store(&after, buff)) {
+                stats_cache(STATS_CACHE_EVICTION);
+        }
+        return buff;
+}
+
+/*
+ * Parses the arguments of put, "[-o offset [-m crc]] [-z | -h] [-k]
+ * file size", and opens the file to receive size bytes at offset, see
+ * upload.h; finish_put_file is to close it. Returns
+ * the descriptor, or -1 with a fail reply in reply; *nbytesp is the
+ * number of bytes the client sends either way, *compressedp tells
+ * whether they come compressed (see zstream.h), *sparsep whether they
+ * are the extents of a file with holes (see sparse.h) and *digestp
+ * whether their crc32c follows them. Resuming at offset goes on with what an
+ * earlier put left, see upload.h, and requires it to be exactly offset
+ * bytes long and, with -m, to end in the bytes the client checksummed,
+ * so a stale partial file is never extended.
+ */
+static int
+prepare_put(char *saveptr, size_t *nbytesp, int *compressedp, int *sparsep, int *digestp,
+            char *reply)
+{
+        const char *filename;
+        const char *size;
+        char *value;
+        struct stat sb;
+        off_t offset;
+        uint32_t crc;
+        int verify;
+        int opt;
+        int fd;
+
+        offset = 0;
+        crc = 0;
+        verify = 0;
+        *compressedp = 0;
+        *sparsep = 0;
+        *digestp = 0;
+        while ((opt = next_option(&saveptr, "o:m:zhk", &value)) != 0) {
+                switch (opt) {
+                case 'o':
+                        offset = strtoll(value, NULL, 10);
+                        break;
+                case 'm':
+                        crc = strtoul(value, NULL, 16);
+                        verify = 1;
+                        break;
+                case 'z':
+                        *compressedp = 1;
+                        break;
+                case 'h':
+                        *sparsep = 1;
+                        break;
+                case 'k':
+                        *digestp = 1;
+                        break;
+                default:
+                        offset = -1;
+                        break;
+                }
+        }
+        filename = strtok_r(NULL, " ", &saveptr);
+        size = strtok_r(NULL, "\r\n", &saveptr);
+        *nbytesp = size != NULL ? strtoul(size, NULL, 10) : 0;
+        if (filename == NULL || size == NULL || offset < 0 ||
+            (*sparsep && (*compressedp || offset > 0))) {
+                snprintf(reply, BUFF_SIZE, "fail: usage: put [-o offset [-m crc]] [-z | -h] [-k] file size\n");
+                return -1;
+        }
+        if (offset == 0) {
+                /* how big a compressed file turns out is not known yet; holes take no room */
+                fd = upload_open(filename, *compressedp || *sparsep ? 0 : (off_t)*nbytesp,
+                                 *digestp ? O_RDWR : O_WRONLY);
+                if (fd < 0) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                }
+                return fd;
+        }
+        fd = upload_resume(filename, O_RDWR);
+        if (fd < 0 && errno == ENOENT) {
+                fd = open(filename, O_RDWR | O_CLOEXEC);
+        }
+        if (fd < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                return -1;
+        }
+        if (fstat(fd, &sb) < 0 || sb.st_size != offset ||
+            (verify && verify_prefix(fd, offset, crc) < 0)) {
+                snprintf(reply, BUFF_SIZE, "fail: partial file does not match\n");
+                upload_close(fd, UPLOAD_SUSPEND);
+                return -1;
+        }
+        if (lseek(fd, offset, SEEK_SET) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                upload_close(fd, UPLOAD_SUSPEND);
+                return -1;
+        }
+        return fd;
+}
+
+/* Checks the RESUME_WINDOW bytes before offset against crc. */
+static int
+verify_prefix(int fd, off_t offset, uint32_t crc)
+{
+        off_t start;
+        uint32_t actual;
+
+        start = offset > RESUME_WINDOW ? offset - RESUME_WINDOW : 0;
+        if (crc32c_file(fd, start, offset - start, &actual) < 0) {
+                return -1;
+        }
+        return actual == crc ? 0 : -1;
+}
+
+/* Feeds nbytes of zeros into crc, for what went out as padding. */
+static uint32_t
+digest_zeros(uint32_t crc, size_t nbytes)
+{
+        char zeros[BUFF_SIZE];
+        size_t chunk;
+
+        memset(zeros, 0, BUFF_SIZE);
+        for (; nbytes > 0; nbytes -= chunk) {
+                chunk = nbytes < BUFF_SIZE ? nbytes : BUFF_SIZE;
+                crc = crc32c(crc, zeros, chunk);
+        }
+        return crc;
+}
+
+/*
+ * Feeds into *crcp the nbytes of fd just before its offset, which a
+ * sendfile or splice has only now moved. They are read back at once,
+ * while the page cache still has them and before bulk_advance lets go
+ * of them. Whatever cannot be read counts as zeros.
+ */
+static void
+digest_behind(int fd, size_t nbytes, uint32_t *crcp)
+{
+        char *buff;
+        off_t offset;
+        size_t chunk;
+        ssize_t n;
+
+        offset = lseek(fd, 0, SEEK_CUR);
+        buff = offset < (off_t)nbytes ? NULL : buffpool_get();
+        if (buff == NULL) {
+                *crcp = digest_zeros(*crcp, nbytes);
+                return;
+        }
+        offset -= nbytes;
+        while (nbytes > 0) {
+                chunk = nbytes < buffpool_size() ? nbytes : buffpool_size();
+                n = pread(fd, buff, chunk, offset);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                *crcp = crc32c(*crcp, buff, n);
+                offset += n;
+                nbytes -= n;
+        }
+        buffpool_put(buff);
+        *crcp = digest_zeros(*crcp, nbytes);
+}
+
+/*
+ * Looks up the checksum that follows a get -k of the nbytes of fd from
+ * offset; only that of a whole file can be known. Returns -1 if the
+ * bytes are to be checksummed as they go out, and then *sb is what to
+ * hand remember_digest once they have.
+ */
+static int
+known_digest(int fd, off_t offset, size_t nbytes, struct stat *sb, uint32_t *crcp)
+{
+        if (fstat(fd, sb) < 0 || offset != 0 || (off_t)nbytes != sb->st_size) {
+                /* nothing to remember either */
+                sb->st_mode = 0;
+                return -1;
+        }
+        return sumcache_lookup(sb, crcp);
+}
+
+/* Keeps crc for the next get of a whole file that held still meanwhile. */
+static void
+remember_digest(int fd, const struct stat *sb, uint32_t crc)
+{
+        struct stat after;
+
+        if (S_ISREG(sb->st_mode) && fstat(fd, &after) == 0 && after.st_size == sb->st_size &&
+            after.st_ctim.tv_sec == sb->st_ctim.tv_sec &&
+            after.st_ctim.tv_nsec == sb->st_ctim.tv_nsec) {
+                sumcache_store(&after, crc);
+        }
+}
+
+/*
+ * Turns the reply to a put -k into a failure if the checksum the client
+ * sent after the data is not crc, that of what has been stored.
+ */
+static void
+check_put_digest(const unsigned char *trailer, uint32_t crc, char *reply)
+{
+        if (strncmp(reply, "succ:", 5) == 0 && crc32c_decode(trailer) != crc) {
+                snprintf(reply, BUFF_SIZE, "fail: checksum mismatch\n");
+        }
+}
+
+/* Takes "-x" off the front of the arguments if it is there. */
+static int
+take_flag(char **saveptr, int flag)
+{
+        char *p;
+
+        p = *saveptr;
+        while (*p == ' ') {
+                p++;
+        }
+        if (p[0] != '-' || p[1] != flag || strchr(" \r\n", p[2]) == NULL) {
+                return 0;
+        }
+        *saveptr = p + 2;
+        return 1;
+}
+
+/*
+ * Parses the arguments of get -r, "[--] path", and starts archiving
+ * path. Returns the writer, or NULL; reply gets the line to send
+ * either way.
+ */
+static struct archive_writer *
+open_archive_writer(char *saveptr, char *reply)
+{
+        struct archive_writer *aw;
+        const char *root;
+        char *value;
+
+        if (next_option(&saveptr, "", &value) != 0 ||
+            (root = strtok_r(NULL, "\r\n", &saveptr)) == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: usage: get -r path\n");
+                return NULL;
+        }
+        aw = malloc(sizeof(struct archive_writer));
+        if (aw == NULL || archive_writer_open(aw, root) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(aw);
+                return NULL;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: archive\n");
+        return aw;
+}
+
+/*
+ * Parses the arguments of get -b, "[-k] listlen": the names of the
+ * files to send follow on the data channel, listlen bytes of them, each
+ * name ending in a newline. Returns -1 with a fail reply in reply if
+ * they are not to be taken; they still have to be read past.
+ */
+static int
+prepare_batch_get(char *saveptr, size_t *listlenp, int *digestp, char *reply)
+{
+        const char *listlen;
+        char *value;
+        int opt;
+
+        *listlenp = 0;
+        *digestp = 0;
+        while ((opt = next_option(&saveptr, "k", &value)) != 0) {
+                if (opt != 'k') {
+                        snprintf(reply, BUFF_SIZE, "fail: usage: get -b [-k] listlen\n");
+                        return -1;
+                }
+                *digestp = 1;
+        }
+        listlen = strtok_r(NULL, " \r\n", &saveptr);
+        if (listlen == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: usage: get -b [-k] listlen\n");
+                return -1;
+        }
+        *listlenp = strtoul(listlen, NULL, 10);
+        if (*listlenp > ARCHIVE_LIST_MAX) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(EFBIG));
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Reads the listlen bytes of names that follow a get -b or an rstat -b
+ * into list, or only takes them in if list is NULL. Returns list, or
+ * NULL, having freed it, if they did not all arrive.
+ */
+static char *
+read_name_list(FILE *datafp, char *list, size_t listlen)
+{
+        char buff[BUFF_SIZE];
+        size_t got;
+        ssize_t n;
+
+        for (got = 0; got < listlen; got += n) {
+                n = listlen - got < BUFF_SIZE ? listlen - got : BUFF_SIZE;
+                n = read(fileno(datafp), list != NULL ? list + got : buff, n);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+        }
+        if (got < listlen) {
+                free(list);
+                list = NULL;
+        }
+        return list;
+}
+
+/* The same as prepare_batch_get, for the "listlen" of an rstat -b. */
+static int
+prepare_stat_list(char *saveptr, size_t *listlenp, char *reply)
+{
+        const char *listlen;
+
+        *listlenp = 0;
+        listlen = strtok_r(NULL, " \r\n", &saveptr);
+        if (listlen == NULL || listlen[0] == '-') {
+                snprintf(reply, BUFF_SIZE, "fail: usage: rstat -b listlen\n");
+                return -1;
+        }
+        *listlenp = strtoul(listlen, NULL, 10);
+        if (*listlenp > ARCHIVE_LIST_MAX) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(EFBIG));
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Describes every file named in list, names each followed by a newline
+ * and relative to basefd, the way rstat does; it takes list over, which
+ * is NULL if the names did not all arrive. A directory is opened once
+ * for a run of names in it. Returns the text, its length in *lenp, or
+ * NULL; reply gets the line to send either way.
+ */
+static char *
+stat_names(int basefd, char *list, size_t listlen, const char *failreply, size_t *lenp, char *reply)
+{
+        const char *held;
+        const char *base;
+        char *text;
+        char *name;
+        char *end;
+        char *slash;
+        size_t heldlen;
+        size_t dirlen;
+        FILE *fp;
+        int dirfd;
+        int error;
+        char c;
+
+        if (failreply != NULL || list == NULL || (listlen > 0 && list[listlen - 1] != '\n')) {
+                snprintf(reply, BUFF_SIZE, "%s", failreply != NULL ? failreply : "fail: bad name list\n");
+                free(list);
+                return NULL;
+        }
+        text = NULL;
+        fp = open_memstream(&text, lenp);
+        if (fp == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(list);
+                return NULL;
+        }
+        held = NULL;
+        heldlen = 0;
+        dirfd = basefd;
+        error = 0;
+        for (name = list; name < list + listlen; name = end + 1) {
+                end = memchr(name, '\n', list + listlen - name);
+                *end = '\0';
+                if (end == name) {
+                        continue;
+                }
+                /* "a/b" is b in a, "/b" b in /, and "a/" a itself */
+                slash = strrchr(name, '/');
+                dirlen = slash == NULL ? 0 : slash > name ? (size_t)(slash - name) : 1;
+                base = slash == NULL ? name : slash[1] != '\0' ? slash + 1 : ".";
+                /* the names of a directory mostly come one after another */
+                if (dirlen != heldlen || (dirlen > 0 && memcmp(held, name, dirlen) != 0)) {
+                        if (dirfd >= 0 && dirfd != basefd) {
+                                close(dirfd);
+                        }
+                        held = name;
+                        heldlen = dirlen;
+                        dirfd = basefd;
+                        error = 0;
+                        if (dirlen > 0) {
+                                c = name[dirlen];
+                                name[dirlen] = '\0';
+                                dirfd = openat(basefd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+                                error = dirfd < 0 ? errno : 0;
+                                name[dirlen] = c;
+                        }
+                }
+                if (error != 0) {
+                        fprintf(fp, "! %d %s\n", error, name);
+                }
+                else {
+                        print_stat(fp, dirfd, base, name);
+                }
+        }
+        if (dirfd >= 0 && dirfd != basefd) {
+                close(dirfd);
+        }
+        free(list);
+        if (fclose(fp) != 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(text);
+                return NULL;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: %zu\n", *lenp);
+        return text;
+}
+
+/*
+ * Starts the archive of the files a get -b names, taking list over; it
+ * is NULL if the names did not all arrive.
+ */
+static struct archive_writer *
+open_batch_writer(char *list, size_t listlen, const char *failreply, char *reply)
+{
+        struct archive_writer *aw;
+
+        if (failreply != NULL || list == NULL) {
+                snprintf(reply, BUFF_SIZE, "%s", failreply != NULL ? failreply : "fail: bad name list\n");
+                free(list);
+                return NULL;
+        }
+        aw = malloc(sizeof(struct archive_writer));
+        if (aw == NULL) {
+                free(list);
+        }
+        if (aw == NULL || archive_writer_open_list(aw, list, listlen) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(aw);
+                return NULL;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: archive\n");
+        return aw;
+}
+
+/*
+ * Starts unpacking a put -r into the current directory. Even when that
+ * fails the reader takes in the archive, which the client sends anyway.
+ */
+static struct archive_reader *
+open_archive_reader(void)
+{
+        struct archive_reader *ar;
+
+        ar = malloc(sizeof(struct archive_reader));
+        if (ar != NULL) {
+                archive_reader_open(ar);
+        }
+        return ar;
+}
+
+/* Finishes a put -r and puts the reply for it in reply. */
+static void
+close_archive_reader(struct archive_reader *ar, char *reply)
+{
+        if (archive_reader_close(ar) == 0) {
+                snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        }
+        else if (ar->errpath[0] != '\0') {
+                snprintf(reply, BUFF_SIZE, "fail: %.*s: %s\n", BUFF_SIZE / 2, ar->errpath,
+                         strerror(ar->error));
+        }
+        else {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(ar->error));
+        }
+        free(ar);
+}
+
+/*
+ * Starts compressing nbytes of fd for a get -z. Returns NULL, with fd
+ * closed, if there is no memory for it.
+ */
+static struct zstream_writer *
+open_zstream_writer(int fd, size_t nbytes, int level)
+{
+        struct zstream_writer *zw;
+
+        zw = malloc(sizeof(struct zstream_writer));
+        if (zw == NULL) {
+                close(fd);
+                return NULL;
+        }
+        zstream_writer_open(zw, fd, nbytes, level);
+        return zw;
+}
+
+/*
+ * Maps the holes in the next nbytes of fd for a get -h, see sparse.h.
+ * NULL with errno set if that fails, and then fd is closed.
+ */
+static struct sparse_writer *
+open_sparse_writer(int fd, size_t nbytes)
+{
+        struct sparse_writer *sw;
+
+        sw = malloc(sizeof(struct sparse_writer));
+        if (sw == NULL) {
+                close(fd);
+                errno = ENOMEM;
+                return NULL;
+        }
+        if (sparse_writer_open(sw, fd, lseek(fd, 0, SEEK_CUR), nbytes) < 0) {
+                free(sw);
+                close(fd);
+                return NULL;
+        }
+        return sw;
+}
+
+/*
+ * Starts decompressing a put -z into fd, which is -1 if the put has
+ * been refused: the data still has to be taken in to find its end.
+ */
+static struct zstream_reader *
+open_zstream_reader(int fd, size_t nbytes)
+{
+        struct zstream_reader *zr;
+
+        zr = malloc(sizeof(struct zstream_reader));
+        if (zr == NULL) {
+                if (fd >= 0) {
+                        upload_close(fd, UPLOAD_DISCARD);
+                }
+                return NULL;
+        }
+        zstream_reader_open(zr, fd, nbytes);
+        return zr;
+}
+
+/*
+ * Finishes a put -z and puts the reply for it in reply: failreply if
+ * the put was refused up front, else how the file turned out. Returns
+ * the file, still open for finish_put_file, or -1 for a refused put.
+ */
+static int
+close_zstream_reader(struct zstream_reader *zr, const char *failreply, char *reply)
+{
+        int fd;
+
+        fd = zr->fd;
+        zr->fd = -1;
+        if (zstream_reader_close(zr) < 0 && failreply == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(zr->error));
+        }
+        else if (failreply != NULL) {
+                snprintf(reply, BUFF_SIZE, "%s", failreply);
+        }
+        else {
+                snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        }
+        free(zr);
+        return fd;
+}
+
+/*
+ * Starts taking in the extents of a put -h into fd, which is -1 if the
+ * put has been refused: the data still has to be taken in to find its
+ * end. The file is fresh, so its holes need no punching.
+ */
+static struct sparse_reader *
+open_sparse_reader(int fd, size_t nbytes)
+{
+        struct sparse_reader *sr;
+
+        sr = malloc(sizeof(struct sparse_reader));
+        if (sr == NULL) {
+                if (fd >= 0) {
+                        upload_close(fd, UPLOAD_DISCARD);
+                }
+                return NULL;
+        }
+        sparse_reader_open(sr, fd, 0, nbytes);
+        return sr;
+}
+
+/*
+ * Finishes a put -h the way close_zstream_reader does a put -z. The
+ * file is given its full size, holes at the end and all, only if the
+ * stream was complete.
+ */
+static int
+close_sparse_reader(struct sparse_reader *sr, const char *failreply, char *reply)
+{
+        int fd;
+
+        fd = sr->fd;
+        sr->fd = -1;
+        if (sparse_reader_close(sr) == 0 && fd >= 0 && ftruncate(fd, sr->size) < 0) {
+                sr->error = errno;
+        }
+        if (failreply != NULL) {
+                snprintf(reply, BUFF_SIZE, "%s", failreply);
+        }
+        else if (sr->error != 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(sr->error));
+        }
+        else {
+                snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        }
+        free(sr);
+        return fd;
+}
+
+/*
+ * Closes the file a put went into, keeping it only if reply tells of
+ * success; reply turns into a failure if it cannot be kept after all.
+ * What a put cut short did receive is kept for a put -o to resume.
+ */
+static void
+finish_put_file(int fd, int cut, char *reply)
+{
+        if (fd < 0) {
+                return;
+        }
+        if (cut) {
+                upload_close(fd, UPLOAD_SUSPEND);
+        }
+        else if (upload_close(fd, strncmp(reply, "succ", 4) == 0 ? UPLOAD_COMMIT : UPLOAD_DISCARD) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+        }
+}
+
+/*
+ * Parses the arguments of get -d, "siglen [--] file", and opens the
+ * file. Returns the descriptor, or -1 with a fail reply in reply;
+ * *siglenp is the size of the signature the client sends either way.
+ */
+static int
+prepare_delta_get(char *saveptr, size_t *siglenp, char *reply)
+{
+        const char *siglen;
+        const char *filename;
+        char *value;
+        int fd;
+
+        siglen = strtok_r(NULL, " \r\n", &saveptr);
+        *siglenp = siglen != NULL ? strtoul(siglen, NULL, 10) : 0;
+        if (siglen == NULL || next_option(&saveptr, "", &value) != 0 ||
+            (filename = strtok_r(NULL, "\r\n", &saveptr)) == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: usage: get -d siglen file\n");
+                return -1;
+        }
+        if (*siglenp > DELTA_SIG_MAX) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(EFBIG));
+                return -1;
+        }
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+        }
+        return fd;
+}
+
+/*
+ * Starts a get -d once the signature of the client's copy has arrived,
+ * taking over fd. Returns the writer, or NULL; reply gets the line to
+ * send either way, failreply if the get was refused up front.
+ */
+static struct delta_writer *
+open_delta_writer(int fd, const char *sig, size_t siglen, const char *failreply, char *reply)
+{
+        struct delta_writer *dw;
+        struct delta_sig *parsed;
+        struct stat sb;
+
+        if (failreply != NULL) {
+                snprintf(reply, BUFF_SIZE, "%s", failreply);
+                return NULL;
+        }
+        parsed = sig != NULL ? delta_sig_parse(sig, siglen) : NULL;
+        if (parsed == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: bad signature\n");
+                close(fd);
+                return NULL;
+        }
+        if (fstat(fd, &sb) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                close(fd);
+                delta_sig_free(parsed);
+                return NULL;
+        }
+        dw = malloc(sizeof(struct delta_writer));
+        if (dw == NULL) {
+                close(fd);
+                delta_sig_free(parsed);
+        }
+        if (dw == NULL || delta_writer_open(dw, fd, parsed) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(ENOMEM));
+                free(dw);
+                return NULL;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: %lld\n", (long long)sb.st_size);
+        return dw;
+}
+
+/*
+ * Parses the arguments of put -d, "blocksize [--] file", and starts
+ * rebuilding the file. Even with bad arguments the reader takes in
+ * the delta, which the client sends anyway.
+ */
+static struct delta_reader *
+open_delta_reader(char *saveptr)
+{
+        struct delta_reader *dr;
+        const char *blocksize;
+        const char *filename;
+        char *value;
+
+        dr = malloc(sizeof(struct delta_reader));
+        if (dr == NULL) {
+                return NULL;
+        }
+        blocksize = strtok_r(NULL, " \r\n", &saveptr);
+        if (blocksize == NULL || next_option(&saveptr, "", &value) != 0 ||
+            (filename = strtok_r(NULL, "\r\n", &saveptr)) == NULL) {
+                delta_reader_open(dr, "", 0);
+                return dr;
+        }
+        delta_reader_open(dr, filename, strtoul(blocksize, NULL, 10));
+        return dr;
+}
+
+/* Finishes a put -d and puts the reply for it in reply. */
+static void
+close_delta_reader(struct delta_reader *dr, char *reply)
+{
+        if (delta_reader_close(dr) == 0) {
+                snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        }
+        else {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(dr->error));
+        }
+        free(dr);
+}
+
+static void
+execute_command(char *input, FILE *ctrlfp, FILE *datafp)
+{
+        const char *command;
+        char *saveptr;
+        
+        command = strtok_r(input, " \r\n", &saveptr);
+        if (command == NULL) {
+                return;
+        }
+        if (strcmp(command, "exit") == 0) {
+                execute_exit_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "echo") == 0) {
+                execute_echo_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rls") == 0) {
+                execute_rls_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rcd") == 0) {
+                execute_rcd_command(saveptr, ctrlfp, datafp);
+                return;
         }
         if (strcmp(command, "rpwd") == 0) {
                 execute_rpwd_command(saveptr, ctrlfp, datafp);
                 return;
         }
-        if (strcmp(command, "get") == 0) {
-                execute_get_command(saveptr, ctrlfp, datafp);
+        if (strcmp(command, "get") == 0) {
+                execute_get_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "put") == 0) {
+                execute_put_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rsize") == 0) {
+                execute_rsize_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rsum") == 0) {
+                execute_rsum_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rstat") == 0) {
+                execute_rstat_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rcp") == 0) {
+                execute_rcp_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "rmv") == 0) {
+                execute_rmv_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "feat") == 0) {
+                execute_feat_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "sig") == 0) {
+                execute_sig_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (strcmp(command, "stats") == 0) {
+                execute_stats_command(saveptr, ctrlfp, datafp);
+                return;
+        }
+        fprintf(ctrlfp, "fail: command not found\n");
+        fflush(ctrlfp);
+}
+
+static void
+execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        (void)saveptr;
+        leave_service(ctrlfp, datafp);
+}
+
+static void
+execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *arg;
+        size_t nbytes;
+
+        arg = strtok_r(NULL, "\r\n", &saveptr);
+        if (arg == NULL) {
+                nbytes = fprintf(datafp, "\n");
+        }
+        else {
+                nbytes = fprintf(datafp, "%s\n", arg);
+        }
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %u\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Parses the arguments of rls, "[-u] [-n limit] [-c cursor] [dir]", and
+ * lists dir, sorted. With -u the entries come unsorted, as the file
+ * system keeps them, a page of at most limit of them at a time; a page
+ * that is not the last ends with the line "/more cursor", which no name
+ * can make, and -c cursor asks for the page after it.
+ */
+static void
+execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *dirname;
+        const struct dirlist *listing;
+        struct dirlist dl;
+        struct stat sb;
+        char *value;
+        char *end;
+        uint64_t start;
+        size_t index;
+        size_t limit;
+        size_t first;
+        size_t last;
+        size_t *order;
+        size_t nbytes;
+        size_t i;
+        int unsorted;
+        int paged;
+        int cached;
+        int opt;
+        int fd;
+
+        unsorted = 0;
+        paged = 0;
+        limit = RLS_PAGE;
+        start = 0;
+        index = 0;
+        while ((opt = next_option(&saveptr, "un:c:", &value)) != 0) {
+                switch (opt) {
+                case 'u':
+                        unsorted = 1;
+                        break;
+                case 'n':
+                        limit = strtoul(value, NULL, 10);
+                        paged = 1;
+                        break;
+                case 'c':
+                        start = strtoull(value, &end, 16);
+                        if (*end == ':') {
+                                index = strtoull(end + 1, &end, 16);
+                        }
+                        paged = *end == '\0' ? 1 : -1;
+                        break;
+                default:
+                        paged = -1;
+                        break;
+                }
+        }
+        if (paged < 0 || (paged && !unsorted) || limit == 0) {
+                fprintf(ctrlfp, "fail: usage: rls [-u] [-n limit] [-c cursor] [dir]\n");
+                fflush(ctrlfp);
+                return;
+        }
+        if (limit > RLS_PAGE_MAX) {
+                limit = RLS_PAGE_MAX;
+        }
+        dirname = strtok_r(NULL, "\r\n", &saveptr);
+        if (dirname == NULL) {
+                dirname = ".";
+        }
+        fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &sb) < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return;
+        }
+        dirlist_init(&dl);
+        listing = &dl;
+        first = 0;
+        cached = dircache_lookup(&sb, &dl) == 0;
+        if (cached && (first = find_cursor(listing, start, index)) > listing->nentries) {
+                /* the entry before the cursor is gone; the file system still knows where it was */
+                dirlist_free(&dl);
+                cached = 0;
+                first = 0;
+        }
+        if (!cached) {
+                if (dirlist_read(fd, start, unsorted ? limit + 1 : 0, &dl) < 0) {
+                        fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                        fflush(ctrlfp);
+                        dirlist_free(&dl);
+                        close(fd);
+                        return;
+                }
+                if (start == 0 && dl.eof) {
+                        dircache_store(fd, &sb, &dl);
+                }
+        }
+        close(fd);
+        nbytes = 0;
+        if (unsorted) {
+                last = first + limit < listing->nentries ? first + limit : listing->nentries;
+                for (i = first; i < last; i++) {
+                        nbytes += fprintf(datafp, "%s\n", dirlist_name(listing, i));
+                }
+                if (last < listing->nentries) {
+                        nbytes += fprintf(datafp, "/more %llx:%zx\n",
+                                          (unsigned long long)listing->entries[last - 1].next,
+                                          index + (last - first));
+                }
+        }
+        else {
+                order = sort_listing(listing);
+                if (order == NULL) {
+                        fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                        fflush(ctrlfp);
+                        dirlist_free(&dl);
+                        return;
+                }
+                for (i = 0; i < listing->nentries; i++) {
+                        nbytes += fprintf(datafp, "%s\n", dirlist_name(listing, order[i]));
+                }
+                free(order);
+        }
+        dirlist_free(&dl);
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Tells where in a cached listing the page after cursor starts, index
+ * being where it used to; past the end if the cursor is not there.
+ */
+static size_t
+find_cursor(const struct dirlist *listing, uint64_t start, size_t index)
+{
+        size_t i;
+
+        if (start == 0) {
+                return 0;
+        }
+        if (index > 0 && index <= listing->nentries && listing->entries[index - 1].next == start) {
+                return index;
+        }
+        for (i = 0; i < listing->nentries; i++) {
+                if (listing->entries[i].next == start) {
+                        return i + 1;
+                }
+        }
+        return listing->nentries + 1;
+}
+
+/* Returns the order of the entries by name, as alphasort has it. */
+static size_t *
+sort_listing(const struct dirlist *listing)
+{
+        size_t *order;
+        size_t i;
+
+        order = malloc((listing->nentries + 1) * sizeof(size_t));
+        if (order == NULL) {
+                return NULL;
+        }
+        for (i = 0; i < listing->nentries; i++) {
+                order[i] = i;
+        }
+        qsort_r(order, listing->nentries, sizeof(size_t), compare_names, (void *)listing);
+        return order;
+}
+
+static int
+compare_names(const void *a, const void *b, void *listing)
+{
+        return strcoll(dirlist_name(listing, *(const size_t *)a),
+                       dirlist_name(listing, *(const size_t *)b));
+}
+
+static void
+execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *dirname;
+
+        (void)datafp;
+        dirname = strtok_r(NULL, "\r\n", &saveptr);
+        if (dirname == NULL) {
+                fprintf(ctrlfp, "fail: usage: rcd dir\n");
+                fflush(ctrlfp);
+                return;
+        }
+        if (chdir(dirname) < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        fprintf(ctrlfp, "succ: 0\n");
+        fflush(ctrlfp);
+}
+
+static void
+execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char buff[BUFF_SIZE];
+        size_t nbytes;
+
+        (void)saveptr;
+        if (getcwd(buff, BUFF_SIZE) == NULL) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        nbytes = fprintf(datafp, "%s\n", buff);
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %u\n", nbytes);
+        fflush(ctrlfp);
+}
+
+static void
+execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ZSTREAM_BLOCK];
+        char *copy;
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        struct zstream_writer *zw;
+        struct sparse_writer *sw;
+        struct uring *ring;
+        struct bulk bulk;
+        struct stat sb;
+        int fd;
+        int directfd;
+        int level;
+        int digest;
+        int sparse;
+        int known;
+        off_t offset;
+        uint32_t crc;
+        size_t nbytes;
+        size_t nsent;
+        size_t n;
+
+        if (take_flag(&saveptr, 'r')) {
+                execute_get_archive(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (take_flag(&saveptr, 'd')) {
+                execute_get_delta(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (take_flag(&saveptr, 'b')) {
+                execute_get_batch(saveptr, ctrlfp, datafp);
+                return;
+        }
+        fd = prepare_get(saveptr, &nbytes, &level, &digest, &sparse, &copy, reply);
+        if (copy != NULL) {
+                fprintf(ctrlfp, "succ: %zu\n", nbytes);
+                fflush(ctrlfp);
+                stats_first_byte(command_start);
+                shaper_pace(transfer_shaper());
+                fwrite(copy, sizeof(char), nbytes, datafp);
+                shaper_charge(transfer_shaper(), nbytes);
+                if (digest) {
+                        crc32c_encode(crc32c(0, copy, nbytes), trailer);
+                        fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+                }
+                fflush(datafp);
+                free(copy);
+                return;
+        }
+        if (fd < 0) {
+                fprintf(ctrlfp, "%s", reply);
+                fflush(ctrlfp);
+                return;
+        }
+        if (level > 0) {
+                zw = open_zstream_writer(fd, nbytes, level);
+                if (zw == NULL) {
+                        fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                        fflush(ctrlfp);
+                        return;
+                }
+                fprintf(ctrlfp, "succ: %zu\n", nbytes);
+                fflush(ctrlfp);
+                stats_first_byte(command_start);
+                shaper_pace(transfer_shaper());
+                while ((n = zstream_read(zw, buff, ZSTREAM_BLOCK)) > 0) {
+                        if (fwrite(buff, sizeof(char), n, datafp) < n) {
+                                break;
+                        }
+                        shaper_charge(transfer_shaper(), n);
+                        shaper_pace(transfer_shaper());
+                }
+                if (digest) {
+                        crc32c_encode(zw->crc, trailer);
+                        fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+                }
+                fflush(datafp);
+                zstream_writer_close(zw);
+                free(zw);
+                return;
+        }
+        if (sparse) {
+                sw = open_sparse_writer(fd, nbytes);
+                if (sw == NULL) {
+                        fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                        fflush(ctrlfp);
+                        return;
+                }
+                /* the size is that of the stream, and the reply says it is one */
+                fprintf(ctrlfp, "succ: %llu sparse\n", (unsigned long long)sw->total);
+                fflush(ctrlfp);
+                stats_first_byte(command_start);
+                shaper_pace(transfer_shaper());
+                while ((n = sparse_read(sw, buff, ZSTREAM_BLOCK)) > 0) {
+                        if (fwrite(buff, sizeof(char), n, datafp) < n) {
+                                break;
+                        }
+                        shaper_charge(transfer_shaper(), n);
+                        shaper_pace(transfer_shaper());
+                }
+                if (digest) {
+                        crc32c_encode(sw->crc, trailer);
+                        fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+                }
+                fflush(datafp);
+                sparse_writer_close(sw);
+                free(sw);
+                return;
+        }
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+        stats_first_byte(command_start);
+        offset = lseek(fd, 0, SEEK_CUR);
+        known = digest && known_digest(fd, offset, nbytes, &sb, &crc) == 0;
+        if (!known) {
+                crc = 0;
+        }
+        bulk_begin(&bulk, fd, offset, nbytes, 0);
+        ring = transfer_ring();
+        directfd = -1;
+        if (ring != NULL && bulk.active) {
+                /* without direct reads the ring would fill the cache it should keep out of */
+                directfd = reopen_direct(fd, O_RDONLY);
+                if (directfd < 0) {
+                        ring = NULL;
+                }
+        }
+        if (ring != NULL) {
+                fflush(datafp);
+                errno = 0;
+                nsent = uring_send_file(ring, fd, directfd, offset, fileno(datafp), nbytes, &crc);
+                bulk_advance(&bulk, nsent);
+                known = 0;
+        }
+        else {
+                /* sendfile never shows us the bytes; each chunk is read back as it goes */
+                nsent = sendfile_from_to(fd, datafp, nbytes, &bulk, transfer_shaper(),
+                                         digest && !known ? &crc : NULL);
+        }
+        /* the file shrank under us; keep the stream in sync unless no one is listening */
+        if (nsent < nbytes && (peer_gone(errno) || fzero_to(datafp, nbytes - nsent) < 0)) {
+                /* a client that went away is nothing to report */
+                digest = 0;
+        }
+        if (digest) {
+                if (!known) {
+                        crc = digest_zeros(crc, nbytes - nsent);
+                        remember_digest(fd, &sb, crc);
+                }
+                crc32c_encode(crc, trailer);
+                fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+        }
+        fflush(datafp);
+        bulk_end(&bulk);
+        if (directfd >= 0) {
+                close(directfd);
+        }
+        close(fd);
+}
+
+static void
+execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        struct uring *ring;
+        struct bulk bulk;
+        int fd;
+        int directfd;
+        int compressed;
+        int sparse;
+        int digest;
+        off_t offset;
+        uint32_t crc;
+        size_t nbytes;
+        size_t nrecv;
+
+        if (take_flag(&saveptr, 'r')) {
+                execute_put_archive(saveptr, ctrlfp, datafp);
+                return;
+        }
+        if (take_flag(&saveptr, 'd')) {
+                execute_put_delta(saveptr, ctrlfp, datafp);
+                return;
+        }
+        fd = prepare_put(saveptr, &nbytes, &compressed, &sparse, &digest, reply);
+        if (compressed) {
+                execute_put_zstream(fd, nbytes, digest, fd < 0 ? reply : NULL, ctrlfp, datafp);
+                return;
+        }
+        if (sparse) {
+                execute_put_sparse(fd, nbytes, digest, fd < 0 ? reply : NULL, ctrlfp, datafp);
+                return;
+        }
+        if (fd < 0) {
+                /* swallow the data so that the channel stays in sync */
+                fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+                if (fd >= 0) {
+                        splice_from_to(fileno(datafp), fd, nbytes, NULL, NULL, NULL);
+                        close(fd);
+                }
+                if (digest) {
+                        read_all(fileno(datafp), (char *)trailer, CRC32C_DIGEST_SIZE);
+                }
+                fprintf(ctrlfp, "%s", reply);
+                fflush(ctrlfp);
+                return;
+        }
+        offset = lseek(fd, 0, SEEK_CUR);
+        bulk_begin(&bulk, fd, offset, nbytes, 1);
+        ring = transfer_ring();
+        directfd = -1;
+        if (ring != NULL && bulk.active) {
+                directfd = reopen_direct(fd, O_WRONLY);
+                if (directfd < 0) {
+                        ring = NULL;
+                }
+        }
+        if (ring != NULL) {
+                nrecv = uring_receive_file(ring, fileno(datafp), fd, directfd, offset, nbytes, &crc);
+                bulk_advance(&bulk, nrecv);
+        }
+        else {
+                /* spliced data is checked as it is stored, from the page cache */
+                crc = 0;
+                nrecv = splice_from_to(fileno(datafp), fd, nbytes, &bulk, transfer_shaper(),
+                                       digest ? &crc : NULL);
+        }
+        if (directfd >= 0) {
+                close(directfd);
+        }
+        if (nrecv < nbytes ||
+            (digest && read_all(fileno(datafp), (char *)trailer, CRC32C_DIGEST_SIZE) < 0)) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                bulk_end(&bulk);
+                upload_close(fd, UPLOAD_SUSPEND);
+                return;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        if (digest) {
+                check_put_digest(trailer, crc, reply);
+        }
+        bulk_end(&bulk);
+        finish_put_file(fd, 0, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/*
+ * Receives a put -z into fd, or only takes it in when failreply says
+ * why the put was refused. As with an archive, nothing past the end of
+ * the stream is read, but for the checksum with digest.
+ */
+static void
+execute_put_zstream(int fd, size_t nbytes, int digest, const char *failreply,
+                    FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ZSTREAM_BLOCK];
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        struct zstream_reader *zr;
+        uint32_t crc;
+        size_t want;
+        ssize_t n;
+        int cut;
+
+        zr = open_zstream_reader(fd, nbytes);
+        if (zr == NULL) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        while ((want = zstream_want(zr)) > 0) {
+                shaper_pace(transfer_shaper());
+                n = read(fileno(datafp), buff, want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                zstream_write(zr, buff, n);
+        }
+        crc = zr->crc;
+        cut = zstream_want(zr) > 0;
+        if (digest && !cut &&
+            read_all(fileno(datafp), (char *)trailer, CRC32C_DIGEST_SIZE) < 0 && zr->error == 0) {
+                zr->error = errno;
+        }
+        fd = close_zstream_reader(zr, failreply, reply);
+        if (digest) {
+                check_put_digest(trailer, crc, reply);
+        }
+        finish_put_file(fd, cut, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/* The same for a put -h, see sparse.h. */
+static void
+execute_put_sparse(int fd, size_t nbytes, int digest, const char *failreply,
+                   FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ZSTREAM_BLOCK];
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        struct sparse_reader *sr;
+        uint32_t crc;
+        size_t want;
+        ssize_t n;
+        int cut;
+
+        sr = open_sparse_reader(fd, nbytes);
+        if (sr == NULL) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        while ((want = sparse_want(sr)) > 0) {
+                shaper_pace(transfer_shaper());
+                n = read(fileno(datafp), buff, want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                sparse_write(sr, buff, n);
+        }
+        crc = sr->crc;
+        cut = sparse_want(sr) > 0;
+        if (digest && !cut &&
+            read_all(fileno(datafp), (char *)trailer, CRC32C_DIGEST_SIZE) < 0 && sr->error == 0) {
+                sr->error = errno;
+        }
+        fd = close_sparse_reader(sr, failreply, reply);
+        if (digest) {
+                check_put_digest(trailer, crc, reply);
+        }
+        finish_put_file(fd, cut, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/*
+ * Sends the difference between a file and the client's copy of it,
+ * whose signature comes first on the data channel, see delta.h.
+ */
+static void
+execute_get_delta(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[DELTA_LITERAL_MAX];
+        char *failreply;
+        char *sig;
+        struct delta_writer *dw;
+        size_t siglen;
+        size_t got;
+        ssize_t n;
+        int fd;
+
+        fd = prepare_delta_get(saveptr, &siglen, reply);
+        failreply = fd < 0 ? reply : NULL;
+        sig = failreply == NULL ? malloc(siglen + 1) : NULL;
+        for (got = 0; got < siglen; got += n) {
+                n = siglen - got < DELTA_LITERAL_MAX ? siglen - got : DELTA_LITERAL_MAX;
+                n = read(fileno(datafp), sig != NULL ? sig + got : buff, n);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+        }
+        if (got < siglen) {
+                free(sig);
+                sig = NULL;
+        }
+        dw = open_delta_writer(fd, sig, siglen, failreply, reply);
+        free(sig);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+        if (dw == NULL) {
+                return;
+        }
+        shaper_pace(transfer_shaper());
+        while ((n = delta_read(dw, buff, DELTA_LITERAL_MAX)) > 0) {
+                if (fwrite(buff, sizeof(char), n, datafp) < (size_t)n) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                shaper_pace(transfer_shaper());
+        }
+        fflush(datafp);
+        delta_writer_close(dw);
+        free(dw);
+}
+
+/*
+ * Rebuilds a file from its current contents and a delta, reading no
+ * further than the end of the delta.
+ */
+static void
+execute_put_delta(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[DELTA_LITERAL_MAX];
+        struct delta_reader *dr;
+        size_t want;
+        ssize_t n;
+
+        dr = open_delta_reader(saveptr);
+        if (dr == NULL) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        while ((want = delta_want(dr)) > 0) {
+                shaper_pace(transfer_shaper());
+                n = read(fileno(datafp), buff, want < DELTA_LITERAL_MAX ? want : DELTA_LITERAL_MAX);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                delta_write(dr, buff, n);
+        }
+        close_delta_reader(dr, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/* Sends a directory tree as one archive, see archive.h. */
+static void
+execute_get_archive(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ARCHIVE_CHUNK];
+        struct archive_writer *aw;
+        size_t n;
+
+        aw = open_archive_writer(saveptr, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+        if (aw == NULL) {
+                return;
+        }
+        shaper_pace(transfer_shaper());
+        while ((n = archive_read(aw, buff, ARCHIVE_CHUNK)) > 0) {
+                if (fwrite(buff, sizeof(char), n, datafp) < n) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                shaper_pace(transfer_shaper());
+        }
+        fflush(datafp);
+        archive_writer_close(aw);
+        free(aw);
+}
+
+/*
+ * Sends the files named in the list that comes first on the data
+ * channel as one archive, see archive.h.
+ */
+static void
+execute_get_batch(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ARCHIVE_CHUNK];
+        unsigned char trailer[CRC32C_DIGEST_SIZE];
+        struct archive_writer *aw;
+        char *failreply;
+        char *list;
+        size_t listlen;
+        ssize_t n;
+        int digest;
+
+        failreply = prepare_batch_get(saveptr, &listlen, &digest, reply) < 0 ? reply : NULL;
+        list = read_name_list(datafp, failreply == NULL ? malloc(listlen + 1) : NULL, listlen);
+        aw = open_batch_writer(list, listlen, failreply, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+        if (aw == NULL) {
+                return;
+        }
+        shaper_pace(transfer_shaper());
+        while ((n = archive_read(aw, buff, ARCHIVE_CHUNK)) > 0) {
+                if (fwrite(buff, sizeof(char), n, datafp) < (size_t)n) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                shaper_pace(transfer_shaper());
+        }
+        if (digest) {
+                crc32c_encode(aw->crc, trailer);
+                fwrite(trailer, sizeof(char), CRC32C_DIGEST_SIZE, datafp);
+        }
+        fflush(datafp);
+        archive_writer_close(aw);
+        free(aw);
+}
+
+/*
+ * Unpacks an archive into the current directory as it arrives. Only
+ * as much as the archive has left is read, so a command sent after it
+ * keeps its data.
+ */
+static void
+execute_put_archive(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        char buff[ARCHIVE_CHUNK];
+        struct archive_reader *ar;
+        size_t want;
+        ssize_t n;
+
+        (void)saveptr;
+        ar = open_archive_reader();
+        if (ar == NULL) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        while ((want = archive_want(ar)) > 0) {
+                shaper_pace(transfer_shaper());
+                n = read(fileno(datafp), buff, want < ARCHIVE_CHUNK ? want : ARCHIVE_CHUNK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(transfer_shaper(), n);
+                archive_write(ar, buff, n);
+        }
+        close_archive_reader(ar, reply);
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/*
+ * Replies with "size mtime", plus with -w the checksum of the last
+ * window bytes, which lets a client decide whether to resume a put.
+ */
+static void
+execute_rsize_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *filename;
+        char *value;
+        struct stat sb;
+        off_t window;
+        uint32_t crc;
+        size_t nbytes;
+        int opt;
+        int fd;
+
+        window = -1;
+        while ((opt = next_option(&saveptr, "w:", &value)) != 0) {
+                window = opt == 'w' ? strtoll(value, NULL, 10) : -2;
+        }
+        filename = strtok_r(NULL, "\r\n", &saveptr);
+        if (filename == NULL || window < -1) {
+                fprintf(ctrlfp, "fail: usage: rsize [-w window] file\n");
+                fflush(ctrlfp);
+                return;
+        }
+        /* a put -c asks with -w, and resumes what the last put left if anything */
+        fd = window >= 0 ? upload_partial(filename) : -1;
+        if (fd < 0) {
+                fd = open(filename, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0 || fstat(fd, &sb) < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return;
+        }
+        if (window < 0) {
+                nbytes = fprintf(datafp, "%lld %lld\n", (long long)sb.st_size, (long long)sb.st_mtime);
+        }
+        else {
+                if (window > sb.st_size) {
+                        window = sb.st_size;
+                }
+                if (crc32c_file(fd, sb.st_size - window, window, &crc) < 0) {
+                        fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                        fflush(ctrlfp);
+                        close(fd);
+                        return;
+                }
+                nbytes = fprintf(datafp, "%lld %lld %08x\n", (long long)sb.st_size,
+                                 (long long)sb.st_mtime, crc);
+        }
+        close(fd);
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Sends the crc32c and the size of a whole file. The checksum comes
+ * from the cache while the file stays as it was, so checking a large
+ * file again costs no reading.
+ */
+static void
+execute_rsum_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *filename;
+        char *value;
+        struct stat sb;
+        uint32_t crc;
+        size_t nbytes;
+        int fd;
+
+        if (next_option(&saveptr, "", &value) != 0 ||
+            (filename = strtok_r(NULL, "\r\n", &saveptr)) == NULL) {
+                fprintf(ctrlfp, "fail: usage: rsum file\n");
+                fflush(ctrlfp);
+                return;
+        }
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &sb) < 0 || sumcache_file(fd, &crc) < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return;
+        }
+        close(fd);
+        nbytes = fprintf(datafp, "%08x %lld\n", crc, (long long)sb.st_size);
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Describes files in one go, a line for each with its size, mtime, mode
+ * and inode, then its name: every entry of a directory, or with -b every
+ * file named in a list that follows on the data channel, as get -b's
+ * does. A name that cannot be looked up gets "! errno name" instead.
+ * Each is looked up with fstatat in its directory, opened only once.
+ */
+static void
+execute_rstat_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char reply[BUFF_SIZE];
+        const char *dirname;
+        char *failreply;
+        char *value;
+        char *list;
+        char *text;
+        size_t listlen;
+        size_t len;
+
+        if (take_flag(&saveptr, 'b')) {
+                failreply = prepare_stat_list(saveptr, &listlen, reply) < 0 ? reply : NULL;
+                list = read_name_list(datafp, failreply == NULL ? malloc(listlen + 1) : NULL, listlen);
+                text = stat_names(AT_FDCWD, list, listlen, failreply, &len, reply);
+        }
+        else if (next_option(&saveptr, "", &value) != 0) {
+                snprintf(reply, BUFF_SIZE, "fail: usage: rstat [dir]\n"
+                                           "      rstat -b listlen\n");
+                text = NULL;
+        }
+        else {
+                dirname = strtok_r(NULL, "\r\n", &saveptr);
+                text = stat_directory(dirname != NULL ? dirname : ".", &len, reply);
+        }
+        if (text != NULL) {
+                fwrite(text, sizeof(char), len, datafp);
+                fflush(datafp);
+                free(text);
+        }
+        fprintf(ctrlfp, "%s", reply);
+        fflush(ctrlfp);
+}
+
+/* The lines of rstat for the entries of a directory, sorted like rls's. */
+static char *
+stat_directory(const char *dirname, size_t *lenp, char *reply)
+{
+        const struct dirlist *listing;
+        struct dirlist dl;
+        struct stat sb;
+        size_t *order;
+        size_t i;
+        char *text;
+        FILE *fp;
+        int fd;
+
+        fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &sb) < 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+        dirlist_init(&dl);
+        listing = &dl;
+        if (dircache_lookup(&sb, &dl) < 0) {
+                if (dirlist_read(fd, 0, 0, &dl) < 0) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        dirlist_free(&dl);
+                        close(fd);
+                        return NULL;
+                }
+                dircache_store(fd, &sb, &dl);
+        }
+        order = sort_listing(listing);
+        text = NULL;
+        fp = order != NULL ? open_memstream(&text, lenp) : NULL;
+        if (fp == NULL) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(order);
+                dirlist_free(&dl);
+                close(fd);
+                return NULL;
+        }
+        for (i = 0; i < listing->nentries; i++) {
+                print_stat(fp, fd, dirlist_name(listing, order[i]), dirlist_name(listing, order[i]));
+        }
+        free(order);
+        dirlist_free(&dl);
+        close(fd);
+        if (fclose(fp) != 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                free(text);
+                return NULL;
+        }
+        snprintf(reply, BUFF_SIZE, "succ: %zu\n", *lenp);
+        return text;
+}
+
+/* Writes the rstat line of name in dirfd, as shown. */
+static void
+print_stat(FILE *fp, int dirfd, const char *name, const char *shown)
+{
+        struct stat sb;
+
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                fprintf(fp, "! %d %s\n", errno, shown);
+                return;
+        }
+        fprintf(fp, "%lld %lld %o %llu %s\n", (long long)sb.st_size, (long long)sb.st_mtime,
+                (unsigned)sb.st_mode, (unsigned long long)sb.st_ino, shown);
+}
+
+/*
+ * Copies a file to another name on the server, so that the data need
+ * not go to the client and back. Replies with how many bytes were
+ * copied and how.
+ */
+static void
+execute_rcp_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *from;
+        const char *to;
+        const char *how;
+        size_t nbytes;
+        off_t copied;
+
+        from = strtok_r(NULL, " \r\n", &saveptr);
+        to = strtok_r(NULL, "\r\n", &saveptr);
+        if (from == NULL || to == NULL) {
+                fprintf(ctrlfp, "fail: usage: rcp from to\n");
+                fflush(ctrlfp);
+                return;
+        }
+        copied = copy_by_name(from, to, &how);
+        if (copied < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        nbytes = fprintf(datafp, "%lld bytes %s\n", (long long)copied, how);
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Renames a file on the server; across file systems it is copied as
+ * by rcp and the original removed.
+ */
+static void
+execute_rmv_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *from;
+        const char *to;
+        const char *how;
+
+        (void)datafp;
+        from = strtok_r(NULL, " \r\n", &saveptr);
+        to = strtok_r(NULL, "\r\n", &saveptr);
+        if (from == NULL || to == NULL) {
+                fprintf(ctrlfp, "fail: usage: rmv from to\n");
+                fflush(ctrlfp);
+                return;
+        }
+        if (rename(from, to) < 0 &&
+            (errno != EXDEV || copy_by_name(from, to, &how) < 0 || unlink(from) < 0)) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                return;
+        }
+        fprintf(ctrlfp, "succ: 0\n");
+        fflush(ctrlfp);
+}
+
+/*
+ * Copies the regular file from to to, which appears whole or not at
+ * all as a put's file does (see upload.h). Returns the size copied, or
+ * -1 with errno set.
+ */
+static off_t
+copy_by_name(const char *from, const char *to, const char **howp)
+{
+        struct stat sb;
+        off_t copied;
+        int fromfd;
+        int tofd;
+        int error;
+
+        fromfd = open(from, O_RDONLY | O_CLOEXEC);
+        if (fromfd < 0) {
+                return -1;
+        }
+        error = 0;
+        if (fstat(fromfd, &sb) < 0) {
+                error = errno;
+        }
+        else if (!S_ISREG(sb.st_mode)) {
+                error = S_ISDIR(sb.st_mode) ? EISDIR : EINVAL;
+        }
+        if (error != 0) {
+                close(fromfd);
+                errno = error;
+                return -1;
+        }
+        /* not preallocated: a clone brings its own blocks */
+        tofd = upload_open(to, 0, O_WRONLY);
+        if (tofd < 0) {
+                error = errno;
+                close(fromfd);
+                errno = error;
+                return -1;
+        }
+        copied = copy_whole_file(fromfd, tofd, howp);
+        error = errno;
+        close(fromfd);
+        if (upload_close(tofd, copied >= 0 ? UPLOAD_COMMIT : UPLOAD_DISCARD) < 0) {
+                return -1;
+        }
+        errno = error;
+        return copied;
+}
+
+/*
+ * Copies all of fromfd into the empty tofd without the data passing
+ * through here if it can: as a clone sharing the blocks where the file
+ * system can do that (FICLONE), else with copy_file_range, which lets
+ * the file system or the storage under it do the copying. Through a
+ * buffer as a last resort. *howp says which it was.
+ */
+static off_t
+copy_whole_file(int fromfd, int tofd, const char **howp)
+{
+        struct stat sb;
+        char *buff;
+        off_t copied;
+        ssize_t n;
+
+        if (ioctl(tofd, FICLONE, fromfd) == 0 && fstat(tofd, &sb) == 0) {
+                *howp = "cloned";
+                return sb.st_size;
+        }
+        *howp = "copied";
+        copied = 0;
+        while ((n = copy_file_range(fromfd, NULL, tofd, NULL, SIZE_MAX >> 1, 0)) > 0) {
+                copied += n;
+        }
+        if (n == 0) {
+                return copied;
+        }
+        if (copied > 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+                return -1;
+        }
+        buff = buffpool_get();
+        if (buff == NULL) {
+                return -1;
+        }
+        while ((n = read(fromfd, buff, buffpool_size())) > 0) {
+                if (write_all(tofd, buff, n) < 0) {
+                        break;
+                }
+                copied += n;
+        }
+        buffpool_put(buff);
+        return n == 0 ? copied : -1;
+}
+
+/*
+ * Lists the optional parts of the protocol, one per line, so that a
+ * client can find out what it may use before it does.
+ */
+static void
+execute_feat_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        size_t nbytes;
+
+        (void)saveptr;
+        nbytes = fprintf(datafp, "mux\nrange\nresume\narchive\ndeflate\ndelta\ndigest\npages\nstats\nbatch\nsparse\n");
+        fflush(datafp);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/* Sends the counters and histograms of the whole server, see stats.h. */
+static void
+execute_stats_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        char *text;
+        size_t nbytes;
+
+        (void)saveptr;
+        text = stats_summary(&nbytes);
+        if (text == NULL) {
+                fprintf(ctrlfp, "fail: statistics are not kept\n");
+                fflush(ctrlfp);
+                return;
+        }
+        fwrite(text, sizeof(char), nbytes, datafp);
+        fflush(datafp);
+        free(text);
+        fprintf(ctrlfp, "succ: %zu\n", nbytes);
+        fflush(ctrlfp);
+}
+
+/*
+ * Sends the signature of a file (see delta.h), with which the client
+ * works out what to send of its newer copy in a put -d.
+ */
+static void
+execute_sig_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+{
+        const char *filename;
+        char *value;
+        char *sig;
+        size_t siglen;
+        struct stat sb;
+        FILE *sigfp;
+        int result;
+        int fd;
+
+        if (next_option(&saveptr, "", &value) != 0 ||
+            (filename = strtok_r(NULL, "\r\n", &saveptr)) == NULL) {
+                fprintf(ctrlfp, "fail: usage: sig file\n");
+                fflush(ctrlfp);
+                return;
+        }
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &sb) < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return;
+        }
+        /*
+         * The signature is made in memory first: the reply has to come
+         * before it, and the client reads neither until it is complete.
+         */
+        sig = NULL;
+        sigfp = open_memstream(&sig, &siglen);
+        result = sigfp != NULL ? delta_sign(fd, delta_block_size(sb.st_size), sigfp) : -1;
+        if (result < 0) {
+                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
+                fflush(ctrlfp);
+        }
+        if (sigfp != NULL) {
+                fclose(sigfp);
+        }
+        close(fd);
+        if (result == 0) {
+                fprintf(ctrlfp, "succ: %zu\n", siglen);
+                fflush(ctrlfp);
+                fwrite(sig, sizeof(char), siglen, datafp);
+                fflush(datafp);
+        }
+        free(sig);
+}
+
+/*
+ * Runs nworkers event loops, one per process, instead of forking per
+ * session. Each worker owns its own pair of listening sockets in a
+ * SO_REUSEPORT group; a classic BPF program steers connections by the
+ * client address, so the control and data connections of a client land
+ * in the same worker and can be paired there.
+ */
+static void
+run_event_engine(const char *ctrlport, const char *dataport, int nworkers)
+{
+        int *acceptfds;
+        pid_t *pids;
+        pid_t pid;
+        int status;
+        int i;
+
+        acceptfds = malloc(sizeof(int) * 2 * nworkers);
+        pids = malloc(sizeof(pid_t) * nworkers);
+        if (acceptfds == NULL || pids == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < nworkers; i++) {
+                acceptfds[2 * i] = create_acceptable_socket(ctrlport, 1);
+                acceptfds[2 * i + 1] = create_acceptable_socket(dataport, 1);
+        }
+        if (nworkers > 1 &&
+            (attach_reuseport_filter(acceptfds[0], nworkers) < 0 ||
+             attach_reuseport_filter(acceptfds[1], nworkers) < 0)) {
+                perror("setsockopt");
+                fprintf(stderr, "mftpd: cannot steer connections, using 1 worker\n");
+                for (i = 1; i < nworkers; i++) {
+                        close(acceptfds[2 * i]);
+                        close(acceptfds[2 * i + 1]);
+                }
+                nworkers = 1;
+        }
+        /*
+         * The parent keeps every listening socket open so that the order
+         * of the reuseport group, which the filter indexes, never changes
+         * while workers come and go.
+         */
+        for (i = 0; i < nworkers; i++) {
+                pids[i] = -1;
+        }
+        for (;;) {
+                for (i = 0; i < nworkers; i++) {
+                        if (pids[i] != -1) {
+                                continue;
+                        }
+                        pids[i] = fork();
+                        if (pids[i] == -1) {
+                                perror("fork");
+                                exit(EXIT_FAILURE);
+                        }
+                        if (pids[i] == 0) {
+                                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                                run_event_worker(acceptfds[2 * i], acceptfds[2 * i + 1]);
+                                _exit(EXIT_FAILURE);
+                        }
+                }
+                pid = waitpid(-1, &status, 0);
+                if (pid < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("waitpid");
+                        exit(EXIT_FAILURE);
+                }
+                for (i = 0; i < nworkers; i++) {
+                        if (pids[i] == pid) {
+                                fprintf(stderr, "mftpd: worker %d exited, restarting\n", i);
+                                pids[i] = -1;
+                        }
+                }
+        }
+}
+
+/*
+ * Hashes the source address of the incoming SYN to a socket index.
+ * Looks at the IP version so that v4 clients of a dual-stack socket
+ * hash the same way on both ports.
+ */
+static int
+attach_reuseport_filter(int sockfd, int nworkers)
+{
+        struct sock_filter code[] = {
+                BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),
+                BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 2),
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+                BPF_STMT(BPF_JMP | BPF_JA, 1),
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+                BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 2654435761U),
+                BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+                BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nworkers),
+                BPF_STMT(BPF_RET | BPF_A, 0),
+        };
+        struct sock_fprog prog;
+
+        prog.len = sizeof(code) / sizeof(code[0]);
+        prog.filter = code;
+        return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+static void
+run_event_worker(int acceptfd_ctrl, int acceptfd_data)
+{
+        struct worker w;
+        struct epoll_event events[MAX_EVENTS];
+        struct watch *wt;
+        struct session *s;
+        uint64_t wakeat;
+        int nevents;
+        int i;
+
+        signal(SIGPIPE, SIG_IGN);
+        w.epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w.epfd < 0) {
+                perror("epoll_create1");
+                exit(EXIT_FAILURE);
+        }
+        w.basefd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (w.basefd < 0) {
+                perror("open");
+                exit(EXIT_FAILURE);
+        }
+        w.unpaired = NULL;
+        w.orphans = NULL;
+        w.pairat = 0;
+        w.dead = NULL;
+        w.throttled = NULL;
+        w.ctrlw.kind = WATCH_LISTEN_CTRL;
+        w.ctrlw.fd = acceptfd_ctrl;
+        w.ctrlw.added = 0;
+        w.ctrlw.events = 0;
+        w.ctrlw.session = NULL;
+        w.dataw.kind = WATCH_LISTEN_DATA;
+        w.dataw.fd = acceptfd_data;
+        w.dataw.added = 0;
+        w.dataw.events = 0;
+        w.dataw.session = NULL;
+        fcntl(acceptfd_ctrl, F_SETFL, O_NONBLOCK);
+        fcntl(acceptfd_data, F_SETFL, O_NONBLOCK);
+        watch_update(&w, &w.ctrlw, EPOLLIN);
+        watch_update(&w, &w.dataw, EPOLLIN);
+        for (;;) {
+                /* wake up for the first session that is held back */
+                wakeat = w.pairat;
+                for (s = w.throttled; s != NULL; s = s->throttlenext) {
+                        if (wakeat == 0 || s->wakeat < wakeat) {
+                                wakeat = s->wakeat;
+                        }
+                }
+                nevents = epoll_wait(w.epfd, events, MAX_EVENTS, wakeat != 0 ? wait_millis(wakeat) : -1);
+                if (nevents < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("epoll_wait");
+                        exit(EXIT_FAILURE);
+                }
+                for (i = 0; i < nevents; i++) {
+                        wt = events[i].data.ptr;
+                        s = wt->session;
+                        switch (wt->kind) {
+                        case WATCH_LISTEN_CTRL:
+                                accept_ctrl_connections(&w);
+                                break;
+                        case WATCH_LISTEN_DATA:
+                                accept_data_connections(&w);
+                                break;
+                        case WATCH_CTRL:
+                                if (s->closed) {
+                                        break;
+                                }
+                                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                                        read_session_input(&w, s);
+                                }
+                                if (!s->closed) {
+                                        advance_session(&w, s);
+                                }
+                                break;
+                        case WATCH_DATA:
+                                if (s->closed) {
+                                        break;
+                                }
+                                if ((events[i].events & (EPOLLHUP | EPOLLERR)) &&
+                                    !(wt->events & (EPOLLIN | EPOLLOUT))) {
+                                        /* the data connection died while idle */
+                                        close_session(&w, s);
+                                        break;
+                                }
+                                advance_session(&w, s);
+                                break;
+                        case WATCH_HELPER:
+                                if (s->closed || s->helperw.fd < 0) {
+                                        break;
+                                }
+                                read_session_helper(s);
+                                if (s->helperw.fd < 0) {
+                                        advance_session(&w, s);
+                                }
+                                break;
+                        case WATCH_ORPHAN:
+                                read_orphan(&w, wt, events[i].events);
+                                break;
+                        }
+                }
+                pair_orphans(&w);
+                wake_sessions(&w);
+                while (w.dead != NULL) {
+                        s = w.dead;
+                        w.dead = s->deadnext;
+                        free(s);
+                }
+        }
+}
+
+static void
+watch_update(struct worker *w, struct watch *wt, unsigned int events)
+{
+        struct epoll_event ev;
+
+        if (wt->fd < 0 || (wt->added && wt->events == events)) {
+                return;
+        }
+        ev.events = events;
+        ev.data.ptr = wt;
+        if (epoll_ctl(w->epfd, wt->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, wt->fd, &ev) < 0) {
+                perror("epoll_ctl");
+                exit(EXIT_FAILURE);
+        }
+        wt->added = 1;
+        wt->events = events;
+}
+
+static void
+accept_ctrl_connections(struct worker *w)
+{
+        struct sockaddr_storage peer;
+        socklen_t peerlen;
+        struct session *s;
+        struct session **tail;
+        int fd;
+
+        for (;;) {
+                peerlen = sizeof(peer);
+                fd = accept4(w->ctrlw.fd, (struct sockaddr *)&peer, &peerlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                                perror("accept");
+                        }
+                        return;
+                }
+                s = calloc(1, sizeof(struct session));
+                if (s == NULL) {
+                        close(fd);
+                        continue;
+                }
+                s->ctrlw.kind = WATCH_CTRL;
+                s->ctrlw.fd = fd;
+                s->ctrlw.session = s;
+                s->dataw.kind = WATCH_DATA;
+                s->dataw.fd = -1;
+                s->dataw.session = s;
+                s->helperw.kind = WATCH_HELPER;
+                s->helperw.fd = -1;
+                s->helperw.session = s;
+                s->peer = peer;
+                s->filefd = -1;
+                s->cwdfd = dup(w->basefd);
+                s->accepted = stats_now();
+                s->statcmd = -1;
+                shaper_init(&s->shaper, peer_weight(&peer));
+                watch_update(w, &s->ctrlw, EPOLLIN);
+                /* a client says its hello right away */
+                read_session_input(w, s);
+                if (s->closed) {
+                        continue;
+                }
+                for (tail = &w->unpaired; *tail != NULL; tail = &(*tail)->pairnext) {
+                }
+                *tail = s;
+                advance_session(w, s);
+        }
+}
+
+/*
+ * Data connections wait as orphans until pair_orphans finds them their
+ * control connection.
+ */
+static void
+accept_data_connections(struct worker *w)
+{
+        struct sockaddr_storage peer;
+        socklen_t peerlen;
+        struct pending *o;
+        int fd;
+
+        for (;;) {
+                peerlen = sizeof(peer);
+                fd = accept4(w->dataw.fd, (struct sockaddr *)&peer, &peerlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                                perror("accept");
+                        }
+                        return;
+                }
+                o = calloc(1, sizeof(struct pending));
+                if (o == NULL) {
+                        close(fd);
+                        continue;
+                }
+                o->fd = fd;
+                o->peer = peer;
+                o->accepted = stats_now();
+                o->watch.kind = WATCH_ORPHAN;
+                o->watch.fd = fd;
+                append_pending(&w->orphans, o);
+                watch_update(w, &o->watch, EPOLLIN | EPOLLRDHUP);
+                read_pair_token(o);
+        }
+}
+
+/* Takes in what an orphan has sent, or lets it go if it is gone. */
+static void
+read_orphan(struct worker *w, struct watch *wt, unsigned int events)
+{
+        struct pending **op;
+        struct pending *o;
+
+        for (op = &w->orphans; *op != NULL && &(*op)->watch != wt; op = &(*op)->next) {
+        }
+        o = *op;
+        if (o == NULL) {
+                return;
+        }
+        if ((o->legacy && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) ||
+            read_pair_token(o) < 0) {
+                /* the client left before its control connection was found */
+                *op = o->next;
+                close(o->fd);
+                free(o);
+                return;
+        }
+        if (o->legacy) {
+                /* it is typing ahead; only watch for it leaving */
+                watch_update(w, &o->watch, EPOLLRDHUP);
+        }
+}
+
+/*
+ * Pairs the orphans with their control connections as far as can be
+ * told, see judge_partner, and sets when to try again for the rest.
+ */
+static void
+pair_orphans(struct worker *w)
+{
+        struct pending **op;
+        struct pending *o;
+        struct session **sp;
+        struct session **match;
+        struct session *s;
+        uint64_t now;
+        int legacy;
+        int verdict;
+
+        w->pairat = 0;
+        now = stats_now();
+        op = &w->orphans;
+        while (*op != NULL) {
+                o = *op;
+                match = NULL;
+                for (sp = &w->unpaired; *sp != NULL; sp = &(*sp)->pairnext) {
+                        s = *sp;
+                        legacy = s->inlen > 0 && match_hello(MUX_HELLO, s->inbuff, s->inlen) < 0 &&
+                                 match_hello(PAIR_HELLO, s->inbuff, s->inlen) < 0;
+                        verdict = judge_partner(o, &s->peer, s->pairtoken, legacy, s->accepted,
+                                                now, &w->pairat);
+                        if (verdict < 0) {
+                                match = NULL;
+                                break;
+                        }
+                        if (verdict > 0 && match == NULL) {
+                                match = sp;
+                        }
+                }
+                if (match == NULL && o->token[0] == '\0') {
+                        op = &o->next;
+                        continue;
+                }
+                *op = o->next;
+                if (match == NULL) {
+                        /* its control connection is gone */
+                        close(o->fd);
+                        free(o);
+                        continue;
+                }
+                s = *match;
+                *match = s->pairnext;
+                s->pairnext = NULL;
+                /* the session watches it from here on */
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, o->fd, NULL);
+                pair_session(w, s, o->fd, o->accepted);
+                free(o);
+        }
+}
+
+static int
+same_peer_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+        const struct sockaddr_in *a4;
+        const struct sockaddr_in *b4;
+        const struct sockaddr_in6 *a6;
+        const struct sockaddr_in6 *b6;
+
+        if (a->ss_family != b->ss_family) {
+                return 0;
+        }
+        if (a->ss_family == AF_INET) {
+                a4 = (const struct sockaddr_in *)a;
+                b4 = (const struct sockaddr_in *)b;
+                return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+        }
+        if (a->ss_family == AF_INET6) {
+                a6 = (const struct sockaddr_in6 *)a;
+                b6 = (const struct sockaddr_in6 *)b;
+                return memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+        }
+        return 0;
+}
+
+static void
+pair_session(struct worker *w, struct session *s, int datafd, uint64_t accepted)
+{
+        s->dataw.fd = datafd;
+        /* nothing is expected on the data connection yet */
+        watch_update(w, &s->dataw, 0);
+        stats_session_start(accepted > s->accepted ? accepted : s->accepted);
+        advance_session(w, s);
+}
+
+static void
+close_session(struct worker *w, struct session *s)
+{
+        struct session **sp;
+
+        if (s->dataw.fd < 0) {
+                for (sp = &w->unpaired; *sp != NULL; sp = &(*sp)->pairnext) {
+                        if (*sp == s) {
+                                *sp = s->pairnext;
+                                break;
+                        }
+                }
+        }
+        if (s->dataw.fd >= 0) {
+                stats_socket(s->ctrlw.fd, &s->ctrlseen);
+                stats_socket(s->dataw.fd, &s->dataseen);
+                stats_session_end();
+        }
+        if (s->throttled) {
+                for (sp = &w->throttled; *sp != NULL; sp = &(*sp)->throttlenext) {
+                        if (*sp == s) {
+                                *sp = s->throttlenext;
+                                break;
+                        }
+                }
+        }
+        shaper_release(&s->shaper);
+        if (s->ctrlw.fd >= 0) {
+                close(s->ctrlw.fd);
+        }
+        if (s->dataw.fd >= 0) {
+                close(s->dataw.fd);
+        }
+        if (s->helperw.fd >= 0) {
+                /* the helper finishes on its own, with no one to tell */
+                close(s->helperw.fd);
+        }
+        free(s->helperbuff);
+        if (s->filefd >= 0) {
+                bulk_end(&s->bulk);
+                /* a put cut short is kept to be resumed */
+                upload_close(s->filefd, UPLOAD_SUSPEND);
+        }
+        close(s->cwdfd);
+        free(s->ctrlout);
+        drop_session_dataout(s);
+        free(s->failreply);
+        if (s->aw != NULL) {
+                archive_writer_close(s->aw);
+                free(s->aw);
+        }
+        if (s->ar != NULL) {
+                archive_reader_close(s->ar);
+                free(s->ar);
+        }
+        if (s->zw != NULL) {
+                zstream_writer_close(s->zw);
+                free(s->zw);
+        }
+        if (s->sw != NULL) {
+                sparse_writer_close(s->sw);
+                free(s->sw);
+        }
+        if (s->zr != NULL) {
+                if (s->zr->fd >= 0) {
+                        upload_close(s->zr->fd, UPLOAD_SUSPEND);
+                        s->zr->fd = -1;
+                }
+                zstream_reader_close(s->zr);
+                free(s->zr);
+        }
+        if (s->sr != NULL) {
+                if (s->sr->fd >= 0) {
+                        upload_close(s->sr->fd, UPLOAD_SUSPEND);
+                        s->sr->fd = -1;
+                }
+                sparse_reader_close(s->sr);
+                free(s->sr);
+        }
+        if (s->dw != NULL) {
+                delta_writer_close(s->dw);
+                free(s->dw);
+        }
+        if (s->dr != NULL) {
+                delta_reader_close(s->dr);
+                free(s->dr);
+        }
+        free(s->sig);
+        s->closed = 1;
+        s->deadnext = w->dead;
+        w->dead = s;
+}
+
+static void
+read_session_input(struct worker *w, struct session *s)
+{
+        ssize_t n;
+
+        while (!s->eof && s->inlen < BUFF_SIZE - 1) {
+                n = read(s->ctrlw.fd, s->inbuff + s->inlen, BUFF_SIZE - 1 - s->inlen);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EAGAIN) {
+                                return;
+                        }
+                        close_session(w, s);
+                        return;
+                }
+                if (n == 0) {
+                        s->eof = 1;
+                        return;
+                }
+                s->inlen += n;
+        }
+}
+
+/*
+ * Runs the session as far as it can go without blocking: finishes
+ * pending output and input, then executes buffered commands one at a
+ * time until one of them has to wait for a socket.
+ */
+static void
+advance_session(struct worker *w, struct session *s)
+{
+        char line[BUFF_SIZE];
+        unsigned int ctrlevents;
+        unsigned int dataevents;
+
+        for (;;) {
+                if (flush_session(s) < 0) {
+                        close_session(w, s);
+                        return;
+                }
+                if (s->ctrloutoff < s->ctrloutlen || s->dataout != NULL ||
+                    s->fileleft > 0 || s->aw != NULL || s->zw != NULL || s->sw != NULL ||
+                    s->dw != NULL || s->receiving || s->helperw.fd >= 0) {
+                        break;
+                }
+                if (s->statcmd >= 0) {
+                        /* the last command is over, its reply and data all written */
+                        stats_command_done(s->statcmd, s->statstart);
+                        stats_socket(s->ctrlw.fd, &s->ctrlseen);
+                        stats_socket(s->dataw.fd, &s->dataseen);
+                        s->statcmd = -1;
+                }
+                if (s->dataw.fd < 0) {
+                        if (match_hello(MUX_HELLO, s->inbuff, s->inlen) == 1) {
+                                hand_off_mux_session(w, s);
+                                return;
+                        }
+                        if (s->pairtoken[0] == '\0' &&
+                            match_hello(PAIR_HELLO, s->inbuff, s->inlen) == 1) {
+                                greet_session(s);
+                                continue;
+                        }
+                        if (s->eof) {
+                                /* gave up before its data connection arrived */
+                                close_session(w, s);
+                                return;
+                        }
+                        break;
+                }
+                if (!next_session_line(s, line)) {
+                        if (s->eof) {
+                                close_session(w, s);
+                                return;
+                        }
+                        break;
+                }
+                s->statcmd = stats_command(line);
+                s->statstart = stats_now();
+                execute_session_command(w, s, line);
+                if (s->closed) {
+                        close_session(w, s);
+                        return;
+                }
+        }
+        ctrlevents = 0;
+        if (!s->eof && s->inlen < BUFF_SIZE - 1) {
+                ctrlevents |= EPOLLIN;
+        }
+        if (s->ctrloutoff < s->ctrloutlen) {
+                ctrlevents |= EPOLLOUT;
+        }
+        dataevents = 0;
+        if (s->wakeat != 0) {
+                /* held back by its limits; the worker wakes it up */
+                throttle_session(w, s);
+        }
+        else if (s->receiving) {
+                dataevents |= EPOLLIN;
+        }
+        else if (s->dataout != NULL || s->fileleft > 0 || s->aw != NULL || s->zw != NULL ||
+                 s->sw != NULL || s->dw != NULL) {
+                dataevents |= EPOLLOUT;
+        }
+        if (ctrlevents == 0 && s->ctrlw.added) {
+                /* stop watching; a closed peer would report EPOLLHUP forever */
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->ctrlw.fd, NULL);
+                s->ctrlw.added = 0;
+        }
+        else {
+                watch_update(w, &s->ctrlw, ctrlevents);
+        }
+        watch_update(w, &s->dataw, dataevents);
+}
+
+/* Returns -1 if the session has to be torn down. */
+static int
+flush_session(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        size_t chunk;
+        size_t nrecv;
+        size_t moved;
+        ssize_t n;
+        int done;
+
+        s->wakeat = 0;
+        if (s->receiving && !s->signing && session_throttled(s)) {
+                /* nothing is taken in until the limits allow it */
+        }
+        else if (s->receiving && s->ar != NULL) {
+                receive_session_archive(s);
+        }
+        else if (s->receiving && s->zr != NULL) {
+                receive_session_zstream(s);
+        }
+        else if (s->receiving && s->sr != NULL) {
+                receive_session_sparse(s);
+        }
+        else if (s->receiving && s->signing) {
+                receive_session_signature(s);
+        }
+        else if (s->receiving && s->dr != NULL) {
+                receive_session_delta(s);
+        }
+        else if (s->receiving) {
+                errno = 0;
+                chunk = s->fileleft;
+                if (chunk > SPLICE_CHUNK) {
+                        /* one step per pass; the other sessions get theirs in between */
+                        chunk = SPLICE_CHUNK;
+                }
+                if (shaper_enabled() && chunk > shaper_quantum(&s->shaper)) {
+                        chunk = shaper_quantum(&s->shaper);
+                }
+                nrecv = splice_from_to(s->dataw.fd, s->filefd, chunk, &s->bulk, NULL,
+                                       s->digest && s->failreply == NULL ? &s->filecrc : NULL);
+                shaper_charge(&s->shaper, nrecv);
+                s->fileleft -= nrecv;
+                if (s->fileleft > 0 && nrecv < chunk && errno != EAGAIN) {
+                        n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, n);
+                        bulk_end(&s->bulk);
+                        upload_close(s->filefd, UPLOAD_SUSPEND);
+                        s->filefd = -1;
+                        s->fileleft = 0;
+                        s->receiving = 0;
+                }
+                else if (s->fileleft == 0 && (done = receive_session_digest(s)) != 0) {
+                        snprintf(reply, BUFF_SIZE, "succ: 0\n");
+                        if (done < 0) {
+                                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        }
+                        else if (s->digest && s->failreply == NULL) {
+                                check_put_digest(s->trailer, s->filecrc, reply);
+                        }
+                        bulk_end(&s->bulk);
+                        finish_put_file(s->filefd, 0, reply);
+                        if (s->failreply != NULL) {
+                                snprintf(reply, BUFF_SIZE, "%s", s->failreply);
+                        }
+                        append_session_reply(s, reply, strlen(reply));
+                        s->filefd = -1;
+                        s->receiving = 0;
+                }
+                if (!s->receiving) {
+                        free(s->failreply);
+                        s->failreply = NULL;
+                }
+        }
+        moved = 0;
+        while (s->dataw.fd >= 0 && !s->receiving && moved < SPLICE_CHUNK) {
+                if (s->dataout != NULL) {
+                        if (s->dataoutoff == s->dataoutlen) {
+                                drop_session_dataout(s);
+                                continue;
+                        }
+                        n = write(s->dataw.fd, s->dataout + s->dataoutoff,
+                                  s->dataoutlen - s->dataoutoff);
+                        if (n < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                if (errno == EAGAIN) {
+                                        break;
+                                }
+                                return -1;
+                        }
+                        s->dataoutoff += n;
+                        moved += n;
+                        continue;
+                }
+                if ((s->aw != NULL || s->zw != NULL || s->sw != NULL || s->dw != NULL ||
+                     s->fileleft > 0) && session_throttled(s)) {
+                        break;
+                }
+                if (s->aw != NULL) {
+                        if (take_session_buffer(s) < 0) {
+                                return -1;
+                        }
+                        s->dataoutlen = archive_read(s->aw, s->dataout, ARCHIVE_CHUNK);
+                        s->dataoutoff = 0;
+                        shaper_charge(&s->shaper, s->dataoutlen);
+                        if (s->dataoutlen == 0) {
+                                drop_session_dataout(s);
+                                if (s->digest && queue_session_digest(s, s->aw->crc) < 0) {
+                                        return -1;
+                                }
+                                archive_writer_close(s->aw);
+                                free(s->aw);
+                                s->aw = NULL;
+                        }
+                        continue;
+                }
+                if (s->zw != NULL) {
+                        if (take_session_buffer(s) < 0) {
+                                return -1;
+                        }
+                        s->dataoutlen = zstream_read(s->zw, s->dataout, ZSTREAM_BLOCK);
+                        s->dataoutoff = 0;
+                        shaper_charge(&s->shaper, s->dataoutlen);
+                        if (s->dataoutlen == 0) {
+                                drop_session_dataout(s);
+                                if (s->digest && queue_session_digest(s, s->zw->crc) < 0) {
+                                        return -1;
+                                }
+                                zstream_writer_close(s->zw);
+                                free(s->zw);
+                                s->zw = NULL;
+                        }
+                        continue;
+                }
+                if (s->sw != NULL) {
+                        if (take_session_buffer(s) < 0) {
+                                return -1;
+                        }
+                        s->dataoutlen = sparse_read(s->sw, s->dataout, buffpool_size());
+                        s->dataoutoff = 0;
+                        shaper_charge(&s->shaper, s->dataoutlen);
+                        if (s->dataoutlen == 0) {
+                                drop_session_dataout(s);
+                                if (s->digest && queue_session_digest(s, s->sw->crc) < 0) {
+                                        return -1;
+                                }
+                                sparse_writer_close(s->sw);
+                                free(s->sw);
+                                s->sw = NULL;
+                        }
+                        continue;
+                }
+                if (s->dw != NULL) {
+                        if (take_session_buffer(s) < 0) {
+                                return -1;
+                        }
+                        s->dataoutlen = delta_read(s->dw, s->dataout, DELTA_LITERAL_MAX);
+                        s->dataoutoff = 0;
+                        shaper_charge(&s->shaper, s->dataoutlen);
+                        if (s->dataoutlen == 0) {
+                                drop_session_dataout(s);
+                                delta_writer_close(s->dw);
+                                free(s->dw);
+                                s->dw = NULL;
+                        }
+                        continue;
+                }
+                if (s->fileleft == 0) {
+                        if (s->filefd >= 0 && s->digest) {
+                                if (!s->crcknown) {
+                                        remember_digest(s->filefd, &s->filestat, s->filecrc);
+                                }
+                                if (queue_session_digest(s, s->filecrc) < 0) {
+                                        return -1;
+                                }
+                        }
+                        if (s->filefd >= 0) {
+                                bulk_end(&s->bulk);
+                                close(s->filefd);
+                                s->filefd = -1;
+                        }
+                        if (s->dataout != NULL) {
+                                continue;
+                        }
+                        break;
+                }
+                chunk = s->fileleft;
+                if (shaper_enabled() && chunk > shaper_quantum(&s->shaper)) {
+                        chunk = shaper_quantum(&s->shaper);
+                }
+                if (s->use_sendfile) {
+                        if (chunk > SPLICE_CHUNK - moved) {
+                                chunk = SPLICE_CHUNK - moved;
+                        }
+                        n = sendfile(s->dataw.fd, s->filefd, NULL, chunk);
+                        if (n < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                if (errno == EAGAIN) {
+                                        break;
+                                }
+                                if (errno != EINVAL && errno != ENOSYS) {
+                                        return -1;
+                                }
+                        }
+                        if (n > 0) {
+                                s->fileleft -= n;
+                                moved += n;
+                                if (s->digest && !s->crcknown) {
+                                        digest_behind(s->filefd, n, &s->filecrc);
+                                }
+                                bulk_advance(&s->bulk, n);
+                                shaper_charge(&s->shaper, n);
+                                continue;
+                        }
+                        /* unsupported, or the file shrank: go through memory */
+                        s->use_sendfile = 0;
+                }
+                if (chunk > buffpool_size()) {
+                        chunk = buffpool_size();
+                }
+                if (take_session_buffer(s) < 0) {
+                        return -1;
+                }
+                n = read(s->filefd, s->dataout, chunk);
+                if (n > 0) {
+                        bulk_advance(&s->bulk, n);
+                }
+                if (n <= 0) {
+                        /* keep the stream in sync with the announced size */
+                        memset(s->dataout, 0, chunk);
+                        n = chunk;
+                }
+                if (s->digest && !s->crcknown) {
+                        s->filecrc = crc32c(s->filecrc, s->dataout, n);
+                }
+                s->dataoutlen = n;
+                s->dataoutoff = 0;
+                s->fileleft -= n;
+                shaper_charge(&s->shaper, n);
+        }
+        while (s->ctrloutoff < s->ctrloutlen) {
+                n = write(s->ctrlw.fd, s->ctrlout + s->ctrloutoff, s->ctrloutlen - s->ctrloutoff);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EAGAIN) {
+                                return 0;
+                        }
+                        return -1;
+                }
+                s->ctrloutoff += n;
+        }
+        s->ctrloutlen = 0;
+        s->ctrloutoff = 0;
+        return 0;
+}
+
+/* Puts a pool buffer in place for the next chunk of data out. */
+static int
+take_session_buffer(struct session *s)
+{
+        s->dataout = buffpool_get();
+        if (s->dataout == NULL) {
+                return -1;
+        }
+        s->dataoutpooled = 1;
+        return 0;
+}
+
+/* Lets go of the data out, whether from the pool or from malloc. */
+static void
+drop_session_dataout(struct session *s)
+{
+        if (s->dataoutpooled) {
+                buffpool_put(s->dataout);
+        }
+        else {
+                free(s->dataout);
+        }
+        s->dataout = NULL;
+        s->dataoutpooled = 0;
+}
+
+/* Cuts the next command out of the input buffer the way fgets would. */
+static int
+next_session_line(struct session *s, char *line)
+{
+        char *newline;
+        size_t len;
+
+        newline = memchr(s->inbuff, '\n', s->inlen);
+        if (newline != NULL) {
+                len = newline - s->inbuff + 1;
+        }
+        else if (s->inlen == BUFF_SIZE - 1 || (s->eof && s->inlen > 0)) {
+                len = s->inlen;
+        }
+        else {
+                return 0;
+        }
+        memcpy(line, s->inbuff, len);
+        line[len] = '\0';
+        memmove(s->inbuff, s->inbuff + len, s->inlen - len);
+        s->inlen -= len;
+        return 1;
+}
+
+/*
+ * get and put are run natively so that their transfers can wait for
+ * the socket. Every other command only produces a reply and some
+ * output, so the ordinary handler runs against memory streams whose
+ * contents are queued on the session; one that may take long runs in
+ * a helper instead.
+ */
+static void
+execute_session_command(struct worker *w, struct session *s, char *line)
+{
+        char buff[BUFF_SIZE];
+        const char *command;
+        char *saveptr;
+        FILE *ctrlfp;
+        FILE *datafp;
+        char *ctrlbuff;
+        size_t ctrllen;
+        int cwdfd;
+
+        if (fchdir(s->cwdfd) < 0) {
+                s->closed = 1;
+                return;
+        }
+        strcpy(buff, line);
+        command = strtok_r(buff, " \r\n", &saveptr);
+        if (command == NULL) {
+                return;
+        }
+        if (strcmp(command, "exit") == 0) {
+                s->closed = 1;
+                return;
+        }
+        if (strcmp(command, "get") == 0) {
+                start_session_get(s, saveptr);
+                return;
+        }
+        if (strcmp(command, "put") == 0) {
+                start_session_put(s, saveptr);
+                return;
+        }
+        if (strcmp(command, "rstat") == 0 && take_flag(&saveptr, 'b')) {
+                start_session_rstat(s, saveptr);
+                return;
+        }
+        if (runs_long(command, saveptr)) {
+                start_session_helper(w, s, line);
+                return;
+        }
+        ctrlbuff = NULL;
+        ctrlfp = open_memstream(&ctrlbuff, &ctrllen);
+        datafp = open_memstream(&s->dataout, &s->dataoutlen);
+        if (ctrlfp == NULL || datafp == NULL) {
+                s->closed = 1;
+                return;
+        }
+        execute_command(line, ctrlfp, datafp);
+        fclose(ctrlfp);
+        fclose(datafp);
+        append_session_reply(s, ctrlbuff, ctrllen);
+        free(ctrlbuff);
+        s->dataoutoff = 0;
+        if (s->dataoutlen == 0) {
+                drop_session_dataout(s);
+        }
+        /* the handler may have changed directory (rcd) */
+        cwdfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cwdfd >= 0) {
+                close(s->cwdfd);
+                s->cwdfd = cwdfd;
+        }
+}
+
+/*
+ * Tells whether a command may go through a whole file: an rcp, or an
+ * rmv across file systems, which copies, a sig, which reads the file
+ * to sign it, and an rsum the checksum cache cannot answer. Whole
+ * listings of a big directory by rls or rstat count too; a page of rls
+ * -u does not. Any of them would hold up every other session of the
+ * worker for as long as it took. saveptr is what follows the command
+ * name, and is used up.
+ */
+static int
+runs_long(const char *command, char *saveptr)
+{
+        struct stat sb;
+        struct stat fromsb;
+        struct stat tosb;
+        char *filename;
+        char *from;
+        char *to;
+        char *slash;
+        char *value;
+        uint32_t crc;
+        size_t limit;
+        int result;
+        int paged;
+        int opt;
+
+        if (strcmp(command, "rcp") == 0 || strcmp(command, "sig") == 0) {
+                return 1;
+        }
+        if (strcmp(command, "rls") == 0 || strcmp(command, "rstat") == 0) {
+                paged = 0;
+                limit = RLS_PAGE;
+                while ((opt = next_option(&saveptr, command[1] == 'l' ? "un:c:" : "", &value)) != 0) {
+                        if (opt == '?') {
+                                return 0;
+                        }
+                        if (opt == 'u') {
+                                paged = 1;
+                        }
+                        if (opt == 'n') {
+                                limit = strtoul(value, NULL, 10);
+                        }
+                }
+                filename = strtok_r(NULL, "\r\n", &saveptr);
+                if ((paged && limit <= RLS_PAGE) || stat(filename != NULL ? filename : ".", &sb) < 0) {
+                        return 0;
+                }
+                return S_ISDIR(sb.st_mode) && sb.st_size > LIST_INLINE_SIZE;
+        }
+        if (strcmp(command, "rsum") == 0) {
+                if (next_option(&saveptr, "", &value) != 0 ||
+                    (filename = strtok_r(NULL, "\r\n", &saveptr)) == NULL || stat(filename, &sb) < 0) {
+                        return 0;
+                }
+                return S_ISREG(sb.st_mode) && sumcache_lookup(&sb, &crc) < 0;
+        }
+        if (strcmp(command, "rmv") != 0) {
+                return 0;
+        }
+        from = strtok_r(NULL, " \r\n", &saveptr);
+        to = strtok_r(NULL, "\r\n", &saveptr);
+        if (from == NULL || to == NULL || lstat(from, &fromsb) < 0) {
+                return 0;
+        }
+        slash = strrchr(to, '/');
+        if (slash == NULL) {
+                result = stat(".", &tosb);
+        }
+        else if (slash == to) {
+                result = stat("/", &tosb);
+        }
+        else {
+                *slash = '\0';
+                result = stat(to, &tosb);
+        }
+        return result == 0 && tosb.st_dev != fromsb.st_dev;
+}
+
+/*
+ * Runs line in a process of its own, detached as a multiplexed session
+ * is, while the worker goes on with its other sessions. The reply and
+ * the output come back through a pipe, and the session takes no other
+ * command until read_session_helper has them.
+ */
+static void
+start_session_helper(struct worker *w, struct session *s, char *line)
+{
+        char reply[BUFF_SIZE];
+        int pipefd[2];
+        int n;
+
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                append_session_reply(s, reply, n);
+                return;
+        }
+        if (fork_and_detach() == 0) {
+                close_inherited_fds(pipefd[1], -1);
+                run_session_helper(line, pipefd[1]);
+                _exit(EXIT_SUCCESS);
+        }
+        close(pipefd[1]);
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        s->helperw.fd = pipefd[0];
+        s->helperw.added = 0;
+        s->helperlen = 0;
+        watch_update(w, &s->helperw, EPOLLIN);
+}
+
+/*
+ * The helper's side: runs the command against memory streams, then
+ * sends the lengths of the reply and the output, and both of them.
+ */
+static void
+run_session_helper(char *line, int fd)
+{
+        size_t lengths[2];
+        char *ctrlbuff;
+        char *databuff;
+        FILE *ctrlfp;
+        FILE *datafp;
+
+        ctrlbuff = NULL;
+        databuff = NULL;
+        ctrlfp = open_memstream(&ctrlbuff, &lengths[0]);
+        datafp = open_memstream(&databuff, &lengths[1]);
+        if (ctrlfp == NULL || datafp == NULL) {
+                return;
+        }
+        execute_command(line, ctrlfp, datafp);
+        fclose(ctrlfp);
+        fclose(datafp);
+        if (write_all(fd, (const char *)lengths, sizeof(lengths)) == 0 &&
+            write_all(fd, ctrlbuff, lengths[0]) == 0) {
+                write_all(fd, databuff, lengths[1]);
+        }
+}
+
+/*
+ * Takes in what the helper sends back. Once it is all in, the reply and
+ * the output are queued as if the worker had run the command; a helper
+ * that died on the way leaves a failure instead.
+ */
+static void
+read_session_helper(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        size_t lengths[2];
+        char *buff;
+        ssize_t n;
+        int error;
+
+        error = EIO;
+        for (;;) {
+                if (s->helperlen == s->helpercap) {
+                        buff = realloc(s->helperbuff, s->helpercap > 0 ? s->helpercap * 2 : BUFF_SIZE);
+                        if (buff == NULL) {
+                                error = ENOMEM;
+                                break;
+                        }
+                        s->helperbuff = buff;
+                        s->helpercap = s->helpercap > 0 ? s->helpercap * 2 : BUFF_SIZE;
+                }
+                n = read(s->helperw.fd, s->helperbuff + s->helperlen, s->helpercap - s->helperlen);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n < 0) {
+                        error = errno;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                s->helperlen += n;
+        }
+        close(s->helperw.fd);
+        s->helperw.fd = -1;
+        s->helperw.added = 0;
+        memset(lengths, 0, sizeof(lengths));
+        if (s->helperlen >= sizeof(lengths)) {
+                memcpy(lengths, s->helperbuff, sizeof(lengths));
+        }
+        if (s->helperlen < sizeof(lengths) || s->helperlen != sizeof(lengths) + lengths[0] + lengths[1]) {
+                n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(error));
+                append_session_reply(s, reply, n);
+                free(s->helperbuff);
+        }
+        else if (lengths[1] == 0) {
+                append_session_reply(s, s->helperbuff + sizeof(lengths), lengths[0]);
+                free(s->helperbuff);
+        }
+        else {
+                append_session_reply(s, s->helperbuff + sizeof(lengths), lengths[0]);
+                /* the output goes out of the same buffer, after the reply */
+                s->dataout = s->helperbuff;
+                s->dataoutoff = sizeof(lengths) + lengths[0];
+                s->dataoutlen = s->helperlen;
+                s->dataoutpooled = 0;
+        }
+        s->helperbuff = NULL;
+        s->helperlen = 0;
+        s->helpercap = 0;
+}
+
+static void
+start_session_get(struct session *s, char *saveptr)
+{
+        char reply[BUFF_SIZE];
+        char *copy;
+        size_t nbytes;
+        int level;
+        int sparse;
+        int fd;
+        int n;
+
+        if (take_flag(&saveptr, 'r')) {
+                s->aw = open_archive_writer(saveptr, reply);
+                s->digest = 0;
+                append_session_reply(s, reply, strlen(reply));
+                return;
+        }
+        if (take_flag(&saveptr, 'b')) {
+                /* the names come first, the way a get -d's signature does */
+                if (prepare_batch_get(saveptr, &s->siglen, &s->digest, reply) < 0) {
+                        s->failreply = strdup(reply);
+                }
+                else {
+                        s->sig = malloc(s->siglen + 1);
+                }
+                s->siggot = 0;
+                s->batch = 1;
+                s->signing = 1;
+                s->receiving = 1;
+                return;
+        }
+        if (take_flag(&saveptr, 'd')) {
+                /* the reply waits for the signature, see receive_session_signature */
+                s->filefd = prepare_delta_get(saveptr, &s->siglen, reply);
+                if (s->filefd < 0) {
+                        s->failreply = strdup(reply);
+                }
+                else {
+                        s->sig = malloc(s->siglen + 1);
+                }
+                s->siggot = 0;
+                s->signing = 1;
+                s->receiving = 1;
+                return;
+        }
+        fd = prepare_get(saveptr, &nbytes, &level, &s->digest, &sparse, &copy, reply);
+        if (copy != NULL) {
+                n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+                append_session_reply(s, reply, n);
+                stats_first_byte(s->statstart);
+                if (s->digest) {
+                        crc32c_encode(crc32c(0, copy, nbytes), (unsigned char *)copy + nbytes);
+                        nbytes += CRC32C_DIGEST_SIZE;
+                        s->digest = 0;
+                }
+                s->dataout = copy;
+                s->dataoutlen = nbytes;
+                s->dataoutoff = 0;
+                s->dataoutpooled = 0;
+                shaper_charge(&s->shaper, nbytes);
+                return;
+        }
+        if (fd < 0) {
+                append_session_reply(s, reply, strlen(reply));
+                return;
+        }
+        if (level > 0) {
+                s->zw = open_zstream_writer(fd, nbytes, level);
+                if (s->zw == NULL) {
+                        n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, n);
+                        return;
+                }
+                n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+                append_session_reply(s, reply, n);
+                stats_first_byte(s->statstart);
+                return;
+        }
+        if (sparse) {
+                s->sw = open_sparse_writer(fd, nbytes);
+                if (s->sw == NULL) {
+                        n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, n);
+                        return;
+                }
+                n = snprintf(reply, BUFF_SIZE, "succ: %llu sparse\n", (unsigned long long)s->sw->total);
+                append_session_reply(s, reply, n);
+                stats_first_byte(s->statstart);
+                return;
+        }
+        n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+        append_session_reply(s, reply, n);
+        stats_first_byte(s->statstart);
+        s->filefd = fd;
+        s->fileoffset = lseek(fd, 0, SEEK_CUR);
+        s->filesize = nbytes;
+        s->fileleft = nbytes;
+        s->filecrc = 0;
+        s->crcknown = s->digest &&
+                      known_digest(fd, s->fileoffset, nbytes, &s->filestat, &s->filecrc) == 0;
+        s->use_sendfile = 1;
+        bulk_begin(&s->bulk, fd, s->fileoffset, nbytes, 0);
+}
+
+/*
+ * Unpacks what has arrived of a put -r, reading no further than the
+ * end of the archive, and replies once it is over.
+ */
+static void
+receive_session_archive(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        char buff[ARCHIVE_CHUNK];
+        size_t want;
+        ssize_t n;
+
+        while ((want = archive_want(s->ar)) > 0) {
+                if (session_throttled(s)) {
+                        return;
+                }
+                n = read(s->dataw.fd, buff, want < ARCHIVE_CHUNK ? want : ARCHIVE_CHUNK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(&s->shaper, n);
+                archive_write(s->ar, buff, n);
+        }
+        close_archive_reader(s->ar, reply);
+        s->ar = NULL;
+        s->receiving = 0;
+        append_session_reply(s, reply, strlen(reply));
+}
+
+/*
+ * Takes in the signature that comes with a get -d and, once it is all
+ * there, replies and starts sending the delta. A refused get only
+ * drops it.
+ */
+static void
+receive_session_signature(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        char buff[BUFF_SIZE];
+        char *text;
+        size_t chunk;
+        size_t len;
+        ssize_t n;
+
+        while (s->siggot < s->siglen) {
+                chunk = s->siglen - s->siggot;
+                if (s->sig == NULL && chunk > BUFF_SIZE) {
+                        chunk = BUFF_SIZE;
+                }
+                n = read(s->dataw.fd, s->sig != NULL ? s->sig + s->siggot : buff, chunk);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                s->siggot += n;
+        }
+        if (s->siggot < s->siglen) {
+                free(s->sig);
+                s->sig = NULL;
+        }
+        if (s->statlist) {
+                /* the names are the session's, whatever directory the worker is in */
+                text = stat_names(s->cwdfd, s->sig, s->siglen, s->failreply, &len, reply);
+                if (text != NULL && len > 0) {
+                        s->dataout = text;
+                        s->dataoutlen = len;
+                        s->dataoutoff = 0;
+                        s->dataoutpooled = 0;
+                }
+                else {
+                        free(text);
+                }
+        }
+        else if (s->batch) {
+                /* the writer takes the names over */
+                s->aw = open_batch_writer(s->sig, s->siglen, s->failreply, reply);
+                s->digest = s->aw != NULL ? s->digest : 0;
+        }
+        else {
+                s->dw = open_delta_writer(s->filefd, s->sig, s->siglen, s->failreply, reply);
+                s->filefd = -1;
+                free(s->sig);
+        }
+        s->sig = NULL;
+        s->batch = 0;
+        s->statlist = 0;
+        free(s->failreply);
+        s->failreply = NULL;
+        s->signing = 0;
+        s->receiving = 0;
+        append_session_reply(s, reply, strlen(reply));
+}
+
+/* The same as for an archive, for a put -d. */
+static void
+receive_session_delta(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        char buff[DELTA_LITERAL_MAX];
+        size_t want;
+        ssize_t n;
+
+        while ((want = delta_want(s->dr)) > 0) {
+                if (session_throttled(s)) {
+                        return;
+                }
+                n = read(s->dataw.fd, buff, want < DELTA_LITERAL_MAX ? want : DELTA_LITERAL_MAX);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(&s->shaper, n);
+                delta_write(s->dr, buff, n);
+        }
+        close_delta_reader(s->dr, reply);
+        s->dr = NULL;
+        s->receiving = 0;
+        append_session_reply(s, reply, strlen(reply));
+}
+
+/* The same for a put -z, see zstream.h, and its checksum with -k. */
+static void
+receive_session_zstream(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        char buff[ZSTREAM_BLOCK];
+        uint32_t crc;
+        size_t want;
+        ssize_t n;
+        int done;
+        int cut;
+        int fd;
+
+        while ((want = zstream_want(s->zr)) > 0) {
+                if (session_throttled(s)) {
+                        return;
+                }
+                n = read(s->dataw.fd, buff, want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(&s->shaper, n);
+                zstream_write(s->zr, buff, n);
+        }
+        crc = s->zr->crc;
+        if (zstream_want(s->zr) == 0) {
+                done = receive_session_digest(s);
+                if (done == 0) {
+                        return;
+                }
+                if (done < 0 && s->zr->error == 0) {
+                        s->zr->error = errno;
+                }
+        }
+        cut = zstream_want(s->zr) > 0;
+        fd = close_zstream_reader(s->zr, s->failreply, reply);
+        if (s->digest) {
+                check_put_digest(s->trailer, crc, reply);
+        }
+        finish_put_file(fd, cut, reply);
+        s->zr = NULL;
+        free(s->failreply);
+        s->failreply = NULL;
+        s->receiving = 0;
+        append_session_reply(s, reply, strlen(reply));
+}
+
+/* The same for a put -h, see sparse.h. */
+static void
+receive_session_sparse(struct session *s)
+{
+        char reply[BUFF_SIZE];
+        char buff[ZSTREAM_BLOCK];
+        uint32_t crc;
+        size_t want;
+        ssize_t n;
+        int done;
+        int cut;
+        int fd;
+
+        while ((want = sparse_want(s->sr)) > 0) {
+                if (session_throttled(s)) {
+                        return;
+                }
+                n = read(s->dataw.fd, buff, want < ZSTREAM_BLOCK ? want : ZSTREAM_BLOCK);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                shaper_charge(&s->shaper, n);
+                sparse_write(s->sr, buff, n);
+        }
+        crc = s->sr->crc;
+        if (sparse_want(s->sr) == 0) {
+                done = receive_session_digest(s);
+                if (done == 0) {
+                        return;
+                }
+                if (done < 0 && s->sr->error == 0) {
+                        s->sr->error = errno;
+                }
+        }
+        cut = sparse_want(s->sr) > 0;
+        fd = close_sparse_reader(s->sr, s->failreply, reply);
+        if (s->digest) {
+                check_put_digest(s->trailer, crc, reply);
+        }
+        finish_put_file(fd, cut, reply);
+        s->sr = NULL;
+        free(s->failreply);
+        s->failreply = NULL;
+        s->receiving = 0;
+        append_session_reply(s, reply, strlen(reply));
+}
+
+static void
+start_session_put(struct session *s, char *saveptr)
+{
+        char reply[BUFF_SIZE];
+        size_t nbytes;
+        int compressed;
+        int sparse;
+        int fd;
+
+        if (take_flag(&saveptr, 'r')) {
+                s->ar = open_archive_reader();
+                if (s->ar == NULL) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, strlen(reply));
+                        return;
+                }
+                s->receiving = 1;
+                return;
+        }
+        if (take_flag(&saveptr, 'd')) {
+                s->dr = open_delta_reader(saveptr);
+                if (s->dr == NULL) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, strlen(reply));
+                        return;
+                }
+                s->receiving = 1;
+                return;
+        }
+        fd = prepare_put(saveptr, &nbytes, &compressed, &sparse, &s->digest, reply);
+        s->trailerlen = 0;
+        if (compressed) {
+                s->zr = open_zstream_reader(fd, nbytes);
+                if (s->zr == NULL) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, strlen(reply));
+                        return;
+                }
+                if (fd < 0) {
+                        s->failreply = strdup(reply);
+                }
+                s->receiving = 1;
+                return;
+        }
+        if (sparse) {
+                s->sr = open_sparse_reader(fd, nbytes);
+                if (s->sr == NULL) {
+                        snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_session_reply(s, reply, strlen(reply));
+                        return;
+                }
+                if (fd < 0) {
+                        s->failreply = strdup(reply);
+                }
+                s->receiving = 1;
+                return;
+        }
+        if (fd < 0) {
+                /* swallow the data so that the channel stays in sync */
+                fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        append_session_reply(s, reply, strlen(reply));
+                        return;
+                }
+                s->failreply = strdup(reply);
+        }
+        s->filefd = fd;
+        s->fileoffset = lseek(fd, 0, SEEK_CUR);
+        s->filesize = nbytes;
+        s->fileleft = nbytes;
+        s->filecrc = 0;
+        s->receiving = 1;
+        if (s->failreply == NULL) {
+                bulk_begin(&s->bulk, fd, s->fileoffset, nbytes, 1);
+        }
+}
+
+/* Starts an rstat -b: the names come first, the way a get -b's do. */
+static void
+start_session_rstat(struct session *s, char *saveptr)
+{
+        char reply[BUFF_SIZE];
+
+        if (prepare_stat_list(saveptr, &s->siglen, reply) < 0) {
+                s->failreply = strdup(reply);
+        }
+        else {
+                s->sig = malloc(s->siglen + 1);
+        }
+        s->siggot = 0;
+        s->statlist = 1;
+        s->signing = 1;
+        s->receiving = 1;
+        if (s->siglen == 0) {
+                /* no data to wait for */
+                receive_session_signature(s);
+        }
+}
+
+/*
+ * Reads the checksum that follows the data of a put -k. Returns 1 once
+ * it is in, straight away without -k, 0 while it has yet to arrive and
+ * -1 if the connection broke.
+ */
+static int
+receive_session_digest(struct session *s)
+{
+        ssize_t n;
+
+        while (s->digest && s->trailerlen < CRC32C_DIGEST_SIZE) {
+                n = read(s->dataw.fd, s->trailer + s->trailerlen, CRC32C_DIGEST_SIZE - s->trailerlen);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return 0;
+                }
+                if (n == 0) {
+                        errno = ECONNRESET;
+                }
+                if (n <= 0) {
+                        return -1;
+                }
+                s->trailerlen += n;
+        }
+        return 1;
+}
+
+/* Queues the checksum that ends a get -k; -1 without memory for it. */
+static int
+queue_session_digest(struct session *s, uint32_t crc)
+{
+        s->dataout = malloc(CRC32C_DIGEST_SIZE);
+        if (s->dataout == NULL) {
+                return -1;
+        }
+        crc32c_encode(crc, (unsigned char *)s->dataout);
+        s->dataoutlen = CRC32C_DIGEST_SIZE;
+        s->dataoutoff = 0;
+        s->digest = 0;
+        return 0;
+}
+
+static void
+append_session_reply(struct session *s, const char *buff, size_t len)
+{
+        char *ctrlout;
+
+        ctrlout = realloc(s->ctrlout, s->ctrloutlen + len);
+        if (ctrlout == NULL) {
+                return;
+        }
+        memcpy(ctrlout + s->ctrloutlen, buff, len);
+        s->ctrlout = ctrlout;
+        s->ctrloutlen += len;
+}
+
+/* Answers a PAIR_HELLO with the token the data connection is to send. */
+static void
+greet_session(struct session *s)
+{
+        char reply[BUFF_SIZE];
+
+        s->inlen -= strlen(PAIR_HELLO);
+        memmove(s->inbuff, s->inbuff + strlen(PAIR_HELLO), s->inlen);
+        new_pair_token(s->pairtoken);
+        snprintf(reply, BUFF_SIZE, "succ: %s\n", s->pairtoken);
+        append_session_reply(s, reply, strlen(reply));
+}
+
+/*
+ * Multiplexed sessions are served by a process of their own, exactly as
+ * the fork engine does. The client waits for the reply to MUX_HELLO
+ * before sending frames, so nothing but the hello has been read.
+ */
+static void
+hand_off_mux_session(struct worker *w, struct session *s)
+{
+        if (fork_and_detach() == 0) {
+                if (fchdir(s->cwdfd) < 0) {
+                        _exit(EXIT_FAILURE);
+                }
+                close_inherited_fds(s->ctrlw.fd, -1);
+                signal(SIGPIPE, SIG_DFL);
+                provide_mux_service(s->ctrlw.fd, s->accepted);
+                _exit(EXIT_SUCCESS);
+        }
+        close_session(w, s);
+}
+
+/*
+ * Tells whether the session has to hold its file data back for now,
+ * and if so sets when it may go on.
+ */
+static int
+session_throttled(struct session *s)
+{
+        uint64_t delay;
+
+        if (!shaper_enabled() || (delay = shaper_delay(&s->shaper)) == 0) {
+                return 0;
+        }
+        s->wakeat = stats_now() + delay;
+        return 1;
+}
+
+/* Puts a held back session on the list the worker wakes up from. */
+static void
+throttle_session(struct worker *w, struct session *s)
+{
+        if (s->throttled) {
+                return;
+        }
+        s->throttled = 1;
+        s->throttlenext = w->throttled;
+        w->throttled = s;
+}
+
+/* Lets the sessions whose time has come go on. */
+static void
+wake_sessions(struct worker *w)
+{
+        struct session *list;
+        struct session *s;
+        uint64_t now;
+
+        list = w->throttled;
+        w->throttled = NULL;
+        now = stats_now();
+        while (list != NULL) {
+                s = list;
+                list = s->throttlenext;
+                s->throttled = 0;
+                if (s->closed) {
+                        continue;
+                }
+                if (s->wakeat > now) {
+                        throttle_session(w, s);
+                        continue;
+                }
+                s->wakeat = 0;
+                advance_session(w, s);
+        }
+}
+
+/*
+ * Serves a session whose control and data traffic share one connection.
+ * Every frame starts with a type byte, a stream id and a payload length,
+ * the latter two as 32-bit big-endian numbers. A control frame from the
+ * client carries one command and opens the stream with its id; the reply
+ * and the data of that command travel on the same id. Transfers of
+ * different streams are interleaved frame by frame, so one session can
+ * run many of them at once.
+ */
+static void
+provide_mux_service(int sockfd, uint64_t accepted)
+{
+        struct mux_session m;
+        struct pollfd pfd;
+        size_t off;
+        uint32_t id;
+        uint32_t len;
+        ssize_t n;
+
+        m.fd = sockfd;
+        m.exiting = 0;
+        m.inbuff = malloc(MUX_HEADER_SIZE + MUX_FRAME_MAX);
+        m.inlen = 0;
+        m.outbuff = NULL;
+        m.outlen = 0;
+        m.outoff = 0;
+        m.outcap = 0;
+        m.streams = NULL;
+        m.statcmd = -1;
+        memset(&m.seen, 0, sizeof(m.seen));
+        shaper_init(&m.shaper, socket_weight(sockfd));
+        m.wakeat = 0;
+        if (m.inbuff == NULL) {
+                return;
+        }
+        if (write_all(sockfd, "succ: 0\n", strlen("succ: 0\n")) < 0) {
+                free(m.inbuff);
+                close(sockfd);
+                return;
+        }
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        stats_session_start(accepted);
+        for (;;) {
+                if (fill_mux_output(&m) < 0) {
+                        break;
+                }
+                if (m.exiting && m.outoff == m.outlen) {
+                        break;
+                }
+                pfd.fd = sockfd;
+                pfd.events = m.exiting ? 0 : POLLIN;
+                if (m.outoff < m.outlen) {
+                        pfd.events |= POLLOUT;
+                }
+                if (poll(&pfd, 1, m.wakeat != 0 ? wait_millis(m.wakeat) : -1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                if (pfd.revents & POLLOUT) {
+                        n = write(sockfd, m.outbuff + m.outoff, m.outlen - m.outoff);
+                        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                                break;
+                        }
+                        if (n > 0) {
+                                m.outoff += n;
+                        }
+                        if (m.outoff == m.outlen) {
+                                m.outoff = 0;
+                                m.outlen = 0;
+                        }
+                }
+                if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+                        continue;
+                }
+                n = read(sockfd, m.inbuff + m.inlen, MUX_HEADER_SIZE + MUX_FRAME_MAX - m.inlen);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                m.inlen += n;
+                off = 0;
+                while (m.inlen - off >= MUX_HEADER_SIZE) {
+                        memcpy(&id, m.inbuff + off + 1, sizeof(id));
+                        memcpy(&len, m.inbuff + off + 5, sizeof(len));
+                        id = ntohl(id);
+                        len = ntohl(len);
+                        if (len > MUX_FRAME_MAX) {
+                                m.exiting = 1;
+                                m.inlen = 0;
+                                break;
+                        }
+                        if (m.inlen - off < MUX_HEADER_SIZE + len) {
+                                break;
+                        }
+                        handle_mux_frame(&m, m.inbuff[off], id, m.inbuff + off + MUX_HEADER_SIZE, len);
+                        off += MUX_HEADER_SIZE + len;
+                }
+                memmove(m.inbuff, m.inbuff + off, m.inlen - off);
+                m.inlen -= off;
+        }
+        while (m.streams != NULL) {
+                /* cut short, so not timed */
+                m.streams->statcmd = -1;
+                remove_mux_stream(&m, m.streams);
+        }
+        stats_socket(sockfd, &m.seen);
+        stats_session_end();
+        shaper_release(&m.shaper);
+        free(m.inbuff);
+        free(m.outbuff);
+        close(sockfd);
+}
+
+static int
+handle_mux_frame(struct mux_session *m, int type, uint32_t id, char *payload, size_t len)
+{
+        char line[BUFF_SIZE];
+
+        if (type == MUX_CTRL) {
+                if (len > BUFF_SIZE - 1) {
+                        len = BUFF_SIZE - 1;
+                }
+                memcpy(line, payload, len);
+                line[len] = '\0';
+                execute_mux_command(m, id, line);
+                return 0;
+        }
+        if (type == MUX_DATA) {
+                receive_mux_data(m, id, payload, len);
+                return 0;
+        }
+        return -1;
+}
+
+/*
+ * Executes a command. One that goes on with a stream is timed until the
+ * stream is removed, any other right here.
+ */
+static void
+execute_mux_command(struct mux_session *m, uint32_t id, char *line)
+{
+        m->statcmd = stats_command(line);
+        m->statstart = stats_now();
+        start_mux_command(m, id, line);
+        if (m->statcmd >= 0) {
+                stats_command_done(m->statcmd, m->statstart);
+                stats_socket(m->fd, &m->seen);
+                m->statcmd = -1;
+        }
+}
+
+static void
+start_mux_command(struct mux_session *m, uint32_t id, char *line)
+{
+        char buff[BUFF_SIZE];
+        const char *command;
+        char *saveptr;
+        FILE *ctrlfp;
+        FILE *datafp;
+        char *ctrlbuff;
+        size_t ctrllen;
+        struct mux_stream *ms;
+
+        strcpy(buff, line);
+        command = strtok_r(buff, " \r\n", &saveptr);
+        if (command == NULL) {
+                return;
+        }
+        if (strcmp(command, "exit") == 0) {
+                m->exiting = 1;
+                return;
+        }
+        if (strcmp(command, "get") == 0) {
+                start_mux_get(m, id, saveptr);
+                return;
+        }
+        if (strcmp(command, "put") == 0) {
+                start_mux_put(m, id, saveptr);
+                return;
+        }
+        if (strcmp(command, "rstat") == 0 && take_flag(&saveptr, 'b')) {
+                start_mux_rstat(m, id, saveptr);
                 return;
         }
-        if (strcmp(command, "put") == 0) {
-                execute_put_command(saveptr, ctrlfp, datafp);
+        ms = add_mux_stream(m, id);
+        if (ms == NULL) {
                 return;
         }
-        fprintf(ctrlfp, "fail: command not found\n");
-        fflush(ctrlfp);
+        ctrlbuff = NULL;
+        ctrlfp = open_memstream(&ctrlbuff, &ctrllen);
+        datafp = open_memstream(&ms->buff, &ms->len);
+        if (ctrlfp == NULL || datafp == NULL) {
+                m->exiting = 1;
+                return;
+        }
+        execute_command(line, ctrlfp, datafp);
+        fclose(ctrlfp);
+        fclose(datafp);
+        append_mux_frame(m, MUX_CTRL, id, ctrlbuff, ctrllen);
+        free(ctrlbuff);
+        ms->left = ms->len;
+        if (ms->left == 0) {
+                remove_mux_stream(m, ms);
+        }
 }
 
 static void
-execute_exit_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+start_mux_get(struct mux_session *m, uint32_t id, char *saveptr)
 {
-        (void)saveptr;
-        (void)ctrlfp;
-        (void)datafp;
-        _exit(EXIT_SUCCESS);
+        char reply[BUFF_SIZE];
+        char *copy;
+        struct mux_stream *ms;
+        size_t nbytes;
+        int level;
+        int digest;
+        int sparse;
+        int fd;
+        int n;
+
+        if (take_flag(&saveptr, 'r')) {
+                ms = add_mux_stream(m, id);
+                if (ms == NULL) {
+                        return;
+                }
+                ms->aw = open_archive_writer(saveptr, reply);
+                append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                if (ms->aw == NULL) {
+                        remove_mux_stream(m, ms);
+                }
+                return;
+        }
+        if (take_flag(&saveptr, 'b')) {
+                /* the names arrive first, like a get -d's signature */
+                ms = add_mux_stream(m, id);
+                if (ms == NULL) {
+                        return;
+                }
+                ms->incoming = 1;
+                ms->signing = 1;
+                ms->batch = 1;
+                if (prepare_batch_get(saveptr, &ms->left, &ms->digest, reply) < 0) {
+                        ms->failreply = strdup(reply);
+                }
+                else {
+                        ms->buff = malloc(ms->left + 1);
+                }
+                receive_mux_data(m, id, NULL, 0);
+                return;
+        }
+        if (take_flag(&saveptr, 'd')) {
+                /* the signature arrives on the stream first, then it turns around */
+                ms = add_mux_stream(m, id);
+                if (ms == NULL) {
+                        return;
+                }
+                ms->incoming = 1;
+                ms->signing = 1;
+                ms->fd = prepare_delta_get(saveptr, &ms->left, reply);
+                if (ms->fd < 0) {
+                        ms->failreply = strdup(reply);
+                }
+                else {
+                        ms->buff = malloc(ms->left + 1);
+                }
+                receive_mux_data(m, id, NULL, 0);
+                return;
+        }
+        fd = prepare_get(saveptr, &nbytes, &level, &digest, &sparse, &copy, reply);
+        if (copy != NULL) {
+                ms = add_mux_stream(m, id);
+                if (ms == NULL) {
+                        free(copy);
+                        return;
+                }
+                ms->digest = digest;
+                n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+                append_mux_frame(m, MUX_CTRL, id, reply, n);
+                stats_first_byte(ms->statstart);
+                /* sent like a listing, from memory */
+                ms->buff = copy;
+                ms->left = nbytes;
+                shaper_charge(&m->shaper, nbytes);
+                if (ms->left == 0) {
+                        append_mux_digest(m, ms, 0);
+                        remove_mux_stream(m, ms);
+                }
+                return;
+        }
+        if (fd < 0) {
+                append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                return;
+        }
+        ms = add_mux_stream(m, id);
+        if (ms == NULL) {
+                close(fd);
+                return;
+        }
+        ms->digest = digest;
+        if (level > 0) {
+                ms->zw = open_zstream_writer(fd, nbytes, level);
+                if (ms->zw == NULL) {
+                        n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_mux_frame(m, MUX_CTRL, id, reply, n);
+                        remove_mux_stream(m, ms);
+                        return;
+                }
+                n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+                append_mux_frame(m, MUX_CTRL, id, reply, n);
+                stats_first_byte(ms->statstart);
+                return;
+        }
+        if (sparse) {
+                ms->sw = open_sparse_writer(fd, nbytes);
+                if (ms->sw == NULL) {
+                        n = snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(errno));
+                        append_mux_frame(m, MUX_CTRL, id, reply, n);
+                        remove_mux_stream(m, ms);
+                        return;
+                }
+                n = snprintf(reply, BUFF_SIZE, "succ: %llu sparse\n", (unsigned long long)ms->sw->total);
+                append_mux_frame(m, MUX_CTRL, id, reply, n);
+                stats_first_byte(ms->statstart);
+                return;
+        }
+        n = snprintf(reply, BUFF_SIZE, "succ: %zu\n", nbytes);
+        append_mux_frame(m, MUX_CTRL, id, reply, n);
+        stats_first_byte(ms->statstart);
+        ms->fd = fd;
+        ms->left = nbytes;
+        bulk_begin(&ms->bulk, fd, lseek(fd, 0, SEEK_CUR), nbytes, 0);
+        if (ms->left == 0) {
+                append_mux_digest(m, ms, 0);
+                remove_mux_stream(m, ms);
+        }
 }
 
 static void
-execute_echo_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+start_mux_put(struct mux_session *m, uint32_t id, char *saveptr)
 {
-        const char *arg;
-        size_t nbytes;
+        char reply[BUFF_SIZE];
+        struct mux_stream *ms;
+        int compressed;
+        int sparse;
 
-        arg = strtok_r(NULL, "\r\n", &saveptr);
-        if (arg == NULL) {
-                nbytes = fprintf(datafp, "\n");
+        ms = add_mux_stream(m, id);
+        if (ms == NULL) {
+                return;
         }
-        else {
-                nbytes = fprintf(datafp, "%s\n", arg);
+        ms->incoming = 1;
+        if (take_flag(&saveptr, 'r')) {
+                ms->ar = open_archive_reader();
+                if (ms->ar == NULL) {
+                        append_mux_frame(m, MUX_CTRL, id, "fail: out of memory\n",
+                                         strlen("fail: out of memory\n"));
+                        remove_mux_stream(m, ms);
+                }
+                return;
         }
-        fflush(datafp);
-        fprintf(ctrlfp, "succ: %u\n", nbytes);
-        fflush(ctrlfp);
+        if (take_flag(&saveptr, 'd')) {
+                ms->dr = open_delta_reader(saveptr);
+                if (ms->dr == NULL) {
+                        append_mux_frame(m, MUX_CTRL, id, "fail: out of memory\n",
+                                         strlen("fail: out of memory\n"));
+                        remove_mux_stream(m, ms);
+                }
+                return;
+        }
+        ms->fd = prepare_put(saveptr, &ms->left, &compressed, &sparse, &ms->digest, reply);
+        if (ms->fd < 0) {
+                /* the data still arrives on this stream and is dropped */
+                ms->failreply = strdup(reply);
+                ms->error = EINVAL;
+        }
+        if (compressed) {
+                ms->zr = open_zstream_reader(ms->fd, ms->left);
+                ms->fd = -1;
+                if (ms->zr == NULL) {
+                        append_mux_frame(m, MUX_CTRL, id, "fail: out of memory\n",
+                                         strlen("fail: out of memory\n"));
+                        remove_mux_stream(m, ms);
+                        return;
+                }
+        }
+        else if (sparse) {
+                ms->sr = open_sparse_reader(ms->fd, ms->left);
+                ms->fd = -1;
+                if (ms->sr == NULL) {
+                        append_mux_frame(m, MUX_CTRL, id, "fail: out of memory\n",
+                                         strlen("fail: out of memory\n"));
+                        remove_mux_stream(m, ms);
+                        return;
+                }
+        }
+        else if (ms->fd >= 0) {
+                bulk_begin(&ms->bulk, ms->fd, lseek(ms->fd, 0, SEEK_CUR), ms->left, 1);
+        }
+        receive_mux_data(m, id, NULL, 0);
 }
 
+/* Starts an rstat -b, whose names arrive on the stream first. */
 static void
-execute_rls_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+start_mux_rstat(struct mux_session *m, uint32_t id, char *saveptr)
 {
-        const char *dirname;
-        struct dirent **direntv;
-        int direntc;
-        int i;
-        size_t nbytes;
+        char reply[BUFF_SIZE];
+        struct mux_stream *ms;
 
-        dirname = strtok_r(NULL, "\r\n", &saveptr);
-        if (dirname == NULL) {
-                dirname = ".";
-        }
-        direntc = scandir(dirname, &direntv, NULL, alphasort);
-        if (direntc < 0) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
+        ms = add_mux_stream(m, id);
+        if (ms == NULL) {
                 return;
         }
-        nbytes = 0;
-        for (i = 0; i < direntc; i++) {
-                nbytes += fprintf(datafp, "%s\n", direntv[i]->d_name);
-                free(direntv[i]);
+        ms->incoming = 1;
+        ms->signing = 1;
+        ms->statlist = 1;
+        if (prepare_stat_list(saveptr, &ms->left, reply) < 0) {
+                ms->failreply = strdup(reply);
         }
-        fflush(datafp);
-        fprintf(ctrlfp, "succ: %u\n", nbytes);
-        fflush(ctrlfp);
-        free(direntv);
+        else {
+                ms->buff = malloc(ms->left + 1);
+        }
+        receive_mux_data(m, id, NULL, 0);
 }
 
 static void
-execute_rcd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+receive_mux_data(struct mux_session *m, uint32_t id, const char *payload, size_t len)
 {
-        const char *dirname;
+        char reply[BUFF_SIZE];
+        struct mux_stream *ms;
+        uint32_t crc;
+        size_t chunk;
+        int fd;
 
-        (void)datafp;
-        dirname = strtok_r(NULL, "\r\n", &saveptr);
-        if (dirname == NULL) {
-                fprintf(ctrlfp, "fail: usage: rcd dir\n");
-                fflush(ctrlfp);
+        for (ms = m->streams; ms != NULL; ms = ms->next) {
+                if (ms->id == id && ms->incoming) {
+                        break;
+                }
+        }
+        if (ms == NULL) {
                 return;
         }
-        if (chdir(dirname) < 0) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
+        if (ms->ar != NULL) {
+                archive_write(ms->ar, payload, len);
+                if (archive_want(ms->ar) == 0) {
+                        close_archive_reader(ms->ar, reply);
+                        ms->ar = NULL;
+                        append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                        remove_mux_stream(m, ms);
+                }
                 return;
         }
-        fprintf(ctrlfp, "succ: 0\n");
-        fflush(ctrlfp);
+        if (ms->dr != NULL) {
+                delta_write(ms->dr, payload, len);
+                if (delta_want(ms->dr) == 0) {
+                        close_delta_reader(ms->dr, reply);
+                        ms->dr = NULL;
+                        append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                        remove_mux_stream(m, ms);
+                }
+                return;
+        }
+        if (ms->signing) {
+                receive_mux_signature(m, ms, payload, len);
+                return;
+        }
+        if (ms->zr != NULL) {
+                while (len > 0 && (chunk = zstream_want(ms->zr)) > 0) {
+                        chunk = chunk < len ? chunk : len;
+                        zstream_write(ms->zr, payload, chunk);
+                        payload += chunk;
+                        len -= chunk;
+                }
+                if (zstream_want(ms->zr) > 0 || !receive_mux_digest(ms, payload, len)) {
+                        return;
+                }
+                crc = ms->zr->crc;
+                fd = close_zstream_reader(ms->zr, ms->failreply, reply);
+                ms->zr = NULL;
+                if (ms->digest) {
+                        check_put_digest(ms->trailer, crc, reply);
+                }
+                finish_put_file(fd, 0, reply);
+                append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                remove_mux_stream(m, ms);
+                return;
+        }
+        if (ms->sr != NULL) {
+                while (len > 0 && (chunk = sparse_want(ms->sr)) > 0) {
+                        chunk = chunk < len ? chunk : len;
+                        sparse_write(ms->sr, payload, chunk);
+                        payload += chunk;
+                        len -= chunk;
+                }
+                if (sparse_want(ms->sr) > 0 || !receive_mux_digest(ms, payload, len)) {
+                        return;
+                }
+                crc = ms->sr->crc;
+                fd = close_sparse_reader(ms->sr, ms->failreply, reply);
+                ms->sr = NULL;
+                if (ms->digest) {
+                        check_put_digest(ms->trailer, crc, reply);
+                }
+                finish_put_file(fd, 0, reply);
+                append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+                remove_mux_stream(m, ms);
+                return;
+        }
+        chunk = len < ms->left ? len : ms->left;
+        if (ms->error == 0 && write_all(ms->fd, payload, chunk) < 0) {
+                ms->error = errno;
+        }
+        bulk_advance(&ms->bulk, chunk);
+        ms->crc = crc32c(ms->crc, payload, chunk);
+        ms->left -= chunk;
+        if (ms->left > 0 || !receive_mux_digest(ms, payload + chunk, len - chunk)) {
+                return;
+        }
+        bulk_end(&ms->bulk);
+        if (ms->failreply != NULL) {
+                snprintf(reply, BUFF_SIZE, "%s", ms->failreply);
+        }
+        else if (ms->error != 0) {
+                snprintf(reply, BUFF_SIZE, "fail: %s\n", strerror(ms->error));
+        }
+        else {
+                snprintf(reply, BUFF_SIZE, "succ: 0\n");
+        }
+        if (ms->digest) {
+                check_put_digest(ms->trailer, ms->crc, reply);
+        }
+        finish_put_file(ms->fd, 0, reply);
+        ms->fd = -1;
+        append_mux_frame(m, MUX_CTRL, id, reply, strlen(reply));
+        remove_mux_stream(m, ms);
+}
+
+/*
+ * Takes in what there is of the checksum that follows the data of a
+ * put -k. Returns 1 once it is all in, or without -k.
+ */
+static int
+receive_mux_digest(struct mux_stream *ms, const char *payload, size_t len)
+{
+        if (!ms->digest) {
+                return 1;
+        }
+        if (len > CRC32C_DIGEST_SIZE - ms->trailerlen) {
+                len = CRC32C_DIGEST_SIZE - ms->trailerlen;
+        }
+        if (len > 0) {
+                memcpy(ms->trailer + ms->trailerlen, payload, len);
+                ms->trailerlen += len;
+        }
+        return ms->trailerlen == CRC32C_DIGEST_SIZE;
+}
+
+/*
+ * Sends the checksum that ends a get -k, if it is one. The bytes were
+ * all read here, so crc has been worked out on the way.
+ */
+static int
+append_mux_digest(struct mux_session *m, struct mux_stream *ms, uint32_t crc)
+{
+        char *payload;
+
+        if (!ms->digest) {
+                return 0;
+        }
+        payload = reserve_mux_frame(m, CRC32C_DIGEST_SIZE);
+        if (payload == NULL) {
+                return -1;
+        }
+        crc32c_encode(crc, (unsigned char *)payload);
+        append_mux_frame(m, MUX_DATA, ms->id, NULL, CRC32C_DIGEST_SIZE);
+        return 0;
 }
 
+/*
+ * Collects the signature of a get -d in ms->buff, ms->left bytes still
+ * to come; once it is complete the stream replies and turns outgoing.
+ */
 static void
-execute_rpwd_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+receive_mux_signature(struct mux_session *m, struct mux_stream *ms, const char *payload, size_t len)
 {
-        char buff[BUFF_SIZE];
-        size_t nbytes;
+        char reply[BUFF_SIZE];
+        char *text;
+        size_t textlen;
 
-        (void)saveptr;
-        if (getcwd(buff, BUFF_SIZE) == NULL) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
+        if (len > ms->left) {
+                len = ms->left;
+        }
+        if (ms->buff != NULL && len > 0) {
+                memcpy(ms->buff + ms->len, payload, len);
+        }
+        ms->len += len;
+        ms->left -= len;
+        if (ms->left > 0) {
                 return;
         }
-        nbytes = fprintf(datafp, "%s\n", buff);
-        fflush(datafp);
-        fprintf(ctrlfp, "succ: %u\n", nbytes);
-        fflush(ctrlfp);
+        text = NULL;
+        textlen = 0;
+        if (ms->statlist) {
+                text = stat_names(AT_FDCWD, ms->buff, ms->len, ms->failreply, &textlen, reply);
+        }
+        else if (ms->batch) {
+                ms->aw = open_batch_writer(ms->buff, ms->len, ms->failreply, reply);
+        }
+        else {
+                ms->dw = open_delta_writer(ms->fd, ms->buff, ms->len, ms->failreply, reply);
+                ms->fd = -1;
+                free(ms->buff);
+        }
+        /* the lines of an rstat -b go out like a listing, from memory */
+        ms->buff = text;
+        ms->left = textlen;
+        ms->len = 0;
+        ms->signing = 0;
+        ms->incoming = 0;
+        append_mux_frame(m, MUX_CTRL, ms->id, reply, strlen(reply));
+        if (ms->dw == NULL && ms->aw == NULL && ms->left == 0) {
+                remove_mux_stream(m, ms);
+        }
+}
+
+/*
+ * Tops up the output buffer with one data frame from each outgoing
+ * stream in turn, so concurrent transfers share the connection.
+ */
+static int
+fill_mux_output(struct mux_session *m)
+{
+        struct mux_stream *ms;
+        struct mux_stream *next;
+        size_t chunk;
+        char *payload;
+        ssize_t n;
+
+        m->wakeat = 0;
+        for (ms = m->streams; ms != NULL && m->outlen - m->outoff < MUX_FRAME_MAX; ms = next) {
+                next = ms->next;
+                if (ms->incoming) {
+                        continue;
+                }
+                if ((ms->fd >= 0 || ms->aw != NULL || ms->dw != NULL || ms->zw != NULL ||
+                     ms->sw != NULL) && mux_throttled(m)) {
+                        /* file data waits; replies and listings go on */
+                        continue;
+                }
+                if (ms->aw != NULL) {
+                        payload = reserve_mux_frame(m, MUX_FRAME_MAX);
+                        if (payload == NULL) {
+                                return -1;
+                        }
+                        chunk = archive_read(ms->aw, payload, MUX_FRAME_MAX);
+                        if (chunk == 0) {
+                                if (append_mux_digest(m, ms, ms->aw->crc) < 0) {
+                                        return -1;
+                                }
+                                remove_mux_stream(m, ms);
+                                continue;
+                        }
+                        shaper_charge(&m->shaper, chunk);
+                        append_mux_frame(m, MUX_DATA, ms->id, NULL, chunk);
+                        continue;
+                }
+                if (ms->dw != NULL) {
+                        payload = reserve_mux_frame(m, MUX_FRAME_MAX);
+                        if (payload == NULL) {
+                                return -1;
+                        }
+                        chunk = delta_read(ms->dw, payload, MUX_FRAME_MAX);
+                        if (chunk == 0) {
+                                remove_mux_stream(m, ms);
+                                continue;
+                        }
+                        shaper_charge(&m->shaper, chunk);
+                        append_mux_frame(m, MUX_DATA, ms->id, NULL, chunk);
+                        continue;
+                }
+                if (ms->zw != NULL) {
+                        payload = reserve_mux_frame(m, MUX_FRAME_MAX);
+                        if (payload == NULL) {
+                                return -1;
+                        }
+                        chunk = zstream_read(ms->zw, payload, MUX_FRAME_MAX);
+                        if (chunk == 0) {
+                                if (append_mux_digest(m, ms, ms->zw->crc) < 0) {
+                                        return -1;
+                                }
+                                remove_mux_stream(m, ms);
+                                continue;
+                        }
+                        shaper_charge(&m->shaper, chunk);
+                        append_mux_frame(m, MUX_DATA, ms->id, NULL, chunk);
+                        continue;
+                }
+                if (ms->sw != NULL) {
+                        payload = reserve_mux_frame(m, MUX_FRAME_MAX);
+                        if (payload == NULL) {
+                                return -1;
+                        }
+                        chunk = sparse_read(ms->sw, payload, MUX_FRAME_MAX);
+                        if (chunk == 0) {
+                                if (append_mux_digest(m, ms, ms->sw->crc) < 0) {
+                                        return -1;
+                                }
+                                remove_mux_stream(m, ms);
+                                continue;
+                        }
+                        shaper_charge(&m->shaper, chunk);
+                        append_mux_frame(m, MUX_DATA, ms->id, NULL, chunk);
+                        continue;
+                }
+                chunk = ms->left;
+                if (chunk > MUX_FRAME_MAX) {
+                        chunk = MUX_FRAME_MAX;
+                }
+                payload = reserve_mux_frame(m, chunk);
+                if (payload == NULL) {
+                        return -1;
+                }
+                if (ms->fd >= 0) {
+                        n = read(ms->fd, payload, chunk);
+                        if (n > 0) {
+                                chunk = n;
+                                bulk_advance(&ms->bulk, n);
+                        }
+                        else {
+                                /* keep the stream in sync with the announced size */
+                                memset(payload, 0, chunk);
+                        }
+                        shaper_charge(&m->shaper, chunk);
+                }
+                else {
+                        memcpy(payload, ms->buff + ms->off, chunk);
+                        ms->off += chunk;
+                }
+                if (ms->digest) {
+                        ms->crc = crc32c(ms->crc, payload, chunk);
+                }
+                append_mux_frame(m, MUX_DATA, ms->id, NULL, chunk);
+                ms->left -= chunk;
+                if (ms->left == 0) {
+                        if (append_mux_digest(m, ms, ms->crc) < 0) {
+                                return -1;
+                        }
+                        remove_mux_stream(m, ms);
+                }
+        }
+        return 0;
+}
+
+/*
+ * Tells whether file data has to wait for the session's limits, and if
+ * so sets when the poll loop looks again.
+ */
+static int
+mux_throttled(struct mux_session *m)
+{
+        uint64_t delay;
+
+        if (!shaper_enabled()) {
+                return 0;
+        }
+        if (m->wakeat != 0) {
+                return 1;
+        }
+        delay = shaper_delay(&m->shaper);
+        if (delay == 0) {
+                return 0;
+        }
+        m->wakeat = stats_now() + delay;
+        return 1;
+}
+
+/*
+ * Makes room for a frame with a len-byte payload at the end of the
+ * output buffer and returns where the payload goes.
+ */
+static char *
+reserve_mux_frame(struct mux_session *m, size_t len)
+{
+        char *outbuff;
+        size_t outcap;
+
+        if (m->outlen + MUX_HEADER_SIZE + len > m->outcap) {
+                outcap = (m->outlen + MUX_HEADER_SIZE + len) * 2;
+                outbuff = realloc(m->outbuff, outcap);
+                if (outbuff == NULL) {
+                        return NULL;
+                }
+                m->outbuff = outbuff;
+                m->outcap = outcap;
+        }
+        return m->outbuff + m->outlen + MUX_HEADER_SIZE;
 }
 
+/*
+ * Appends a frame. A NULL payload means it is already in place after
+ * reserve_mux_frame.
+ */
 static void
-execute_get_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+append_mux_frame(struct mux_session *m, int type, uint32_t id, const char *payload, size_t len)
 {
-        const char *filename;
-        FILE *fp;
-        struct stat sb;
-        size_t nbytes;
+        char *dest;
+        uint32_t netid;
+        uint32_t netlen;
 
-        filename = strtok_r(NULL, "\r\n", &saveptr);
-        if (filename == NULL) {
-                fprintf(ctrlfp, "fail: usage: get file\n");
-                fflush(ctrlfp);
-                return;
+        if (payload != NULL) {
+                dest = reserve_mux_frame(m, len);
+                if (dest == NULL) {
+                        m->exiting = 1;
+                        return;
+                }
+                memcpy(dest, payload, len);
         }
-        fp = fopen(filename, "r");
-        if (fp == NULL) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
-                return;
+        netid = htonl(id);
+        netlen = htonl(len);
+        m->outbuff[m->outlen] = type;
+        memcpy(m->outbuff + m->outlen + 1, &netid, sizeof(netid));
+        memcpy(m->outbuff + m->outlen + 5, &netlen, sizeof(netlen));
+        m->outlen += MUX_HEADER_SIZE + len;
+}
+
+static struct mux_stream *
+add_mux_stream(struct mux_session *m, uint32_t id)
+{
+        struct mux_stream *ms;
+        struct mux_stream **tail;
+
+        ms = calloc(1, sizeof(struct mux_stream));
+        if (ms == NULL) {
+                return NULL;
         }
-        if (fstat(fileno(fp), &sb) < 0) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
-                fclose(fp);
-                return;
+        ms->id = id;
+        ms->fd = -1;
+        /* the stream takes over timing the command that opened it */
+        ms->statcmd = m->statcmd;
+        ms->statstart = m->statstart;
+        m->statcmd = -1;
+        for (tail = &m->streams; *tail != NULL; tail = &(*tail)->next) {
         }
-        nbytes = sb.st_size;
-        fprintf(ctrlfp, "succ: %u\n", nbytes);
-        fflush(ctrlfp);
-        fcopy_from_to(fp, datafp, nbytes);
-        fflush(datafp);
-        fclose(fp);
+        *tail = ms;
+        return ms;
 }
 
 static void
-execute_put_command(char *saveptr, FILE *ctrlfp, FILE *datafp)
+remove_mux_stream(struct mux_session *m, struct mux_stream *ms)
 {
-        const char *filename;
-        const char *size;
-        FILE *fp;
-        size_t nbytes;
+        struct mux_stream **sp;
 
-        filename = strtok_r(NULL, " ", &saveptr);
-        size = strtok_r(NULL, "\r\n", &saveptr);
-        if (filename == NULL || size == NULL) {
-                fprintf(ctrlfp, "fail: usage: put file size\n");
-                fflush(ctrlfp);
-                return;
+        for (sp = &m->streams; *sp != NULL; sp = &(*sp)->next) {
+                if (*sp == ms) {
+                        *sp = ms->next;
+                        break;
+                }
         }
-        fp = fopen(filename, "w");
-        if (fp == NULL) {
-                fprintf(ctrlfp, "fail: %s\n", strerror(errno));
-                fflush(ctrlfp);
-                return;
+        if (ms->statcmd >= 0) {
+                stats_command_done(ms->statcmd, ms->statstart);
+                stats_socket(m->fd, &m->seen);
         }
-        nbytes = strtol(size, NULL, 10);
-        fcopy_from_to(datafp, fp, nbytes);
-        fflush(datafp);
-        fprintf(ctrlfp, "succ: 0\n");
-        fflush(ctrlfp);
-        fclose(fp);
+        if (ms->fd >= 0) {
+                bulk_end(&ms->bulk);
+                /* a put cut short is kept to be resumed */
+                upload_close(ms->fd, UPLOAD_SUSPEND);
+        }
+        free(ms->buff);
+        free(ms->failreply);
+        if (ms->aw != NULL) {
+                archive_writer_close(ms->aw);
+                free(ms->aw);
+        }
+        if (ms->ar != NULL) {
+                archive_reader_close(ms->ar);
+                free(ms->ar);
+        }
+        if (ms->zw != NULL) {
+                zstream_writer_close(ms->zw);
+                free(ms->zw);
+        }
+        if (ms->sw != NULL) {
+                sparse_writer_close(ms->sw);
+                free(ms->sw);
+        }
+        if (ms->zr != NULL) {
+                if (ms->zr->fd >= 0) {
+                        upload_close(ms->zr->fd, UPLOAD_SUSPEND);
+                        ms->zr->fd = -1;
+                }
+                zstream_reader_close(ms->zr);
+                free(ms->zr);
+        }
+        if (ms->sr != NULL) {
+                if (ms->sr->fd >= 0) {
+                        upload_close(ms->sr->fd, UPLOAD_SUSPEND);
+                        ms->sr->fd = -1;
+                }
+                sparse_reader_close(ms->sr);
+                free(ms->sr);
+        }
+        if (ms->dw != NULL) {
+                delta_writer_close(ms->dw);
+                free(ms->dw);
+        }
+        if (ms->dr != NULL) {
+                delta_reader_close(ms->dr);
+                free(ms->dr);
+        }
+        free(ms);
 }
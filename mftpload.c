@@ -0,0 +1,1101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "buffpool.h"
+
+#define BUFF_SIZE 1024
+#define MAX_EVENTS 256
+#define MAX_SIZES 16
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 40)
+#define BACKLOG_MAX (1024 * 1024)
+#define RECONNECT_DELAY 0.1
+#define TIMEOUT_CHECK 0.1
+#define HIST_BAR 50
+
+enum op {
+        OP_GET,
+        OP_PUT,
+        OP_RLS,
+        OP_ECHO,
+        OP_SETUP,
+        NOPS
+};
+
+/*
+ * Where a session is in its life. Sessions connect one at a time, as
+ * the server pairs control and data connections by address; the echo
+ * of a tag of its own proves a session was paired with its own data
+ * connection.
+ */
+enum session_state {
+        SESSION_WAITING,
+        SESSION_CONNECTING,
+        SESSION_GREETING,
+        SESSION_IDLE,
+        SESSION_BUSY
+};
+
+/* what is known of one kind of request */
+struct stats {
+        unsigned long count;
+        unsigned long errors;
+        unsigned long long bytes;
+        double maxlatency;
+        unsigned long hist[HIST_BUCKETS];
+};
+
+/* a file size that gets and puts are drawn from */
+struct size_class {
+        char label[16];
+        size_t size;
+        double weight;
+};
+
+struct session {
+        int id;
+        enum session_state state;
+        int ctrlfd;
+        int datafd;
+        int ctrlconnected;
+        int dataconnected;
+        unsigned int ctrlevents;
+        unsigned int dataevents;
+        enum op op;
+        size_t size;
+        double start;
+        double issued;
+        char out[BUFF_SIZE];
+        size_t outlen;
+        size_t outoff;
+        size_t putleft;
+        char in[BUFF_SIZE];
+        size_t inlen;
+        int replied;
+        int failed;
+        size_t want;
+        size_t datagot;
+        char tag[32];
+        char echoed[32];
+        size_t echoedlen;
+        unsigned long nops;
+        struct session *next;
+};
+
+static void parse_mix(char *spec);
+static void parse_sizes(char *spec);
+static size_t parse_size(const char *s);
+static void resolve(const char *host, const char *port, struct addrinfo **resp);
+static int connect_blocking(const struct addrinfo *ai);
+static void prepare_files(void);
+static void run_load(double duration);
+static void start_setup(struct session *s, double now);
+static void issue_request(struct session *s, double start, double now);
+static void handle_event(struct session *s, int isdata, unsigned int events, double now);
+static int check_connected(struct session *s, int isdata);
+static int flush_ctrl(struct session *s);
+static int send_put_data(struct session *s);
+static int read_ctrl(struct session *s);
+static int read_data(struct session *s);
+static void finish_request(struct session *s, double now);
+static void fail_session(struct session *s, double now);
+static void close_session(struct session *s);
+static void update_events(struct session *s);
+static void push_waiting(struct session *s);
+static struct session *pop_waiting(void);
+static void check_timeouts(double now);
+static void record(enum op op, double latency, size_t nbytes, int failed);
+static int hist_bucket(double latency);
+static double bucket_floor(int b);
+static double percentile(const struct stats *st, double q);
+static void report(double elapsed);
+static void print_histogram(const struct stats *st);
+static const char *format_latency(double seconds, char *buff, size_t size);
+static double now_seconds(void);
+
+static const char *op_names[NOPS] = {"get", "put", "rls", "echo", "setup"};
+
+/* the chances of each request, summed up to 1 */
+static double op_weights[OP_SETUP] = {0.7, 0.2, 0.05, 0.05};
+
+static struct size_class sizes[MAX_SIZES];
+static int nsizes;
+
+static struct addrinfo *ctrladdr;
+static struct addrinfo *dataaddr;
+static int epfd;
+static struct session *sessions;
+static int nsessions = 16;
+static double rate;
+static double timeout = 30;
+static unsigned long reconnect_every;
+static const char *rls_dir = ".";
+static char *databuff;
+static char *sinkbuff;
+static struct stats stats[NOPS];
+
+/* sessions waiting for their turn to connect, and the one connecting */
+static struct session *waiting_head;
+static struct session *waiting_tail;
+static struct session *connecting;
+static double next_setup;
+
+/* idle sessions, ready for a request */
+static struct session *idle;
+
+/* the arrival times of requests no session was free for, open loop only */
+static double *backlog;
+static size_t backlog_head;
+static size_t backlog_len;
+static unsigned long dropped;
+
+int
+main(int argc, char **argv)
+{
+        double duration;
+        int prepare;
+        int opt;
+
+        duration = 10;
+        prepare = 1;
+        while ((opt = getopt(argc, argv, "n:t:r:x:s:l:k:T:P")) != -1) {
+                switch (opt) {
+                case 'n':
+                        nsessions = strtol(optarg, NULL, 10);
+                        break;
+                case 't':
+                        duration = strtod(optarg, NULL);
+                        break;
+                case 'r':
+                        rate = strtod(optarg, NULL);
+                        break;
+                case 'x':
+                        parse_mix(optarg);
+                        break;
+                case 's':
+                        parse_sizes(optarg);
+                        break;
+                case 'l':
+                        rls_dir = optarg;
+                        break;
+                case 'k':
+                        reconnect_every = strtoul(optarg, NULL, 10);
+                        break;
+                case 'T':
+                        timeout = strtod(optarg, NULL);
+                        break;
+                case 'P':
+                        prepare = 0;
+                        break;
+                default:
+                        argc = 0;
+                        break;
+                }
+        }
+        if (argc - optind != 3 || nsessions < 1 || duration <= 0 || timeout <= 0) {
+                fprintf(stderr, "usage: mftpload [-n sessions] [-t seconds] [-r rate] [-x mix] [-s sizes]\n"
+                                "                [-l dir] [-k ops] [-T timeout] [-P] host ctrlport dataport\n");
+                exit(EXIT_FAILURE);
+        }
+        if (nsizes == 0) {
+                parse_sizes(strdup("1k:50,1m:40,64m:10"));
+        }
+        signal(SIGPIPE, SIG_IGN);
+        resolve(argv[optind], argv[optind + 1], &ctrladdr);
+        resolve(argv[optind], argv[optind + 2], &dataaddr);
+        databuff = buffpool_get();
+        sinkbuff = buffpool_get();
+        sessions = calloc(nsessions, sizeof(struct session));
+        backlog = rate > 0 ? malloc(BACKLOG_MAX * sizeof(double)) : NULL;
+        if (databuff == NULL || sinkbuff == NULL || sessions == NULL || (rate > 0 && backlog == NULL)) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+        }
+        srand48(1);
+        for (opt = 0; opt < (int)buffpool_size(); opt++) {
+                databuff[opt] = lrand48();
+        }
+        if (prepare) {
+                prepare_files();
+        }
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+                perror("epoll_create1");
+                exit(EXIT_FAILURE);
+        }
+        run_load(duration);
+        return EXIT_SUCCESS;
+}
+
+/*
+ * Parses "op:weight,..." for the ops get, put, rls and echo; the ones
+ * left out are not made.
+ */
+static void
+parse_mix(char *spec)
+{
+        char *saveptr;
+        char *item;
+        char *colon;
+        double total;
+        int op;
+
+        memset(op_weights, 0, sizeof(op_weights));
+        total = 0;
+        for (item = strtok_r(spec, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+                colon = strchr(item, ':');
+                if (colon != NULL) {
+                        *colon = '\0';
+                }
+                for (op = 0; op < OP_SETUP && strcmp(item, op_names[op]) != 0; op++) {
+                }
+                if (op == OP_SETUP) {
+                        fprintf(stderr, "mftpload: %s: unknown request\n", item);
+                        exit(EXIT_FAILURE);
+                }
+                op_weights[op] = colon != NULL ? strtod(colon + 1, NULL) : 1;
+                total += op_weights[op];
+        }
+        if (total <= 0) {
+                fprintf(stderr, "mftpload: the mix makes no requests\n");
+                exit(EXIT_FAILURE);
+        }
+        for (op = 0; op < OP_SETUP; op++) {
+                op_weights[op] /= total;
+        }
+}
+
+/* Parses "size:weight,...", where a size may end in k, m or g. */
+static void
+parse_sizes(char *spec)
+{
+        char *saveptr;
+        char *item;
+        char *colon;
+        double total;
+        int i;
+
+        nsizes = 0;
+        total = 0;
+        for (item = strtok_r(spec, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+                if (nsizes == MAX_SIZES) {
+                        fprintf(stderr, "mftpload: at most %d sizes\n", MAX_SIZES);
+                        exit(EXIT_FAILURE);
+                }
+                colon = strchr(item, ':');
+                if (colon != NULL) {
+                        *colon = '\0';
+                }
+                snprintf(sizes[nsizes].label, sizeof(sizes[nsizes].label), "%s", item);
+                sizes[nsizes].size = parse_size(item);
+                sizes[nsizes].weight = colon != NULL ? strtod(colon + 1, NULL) : 1;
+                total += sizes[nsizes].weight;
+                nsizes++;
+        }
+        if (total <= 0) {
+                fprintf(stderr, "mftpload: no file sizes\n");
+                exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < nsizes; i++) {
+                sizes[i].weight /= total;
+        }
+}
+
+/* A size with an optional k, m or g after it. */
+static size_t
+parse_size(const char *s)
+{
+        unsigned long long size;
+        char *end;
+
+        size = strtoull(s, &end, 10);
+        switch (*end) {
+        case 'g':
+        case 'G':
+                size *= 1024;
+                /* fall through */
+        case 'm':
+        case 'M':
+                size *= 1024;
+                /* fall through */
+        case 'k':
+        case 'K':
+                size *= 1024;
+                break;
+        }
+        return size;
+}
+
+static void
+resolve(const char *host, const char *port, struct addrinfo **resp)
+{
+        struct addrinfo hints;
+        int eai;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_flags = AI_NUMERICSERV;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        eai = getaddrinfo(host, port, &hints, resp);
+        if (eai != 0) {
+                fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(eai));
+                exit(EXIT_FAILURE);
+        }
+}
+
+static int
+connect_blocking(const struct addrinfo *ai)
+{
+        int fd;
+
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+        }
+        return fd;
+}
+
+/*
+ * Puts a file load-<size> of every size on the server for the gets to
+ * fetch, over a session of its own before the load starts.
+ */
+static void
+prepare_files(void)
+{
+        char command[BUFF_SIZE];
+        char reply[BUFF_SIZE];
+        size_t left;
+        size_t chunk;
+        ssize_t n;
+        size_t len;
+        int ctrlfd;
+        int datafd;
+        int i;
+
+        ctrlfd = connect_blocking(ctrladdr);
+        datafd = connect_blocking(dataaddr);
+        for (i = 0; i < nsizes; i++) {
+                len = snprintf(command, BUFF_SIZE, "put load-%s %zu\n", sizes[i].label, sizes[i].size);
+                if (write(ctrlfd, command, len) != (ssize_t)len) {
+                        perror("write");
+                        exit(EXIT_FAILURE);
+                }
+                for (left = sizes[i].size; left > 0; left -= n) {
+                        chunk = left < buffpool_size() ? left : buffpool_size();
+                        n = write(datafd, databuff, chunk);
+                        if (n <= 0) {
+                                perror("write");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                for (len = 0; len < BUFF_SIZE - 1; len++) {
+                        if (read(ctrlfd, reply + len, 1) != 1 || reply[len] == '\n') {
+                                break;
+                        }
+                }
+                reply[len] = '\0';
+                if (strncmp(reply, "succ:", 5) != 0) {
+                        fprintf(stderr, "mftpload: put load-%s: %s\n", sizes[i].label,
+                                len > 0 ? reply : "connection lost");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        close(ctrlfd);
+        close(datafd);
+}
+
+/*
+ * Keeps the sessions busy for duration seconds: in a closed loop each
+ * makes its next request as soon as the last one is answered; in an
+ * open loop requests arrive at a fixed rate, and wait for a session if
+ * none is free. A request's latency counts from its arrival.
+ */
+static void
+run_load(double duration)
+{
+        struct epoll_event events[MAX_EVENTS];
+        struct session *s;
+        double start;
+        double end;
+        double now;
+        double next_arrival;
+        double last_check;
+        double wait;
+        int busy;
+        int nready;
+        int i;
+
+        for (i = 0; i < nsessions; i++) {
+                sessions[i].id = i;
+                sessions[i].ctrlfd = -1;
+                sessions[i].datafd = -1;
+                push_waiting(&sessions[i]);
+        }
+        start = now_seconds();
+        end = start + duration;
+        next_arrival = start;
+        last_check = start;
+        for (;;) {
+                now = now_seconds();
+                while (rate > 0 && next_arrival <= now && next_arrival < end) {
+                        if (backlog_len == BACKLOG_MAX) {
+                                dropped++;
+                        }
+                        else {
+                                backlog[(backlog_head + backlog_len++) % BACKLOG_MAX] = next_arrival;
+                        }
+                        next_arrival += 1 / rate;
+                }
+                if (connecting == NULL && waiting_head != NULL && now >= next_setup && now < end) {
+                        start_setup(pop_waiting(), now);
+                }
+                while (idle != NULL && now < end && (rate == 0 || backlog_len > 0)) {
+                        s = idle;
+                        idle = s->next;
+                        if (rate > 0) {
+                                issue_request(s, backlog[backlog_head], now);
+                                backlog_head = (backlog_head + 1) % BACKLOG_MAX;
+                                backlog_len--;
+                        }
+                        else {
+                                issue_request(s, now, now);
+                        }
+                }
+                if (now - last_check >= TIMEOUT_CHECK) {
+                        check_timeouts(now);
+                        last_check = now;
+                }
+                busy = connecting != NULL;
+                for (i = 0; i < nsessions && !busy; i++) {
+                        busy = sessions[i].state == SESSION_BUSY;
+                }
+                if (now >= end && !busy) {
+                        break;
+                }
+                wait = TIMEOUT_CHECK;
+                if (rate > 0 && next_arrival < end && next_arrival - now < wait) {
+                        wait = next_arrival - now;
+                }
+                if (connecting == NULL && waiting_head != NULL && next_setup - now < wait) {
+                        wait = next_setup - now;
+                }
+                nready = epoll_wait(epfd, events, MAX_EVENTS, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+                if (nready < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        exit(EXIT_FAILURE);
+                }
+                now = now_seconds();
+                for (i = 0; i < nready; i++) {
+                        s = &sessions[events[i].data.u64 >> 1];
+                        handle_event(s, events[i].data.u64 & 1, events[i].events, now);
+                }
+        }
+        report(now - start);
+}
+
+/* Connects s, without waiting for the connections to complete. */
+static void
+start_setup(struct session *s, double now)
+{
+        connecting = s;
+        s->state = SESSION_CONNECTING;
+        s->start = s->issued = now;
+        s->ctrlconnected = s->dataconnected = 0;
+        s->ctrlevents = s->dataevents = 0;
+        s->ctrlfd = socket(ctrladdr->ai_family, ctrladdr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           ctrladdr->ai_protocol);
+        s->datafd = socket(dataaddr->ai_family, dataaddr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           dataaddr->ai_protocol);
+        /* the control connection goes first, for the server to pair them in order */
+        if (s->ctrlfd < 0 || s->datafd < 0 ||
+            (connect(s->ctrlfd, ctrladdr->ai_addr, ctrladdr->ai_addrlen) < 0 && errno != EINPROGRESS) ||
+            (connect(s->datafd, dataaddr->ai_addr, dataaddr->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+                fail_session(s, now);
+                return;
+        }
+        update_events(s);
+}
+
+/* Sends s a request drawn from the mix, which arrived at start. */
+static void
+issue_request(struct session *s, double start, double now)
+{
+        const struct size_class *sc;
+        double r;
+        int i;
+
+        r = drand48();
+        for (i = 0; i < OP_SETUP - 1 && r >= op_weights[i]; i++) {
+                r -= op_weights[i];
+        }
+        s->op = i;
+        r = drand48();
+        for (i = 0; i < nsizes - 1 && r >= sizes[i].weight; i++) {
+                r -= sizes[i].weight;
+        }
+        sc = &sizes[i];
+        s->state = SESSION_BUSY;
+        s->start = start;
+        s->issued = now;
+        s->size = 0;
+        s->putleft = 0;
+        switch (s->op) {
+        case OP_GET:
+                s->outlen = snprintf(s->out, BUFF_SIZE, "get load-%s\n", sc->label);
+                break;
+        case OP_PUT:
+                s->outlen = snprintf(s->out, BUFF_SIZE, "put load-put-%d %zu\n", s->id, sc->size);
+                s->size = s->putleft = sc->size;
+                break;
+        case OP_RLS:
+                s->outlen = snprintf(s->out, BUFF_SIZE, "rls %s\n", rls_dir);
+                break;
+        default:
+                s->outlen = snprintf(s->out, BUFF_SIZE, "echo x\n");
+                break;
+        }
+        s->outoff = 0;
+        s->inlen = 0;
+        s->replied = 0;
+        s->failed = 0;
+        s->want = 0;
+        if (flush_ctrl(s) < 0 || send_put_data(s) < 0) {
+                fail_session(s, now);
+                return;
+        }
+        update_events(s);
+}
+
+static void
+handle_event(struct session *s, int isdata, unsigned int events, double now)
+{
+        int result;
+
+        if (s->state == SESSION_CONNECTING) {
+                if (check_connected(s, isdata) < 0) {
+                        fail_session(s, now);
+                        return;
+                }
+                if (!s->ctrlconnected || !s->dataconnected) {
+                        update_events(s);
+                        return;
+                }
+                snprintf(s->tag, sizeof(s->tag), "s%d.%lu", s->id, stats[OP_SETUP].count);
+                s->outlen = snprintf(s->out, BUFF_SIZE, "echo %s\n", s->tag);
+                s->outoff = 0;
+                s->inlen = 0;
+                s->replied = 0;
+                s->failed = 0;
+                s->want = 0;
+                s->datagot = 0;
+                s->echoedlen = 0;
+                s->putleft = 0;
+                s->state = SESSION_GREETING;
+                if (flush_ctrl(s) < 0) {
+                        fail_session(s, now);
+                        return;
+                }
+                update_events(s);
+                return;
+        }
+        result = 0;
+        if (!isdata && (events & EPOLLOUT)) {
+                result = flush_ctrl(s);
+        }
+        if (isdata && (events & EPOLLOUT) && result == 0) {
+                result = send_put_data(s);
+        }
+        if (!isdata && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && result == 0) {
+                result = read_ctrl(s);
+        }
+        if (isdata && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && result == 0) {
+                result = read_data(s);
+        }
+        if (result < 0) {
+                fail_session(s, now);
+                return;
+        }
+        if (s->replied && s->datagot >= s->want && s->putleft == 0) {
+                finish_request(s, now);
+                return;
+        }
+        update_events(s);
+}
+
+/* Notes the connection that completed; -1 if it failed. */
+static int
+check_connected(struct session *s, int isdata)
+{
+        socklen_t len;
+        int error;
+
+        len = sizeof(error);
+        if (getsockopt(isdata ? s->datafd : s->ctrlfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+                return -1;
+        }
+        if (isdata) {
+                s->dataconnected = 1;
+        }
+        else {
+                s->ctrlconnected = 1;
+        }
+        return 0;
+}
+
+/* Writes what it can of the command; -1 if the connection broke. */
+static int
+flush_ctrl(struct session *s)
+{
+        ssize_t n;
+
+        while (s->outoff < s->outlen) {
+                n = send(s->ctrlfd, s->out + s->outoff, s->outlen - s->outoff, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return 0;
+                }
+                if (n < 0) {
+                        return -1;
+                }
+                s->outoff += n;
+        }
+        return 0;
+}
+
+/* Writes what it can of the data of a put, once its command is out. */
+static int
+send_put_data(struct session *s)
+{
+        size_t chunk;
+        ssize_t n;
+
+        while (s->putleft > 0 && s->outoff == s->outlen) {
+                chunk = s->putleft < buffpool_size() ? s->putleft : buffpool_size();
+                n = send(s->datafd, databuff, chunk, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return 0;
+                }
+                if (n < 0) {
+                        return -1;
+                }
+                s->putleft -= n;
+        }
+        return 0;
+}
+
+/* Reads the reply line, and learns from it how much data comes with it. */
+static int
+read_ctrl(struct session *s)
+{
+        char *newline;
+        ssize_t n;
+
+        for (;;) {
+                n = read(s->ctrlfd, s->in + s->inlen, BUFF_SIZE - 1 - s->inlen);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return 0;
+                }
+                if (n <= 0 || s->replied) {
+                        /* the server went away, or says more than it was asked */
+                        return -1;
+                }
+                s->inlen += n;
+                s->in[s->inlen] = '\0';
+                newline = strchr(s->in, '\n');
+                if (newline == NULL) {
+                        if (s->inlen == BUFF_SIZE - 1) {
+                                return -1;
+                        }
+                        continue;
+                }
+                if (newline != s->in + s->inlen - 1) {
+                        return -1;
+                }
+                s->replied = 1;
+                if (strncmp(s->in, "succ: ", 6) == 0) {
+                        s->want = strtoull(s->in + 6, NULL, 10);
+                }
+                else if (strncmp(s->in, "fail: ", 6) == 0) {
+                        s->failed = 1;
+                }
+                else {
+                        return -1;
+                }
+        }
+}
+
+/* Takes in and drops what data there is, keeping only an echoed tag. */
+static int
+read_data(struct session *s)
+{
+        ssize_t n;
+        size_t keep;
+
+        for (;;) {
+                n = read(s->datafd, sinkbuff, buffpool_size());
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0 && errno == EAGAIN) {
+                        return 0;
+                }
+                if (n <= 0) {
+                        return -1;
+                }
+                if (s->state == SESSION_GREETING) {
+                        keep = sizeof(s->echoed) - 1 - s->echoedlen;
+                        keep = (size_t)n < keep ? (size_t)n : keep;
+                        memcpy(s->echoed + s->echoedlen, sinkbuff, keep);
+                        s->echoedlen += keep;
+                }
+                s->datagot += n;
+        }
+}
+
+/* Counts the request s has had answered, and readies s for the next. */
+static void
+finish_request(struct session *s, double now)
+{
+        s->datagot -= s->want;
+        if (s->state == SESSION_GREETING) {
+                s->echoed[s->echoedlen] = '\0';
+                if (s->failed || s->datagot != 0 || strlen(s->echoed) != strlen(s->tag) + 1 ||
+                    strncmp(s->echoed, s->tag, strlen(s->tag)) != 0) {
+                        /* paired with another session's data connection */
+                        fail_session(s, now);
+                        return;
+                }
+                record(OP_SETUP, now - s->start, 0, 0);
+                connecting = NULL;
+                s->nops = 0;
+        }
+        else {
+                record(s->op, now - s->start, s->op == OP_PUT ? s->size : s->want, s->failed);
+                s->nops++;
+        }
+        s->state = SESSION_IDLE;
+        update_events(s);
+        if (reconnect_every > 0 && s->nops >= reconnect_every) {
+                close_session(s);
+                push_waiting(s);
+                return;
+        }
+        s->next = idle;
+        idle = s;
+}
+
+/*
+ * Counts an error against what s was doing, and sends it back to
+ * connect again; a failed setup holds up the next for a while.
+ * Losing an idle session costs nothing but the reconnection.
+ */
+static void
+fail_session(struct session *s, double now)
+{
+        struct session **sp;
+
+        if (s->state == SESSION_BUSY) {
+                stats[s->op].errors++;
+        }
+        else if (s->state == SESSION_IDLE) {
+                /* dropped by the server between requests */
+                for (sp = &idle; *sp != s; sp = &(*sp)->next) {
+                }
+                *sp = s->next;
+        }
+        else {
+                stats[OP_SETUP].errors++;
+                connecting = NULL;
+                next_setup = now + RECONNECT_DELAY;
+        }
+        close_session(s);
+        push_waiting(s);
+}
+
+static void
+close_session(struct session *s)
+{
+        if (s->ctrlfd >= 0) {
+                close(s->ctrlfd);
+        }
+        if (s->datafd >= 0) {
+                close(s->datafd);
+        }
+        s->ctrlfd = s->datafd = -1;
+        s->state = SESSION_WAITING;
+}
+
+/* Watches each connection of s for what it is waiting on. */
+static void
+update_events(struct session *s)
+{
+        struct epoll_event ev;
+        unsigned int want;
+        int isdata;
+        int fd;
+        unsigned int *current;
+
+        for (isdata = 0; isdata < 2; isdata++) {
+                fd = isdata ? s->datafd : s->ctrlfd;
+                current = isdata ? &s->dataevents : &s->ctrlevents;
+                if (s->state == SESSION_CONNECTING) {
+                        want = (isdata ? s->dataconnected : s->ctrlconnected) ? 0 : EPOLLOUT;
+                }
+                else if (isdata) {
+                        want = EPOLLIN | (s->putleft > 0 ? EPOLLOUT : 0);
+                }
+                else {
+                        want = EPOLLIN | (s->outoff < s->outlen ? EPOLLOUT : 0);
+                }
+                if (want == *current) {
+                        continue;
+                }
+                ev.events = want;
+                ev.data.u64 = (uint64_t)s->id << 1 | isdata;
+                if (epoll_ctl(epfd, *current == 0 ? EPOLL_CTL_ADD : want == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD,
+                              fd, &ev) < 0) {
+                        perror("epoll_ctl");
+                        exit(EXIT_FAILURE);
+                }
+                *current = want;
+        }
+}
+
+static void
+push_waiting(struct session *s)
+{
+        s->next = NULL;
+        if (waiting_tail == NULL) {
+                waiting_head = s;
+        }
+        else {
+                waiting_tail->next = s;
+        }
+        waiting_tail = s;
+}
+
+static struct session *
+pop_waiting(void)
+{
+        struct session *s;
+
+        s = waiting_head;
+        waiting_head = s->next;
+        if (waiting_head == NULL) {
+                waiting_tail = NULL;
+        }
+        return s;
+}
+
+/* Gives up on every request or setup that has gone on too long. */
+static void
+check_timeouts(double now)
+{
+        int i;
+
+        for (i = 0; i < nsessions; i++) {
+                if ((sessions[i].state == SESSION_BUSY || sessions[i].state == SESSION_CONNECTING ||
+                     sessions[i].state == SESSION_GREETING) && now - sessions[i].issued > timeout) {
+                        fail_session(&sessions[i], now);
+                }
+        }
+}
+
+static void
+record(enum op op, double latency, size_t nbytes, int failed)
+{
+        struct stats *st;
+
+        st = &stats[op];
+        if (failed) {
+                st->errors++;
+                return;
+        }
+        st->count++;
+        st->bytes += nbytes;
+        st->hist[hist_bucket(latency)]++;
+        if (latency > st->maxlatency) {
+                st->maxlatency = latency;
+        }
+}
+
+/*
+ * Latencies are kept in microseconds, HIST_SUB buckets to every power
+ * of two, so that a percentile is off by an eighth at most.
+ */
+static int
+hist_bucket(double latency)
+{
+        unsigned long long us;
+        int e;
+        int b;
+
+        us = latency * 1e6;
+        if (us < HIST_SUB) {
+                return us;
+        }
+        e = 63 - __builtin_clzll(us);
+        b = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+        return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/* The smallest latency, in seconds, bucket b holds. */
+static double
+bucket_floor(int b)
+{
+        int e;
+
+        if (b < HIST_SUB) {
+                return b / 1e6;
+        }
+        e = b / HIST_SUB + HIST_SUB_BITS - 1;
+        return (double)((unsigned long long)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS)) / 1e6;
+}
+
+/* The latency that q of the requests took no longer than, bucket-wise. */
+static double
+percentile(const struct stats *st, double q)
+{
+        unsigned long seen;
+        double upper;
+        int b;
+
+        seen = 0;
+        for (b = 0; b < HIST_BUCKETS; b++) {
+                seen += st->hist[b];
+                if (seen > 0 && seen >= q * st->count) {
+                        break;
+                }
+        }
+        upper = b + 1 < HIST_BUCKETS ? bucket_floor(b + 1) : st->maxlatency;
+        return upper < st->maxlatency ? upper : st->maxlatency;
+}
+
+static void
+report(double elapsed)
+{
+        char p50[16];
+        char p90[16];
+        char p99[16];
+        char p999[16];
+        char max[16];
+        const struct stats *st;
+        int op;
+
+        if (rate > 0) {
+                printf("mftpload: %d sessions, open loop at %g/s, %.1f s\n", nsessions, rate, elapsed);
+        }
+        else {
+                printf("mftpload: %d sessions, closed loop, %.1f s\n", nsessions, elapsed);
+        }
+        printf("%-6s %9s %7s %10s %9s %9s %9s %9s %9s %9s\n", "", "count", "errors", "ops/s", "MB/s",
+               "p50", "p90", "p99", "p99.9", "max");
+        for (op = 0; op < NOPS; op++) {
+                st = &stats[op];
+                if (st->count + st->errors == 0) {
+                        continue;
+                }
+                printf("%-6s %9lu %7lu %10.1f %9.1f", op_names[op], st->count, st->errors,
+                       st->count / elapsed, st->bytes / elapsed / (1024 * 1024));
+                if (st->count == 0) {
+                        printf(" %9s %9s %9s %9s %9s\n", "-", "-", "-", "-", "-");
+                        continue;
+                }
+                printf(" %9s %9s %9s %9s %9s\n",
+                       format_latency(percentile(st, 0.50), p50, sizeof(p50)),
+                       format_latency(percentile(st, 0.90), p90, sizeof(p90)),
+                       format_latency(percentile(st, 0.99), p99, sizeof(p99)),
+                       format_latency(percentile(st, 0.999), p999, sizeof(p999)),
+                       format_latency(st->maxlatency, max, sizeof(max)));
+        }
+        if (backlog_len > 0 || dropped > 0) {
+                printf("unserved: %zu requests still waiting for a session, %lu dropped\n",
+                       backlog_len, dropped);
+        }
+        for (op = 0; op < NOPS; op++) {
+                if (stats[op].count > 0) {
+                        printf("\n%s latency:\n", op_names[op]);
+                        print_histogram(&stats[op]);
+                }
+        }
+}
+
+/* Prints the histogram of st by powers of two, with a bar for each. */
+static void
+print_histogram(const struct stats *st)
+{
+        unsigned long counts[HIST_BUCKETS / HIST_SUB + 1];
+        unsigned long most;
+        char from[16];
+        char to[16];
+        int first;
+        int last;
+        int b;
+        int g;
+
+        memset(counts, 0, sizeof(counts));
+        for (b = 0; b < HIST_BUCKETS; b++) {
+                counts[b < HIST_SUB ? 0 : b / HIST_SUB] += st->hist[b];
+        }
+        first = -1;
+        last = 0;
+        most = 0;
+        for (g = 0; g < HIST_BUCKETS / HIST_SUB; g++) {
+                if (counts[g] > 0) {
+                        first = first < 0 ? g : first;
+                        last = g;
+                        most = counts[g] > most ? counts[g] : most;
+                }
+        }
+        for (g = first; g >= 0 && g <= last; g++) {
+                format_latency(bucket_floor(g * HIST_SUB), from, sizeof(from));
+                format_latency(bucket_floor((g + 1) * HIST_SUB), to, sizeof(to));
+                printf("  %8s - %-8s %9lu %.*s\n", from, to, counts[g],
+                       (int)(counts[g] > 0 ? counts[g] * (HIST_BAR - 1) / most + 1 : 0),
+                       "##################################################");
+        }
+}
+
+static const char *
+format_latency(double seconds, char *buff, size_t size)
+{
+        if (seconds < 1e-3) {
+                snprintf(buff, size, "%.0fus", seconds * 1e6);
+        }
+        else if (seconds < 1) {
+                snprintf(buff, size, "%.2fms", seconds * 1e3);
+        }
+        else {
+                snprintf(buff, size, "%.2fs", seconds);
+        }
+        return buff;
+}
+
+static double
+now_seconds(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
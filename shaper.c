@@ -0,0 +1,258 @@
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+#include "shaper.h"
+
+/* sessions added up for fair share are looked at again after this long */
+#define SHAPER_RECOUNT 10000
+
+/*
+ * A session that has moved data lately, for fair share. A slot whose
+ * owner has not been seen for SHAPER_LEASE is free to be taken over, so
+ * that one left behind by a process that died is not counted forever.
+ */
+struct shaper_slot {
+        uint64_t owner;
+        uint64_t seen;
+        uint64_t weight;
+};
+
+struct shaper_region {
+        uint64_t full;
+        struct shaper_slot slots[SHAPER_SLOTS];
+};
+
+static uint64_t session_limit(struct shaper *sh, uint64_t now);
+static uint64_t active_weight(struct shaper *sh, uint64_t now);
+static void refresh_slot(struct shaper *sh, uint64_t now);
+
+static uint64_t session_rate;
+static uint64_t server_rate;
+static int fair_share;
+static struct shaper_region *shaper_region;
+static uint64_t shaper_owners;
+
+/* the weights of the transferring sessions as last added up, and when */
+static uint64_t weight_sum;
+static uint64_t weight_sum_at;
+
+int
+shaper_open(uint64_t sessionrate, uint64_t serverrate, int fair)
+{
+        void *p;
+
+        session_rate = sessionrate;
+        server_rate = serverrate;
+        fair_share = fair && serverrate > 0;
+        if (serverrate == 0) {
+                return 0;
+        }
+        p = mmap(NULL, sizeof(struct shaper_region), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                server_rate = 0;
+                fair_share = 0;
+                return -1;
+        }
+        shaper_region = p;
+        return 0;
+}
+
+int
+shaper_enabled(void)
+{
+        return session_rate > 0 || server_rate > 0;
+}
+
+void
+shaper_init(struct shaper *sh, unsigned weight)
+{
+        sh->full = 0;
+        sh->weight = weight > 0 ? weight : 1;
+        /* unique across processes as long as pids are not reused within one */
+        sh->owner = (uint64_t)getpid() << 32 | ++shaper_owners;
+        sh->slot = -1;
+}
+
+uint64_t
+shaper_delay(struct shaper *sh)
+{
+        uint64_t now;
+        uint64_t full;
+        uint64_t delay;
+
+        now = stats_now();
+        delay = 0;
+        if (session_limit(sh, now) > 0 && sh->full > now + SHAPER_BURST) {
+                delay = sh->full - now - SHAPER_BURST;
+        }
+        if (server_rate > 0) {
+                full = __atomic_load_n(&shaper_region->full, __ATOMIC_RELAXED);
+                if (full > now + SHAPER_BURST && full - now - SHAPER_BURST > delay) {
+                        delay = full - now - SHAPER_BURST;
+                }
+        }
+        return delay;
+}
+
+void
+shaper_pace(struct shaper *sh)
+{
+        struct timespec ts;
+        uint64_t delay;
+
+        if (sh == NULL) {
+                return;
+        }
+        while ((delay = shaper_delay(sh)) > 0) {
+                ts.tv_sec = delay / 1000000;
+                ts.tv_nsec = delay % 1000000 * 1000;
+                nanosleep(&ts, NULL);
+        }
+}
+
+size_t
+shaper_quantum(struct shaper *sh)
+{
+        uint64_t rate;
+        size_t quantum;
+
+        rate = session_limit(sh, stats_now());
+        if (rate == 0 || (server_rate > 0 && server_rate < rate)) {
+                rate = server_rate;
+        }
+        if (rate == 0) {
+                return SHAPER_QUANTUM_MAX;
+        }
+        /* about a burst's worth */
+        quantum = rate / (1000000 / SHAPER_BURST);
+        if (quantum < SHAPER_QUANTUM_MIN) {
+                quantum = SHAPER_QUANTUM_MIN;
+        }
+        if (quantum > SHAPER_QUANTUM_MAX) {
+                quantum = SHAPER_QUANTUM_MAX;
+        }
+        return quantum;
+}
+
+void
+shaper_charge(struct shaper *sh, size_t nbytes)
+{
+        uint64_t now;
+        uint64_t rate;
+        uint64_t full;
+        uint64_t newfull;
+
+        if (sh == NULL || nbytes == 0 || !shaper_enabled()) {
+                return;
+        }
+        now = stats_now();
+        if (fair_share) {
+                refresh_slot(sh, now);
+        }
+        rate = session_limit(sh, now);
+        if (rate > 0) {
+                sh->full = (sh->full > now ? sh->full : now) + nbytes * 1000000 / rate;
+        }
+        if (server_rate > 0) {
+                full = __atomic_load_n(&shaper_region->full, __ATOMIC_RELAXED);
+                do {
+                        newfull = (full > now ? full : now) + nbytes * 1000000 / server_rate;
+                } while (!__atomic_compare_exchange_n(&shaper_region->full, &full, newfull, 0,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        }
+}
+
+void
+shaper_release(struct shaper *sh)
+{
+        uint64_t owner;
+
+        if (sh->slot < 0) {
+                return;
+        }
+        owner = sh->owner;
+        __atomic_compare_exchange_n(&shaper_region->slots[sh->slot].owner, &owner, 0, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        sh->slot = -1;
+}
+
+/* The rate the session is held to, 0 for none. */
+static uint64_t
+session_limit(struct shaper *sh, uint64_t now)
+{
+        uint64_t share;
+
+        if (!fair_share) {
+                return session_rate;
+        }
+        share = server_rate * sh->weight / active_weight(sh, now);
+        if (share == 0) {
+                share = 1;
+        }
+        return session_rate > 0 && session_rate < share ? session_rate : share;
+}
+
+/* The weights of the transferring sessions, this one's among them. */
+static uint64_t
+active_weight(struct shaper *sh, uint64_t now)
+{
+        struct shaper_slot *slot;
+        uint64_t sum;
+        int i;
+
+        if (now - weight_sum_at >= SHAPER_RECOUNT) {
+                sum = 0;
+                for (i = 0; i < SHAPER_SLOTS; i++) {
+                        slot = &shaper_region->slots[i];
+                        if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) != 0 &&
+                            __atomic_load_n(&slot->seen, __ATOMIC_RELAXED) + SHAPER_LEASE >= now) {
+                                sum += __atomic_load_n(&slot->weight, __ATOMIC_RELAXED);
+                        }
+                }
+                weight_sum = sum;
+                weight_sum_at = now;
+        }
+        if (sh->slot < 0) {
+                /* not counted yet */
+                return weight_sum + sh->weight;
+        }
+        return weight_sum > sh->weight ? weight_sum : sh->weight;
+}
+
+/* Marks the session as transferring, taking a slot if it has none. */
+static void
+refresh_slot(struct shaper *sh, uint64_t now)
+{
+        struct shaper_slot *slot;
+        uint64_t owner;
+        int i;
+
+        if (sh->slot >= 0) {
+                slot = &shaper_region->slots[sh->slot];
+                if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) == sh->owner) {
+                        __atomic_store_n(&slot->seen, now, __ATOMIC_RELAXED);
+                        return;
+                }
+                /* taken over while this session was quiet */
+                sh->slot = -1;
+        }
+        for (i = 0; i < SHAPER_SLOTS; i++) {
+                slot = &shaper_region->slots[i];
+                owner = __atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+                if (owner != 0 && __atomic_load_n(&slot->seen, __ATOMIC_RELAXED) + SHAPER_LEASE >= now) {
+                        continue;
+                }
+                /* fresh before it is ours, so that no one else takes it over meanwhile */
+                __atomic_store_n(&slot->seen, now, __ATOMIC_RELAXED);
+                if (__atomic_compare_exchange_n(&slot->owner, &owner, sh->owner, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                        __atomic_store_n(&slot->weight, sh->weight, __ATOMIC_RELAXED);
+                        sh->slot = i;
+                        /* count this session in from now on */
+                        weight_sum_at = 0;
+                        return;
+                }
+        }
+}
@@ -0,0 +1,64 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bandwidth limits on the file data of get and put. Every session has a
+ * token bucket of its own and the server one more, shared by all its
+ * processes like the checksum table (sumcache.h). A bucket is kept as
+ * the time at which it would be full again (the GCRA form of it), so
+ * that taking from the shared one is a single compare-and-swap.
+ *
+ * Bytes are charged after they have moved; a sender asks first how long
+ * it has to wait, and moves at most shaper_quantum bytes at a time.
+ *
+ * In fair-share mode the server limit is split among the sessions that
+ * moved data within the last SHAPER_LEASE, in proportion to their
+ * weights, and each of them is held to its part. A session that cannot
+ * use its part leaves it unused.
+ */
+#define SHAPER_SLOTS 1024
+/* how long after its last bytes a session still counts as transferring */
+#define SHAPER_LEASE 1000000
+/* how far ahead of its rate a bucket lets a sender get, in microseconds */
+#define SHAPER_BURST 50000
+#define SHAPER_QUANTUM_MIN (16 * 1024)
+#define SHAPER_QUANTUM_MAX (1024 * 1024)
+
+/* one session's bucket; rates are bytes per second, times microseconds */
+struct shaper {
+        uint64_t full;
+        unsigned weight;
+        uint64_t owner;
+        int slot;
+};
+
+/*
+ * Sets the limits, 0 for none; -1 if the shared state cannot be set up,
+ * and then only the per-session limit holds.
+ */
+int shaper_open(uint64_t sessionrate, uint64_t serverrate, int fair);
+
+/* Tells whether any limit is set at all. */
+int shaper_enabled(void);
+
+void shaper_init(struct shaper *sh, unsigned weight);
+
+/* How long to wait before moving more data, in microseconds. */
+uint64_t shaper_delay(struct shaper *sh);
+
+/* Waits as long as shaper_delay says; sh may be NULL, for no limits. */
+void shaper_pace(struct shaper *sh);
+
+/* How much to move between two looks at shaper_delay. */
+size_t shaper_quantum(struct shaper *sh);
+
+/* Takes nbytes out of the buckets; sh may be NULL as for shaper_pace. */
+void shaper_charge(struct shaper *sh, size_t nbytes);
+
+/* Gives up the session's share once it is over. */
+void shaper_release(struct shaper *sh);
+
+#endif
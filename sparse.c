@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "crc32c.h"
+#include "sparse.h"
+
+static void put_number(unsigned char *p, uint64_t value);
+static uint64_t get_number(const unsigned char *p);
+static int add_extent(struct sparse_writer *sw, size_t *capp, off_t offset, off_t length);
+static void take_bytes(struct sparse_reader *sr, const char *buff, size_t len);
+static void start_map(struct sparse_reader *sr);
+static void finish_map(struct sparse_reader *sr);
+static void write_extent(struct sparse_reader *sr, const char *buff, size_t len);
+static void write_at(struct sparse_reader *sr, const char *buff, size_t len, off_t offset);
+static void punch_hole(struct sparse_reader *sr, uint64_t from, uint64_t to);
+static int all_zero(const char *buff, size_t len);
+
+static void
+put_number(unsigned char *p, uint64_t value)
+{
+        int i;
+
+        for (i = 7; i >= 0; i--) {
+                p[i] = value & 0xff;
+                value >>= 8;
+        }
+}
+
+static uint64_t
+get_number(const unsigned char *p)
+{
+        uint64_t value;
+        int i;
+
+        value = 0;
+        for (i = 0; i < 8; i++) {
+                value = (value << 8) | p[i];
+        }
+        return value;
+}
+
+int
+sparse_file(const struct stat *sb)
+{
+        return S_ISREG(sb->st_mode) && (off_t)sb->st_blocks * 512 < sb->st_size;
+}
+
+/* writer */
+
+int
+sparse_writer_open(struct sparse_writer *sw, int fd, off_t offset, uint64_t nbytes)
+{
+        unsigned char *p;
+        uint64_t datalen;
+        size_t cap;
+        size_t i;
+        off_t end;
+        off_t data;
+        off_t next;
+        off_t hole;
+
+        memset(sw, 0, sizeof(struct sparse_writer));
+        sw->fd = fd;
+        sw->base = offset;
+        cap = 0;
+        end = offset + nbytes;
+        for (data = offset; data < end; data = hole) {
+                hole = end;
+                next = lseek(fd, data, SEEK_DATA);
+                if ((next < 0 && errno == ENXIO) || next >= end) {
+                        /* a hole to the end, or the file shrank */
+                        break;
+                }
+                /* where the file system cannot tell, all of the rest is data */
+                if (next >= 0) {
+                        data = next;
+                        if (sw->nextents < SPARSE_EXTENTS_MAX - 1) {
+                                hole = lseek(fd, data, SEEK_HOLE);
+                                if (hole <= data || hole > end) {
+                                        hole = end;
+                                }
+                        }
+                }
+                if (add_extent(sw, &cap, data - offset, hole - data) < 0) {
+                        free(sw->extents);
+                        return -1;
+                }
+        }
+        sw->maplen = SPARSE_HEADER_SIZE + sw->nextents * SPARSE_ENTRY_SIZE;
+        sw->map = malloc(sw->maplen);
+        if (sw->map == NULL) {
+                free(sw->extents);
+                errno = ENOMEM;
+                return -1;
+        }
+        put_number(sw->map, nbytes);
+        put_number(sw->map + 8, sw->nextents);
+        datalen = 0;
+        for (i = 0, p = sw->map + SPARSE_HEADER_SIZE; i < sw->nextents; i++, p += SPARSE_ENTRY_SIZE) {
+                put_number(p, sw->extents[i].offset);
+                put_number(p + 8, sw->extents[i].length);
+                datalen += sw->extents[i].length;
+        }
+        sw->total = sw->maplen + datalen;
+        return 0;
+}
+
+size_t
+sparse_read(struct sparse_writer *sw, char *buff, size_t size)
+{
+        struct sparse_extent *e;
+        size_t total;
+        size_t chunk;
+        ssize_t n;
+
+        total = 0;
+        if (sw->mapoff < sw->maplen) {
+                chunk = sw->maplen - sw->mapoff < size ? sw->maplen - sw->mapoff : size;
+                memcpy(buff, sw->map + sw->mapoff, chunk);
+                sw->mapoff += chunk;
+                total += chunk;
+        }
+        while (total < size && sw->index < sw->nextents) {
+                e = &sw->extents[sw->index];
+                chunk = e->length - sw->done < size - total ? e->length - sw->done : size - total;
+                n = sw->fd >= 0 ? pread(sw->fd, buff + total, chunk, sw->base + e->offset + sw->done) : 0;
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        memset(buff + total, 0, chunk);
+                        n = chunk;
+                }
+                sw->crc = crc32c(sw->crc, buff + total, n);
+                total += n;
+                sw->done += n;
+                if (sw->done == e->length) {
+                        sw->index++;
+                        sw->done = 0;
+                }
+        }
+        return total;
+}
+
+void
+sparse_writer_close(struct sparse_writer *sw)
+{
+        if (sw->fd >= 0) {
+                close(sw->fd);
+                sw->fd = -1;
+        }
+        free(sw->extents);
+        free(sw->map);
+        sw->extents = NULL;
+        sw->map = NULL;
+}
+
+static int
+add_extent(struct sparse_writer *sw, size_t *capp, off_t offset, off_t length)
+{
+        struct sparse_extent *extents;
+
+        if (sw->nextents == *capp) {
+                *capp = *capp > 0 ? *capp * 2 : 16;
+                extents = realloc(sw->extents, *capp * sizeof(struct sparse_extent));
+                if (extents == NULL) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                sw->extents = extents;
+        }
+        sw->extents[sw->nextents].offset = offset;
+        sw->extents[sw->nextents].length = length;
+        sw->nextents++;
+        return 0;
+}
+
+/* reader */
+
+void
+sparse_reader_open(struct sparse_reader *sr, int fd, off_t offset, uint64_t nbytes)
+{
+        struct stat sb;
+
+        memset(sr, 0, sizeof(struct sparse_reader));
+        sr->fd = fd;
+        sr->base = offset;
+        sr->left = nbytes;
+        /* what is past the old end is a hole already, zeros and all */
+        sr->oldsize = fd >= 0 && fstat(fd, &sb) == 0 ? sb.st_size : 0;
+}
+
+size_t
+sparse_want(const struct sparse_reader *sr)
+{
+        uint64_t want;
+
+        if (sr->error != 0) {
+                /* the rest is only consumed */
+                return sr->left;
+        }
+        if (sr->headerlen < SPARSE_HEADER_SIZE) {
+                want = SPARSE_HEADER_SIZE - sr->headerlen;
+        }
+        else if (sr->mapgot < sr->maplen) {
+                want = sr->maplen - sr->mapgot;
+        }
+        else if (sr->index < sr->nextents) {
+                want = sr->extents[sr->index].length - sr->done;
+        }
+        else {
+                /* more than the map holds; taken in as an error */
+                want = sr->left;
+        }
+        return want < sr->left ? want : sr->left;
+}
+
+void
+sparse_write(struct sparse_reader *sr, const char *buff, size_t len)
+{
+        size_t chunk;
+
+        while (len > 0 && (chunk = sparse_want(sr)) > 0) {
+                if (chunk > len) {
+                        chunk = len;
+                }
+                /* after an error the rest is only consumed */
+                if (sr->error == 0) {
+                        take_bytes(sr, buff, chunk);
+                }
+                sr->left -= chunk;
+                buff += chunk;
+                len -= chunk;
+        }
+}
+
+int
+sparse_reader_close(struct sparse_reader *sr)
+{
+        if ((sr->left > 0 || sr->headerlen < SPARSE_HEADER_SIZE || sr->mapgot < sr->maplen ||
+             sr->index < sr->nextents) && sr->error == 0) {
+                sr->error = EPROTO;
+        }
+        if (sr->fd >= 0) {
+                /* the holes at the end are only the size */
+                if (sr->error == 0 && ftruncate(sr->fd, sr->base + sr->size) < 0) {
+                        sr->error = errno;
+                }
+                if (close(sr->fd) < 0 && sr->error == 0) {
+                        sr->error = errno;
+                }
+                sr->fd = -1;
+        }
+        free(sr->map);
+        free(sr->extents);
+        sr->map = NULL;
+        sr->extents = NULL;
+        return sr->error != 0 ? -1 : 0;
+}
+
+/* Takes in len bytes of the part of the stream that is due, no more than sparse_want says. */
+static void
+take_bytes(struct sparse_reader *sr, const char *buff, size_t len)
+{
+        if (sr->headerlen < SPARSE_HEADER_SIZE) {
+                memcpy(sr->header + sr->headerlen, buff, len);
+                sr->headerlen += len;
+                if (sr->headerlen == SPARSE_HEADER_SIZE) {
+                        start_map(sr);
+                }
+        }
+        else if (sr->mapgot < sr->maplen) {
+                memcpy(sr->map + sr->mapgot, buff, len);
+                sr->mapgot += len;
+                if (sr->mapgot == sr->maplen) {
+                        finish_map(sr);
+                }
+        }
+        else if (sr->index == sr->nextents) {
+                sr->error = EPROTO;
+        }
+        else {
+                write_extent(sr, buff, len);
+                sr->crc = crc32c(sr->crc, buff, len);
+                sr->done += len;
+                if (sr->done == sr->extents[sr->index].length) {
+                        sr->index++;
+                        sr->done = 0;
+                }
+        }
+}
+
+/* Sizes the map from the header. */
+static void
+start_map(struct sparse_reader *sr)
+{
+        uint64_t nextents;
+
+        sr->size = get_number(sr->header);
+        nextents = get_number(sr->header + 8);
+        if (nextents > SPARSE_EXTENTS_MAX) {
+                sr->error = EPROTO;
+                return;
+        }
+        sr->nextents = nextents;
+        sr->maplen = nextents * SPARSE_ENTRY_SIZE;
+        sr->map = malloc(sr->maplen + 1);
+        sr->extents = malloc((nextents + 1) * sizeof(struct sparse_extent));
+        if (sr->map == NULL || sr->extents == NULL) {
+                sr->error = ENOMEM;
+                return;
+        }
+        if (sr->maplen == 0) {
+                finish_map(sr);
+        }
+}
+
+/* Checks the extents are in order and inside the range, and punches the holes between. */
+static void
+finish_map(struct sparse_reader *sr)
+{
+        const unsigned char *p;
+        uint64_t end;
+        size_t i;
+
+        end = 0;
+        for (i = 0, p = sr->map; i < sr->nextents; i++, p += SPARSE_ENTRY_SIZE) {
+                sr->extents[i].offset = get_number(p);
+                sr->extents[i].length = get_number(p + 8);
+                if (sr->extents[i].offset < end || sr->extents[i].offset > sr->size ||
+                    sr->extents[i].length == 0 ||
+                    sr->extents[i].length > sr->size - sr->extents[i].offset) {
+                        sr->error = EPROTO;
+                        return;
+                }
+                punch_hole(sr, end, sr->extents[i].offset);
+                end = sr->extents[i].offset + sr->extents[i].length;
+        }
+        punch_hole(sr, end, sr->size);
+}
+
+/*
+ * Writes the next len bytes of the current extent, leaving out the
+ * blocks of zeros that would land past the old end of the file.
+ */
+static void
+write_extent(struct sparse_reader *sr, const char *buff, size_t len)
+{
+        off_t at;
+        size_t start;
+        size_t off;
+        size_t chunk;
+
+        if (sr->fd < 0) {
+                return;
+        }
+        at = sr->base + sr->extents[sr->index].offset + sr->done;
+        start = 0;
+        for (off = 0; off < len; off += chunk) {
+                chunk = SPARSE_BLOCK - (at + off) % SPARSE_BLOCK;
+                if (chunk > len - off) {
+                        chunk = len - off;
+                }
+                if (chunk < SPARSE_BLOCK || at + (off_t)off < sr->oldsize || !all_zero(buff + off, chunk)) {
+                        continue;
+                }
+                write_at(sr, buff + start, off - start, at + start);
+                start = off + chunk;
+        }
+        write_at(sr, buff + start, len - start, at + start);
+}
+
+static void
+write_at(struct sparse_reader *sr, const char *buff, size_t len, off_t offset)
+{
+        ssize_t n;
+
+        while (len > 0 && sr->error == 0) {
+                n = pwrite(sr->fd, buff, len, offset);
+                if (n < 0) {
+                        if (errno != EINTR) {
+                                sr->error = errno;
+                        }
+                        continue;
+                }
+                buff += n;
+                len -= n;
+                offset += n;
+        }
+}
+
+/* Makes a hole of the range, where it covers what the file held before. */
+static void
+punch_hole(struct sparse_reader *sr, uint64_t from, uint64_t to)
+{
+        static const char zeros[SPARSE_BLOCK];
+        off_t start;
+        off_t end;
+
+        start = sr->base + from;
+        end = sr->base + to < (uint64_t)sr->oldsize ? sr->base + (off_t)to : sr->oldsize;
+        if (sr->fd < 0 || start >= end) {
+                return;
+        }
+        if (fallocate(sr->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == 0) {
+                return;
+        }
+        /* no holes on this file system; zeros read back the same */
+        for (; start < end && sr->error == 0; start += SPARSE_BLOCK) {
+                write_at(sr, zeros, end - start < SPARSE_BLOCK ? end - start : SPARSE_BLOCK, start);
+        }
+}
+
+static int
+all_zero(const char *buff, size_t len)
+{
+        return len == 0 || (buff[0] == 0 && memcmp(buff, buff + 1, len - 1) == 0);
+}
@@ -0,0 +1,112 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * A file with holes in it, sent as the map of where its data is and
+ * then only that data. The stream starts with the length of the range
+ * sent and the number of extents, then each extent's offset into the
+ * range and length, all of them big-endian 64-bit numbers, and the
+ * bytes of the extents follow in order. Whatever the map leaves out is
+ * a hole, and stays one at the receiver.
+ */
+#define SPARSE_HEADER_SIZE 16
+#define SPARSE_ENTRY_SIZE 16
+/* past this many extents, the rest of the file goes as one */
+#define SPARSE_EXTENTS_MAX (64 * 1024)
+/* a run of zeros this long and as aligned is left a hole when received */
+#define SPARSE_BLOCK 4096
+
+struct sparse_extent {
+        uint64_t offset;
+        uint64_t length;
+};
+
+/* reads the extents of a file a buffer at a time */
+struct sparse_writer {
+        int fd;
+        off_t base;
+        struct sparse_extent *extents;
+        size_t nextents;
+        unsigned char *map;
+        size_t maplen;
+        size_t mapoff;
+        size_t index;
+        uint64_t done;
+        uint64_t total;
+        uint32_t crc;
+};
+
+/* writes the extents into a file as the bytes come in, holes between them */
+struct sparse_reader {
+        int fd;
+        off_t base;
+        uint64_t left;
+        off_t oldsize;
+        uint64_t size;
+        unsigned char header[SPARSE_HEADER_SIZE];
+        size_t headerlen;
+        unsigned char *map;
+        size_t maplen;
+        size_t mapgot;
+        struct sparse_extent *extents;
+        size_t nextents;
+        size_t index;
+        uint64_t done;
+        int error;
+        uint32_t crc;
+};
+
+/*
+ * Tells whether a file is worth sending as extents: it takes up less
+ * room than its size, so it has holes. A dense file costs only this.
+ */
+int sparse_file(const struct stat *sb);
+
+/*
+ * Maps the holes in the nbytes of fd from offset with SEEK_DATA and
+ * SEEK_HOLE, and starts the stream. The writer owns fd from now on;
+ * sw->total is the length of the stream, and sw->crc the crc32c of the
+ * extents read so far. Returns -1 with errno set if the map cannot be
+ * made, and then fd is left alone.
+ */
+int sparse_writer_open(struct sparse_writer *sw, int fd, off_t offset, uint64_t nbytes);
+
+/*
+ * Fills buff with the next bytes of the stream; 0 once it is over. An
+ * extent that shrank is padded with zeros, so the stream stays as long
+ * as the map says.
+ */
+size_t sparse_read(struct sparse_writer *sw, char *buff, size_t size);
+
+void sparse_writer_close(struct sparse_writer *sw);
+
+/*
+ * Starts receiving a stream of nbytes into fd from offset, which the
+ * reader owns from now on. With fd -1 the bytes are only consumed.
+ * Holes over what fd held before are punched, the rest are left
+ * unwritten; sr->crc is the crc32c of the extents received so far.
+ */
+void sparse_reader_open(struct sparse_reader *sr, int fd, off_t offset, uint64_t nbytes);
+
+/*
+ * Tells how many bytes can be fed without reading past the end of the
+ * stream; 0 once it is over.
+ */
+size_t sparse_want(const struct sparse_reader *sr);
+
+/* Takes in the next len bytes; anything after the end is ignored. */
+void sparse_write(struct sparse_reader *sr, const char *buff, size_t len);
+
+/*
+ * Sets the file to its full size and closes it. Returns -1 with the
+ * reason in sr->error if writing failed, the map was bad or the stream
+ * was cut short.
+ */
+int sparse_reader_close(struct sparse_reader *sr);
+
+#endif
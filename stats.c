@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "stats.h"
+
+struct stats_histogram {
+        uint64_t buckets[STATS_NBUCKETS + 1];
+        uint64_t sum;
+};
+
+struct stats_region {
+        uint64_t sessions;
+        uint64_t active;
+        uint64_t sent;
+        uint64_t received;
+        uint64_t cache[STATS_CACHE_NEVENTS];
+        struct stats_histogram setup;
+        struct stats_histogram firstbyte;
+        struct stats_histogram commands[STATS_NCOMMANDS];
+};
+
+static void add_sample(struct stats_histogram *h, uint64_t start);
+static void copy_histogram(const struct stats_histogram *h, struct stats_histogram *copy,
+                           uint64_t *countp);
+static uint64_t bucket_bound(int i);
+static void write_duration(FILE *fp, uint64_t usecs);
+static void write_percentile(FILE *fp, const struct stats_histogram *h, uint64_t count, double q);
+static void write_summary_line(FILE *fp, const char *name, const struct stats_histogram *h);
+static void write_prometheus_histogram(FILE *fp, const char *name, const char *label,
+                                       const struct stats_histogram *h);
+
+static const char *const command_names[STATS_NCOMMANDS] = {
+        "get", "put", "rls", "rcd", "rpwd", "echo", "other"
+};
+
+static struct stats_region *stats;
+
+int
+stats_open(void)
+{
+        void *p;
+
+        p = mmap(NULL, sizeof(struct stats_region), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                return -1;
+        }
+        stats = p;
+        return 0;
+}
+
+uint64_t
+stats_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int
+stats_command(const char *line)
+{
+        size_t len;
+        int i;
+
+        line += strspn(line, " \r\n");
+        len = strcspn(line, " \r\n");
+        if (len == 0) {
+                return -1;
+        }
+        for (i = 0; i < STATS_OTHER; i++) {
+                if (strlen(command_names[i]) == len && memcmp(line, command_names[i], len) == 0) {
+                        return i;
+                }
+        }
+        return STATS_OTHER;
+}
+
+void
+stats_command_done(int command, uint64_t start)
+{
+        if (stats == NULL || command < 0 || command >= STATS_NCOMMANDS) {
+                return;
+        }
+        add_sample(&stats->commands[command], start);
+}
+
+void
+stats_session_start(uint64_t accepted)
+{
+        if (stats == NULL) {
+                return;
+        }
+        __atomic_add_fetch(&stats->sessions, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->active, 1, __ATOMIC_RELAXED);
+        add_sample(&stats->setup, accepted);
+}
+
+void
+stats_session_end(void)
+{
+        if (stats == NULL) {
+                return;
+        }
+        __atomic_sub_fetch(&stats->active, 1, __ATOMIC_RELAXED);
+}
+
+void
+stats_first_byte(uint64_t start)
+{
+        if (stats == NULL) {
+                return;
+        }
+        add_sample(&stats->firstbyte, start);
+}
+
+void
+stats_cache(int event)
+{
+        if (stats == NULL || event < 0 || event >= STATS_CACHE_NEVENTS) {
+                return;
+        }
+        __atomic_add_fetch(&stats->cache[event], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The kernel keeps count of what a TCP connection has had acknowledged
+ * and received, whichever way the bytes went through it: sendfile,
+ * splice, io_uring or stdio. Taking the difference from time to time is
+ * cheaper than counting along every one of those paths.
+ */
+void
+stats_socket(int fd, struct stats_socket *last)
+{
+        struct tcp_info ti;
+        socklen_t len;
+
+        if (stats == NULL) {
+                return;
+        }
+        memset(&ti, 0, sizeof(ti));
+        len = sizeof(ti);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+                return;
+        }
+        if (ti.tcpi_bytes_acked > last->sent) {
+                __atomic_add_fetch(&stats->sent, ti.tcpi_bytes_acked - last->sent, __ATOMIC_RELAXED);
+                last->sent = ti.tcpi_bytes_acked;
+        }
+        if (ti.tcpi_bytes_received > last->received) {
+                __atomic_add_fetch(&stats->received, ti.tcpi_bytes_received - last->received,
+                                   __ATOMIC_RELAXED);
+                last->received = ti.tcpi_bytes_received;
+        }
+}
+
+char *
+stats_summary(size_t *lenp)
+{
+        char *buff;
+        FILE *fp;
+        int i;
+
+        if (stats == NULL) {
+                return NULL;
+        }
+        buff = NULL;
+        fp = open_memstream(&buff, lenp);
+        if (fp == NULL) {
+                return NULL;
+        }
+        fprintf(fp, "sessions: %lu active, %lu total\n",
+                __atomic_load_n(&stats->active, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->sessions, __ATOMIC_RELAXED));
+        fprintf(fp, "bytes: %lu sent, %lu received\n",
+                __atomic_load_n(&stats->sent, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->received, __ATOMIC_RELAXED));
+        fprintf(fp, "file cache: %lu hits, %lu misses, %lu evictions\n",
+                __atomic_load_n(&stats->cache[STATS_CACHE_HIT], __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->cache[STATS_CACHE_MISS], __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->cache[STATS_CACHE_EVICTION], __ATOMIC_RELAXED));
+        fprintf(fp, "%-14s %10s %10s %10s %10s\n", "", "count", "mean", "p50", "p99");
+        for (i = 0; i < STATS_NCOMMANDS; i++) {
+                write_summary_line(fp, command_names[i], &stats->commands[i]);
+        }
+        write_summary_line(fp, "first byte", &stats->firstbyte);
+        write_summary_line(fp, "session setup", &stats->setup);
+        if (fclose(fp) != 0) {
+                free(buff);
+                return NULL;
+        }
+        return buff;
+}
+
+char *
+stats_prometheus(size_t *lenp)
+{
+        char label[32];
+        char *buff;
+        FILE *fp;
+        int i;
+
+        if (stats == NULL) {
+                return NULL;
+        }
+        buff = NULL;
+        fp = open_memstream(&buff, lenp);
+        if (fp == NULL) {
+                return NULL;
+        }
+        fprintf(fp, "# HELP mftpd_sessions_total Sessions started since the server came up.\n"
+                    "# TYPE mftpd_sessions_total counter\n"
+                    "mftpd_sessions_total %lu\n",
+                __atomic_load_n(&stats->sessions, __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_sessions_active Sessions being served.\n"
+                    "# TYPE mftpd_sessions_active gauge\n"
+                    "mftpd_sessions_active %lu\n",
+                __atomic_load_n(&stats->active, __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_sent_bytes_total Bytes sent to clients and acknowledged.\n"
+                    "# TYPE mftpd_sent_bytes_total counter\n"
+                    "mftpd_sent_bytes_total %lu\n",
+                __atomic_load_n(&stats->sent, __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_received_bytes_total Bytes received from clients.\n"
+                    "# TYPE mftpd_received_bytes_total counter\n"
+                    "mftpd_received_bytes_total %lu\n",
+                __atomic_load_n(&stats->received, __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_file_cache_hits_total Gets answered from the file cache.\n"
+                    "# TYPE mftpd_file_cache_hits_total counter\n"
+                    "mftpd_file_cache_hits_total %lu\n",
+                __atomic_load_n(&stats->cache[STATS_CACHE_HIT], __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_file_cache_misses_total Gets of small files the file cache did not have.\n"
+                    "# TYPE mftpd_file_cache_misses_total counter\n"
+                    "mftpd_file_cache_misses_total %lu\n",
+                __atomic_load_n(&stats->cache[STATS_CACHE_MISS], __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_file_cache_evictions_total Files pushed out of the file cache for others.\n"
+                    "# TYPE mftpd_file_cache_evictions_total counter\n"
+                    "mftpd_file_cache_evictions_total %lu\n",
+                __atomic_load_n(&stats->cache[STATS_CACHE_EVICTION], __ATOMIC_RELAXED));
+        fprintf(fp, "# HELP mftpd_command_duration_seconds From a command coming in to its answer going out.\n"
+                    "# TYPE mftpd_command_duration_seconds histogram\n");
+        for (i = 0; i < STATS_NCOMMANDS; i++) {
+                snprintf(label, sizeof(label), "command=\"%s\",", command_names[i]);
+                write_prometheus_histogram(fp, "mftpd_command_duration_seconds", label, &stats->commands[i]);
+        }
+        fprintf(fp, "# HELP mftpd_first_byte_seconds From a get coming in to its data starting out.\n"
+                    "# TYPE mftpd_first_byte_seconds histogram\n");
+        write_prometheus_histogram(fp, "mftpd_first_byte_seconds", "", &stats->firstbyte);
+        fprintf(fp, "# HELP mftpd_session_setup_seconds From a session's last connection being accepted"
+                    " to its process being ready for commands.\n"
+                    "# TYPE mftpd_session_setup_seconds histogram\n");
+        write_prometheus_histogram(fp, "mftpd_session_setup_seconds", "", &stats->setup);
+        if (fclose(fp) != 0) {
+                free(buff);
+                return NULL;
+        }
+        return buff;
+}
+
+static void
+add_sample(struct stats_histogram *h, uint64_t start)
+{
+        uint64_t usecs;
+        int i;
+
+        usecs = stats_now() - start;
+        for (i = 0; i < STATS_NBUCKETS && usecs > bucket_bound(i); i++) {
+        }
+        __atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->sum, usecs, __ATOMIC_RELAXED);
+}
+
+/* Takes a copy of a histogram other processes may be adding to. */
+static void
+copy_histogram(const struct stats_histogram *h, struct stats_histogram *copy, uint64_t *countp)
+{
+        int i;
+
+        *countp = 0;
+        for (i = 0; i <= STATS_NBUCKETS; i++) {
+                copy->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+                *countp += copy->buckets[i];
+        }
+        copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+bucket_bound(int i)
+{
+        return (uint64_t)STATS_BUCKET_MIN << i;
+}
+
+static void
+write_duration(FILE *fp, uint64_t usecs)
+{
+        if (usecs < 1000) {
+                fprintf(fp, " %8luus", usecs);
+        }
+        else if (usecs < 1000000) {
+                fprintf(fp, " %8.2fms", usecs / 1e3);
+        }
+        else {
+                fprintf(fp, " %9.2fs", usecs / 1e6);
+        }
+}
+
+/* Writes the bound of the bucket the q-th of count samples fell into. */
+static void
+write_percentile(FILE *fp, const struct stats_histogram *h, uint64_t count, double q)
+{
+        uint64_t rank;
+        uint64_t seen;
+        int i;
+
+        rank = (uint64_t)(q * count);
+        if (rank < q * count || rank == 0) {
+                rank++;
+        }
+        seen = 0;
+        for (i = 0; i < STATS_NBUCKETS; i++) {
+                seen += h->buckets[i];
+                if (seen >= rank) {
+                        write_duration(fp, bucket_bound(i));
+                        return;
+                }
+        }
+        fprintf(fp, " %10s", "longer");
+}
+
+static void
+write_summary_line(FILE *fp, const char *name, const struct stats_histogram *h)
+{
+        struct stats_histogram copy;
+        uint64_t count;
+
+        copy_histogram(h, &copy, &count);
+        fprintf(fp, "%-14s %10lu", name, count);
+        if (count == 0) {
+                fprintf(fp, " %10s %10s %10s\n", "-", "-", "-");
+                return;
+        }
+        write_duration(fp, copy.sum / count);
+        write_percentile(fp, &copy, count, 0.50);
+        write_percentile(fp, &copy, count, 0.99);
+        fprintf(fp, "\n");
+}
+
+/* label is empty or ends with a comma, for le to follow */
+static void
+write_prometheus_histogram(FILE *fp, const char *name, const char *label,
+                           const struct stats_histogram *h)
+{
+        struct stats_histogram copy;
+        uint64_t count;
+        uint64_t seen;
+        int i;
+
+        copy_histogram(h, &copy, &count);
+        seen = 0;
+        for (i = 0; i < STATS_NBUCKETS; i++) {
+                seen += copy.buckets[i];
+                fprintf(fp, "%s_bucket{%sle=\"%g\"} %lu\n", name, label, bucket_bound(i) / 1e6, seen);
+        }
+        fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, label, count);
+        if (*label != '\0') {
+                /* the same label, without the comma after it */
+                fprintf(fp, "%s_sum{%.*s} %g\n", name, (int)strlen(label) - 1, label, copy.sum / 1e6);
+                fprintf(fp, "%s_count{%.*s} %lu\n", name, (int)strlen(label) - 1, label, count);
+        }
+        else {
+                fprintf(fp, "%s_sum %g\n", name, copy.sum / 1e6);
+                fprintf(fp, "%s_count %lu\n", name, count);
+        }
+}
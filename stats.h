@@ -0,0 +1,81 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms of the whole server. Like the
+ * checksum table (sumcache.h) they live in shared memory set up before
+ * the server forks, so that every session process, whichever engine
+ * runs it, adds to the same numbers; they are only ever updated with
+ * atomic operations.
+ *
+ * Times are microseconds of CLOCK_MONOTONIC, which the processes share.
+ * A histogram bucket holds what took at most STATS_BUCKET_MIN << i
+ * microseconds, the last one what took longer than all the others.
+ */
+#define STATS_NBUCKETS 20
+#define STATS_BUCKET_MIN 100
+
+/* the commands timed on their own; the rest are counted together */
+enum stats_command {
+        STATS_GET,
+        STATS_PUT,
+        STATS_RLS,
+        STATS_RCD,
+        STATS_RPWD,
+        STATS_ECHO,
+        STATS_OTHER,
+        STATS_NCOMMANDS
+};
+
+/* what the file cache (filecache.h) did for a get it could answer */
+enum stats_cache_event {
+        STATS_CACHE_HIT,
+        STATS_CACHE_MISS,
+        STATS_CACHE_EVICTION,
+        STATS_CACHE_NEVENTS
+};
+
+/* what a socket had moved when last looked at, see stats_socket */
+struct stats_socket {
+        uint64_t sent;
+        uint64_t received;
+};
+
+/* Sets up the region; -1 if it cannot be, and then nothing is kept. */
+int stats_open(void);
+
+uint64_t stats_now(void);
+
+/* The command a line asks for, or -1 for a blank line. */
+int stats_command(const char *line);
+
+/* Records a command that came in at start and is over now. */
+void stats_command_done(int command, uint64_t start);
+
+/*
+ * Records a session that is ready for its first command, whose last
+ * connection was accepted at accepted.
+ */
+void stats_session_start(uint64_t accepted);
+
+void stats_session_end(void);
+
+/* Records a get that came in at start and starts sending now. */
+void stats_first_byte(uint64_t start);
+
+void stats_cache(int event);
+
+/* Adds what fd has moved since last to the byte counters. */
+void stats_socket(int fd, struct stats_socket *last);
+
+/*
+ * The numbers as text for people or for Prometheus, in a buffer the
+ * caller frees; NULL if they are not kept.
+ */
+char *stats_summary(size_t *lenp);
+char *stats_prometheus(size_t *lenp);
+
+#endif
@@ -0,0 +1,141 @@
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "crc32c.h"
+#include "sumcache.h"
+
+/*
+ * An entry is guarded by its sequence number, odd while a process is
+ * writing it: a reader that sees it odd, or changed by the time it has
+ * copied the entry, takes that as a miss. A writer that finds it odd
+ * leaves the entry alone.
+ */
+struct sumcache_entry {
+        uint32_t seq;
+        uint32_t crc;
+        uint64_t dev;
+        uint64_t ino;
+        int64_t size;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+};
+
+static struct sumcache_entry *find_entry(const struct stat *sb);
+static int same_file(const struct sumcache_entry *e, const struct stat *sb);
+
+static struct sumcache_entry *sumcache;
+static size_t sumcache_size;
+
+int
+sumcache_open(size_t nentries)
+{
+        void *p;
+
+        p = mmap(NULL, nentries * sizeof(struct sumcache_entry), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                return -1;
+        }
+        sumcache = p;
+        sumcache_size = nentries;
+        return 0;
+}
+
+int
+sumcache_lookup(const struct stat *sb, uint32_t *crcp)
+{
+        struct sumcache_entry *e;
+        struct sumcache_entry copy;
+        uint32_t seq;
+
+        e = find_entry(sb);
+        if (e == NULL) {
+                return -1;
+        }
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || (seq & 1) != 0) {
+                return -1;
+        }
+        memcpy(&copy, e, sizeof(struct sumcache_entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || !same_file(&copy, sb)) {
+                return -1;
+        }
+        *crcp = copy.crc;
+        return 0;
+}
+
+void
+sumcache_store(const struct stat *sb, uint32_t crc)
+{
+        struct sumcache_entry *e;
+        uint32_t seq;
+
+        e = find_entry(sb);
+        if (e == NULL || sb->st_ctim.tv_sec + SUMCACHE_SETTLE > time(NULL)) {
+                return;
+        }
+        seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) != 0 ||
+            !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+        }
+        e->crc = crc;
+        e->dev = sb->st_dev;
+        e->ino = sb->st_ino;
+        e->size = sb->st_size;
+        e->mtime_sec = sb->st_mtim.tv_sec;
+        e->mtime_nsec = sb->st_mtim.tv_nsec;
+        e->ctime_sec = sb->st_ctim.tv_sec;
+        e->ctime_nsec = sb->st_ctim.tv_nsec;
+        __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int
+sumcache_file(int fd, uint32_t *crcp)
+{
+        struct stat before;
+        struct stat after;
+
+        if (fstat(fd, &before) < 0) {
+                return -1;
+        }
+        if (sumcache_lookup(&before, crcp) == 0) {
+                return 0;
+        }
+        if (crc32c_file(fd, 0, before.st_size, crcp) < 0) {
+                return -1;
+        }
+        /* only what was read from a file that held still is worth keeping */
+        if (fstat(fd, &after) == 0 && after.st_size == before.st_size &&
+            after.st_ctim.tv_sec == before.st_ctim.tv_sec &&
+            after.st_ctim.tv_nsec == before.st_ctim.tv_nsec) {
+                sumcache_store(&after, *crcp);
+        }
+        return 0;
+}
+
+static struct sumcache_entry *
+find_entry(const struct stat *sb)
+{
+        uint64_t h;
+
+        if (sumcache == NULL || !S_ISREG(sb->st_mode)) {
+                return NULL;
+        }
+        h = ((uint64_t)sb->st_dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)sb->st_ino;
+        h *= 0xff51afd7ed558ccdull;
+        return &sumcache[(h >> 32) % sumcache_size];
+}
+
+static int
+same_file(const struct sumcache_entry *e, const struct stat *sb)
+{
+        return e->dev == (uint64_t)sb->st_dev && e->ino == (uint64_t)sb->st_ino &&
+               e->size == sb->st_size &&
+               e->mtime_sec == sb->st_mtim.tv_sec && e->mtime_nsec == sb->st_mtim.tv_nsec &&
+               e->ctime_sec == sb->st_ctim.tv_sec && e->ctime_nsec == sb->st_ctim.tv_nsec;
+}
@@ -0,0 +1,33 @@
+#ifndef SUMCACHE_H
+#define SUMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Whole-file checksums remembered across the server's processes. The
+ * table is shared memory set up before the server forks, so that once
+ * a session has read a file through, the next one asking about it does
+ * not have to. An entry is keyed by device and inode, and is good only
+ * while the file's size, mtime and ctime are still what they were.
+ */
+#define SUMCACHE_ENTRIES 4096
+/* a file changed this recently may change again without its times moving */
+#define SUMCACHE_SETTLE 2
+
+/* Sets up the table; -1 if it cannot be, and then nothing is cached. */
+int sumcache_open(size_t nentries);
+
+/* Looks a file up; -1 if its checksum is not known. */
+int sumcache_lookup(const struct stat *sb, uint32_t *crcp);
+
+void sumcache_store(const struct stat *sb, uint32_t crc);
+
+/*
+ * Checksums the whole file open on fd, from the table when it can.
+ * Returns -1 on a read error.
+ */
+int sumcache_file(int fd, uint32_t *crcp);
+
+#endif
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "upload.h"
+
+/* tries at a temporary name that is not taken yet */
+#define UPLOAD_TRIES 64
+/* links followed to the file a put writes, as many as the kernel does */
+#define UPLOAD_HOPS 40
+/* set on every file the server stages an upload in, to the name it is for */
+#define UPLOAD_MARKER "user.mftpd.upload"
+
+/* where a temporary file goes once it is complete, by its descriptor */
+struct upload {
+        int dirfd;
+        char *name;
+        char *tmpname;
+};
+
+static int open_directory(const char *path, int *dirfdp, char **namep);
+static char *part_name(const char *name);
+static int staging_name(const char *name);
+static int marked_for(int fd, const char *name);
+static int open_marked(int dirfd, const char *name, const char *target, int flags);
+static int remember_upload(int fd, int dirfd, char *name, char *tmpname);
+static char *resolve_link(const char *path);
+static int split_path(const char *path, int *dirfdp, char **namep);
+static int create_temporary(int dirfd, const char *name, char **tmpnamep, int flags, mode_t mode);
+static struct upload *find_upload(int fd);
+static void forget_upload(struct upload *up);
+
+static enum upload_sync sync_policy = UPLOAD_SYNC_NONE;
+static struct upload *uploads;
+static int nuploads;
+
+int
+upload_set_sync(const char *name)
+{
+        if (strcmp(name, "none") == 0) {
+                sync_policy = UPLOAD_SYNC_NONE;
+        }
+        else if (strcmp(name, "close") == 0) {
+                sync_policy = UPLOAD_SYNC_CLOSE;
+        }
+        else if (strcmp(name, "periodic") == 0) {
+                sync_policy = UPLOAD_SYNC_PERIODIC;
+        }
+        else {
+                return -1;
+        }
+        return 0;
+}
+
+enum upload_sync
+upload_sync(void)
+{
+        return sync_policy;
+}
+
+int
+upload_open(const char *path, off_t size, int flags)
+{
+        struct stat sb;
+        mode_t mode;
+        mode_t mask;
+        char *name;
+        char *tmpname;
+        int dirfd;
+        int error;
+        int fd;
+
+        if (open_directory(path, &dirfd, &name) < 0) {
+                return -1;
+        }
+        if (fstatat(dirfd, name, &sb, 0) == 0) {
+                mode = sb.st_mode & 07777;
+                error = S_ISDIR(sb.st_mode) ? EISDIR : 0;
+        }
+        else {
+                mask = umask(0);
+                umask(mask);
+                mode = 0666 & ~mask;
+                error = errno == ENOENT ? 0 : errno;
+        }
+        fd = error == 0 ? create_temporary(dirfd, name, &tmpname, flags, mode) : -1;
+        if (fd < 0) {
+                error = error != 0 ? error : errno;
+                close(dirfd);
+                free(name);
+                errno = error;
+                return -1;
+        }
+        /*
+         * In one piece, or not at all before a byte has moved. The size
+         * follows what is written, so a put cut short is as long as what
+         * arrived.
+         */
+        if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+                error = errno;
+                unlinkat(dirfd, tmpname, 0);
+                close(fd);
+                close(dirfd);
+                free(name);
+                free(tmpname);
+                errno = error;
+                return -1;
+        }
+        if (remember_upload(fd, dirfd, name, tmpname) < 0) {
+                unlinkat(dirfd, tmpname, 0);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+int
+upload_resume(const char *path, int flags)
+{
+        char *name;
+        char *partname;
+        int dirfd;
+        int error;
+        int fd;
+
+        if (open_directory(path, &dirfd, &name) < 0) {
+                return -1;
+        }
+        partname = part_name(name);
+        fd = partname != NULL ? open_marked(dirfd, partname, name, flags) : -1;
+        if (fd < 0) {
+                error = partname != NULL ? errno : ENOMEM;
+                close(dirfd);
+                free(name);
+                free(partname);
+                errno = error;
+                return -1;
+        }
+        if (remember_upload(fd, dirfd, name, partname) < 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+int
+upload_partial(const char *path)
+{
+        char *name;
+        char *partname;
+        int dirfd;
+        int error;
+        int fd;
+
+        if (open_directory(path, &dirfd, &name) < 0) {
+                return -1;
+        }
+        partname = part_name(name);
+        fd = partname != NULL ? open_marked(dirfd, partname, name, O_RDONLY) : -1;
+        error = partname != NULL ? errno : ENOMEM;
+        close(dirfd);
+        free(name);
+        free(partname);
+        errno = error;
+        return fd;
+}
+
+int
+upload_staging(int dirfd, const char *path)
+{
+        const char *name;
+        int fd;
+
+        name = strrchr(path, '/');
+        name = name != NULL ? name + 1 : path;
+        if (!staging_name(name)) {
+                return 0;
+        }
+        fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+                return 0;
+        }
+        if (!marked_for(fd, NULL)) {
+                close(fd);
+                return 0;
+        }
+        close(fd);
+        return 1;
+}
+
+int
+upload_close(int fd, enum upload_end end)
+{
+        struct upload *up;
+        struct stat sb;
+        char *partname;
+        int error;
+
+        up = find_upload(fd);
+        error = 0;
+        if (up != NULL && end == UPLOAD_SUSPEND) {
+                /* a file without the marker could not be told from the user's own later */
+                if (fstat(fd, &sb) < 0 || sb.st_size == 0 || !marked_for(fd, up->name)) {
+                        end = UPLOAD_DISCARD;
+                }
+                else {
+                        /* give back the room set aside for what never came */
+                        ftruncate(fd, sb.st_size);
+                }
+        }
+        if (end == UPLOAD_COMMIT && sync_policy != UPLOAD_SYNC_NONE && fsync(fd) < 0) {
+                error = errno;
+        }
+        if (close(fd) < 0 && error == 0) {
+                error = errno;
+        }
+        if (up == NULL) {
+                errno = error;
+                return error != 0 ? -1 : 0;
+        }
+        partname = part_name(up->name);
+        if (end == UPLOAD_COMMIT && error == 0 &&
+            renameat(up->dirfd, up->tmpname, up->dirfd, up->name) < 0) {
+                error = errno;
+        }
+        if (end == UPLOAD_SUSPEND && partname != NULL && strcmp(up->tmpname, partname) != 0 &&
+            renameat(up->dirfd, up->tmpname, up->dirfd, partname) < 0) {
+                end = UPLOAD_DISCARD;
+        }
+        if (end == UPLOAD_DISCARD || (end == UPLOAD_COMMIT && error != 0)) {
+                unlinkat(up->dirfd, up->tmpname, 0);
+        }
+        else if (end == UPLOAD_COMMIT) {
+                if (partname != NULL && strcmp(up->tmpname, partname) != 0 &&
+                    (fd = open_marked(up->dirfd, partname, up->name, O_RDONLY)) >= 0) {
+                        /* what an earlier put left is no longer worth resuming */
+                        close(fd);
+                        unlinkat(up->dirfd, partname, 0);
+                }
+                if (sync_policy != UPLOAD_SYNC_NONE) {
+                        /* the rename, too, has to survive a crash */
+                        fsync(up->dirfd);
+                }
+        }
+        free(partname);
+        forget_upload(up);
+        errno = error;
+        return end == UPLOAD_COMMIT && error != 0 ? -1 : 0;
+}
+
+/*
+ * Opens the directory of the file path leads to, links followed, and
+ * copies out the last part of its name; see split_path.
+ */
+static int
+open_directory(const char *path, int *dirfdp, char **namep)
+{
+        char *target;
+        int error;
+
+        target = resolve_link(path);
+        if (target == NULL) {
+                return -1;
+        }
+        error = split_path(target, dirfdp, namep);
+        free(target);
+        return error;
+}
+
+/* The name of the partial file of name, ".name.part", to free. */
+static char *
+part_name(const char *name)
+{
+        char *partname;
+
+        partname = malloc(strlen(name) + 7);
+        if (partname != NULL) {
+                sprintf(partname, ".%s.part", name);
+        }
+        return partname;
+}
+
+/* Tells whether name looks like ".name.part" or ".name.XXXXXX". */
+static int
+staging_name(const char *name)
+{
+        size_t len;
+        size_t i;
+
+        len = strlen(name);
+        if (name[0] != '.') {
+                return 0;
+        }
+        if (len > 6 && strcmp(name + len - 5, ".part") == 0) {
+                return 1;
+        }
+        if (len < 9 || name[len - 7] != '.') {
+                return 0;
+        }
+        for (i = len - 6; i < len; i++) {
+                if (!isxdigit((unsigned char)name[i]) || isupper((unsigned char)name[i])) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* Tells whether fd carries the marker for name, or with name NULL any marker. */
+static int
+marked_for(int fd, const char *name)
+{
+        char value[NAME_MAX + 1];
+        ssize_t len;
+
+        len = fgetxattr(fd, UPLOAD_MARKER, value, sizeof(value) - 1);
+        if (len < 0) {
+                return 0;
+        }
+        value[len] = '\0';
+        return name == NULL || strcmp(value, name) == 0;
+}
+
+/*
+ * Opens name in dirfd only if the server staged an upload of target in
+ * it; any other file by that name is the user's, and -1 with errno
+ * ENOENT is returned as if there were none.
+ */
+static int
+open_marked(int dirfd, const char *name, const char *target, int flags)
+{
+        int fd;
+
+        fd = openat(dirfd, name, flags | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+                return -1;
+        }
+        if (!marked_for(fd, target)) {
+                close(fd);
+                errno = ENOENT;
+                return -1;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return fd;
+}
+
+/*
+ * Notes where the file open as fd goes once it is complete. The upload
+ * owns dirfd, name and tmpname from now on, even on failure, which
+ * leaves only fd to the caller; -1 with errno set then.
+ */
+static int
+remember_upload(int fd, int dirfd, char *name, char *tmpname)
+{
+        struct upload *table;
+
+        if (fd >= nuploads) {
+                table = realloc(uploads, (fd + 1) * sizeof(struct upload));
+                if (table == NULL) {
+                        close(dirfd);
+                        free(name);
+                        free(tmpname);
+                        errno = ENOMEM;
+                        return -1;
+                }
+                memset(table + nuploads, 0, (fd + 1 - nuploads) * sizeof(struct upload));
+                uploads = table;
+                nuploads = fd + 1;
+        }
+        uploads[fd].dirfd = dirfd;
+        uploads[fd].name = name;
+        uploads[fd].tmpname = tmpname;
+        return 0;
+}
+
+/*
+ * Follows path while it is a symbolic link, so that the file the link
+ * leads to is the one replaced, as writing through the link would; a
+ * link that leads nowhere names the file to create. Returns a copy to
+ * free, or NULL with errno set.
+ */
+static char *
+resolve_link(const char *path)
+{
+        char target[PATH_MAX];
+        struct stat sb;
+        const char *slash;
+        char *resolved;
+        char *next;
+        ssize_t len;
+        int hops;
+
+        resolved = strdup(path);
+        for (hops = 0; resolved != NULL && hops < UPLOAD_HOPS; hops++) {
+                if (lstat(resolved, &sb) < 0 || !S_ISLNK(sb.st_mode)) {
+                        return resolved;
+                }
+                len = readlink(resolved, target, sizeof(target) - 1);
+                if (len < 0) {
+                        free(resolved);
+                        return NULL;
+                }
+                target[len] = '\0';
+                slash = strrchr(resolved, '/');
+                if (target[0] == '/' || slash == NULL) {
+                        next = strdup(target);
+                }
+                else {
+                        /* relative to the directory the link is in */
+                        next = malloc(slash - resolved + len + 2);
+                        if (next != NULL) {
+                                sprintf(next, "%.*s/%s", (int)(slash - resolved), resolved, target);
+                        }
+                }
+                free(resolved);
+                resolved = next;
+        }
+        if (resolved == NULL) {
+                errno = ENOMEM;
+                return NULL;
+        }
+        free(resolved);
+        errno = ELOOP;
+        return NULL;
+}
+
+/*
+ * Opens the directory of path and copies out the last part of it. The
+ * directory is held on to, as the session may have moved elsewhere by
+ * the time the file is complete.
+ */
+static int
+split_path(const char *path, int *dirfdp, char **namep)
+{
+        const char *slash;
+        char *dir;
+
+        slash = strrchr(path, '/');
+        if (slash == NULL) {
+                dir = strdup(".");
+        }
+        else {
+                dir = strndup(path, slash > path ? (size_t)(slash - path) : 1);
+        }
+        *namep = strdup(slash != NULL ? slash + 1 : path);
+        if (dir == NULL || *namep == NULL) {
+                free(dir);
+                free(*namep);
+                errno = ENOMEM;
+                return -1;
+        }
+        if ((*namep)[0] == '\0') {
+                free(dir);
+                free(*namep);
+                errno = EISDIR;
+                return -1;
+        }
+        *dirfdp = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(dir);
+        if (*dirfdp < 0) {
+                free(*namep);
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Creates ".name.XXXXXX" in dirfd, like mkostemp does in the current
+ * directory, and marks it as staging name. Where the file system takes
+ * no extended attributes the file goes unmarked, so it is not kept
+ * when the put is cut short.
+ */
+static int
+create_temporary(int dirfd, const char *name, char **tmpnamep, int flags, mode_t mode)
+{
+        static unsigned counter;
+        unsigned suffix;
+        int fd;
+        int i;
+
+        *tmpnamep = malloc(strlen(name) + 9);
+        if (*tmpnamep == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        for (i = 0; i < UPLOAD_TRIES; i++) {
+                suffix = ((unsigned)getpid() * 2654435761u) ^ ++counter * 40503u ^ (unsigned)random();
+                sprintf(*tmpnamep, ".%s.%06x", name, suffix & 0xffffff);
+                fd = openat(dirfd, *tmpnamep, flags | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+                if (fd >= 0) {
+                        fchmod(fd, mode);
+                        fsetxattr(fd, UPLOAD_MARKER, name, strlen(name), 0);
+                        return fd;
+                }
+                if (errno != EEXIST) {
+                        break;
+                }
+        }
+        free(*tmpnamep);
+        *tmpnamep = NULL;
+        return -1;
+}
+
+static struct upload *
+find_upload(int fd)
+{
+        if (fd < 0 || fd >= nuploads || uploads[fd].name == NULL) {
+                return NULL;
+        }
+        return &uploads[fd];
+}
+
+static void
+forget_upload(struct upload *up)
+{
+        close(up->dirfd);
+        free(up->name);
+        free(up->tmpname);
+        memset(up, 0, sizeof(struct upload));
+}
@@ -0,0 +1,85 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <sys/types.h>
+
+/*
+ * Files being received by put. A new file is written under a temporary
+ * name next to the one it replaces, taking over its mode, with room
+ * for its full size set aside, and renamed into place only once all of
+ * it has arrived intact, as a put -d rebuilds its file (see delta.h): a
+ * reader sees the old file or the new one, never a part of it, and a
+ * put that fails leaves the old one alone. A put onto a symbolic link
+ * replaces the file the link leads to and leaves the link be.
+ *
+ * A put that is cut short keeps what did arrive as ".name.part", next
+ * to the file. That is what a put -o resumes, and it is moved into
+ * place once the rest is in; a partial file without one goes on being
+ * written in place.
+ *
+ * The server marks the files it stages uploads in with an extended
+ * attribute, and only ever resumes or removes a marked one: a file the
+ * user happens to have by such a name is left alone. Listings leave the
+ * marked ones out, and get does not serve them.
+ *
+ * How hard the data is pushed to disk before the reply is the sync
+ * policy's choice.
+ */
+enum upload_sync {
+        /* left to the kernel */
+        UPLOAD_SYNC_NONE,
+        /* fsync before the rename, and of the directory after */
+        UPLOAD_SYNC_CLOSE,
+        /* the same, with the data written back step by step as it arrives */
+        UPLOAD_SYNC_PERIODIC
+};
+
+/* what upload_close does with a file it made */
+enum upload_end {
+        /* thrown away */
+        UPLOAD_DISCARD,
+        /* moved into place */
+        UPLOAD_COMMIT,
+        /* kept as the partial file, for a put -o to resume */
+        UPLOAD_SUSPEND
+};
+
+/* Sets the policy by its name, "none", "close" or "periodic"; -1 for another. */
+int upload_set_sync(const char *name);
+
+enum upload_sync upload_sync(void);
+
+/*
+ * Opens a temporary file to receive size bytes for path, with flags
+ * O_WRONLY or O_RDWR. Returns its descriptor, or -1 with errno set,
+ * ENOSPC among others if the space cannot be had.
+ */
+int upload_open(const char *path, off_t size, int flags);
+
+/*
+ * Opens the partial file of path to go on receiving it, with flags as
+ * for upload_open. Returns its descriptor, or -1 with errno set, ENOENT
+ * if there is none.
+ */
+int upload_resume(const char *path, int flags);
+
+/* Opens the partial file of path only to read it; -1 as upload_resume. */
+int upload_partial(const char *path);
+
+/*
+ * Tells whether path, relative to dirfd, is a file the server stages an
+ * upload in, as opposed to one of the user's.
+ */
+int upload_staging(int dirfd, const char *path);
+
+/*
+ * Finishes receiving into fd and closes it, as end says. To commit,
+ * the file is synced as the policy says and moved into place, and a
+ * partial file left over from before goes; -1 with errno set if that
+ * fails, and then it is gone as well. A suspended file that holds
+ * nothing is thrown away. fd may be any descriptor, which is then only
+ * synced and closed.
+ */
+int upload_close(int fd, enum upload_end end);
+
+#endif
@@ -0,0 +1,494 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "crc32c.h"
+#include "buffpool.h"
+#include "uring.h"
+
+/* where the descriptors of a transfer are registered */
+#define URING_FILE 0
+#define URING_SOCKET 1
+#define URING_DIRECT 2
+
+/* an operation is tagged with its buffer, and with 1 if on the socket */
+#define URING_TAG(i, sock) ((uint64_t)(i) << 1 | (sock))
+
+static void push_sqe(struct uring *u, const struct io_uring_sqe *sqe);
+static void queue_file_op(struct uring *u, int i, int write);
+static void queue_socket_op(struct uring *u, int i, int send);
+static int wait_cqe(struct uring *u, uint64_t *tagp, int *resp);
+static void register_files(struct uring *u, int filefd, int sockfd, int directfd);
+static void unregister_files(struct uring *u);
+static void break_ring(struct uring *u);
+static int find_buff(struct uring *u, enum uring_state state);
+
+int
+uring_probe(void)
+{
+        struct uring *u;
+
+        u = uring_open();
+        if (u == NULL) {
+                return -1;
+        }
+        uring_close(u);
+        return 0;
+}
+
+struct uring *
+uring_open(void)
+{
+        struct io_uring_params p;
+        struct iovec iov[URING_NBUFS];
+        struct uring *u;
+        void *ring;
+        int i;
+
+        u = calloc(1, sizeof(struct uring));
+        if (u == NULL) {
+                return NULL;
+        }
+        memset(&p, 0, sizeof(p));
+        u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+        /* send, receive and plain reads and writes all came with fast poll */
+        if (u->fd < 0 || (p.features & IORING_FEAT_FAST_POLL) == 0) {
+                uring_close(u);
+                return NULL;
+        }
+        u->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        u->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0 && u->cqringsize > u->sqringsize) {
+                u->sqringsize = u->cqringsize;
+        }
+        ring = mmap(NULL, u->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    u->fd, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) {
+                uring_close(u);
+                return NULL;
+        }
+        u->sqring = ring;
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+                ring = mmap(NULL, u->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            u->fd, IORING_OFF_CQ_RING);
+                if (ring == MAP_FAILED) {
+                        uring_close(u);
+                        return NULL;
+                }
+                u->cqring = ring;
+        }
+        u->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    u->fd, IORING_OFF_SQES);
+        if (ring == MAP_FAILED) {
+                uring_close(u);
+                return NULL;
+        }
+        u->sqes = ring;
+        ring = u->cqring != NULL ? u->cqring : u->sqring;
+        u->sqhead = (unsigned *)((char *)u->sqring + p.sq_off.head);
+        u->sqtail = (unsigned *)((char *)u->sqring + p.sq_off.tail);
+        u->sqmask = *(unsigned *)((char *)u->sqring + p.sq_off.ring_mask);
+        u->sqarray = (unsigned *)((char *)u->sqring + p.sq_off.array);
+        u->cqhead = (unsigned *)((char *)ring + p.cq_off.head);
+        u->cqtail = (unsigned *)((char *)ring + p.cq_off.tail);
+        u->cqmask = *(unsigned *)((char *)ring + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)((char *)ring + p.cq_off.cqes);
+        u->buffsize = buffpool_size();
+        for (i = 0; i < URING_NBUFS; i++) {
+                u->buffs[i].data = buffpool_get();
+                if (u->buffs[i].data == NULL) {
+                        uring_close(u);
+                        return NULL;
+                }
+                iov[i].iov_base = u->buffs[i].data;
+                iov[i].iov_len = u->buffsize;
+        }
+        /* past the locked memory limit the buffers are just not registered */
+        u->fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+                           iov, URING_NBUFS) == 0;
+        return u;
+}
+
+void
+uring_close(struct uring *u)
+{
+        int i;
+
+        if (u->fd >= 0) {
+                close(u->fd);
+        }
+        if (u->sqes != NULL) {
+                munmap(u->sqes, u->sqessize);
+        }
+        if (u->cqring != NULL) {
+                munmap(u->cqring, u->cqringsize);
+        }
+        if (u->sqring != NULL) {
+                munmap(u->sqring, u->sqringsize);
+        }
+        for (i = 0; i < URING_NBUFS; i++) {
+                buffpool_put(u->buffs[i].data);
+        }
+        free(u);
+}
+
+size_t
+uring_send_file(struct uring *u, int filefd, int directfd, off_t offset, int sockfd,
+                size_t nbytes, uint32_t *crcp)
+{
+        struct uring_buff *b;
+        uint64_t readseq;
+        uint64_t sendseq;
+        uint64_t endseq;
+        uint64_t tag;
+        uint32_t crc;
+        size_t nsent;
+        int sending;
+        int error;
+        int res;
+        int i;
+
+        register_files(u, filefd, sockfd, directfd);
+        crc = 0;
+        nsent = 0;
+        readseq = 0;
+        sendseq = 0;
+        /* the first buffer that holds nothing, once the file is seen to end */
+        endseq = UINT64_MAX;
+        sending = 0;
+        error = 0;
+        for (;;) {
+                while (!error && nbytes > 0 && readseq < endseq &&
+                       (i = find_buff(u, URING_FREE)) >= 0) {
+                        b = &u->buffs[i];
+                        b->state = URING_FILLING;
+                        b->len = nbytes < u->buffsize ? nbytes : u->buffsize;
+                        b->done = 0;
+                        b->offset = offset;
+                        b->seq = readseq++;
+                        offset += b->len;
+                        nbytes -= b->len;
+                        queue_file_op(u, i, 0);
+                }
+                for (i = 0; !error && !sending && i < URING_NBUFS; i++) {
+                        b = &u->buffs[i];
+                        if (b->state == URING_FULL && b->seq == sendseq) {
+                                crc = crc32c(crc, b->data, b->len);
+                                b->state = URING_DRAINING;
+                                b->done = 0;
+                                queue_socket_op(u, i, 1);
+                                sending = 1;
+                        }
+                }
+                if (u->inflight == 0) {
+                        break;
+                }
+                if (wait_cqe(u, &tag, &res) < 0) {
+                        break;
+                }
+                b = &u->buffs[tag >> 1];
+                if (res == -EINTR || res == -EAGAIN) {
+                        if (tag & 1) {
+                                queue_socket_op(u, tag >> 1, 1);
+                        }
+                        else {
+                                queue_file_op(u, tag >> 1, 0);
+                        }
+                        continue;
+                }
+                if (res < 0) {
+                        error = -res;
+                        b->state = URING_FREE;
+                        continue;
+                }
+                b->done += res;
+                if (b->done > b->len) {
+                        /* a direct read rounded up past what was asked for */
+                        b->done = b->len;
+                }
+                if (tag & 1) {
+                        nsent += res;
+                        if (b->done < b->len) {
+                                queue_socket_op(u, tag >> 1, 1);
+                                continue;
+                        }
+                        b->state = URING_FREE;
+                        sending = 0;
+                        sendseq++;
+                        continue;
+                }
+                if (res == 0) {
+                        /* the file is shorter than it was */
+                        b->len = b->done;
+                        if (b->seq < endseq) {
+                                endseq = b->len > 0 ? b->seq + 1 : b->seq;
+                        }
+                }
+                else if (b->done < b->len) {
+                        queue_file_op(u, tag >> 1, 0);
+                        continue;
+                }
+                b->state = b->seq < endseq ? URING_FULL : URING_FREE;
+        }
+        for (i = 0; i < URING_NBUFS; i++) {
+                u->buffs[i].state = URING_FREE;
+        }
+        unregister_files(u);
+        *crcp = crc;
+        if (error != 0) {
+                errno = error;
+        }
+        return nsent;
+}
+
+size_t
+uring_receive_file(struct uring *u, int sockfd, int filefd, int directfd, off_t offset,
+                   size_t nbytes, uint32_t *crcp)
+{
+        struct uring_buff *b;
+        uint64_t tag;
+        uint32_t crc;
+        size_t nstored;
+        int receiving;
+        int error;
+        int res;
+        int i;
+
+        register_files(u, filefd, sockfd, directfd);
+        crc = 0;
+        nstored = 0;
+        receiving = 0;
+        error = 0;
+        for (;;) {
+                if (!error && !receiving && nbytes > 0 && (i = find_buff(u, URING_FREE)) >= 0) {
+                        b = &u->buffs[i];
+                        b->state = URING_FILLING;
+                        b->len = nbytes < u->buffsize ? nbytes : u->buffsize;
+                        b->done = 0;
+                        b->offset = offset;
+                        offset += b->len;
+                        nbytes -= b->len;
+                        queue_socket_op(u, i, 0);
+                        receiving = 1;
+                }
+                if (u->inflight == 0) {
+                        break;
+                }
+                if (wait_cqe(u, &tag, &res) < 0) {
+                        error = errno;
+                        break;
+                }
+                b = &u->buffs[tag >> 1];
+                if (res == -EINTR || res == -EAGAIN) {
+                        if (tag & 1) {
+                                queue_socket_op(u, tag >> 1, 0);
+                        }
+                        else {
+                                queue_file_op(u, tag >> 1, 1);
+                        }
+                        continue;
+                }
+                if (res <= 0) {
+                        /* a peer that closes early looks like a reset, as with splice */
+                        error = res < 0 ? -res : (tag & 1) ? ECONNRESET : EIO;
+                        b->state = URING_FREE;
+                        receiving = (tag & 1) ? 0 : receiving;
+                        continue;
+                }
+                b->done += res;
+                if (b->done < b->len) {
+                        if (tag & 1) {
+                                queue_socket_op(u, tag >> 1, 0);
+                        }
+                        else {
+                                queue_file_op(u, tag >> 1, 1);
+                        }
+                        continue;
+                }
+                if (tag & 1) {
+                        crc = crc32c(crc, b->data, b->len);
+                        b->state = URING_DRAINING;
+                        b->done = 0;
+                        queue_file_op(u, tag >> 1, 1);
+                        receiving = 0;
+                        continue;
+                }
+                nstored += b->len;
+                b->state = URING_FREE;
+        }
+        for (i = 0; i < URING_NBUFS; i++) {
+                u->buffs[i].state = URING_FREE;
+        }
+        unregister_files(u);
+        *crcp = crc;
+        if (error != 0) {
+                errno = error;
+        }
+        return nstored;
+}
+
+static int
+find_buff(struct uring *u, enum uring_state state)
+{
+        int i;
+
+        for (i = 0; i < URING_NBUFS; i++) {
+                if (u->buffs[i].state == state) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+/*
+ * Reads or writes what is left of buffer i at its place in the file,
+ * directly if that is aligned. A read may run to the next boundary,
+ * past what the buffer is to hold, as the buffer has room for it.
+ */
+static void
+queue_file_op(struct uring *u, int i, int write)
+{
+        struct io_uring_sqe sqe;
+        struct uring_buff *b;
+        size_t len;
+        int file;
+
+        b = &u->buffs[i];
+        memset(&sqe, 0, sizeof(sqe));
+        if (u->fixed) {
+                sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe.buf_index = i;
+        }
+        else {
+                sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        len = b->len - b->done;
+        file = URING_FILE;
+        if (u->fds[URING_DIRECT] >= 0 && (b->offset + b->done) % URING_ALIGN == 0 &&
+            b->done % URING_ALIGN == 0 && (!write || len % URING_ALIGN == 0)) {
+                file = URING_DIRECT;
+                len = (len + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+        }
+        sqe.flags = u->fixedfiles ? IOSQE_FIXED_FILE : 0;
+        sqe.fd = u->fixedfiles ? file : u->fds[file];
+        sqe.addr = (uintptr_t)(b->data + b->done);
+        sqe.len = len;
+        sqe.off = b->offset + b->done;
+        sqe.user_data = URING_TAG(i, 0);
+        push_sqe(u, &sqe);
+}
+
+/* Sends what is left of buffer i, or receives into the rest of it. */
+static void
+queue_socket_op(struct uring *u, int i, int send)
+{
+        struct io_uring_sqe sqe;
+        struct uring_buff *b;
+
+        b = &u->buffs[i];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+        sqe.flags = u->fixedfiles ? IOSQE_FIXED_FILE : 0;
+        sqe.fd = u->fixedfiles ? URING_SOCKET : u->fds[URING_SOCKET];
+        sqe.addr = (uintptr_t)(b->data + b->done);
+        sqe.len = b->len - b->done;
+        sqe.msg_flags = send ? MSG_NOSIGNAL : 0;
+        sqe.user_data = URING_TAG(i, 1);
+        push_sqe(u, &sqe);
+}
+
+/*
+ * Puts an entry on the submission queue; it goes to the kernel with the
+ * next wait. There is always room, as no more than one operation per
+ * buffer and one on the socket are ever outstanding.
+ */
+static void
+push_sqe(struct uring *u, const struct io_uring_sqe *sqe)
+{
+        unsigned tail;
+
+        tail = *u->sqtail;
+        u->sqes[tail & u->sqmask] = *sqe;
+        u->sqarray[tail & u->sqmask] = tail & u->sqmask;
+        __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+        u->tosubmit++;
+        u->inflight++;
+}
+
+/*
+ * Submits what is queued and takes the next completion. Returns -1 if
+ * the ring fails, which leaves it unusable.
+ */
+static int
+wait_cqe(struct uring *u, uint64_t *tagp, int *resp)
+{
+        struct io_uring_cqe *cqe;
+        unsigned head;
+        int n;
+
+        for (;;) {
+                head = *u->cqhead;
+                if (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+                        break;
+                }
+                n = syscall(__NR_io_uring_enter, u->fd, u->tosubmit, 1, IORING_ENTER_GETEVENTS,
+                            NULL, 0);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        break_ring(u);
+                        return -1;
+                }
+                u->tosubmit -= n;
+        }
+        cqe = &u->cqes[head & u->cqmask];
+        *tagp = cqe->user_data;
+        *resp = cqe->res;
+        __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+        u->inflight--;
+        return 0;
+}
+
+static void
+register_files(struct uring *u, int filefd, int sockfd, int directfd)
+{
+        u->fds[URING_FILE] = filefd;
+        u->fds[URING_SOCKET] = sockfd;
+        u->fds[URING_DIRECT] = directfd;
+        /* a missing direct descriptor leaves a hole, which the table may have */
+        u->fixedfiles = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, u->fds, 3) == 0;
+}
+
+static void
+unregister_files(struct uring *u)
+{
+        if (u->fixedfiles && u->fd >= 0) {
+                syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_FILES, NULL, 0);
+        }
+        u->fixedfiles = 0;
+}
+
+/*
+ * Gives up on a ring the kernel no longer takes submissions on. Closing
+ * it cancels whatever is still in flight; the buffers are never given
+ * back to the pool, so nothing can land in another transfer's data.
+ */
+static void
+break_ring(struct uring *u)
+{
+        int i;
+
+        close(u->fd);
+        u->fd = -1;
+        for (i = 0; i < URING_NBUFS; i++) {
+                u->buffs[i].data = NULL;
+        }
+        u->inflight = 0;
+        u->tosubmit = 0;
+}
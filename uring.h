@@ -0,0 +1,99 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/*
+ * Moving a range of a file to or from a socket through io_uring, with
+ * several reads and writes in flight at once so that the disk and the
+ * network work side by side. The buffers are registered with the ring
+ * once, and the two descriptors of every transfer for its duration.
+ *
+ * The bytes cross the socket in order: one send or receive is in
+ * flight at a time, while the file side, whose operations carry their
+ * own offsets, may have a read or write going on every buffer.
+ *
+ * The buffers come from the transfer pool (buffpool.h). Given a second
+ * descriptor of the file opened with O_DIRECT, the ring reads and
+ * writes through it whatever is aligned to URING_ALIGN, which is all
+ * but the ends of a transfer, and so keeps the file out of the cache.
+ */
+#define URING_DEPTH 32
+#define URING_NBUFS 8
+#define URING_ALIGN 4096
+
+/* what a buffer is being used for */
+enum uring_state {
+        URING_FREE,
+        URING_FILLING,
+        URING_FULL,
+        URING_DRAINING
+};
+
+struct uring_buff {
+        enum uring_state state;
+        char *data;
+        size_t len;
+        size_t done;
+        off_t offset;
+        uint64_t seq;
+};
+
+struct uring {
+        int fd;
+        void *sqring;
+        size_t sqringsize;
+        void *cqring;
+        size_t cqringsize;
+        struct io_uring_sqe *sqes;
+        size_t sqessize;
+        unsigned *sqhead;
+        unsigned *sqtail;
+        unsigned sqmask;
+        unsigned *sqarray;
+        unsigned *cqhead;
+        unsigned *cqtail;
+        unsigned cqmask;
+        struct io_uring_cqe *cqes;
+        unsigned tosubmit;
+        unsigned inflight;
+        size_t buffsize;
+        int fixed;
+        int fds[3];
+        int fixedfiles;
+        struct uring_buff buffs[URING_NBUFS];
+};
+
+/* Tells whether io_uring can be used here: 0 if so, else -1. */
+int uring_probe(void);
+
+/*
+ * Sets up a ring with its buffers; NULL if it cannot be. A ring the
+ * kernel stops taking submissions on is given up, and fd is then -1.
+ */
+struct uring *uring_open(void);
+
+void uring_close(struct uring *u);
+
+/*
+ * Sends nbytes of filefd from offset on to sockfd, and sets *crcp to
+ * their crc32c; directfd is the file opened with O_DIRECT, or -1.
+ * Returns the number of bytes sent, which is less than nbytes if the
+ * file shrank or, with errno set, the peer went away.
+ */
+size_t uring_send_file(struct uring *u, int filefd, int directfd, off_t offset, int sockfd,
+                       size_t nbytes, uint32_t *crcp);
+
+/*
+ * Receives nbytes from sockfd into filefd at offset on, and sets *crcp
+ * to their crc32c; directfd is as for uring_send_file. Returns the
+ * number of bytes stored, which is less than nbytes, with errno set,
+ * if the peer closed or a write failed.
+ */
+size_t uring_receive_file(struct uring *u, int sockfd, int filefd, int directfd, off_t offset,
+                          size_t nbytes, uint32_t *crcp);
+
+#endif
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+#include "crc32c.h"
+#include "zstream.h"
+
+static void put_number(unsigned char *p, uint32_t value);
+static uint32_t get_number(const unsigned char *p);
+static size_t fill_block(struct zstream_writer *zw);
+static void next_block(struct zstream_writer *zw);
+static void start_block(struct zstream_reader *zr);
+static void finish_block(struct zstream_reader *zr);
+
+static void
+put_number(unsigned char *p, uint32_t value)
+{
+        p[0] = value >> 24;
+        p[1] = value >> 16;
+        p[2] = value >> 8;
+        p[3] = value;
+}
+
+static uint32_t
+get_number(const unsigned char *p)
+{
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* writer */
+
+void
+zstream_writer_open(struct zstream_writer *zw, int fd, uint64_t nbytes, int level)
+{
+        zw->fd = fd;
+        zw->left = nbytes;
+        zw->level = level < 1 ? 1 : level > 9 ? 9 : level;
+        zw->skip = 0;
+        zw->backoff = 0;
+        zw->blocklen = 0;
+        zw->blockoff = 0;
+        zw->crc = 0;
+}
+
+size_t
+zstream_read(struct zstream_writer *zw, char *buff, size_t size)
+{
+        size_t total;
+        size_t chunk;
+
+        total = 0;
+        while (total < size) {
+                if (zw->blockoff == zw->blocklen) {
+                        if (zw->left == 0) {
+                                break;
+                        }
+                        next_block(zw);
+                }
+                chunk = zw->blocklen - zw->blockoff;
+                if (chunk > size - total) {
+                        chunk = size - total;
+                }
+                memcpy(buff + total, zw->block + zw->blockoff, chunk);
+                zw->blockoff += chunk;
+                total += chunk;
+        }
+        return total;
+}
+
+void
+zstream_writer_close(struct zstream_writer *zw)
+{
+        if (zw->fd >= 0) {
+                close(zw->fd);
+                zw->fd = -1;
+        }
+}
+
+/* Reads the next block of the file into zw->raw and returns its length. */
+static size_t
+fill_block(struct zstream_writer *zw)
+{
+        size_t len;
+        size_t got;
+        ssize_t n;
+
+        len = zw->left < ZSTREAM_BLOCK ? zw->left : ZSTREAM_BLOCK;
+        got = 0;
+        while (got < len && zw->fd >= 0) {
+                n = read(zw->fd, zw->raw + got, len - got);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n <= 0) {
+                        break;
+                }
+                got += n;
+        }
+        memset(zw->raw + got, 0, len - got);
+        zw->crc = crc32c(zw->crc, zw->raw, len);
+        zw->left -= len;
+        return len;
+}
+
+/*
+ * Encodes the next block. Compressing into a buffer no larger than the
+ * block fails by itself for data that does not shrink, which then goes
+ * out stored; so does anything saving less than an eighth, and every
+ * such block doubles the number of blocks sent stored without trying.
+ */
+static void
+next_block(struct zstream_writer *zw)
+{
+        uLongf payloadlen;
+        size_t len;
+        int stored;
+
+        len = fill_block(zw);
+        stored = 1;
+        if (zw->skip > 0) {
+                zw->skip--;
+        }
+        else {
+                payloadlen = len - len / 8;
+                if (compress2(zw->block + ZSTREAM_HEADER_SIZE, &payloadlen,
+                              (const Bytef *)zw->raw, len, zw->level) == Z_OK &&
+                    payloadlen < len - len / 8) {
+                        stored = 0;
+                        zw->backoff = 0;
+                }
+                else {
+                        zw->backoff = zw->backoff == 0 ? 1 : zw->backoff * 2;
+                        if (zw->backoff > ZSTREAM_MAX_BACKOFF) {
+                                zw->backoff = ZSTREAM_MAX_BACKOFF;
+                        }
+                        zw->skip = zw->backoff;
+                }
+        }
+        if (stored) {
+                memcpy(zw->block + ZSTREAM_HEADER_SIZE, zw->raw, len);
+                payloadlen = len;
+        }
+        put_number(zw->block, payloadlen | (stored ? ZSTREAM_STORED : 0));
+        put_number(zw->block + 4, len);
+        zw->blocklen = ZSTREAM_HEADER_SIZE + payloadlen;
+        zw->blockoff = 0;
+}
+
+/* reader */
+
+void
+zstream_reader_open(struct zstream_reader *zr, int fd, uint64_t nbytes)
+{
+        zr->fd = fd;
+        zr->left = nbytes;
+        zr->headerlen = 0;
+        zr->payloadlen = 0;
+        zr->payloadgot = 0;
+        zr->error = 0;
+        zr->crc = 0;
+}
+
+size_t
+zstream_want(const struct zstream_reader *zr)
+{
+        if (zr->headerlen < ZSTREAM_HEADER_SIZE) {
+                return zr->left > 0 ? ZSTREAM_HEADER_SIZE - zr->headerlen : 0;
+        }
+        return zr->payloadlen - zr->payloadgot;
+}
+
+void
+zstream_write(struct zstream_reader *zr, const char *buff, size_t len)
+{
+        size_t chunk;
+
+        while (len > 0 && (chunk = zstream_want(zr)) > 0) {
+                if (chunk > len) {
+                        chunk = len;
+                }
+                if (zr->headerlen < ZSTREAM_HEADER_SIZE) {
+                        memcpy(zr->header + zr->headerlen, buff, chunk);
+                        zr->headerlen += chunk;
+                        if (zr->headerlen == ZSTREAM_HEADER_SIZE) {
+                                start_block(zr);
+                        }
+                }
+                else {
+                        memcpy(zr->payload + zr->payloadgot, buff, chunk);
+                        zr->payloadgot += chunk;
+                        if (zr->payloadgot == zr->payloadlen) {
+                                finish_block(zr);
+                        }
+                }
+                buff += chunk;
+                len -= chunk;
+        }
+}
+
+int
+zstream_reader_close(struct zstream_reader *zr)
+{
+        if ((zr->left > 0 || zr->headerlen > 0) && zr->error == 0) {
+                zr->error = ECONNRESET;
+        }
+        if (zr->fd >= 0) {
+                if (close(zr->fd) < 0 && zr->error == 0) {
+                        zr->error = errno;
+                }
+                zr->fd = -1;
+        }
+        return zr->error != 0 ? -1 : 0;
+}
+
+/*
+ * Checks a block header. A corrupt one leaves no way to find the end
+ * of the stream, so the stream is taken to be over.
+ */
+static void
+start_block(struct zstream_reader *zr)
+{
+        uint32_t payloadlen;
+
+        payloadlen = get_number(zr->header);
+        zr->stored = (payloadlen & ZSTREAM_STORED) != 0;
+        zr->payloadlen = payloadlen & ~ZSTREAM_STORED;
+        zr->payloadgot = 0;
+        zr->rawlen = get_number(zr->header + 4);
+        if (zr->rawlen == 0 || zr->rawlen > ZSTREAM_BLOCK || zr->rawlen > zr->left ||
+            zr->payloadlen == 0 || zr->payloadlen > ZSTREAM_BLOCK ||
+            (zr->stored && zr->payloadlen != zr->rawlen)) {
+                zr->error = EBADMSG;
+                zr->left = 0;
+                zr->headerlen = 0;
+        }
+}
+
+static void
+finish_block(struct zstream_reader *zr)
+{
+        const char *raw;
+        uLongf rawlen;
+        size_t off;
+        ssize_t n;
+
+        raw = zr->payload;
+        if (!zr->stored) {
+                rawlen = zr->rawlen;
+                if (uncompress((Bytef *)zr->raw, &rawlen, (const Bytef *)zr->payload,
+                               zr->payloadlen) != Z_OK || rawlen != zr->rawlen) {
+                        zr->error = EBADMSG;
+                        zr->left = 0;
+                        zr->headerlen = 0;
+                        return;
+                }
+                raw = zr->raw;
+        }
+        zr->crc = crc32c(zr->crc, raw, zr->rawlen);
+        for (off = 0; off < zr->rawlen && zr->fd >= 0 && zr->error == 0; off += n) {
+                n = write(zr->fd, raw + off, zr->rawlen - off);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                }
+                else if (n < 0) {
+                        zr->error = errno;
+                }
+        }
+        zr->left -= zr->rawlen;
+        zr->headerlen = 0;
+}
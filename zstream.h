@@ -0,0 +1,92 @@
+#ifndef ZSTREAM_H
+#define ZSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A file's bytes compressed for the data channel. The bytes are cut
+ * into blocks of up to ZSTREAM_BLOCK, each sent as a header holding the
+ * payload length and the block length as big-endian 32-bit numbers,
+ * then the payload. The payload is the block deflated by zlib, or, when
+ * ZSTREAM_STORED is set in the payload length, the block itself. The
+ * size a command announces is the uncompressed one; the receiver reads
+ * blocks until it has that many bytes.
+ */
+#define ZSTREAM_BLOCK (64 * 1024)
+#define ZSTREAM_HEADER_SIZE 8
+#define ZSTREAM_STORED 0x80000000u
+#define ZSTREAM_MAX_BACKOFF 64
+
+/* compresses a file a buffer at a time */
+struct zstream_writer {
+        int fd;
+        uint64_t left;
+        int level;
+        int skip;
+        int backoff;
+        unsigned char block[ZSTREAM_HEADER_SIZE + ZSTREAM_BLOCK];
+        size_t blocklen;
+        size_t blockoff;
+        char raw[ZSTREAM_BLOCK];
+        uint32_t crc;
+};
+
+/* decompresses into a file as the bytes come in */
+struct zstream_reader {
+        int fd;
+        uint64_t left;
+        unsigned char header[ZSTREAM_HEADER_SIZE];
+        size_t headerlen;
+        int stored;
+        size_t payloadlen;
+        size_t payloadgot;
+        size_t rawlen;
+        char payload[ZSTREAM_BLOCK];
+        char raw[ZSTREAM_BLOCK];
+        int error;
+        uint32_t crc;
+};
+
+/*
+ * Starts compressing the next nbytes of fd at a zlib level from 1 to 9.
+ * A block that does not shrink by an eighth goes out stored, and the
+ * blocks after it are not even tried for a while, so data that is
+ * compressed already costs little. The writer owns fd from now on, and
+ * keeps the crc32c of the bytes it has read in zw->crc.
+ */
+void zstream_writer_open(struct zstream_writer *zw, int fd, uint64_t nbytes, int level);
+
+/*
+ * Fills buff with the next bytes of the stream; 0 once it is over. A
+ * file that shrank is padded with zeros, so the stream still decodes
+ * to the announced size.
+ */
+size_t zstream_read(struct zstream_writer *zw, char *buff, size_t size);
+
+void zstream_writer_close(struct zstream_writer *zw);
+
+/*
+ * Starts decompressing nbytes into fd, which the reader owns from now
+ * on. With fd -1 the bytes are only consumed. zr->crc is the crc32c of
+ * what has been decompressed so far.
+ */
+void zstream_reader_open(struct zstream_reader *zr, int fd, uint64_t nbytes);
+
+/*
+ * Tells how many bytes can be fed without reading past the end of the
+ * stream; 0 once it is over.
+ */
+size_t zstream_want(const struct zstream_reader *zr);
+
+/* Decompresses the next len bytes; anything after the end is ignored. */
+void zstream_write(struct zstream_reader *zr, const char *buff, size_t len);
+
+/*
+ * Finishes decompressing and closes the file. Returns -1 with the
+ * reason in zr->error if writing failed, the stream was corrupt or it
+ * was cut short.
+ */
+int zstream_reader_close(struct zstream_reader *zr);
+
+#endif